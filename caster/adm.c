@@ -13,10 +13,30 @@
 #include "ntripsrv.h"
 #include "request.h"
 #include "sourcetable.h"
+#include "sync_binary.h"
+
+/*
+ * Prepare a request for a streamed Json reply.
+ */
+static void adm_stream_setup(struct ntrip_state *st, struct request *req,
+	void (*stream_cb)(struct caster_state *caster, struct request *req, struct json_stream *js)) {
+	req->stream_cb = stream_cb;
+	/* Chunked encoding is only available from HTTP/1.1 */
+	req->chunked = (st->n_http_args >= 3 && !strcmp(st->http_args[2], "HTTP/1.1"));
+}
+
+/*
+ * Check credentials for the syncer API.
+ */
+static int adm_syncer_auth(struct ntrip_state *st) {
+	return st->config->syncer_auth != NULL
+		&& st->password != NULL && !st->scheme_basic && !strcmp(st->config->syncer_auth, st->password);
+}
 
 int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, const char *uri, int *err, struct evkeyvalq *headers) {
 	struct evbuffer *output = bufferevent_get_output(st->bev);
 	int json_post = 0;
+	int binary_post = 0;
 	struct request *req = request_new();
 	if (req == NULL) {
 		*err = 503;
@@ -33,13 +53,16 @@ int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, con
 	 */
 	if (!strcmp(method, "POST")) {
 		if (st->content_type
-		    && (strcmp(st->content_type, "application/x-www-form-urlencoded") && strcmp(st->content_type, "application/json"))) {
+		    && (strcmp(st->content_type, "application/x-www-form-urlencoded") && strcmp(st->content_type, "application/json")
+			&& strcmp(st->content_type, SYNC_BINARY_MIME_TYPE))) {
 			request_free(req);
-			*err = 503;
+			*err = 415;
 			return -1;
 		}
 		if (!strcmp(st->content_type, "application/json"))
 			json_post = 1;
+		if (!strcmp(st->content_type, SYNC_BINARY_MIME_TYPE))
+			binary_post = 1;
 
 		if (!st->content) {
 			request_free(req);
@@ -81,21 +104,26 @@ int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, con
 			return -1;
 		}
 
+		/*
+		 * Either content_cb or stream_cb is set, the latter for potentially large replies.
+		 */
 		struct uri_calls {
 			const char *uri;
 			const char *method;
 			struct mime_content *(*content_cb)(struct caster_state *caster, struct request *req);
+			void (*stream_cb)(struct caster_state *caster, struct request *req, struct json_stream *js);
 		};
 		const struct uri_calls calls[] = {
-			{"/api/v1/net",	"GET", api_ntrip_list_json},
-			{"/api/v1/rtcm", "GET", api_rtcm_json},
-			{"/api/v1/mem","GET", api_mem_json},
-			{"/api/v1/nodes","GET", api_nodes_json},
-			{"/api/v1/livesources", "GET", livesource_list_json},
-			{"/api/v1/sourcetables", "GET", sourcetable_list_json},
-			{"/api/v1/reload", "POST", api_reload_json},
-			{"/api/v1/drop", "POST", api_drop_json},
-			{NULL, NULL, NULL}
+			{"/api/v1/net",	"GET", NULL, api_ntrip_list_stream},
+			{"/api/v1/rtcm", "GET", api_rtcm_json, NULL},
+			{"/api/v1/mem","GET", api_mem_json, NULL},
+			{"/api/v1/nodes","GET", api_nodes_json, NULL},
+			{"/api/v1/threads","GET", api_threads_json, NULL},
+			{"/api/v1/livesources", "GET", NULL, livesource_list_stream},
+			{"/api/v1/sourcetables", "GET", NULL, sourcetable_list_stream},
+			{"/api/v1/reload", "POST", api_reload_json, NULL},
+			{"/api/v1/drop", "POST", api_drop_json, NULL},
+			{NULL, NULL, NULL, NULL}
 		};
 
 		int i;
@@ -119,15 +147,18 @@ int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, con
 		}
 
 		/* Execute */
-		joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, calls[i].content_cb, req);
+		if (calls[i].stream_cb) {
+			adm_stream_setup(st, req, calls[i].stream_cb);
+			joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_stream, st, NULL, req);
+		} else
+			joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, calls[i].content_cb, req);
 		return 0;
 	} else if (json_post) {
 		req->json = st->content ? json_tokener_parse(st->content) : NULL;
 		if (req->json == NULL) {
 			*err = 400;
 		} else if (!strcmp(uri, "/api/v1/sync") && !strcmp(method, "POST")) {
-			if (st->config->syncer_auth == NULL
-					|| st->password == NULL || st->scheme_basic || strcmp(st->config->syncer_auth, st->password)) {
+			if (!adm_syncer_auth(st)) {
 				*err = 401;
 			} else {
 				ntripsrv_deferred_output(st, api_sync_json, req);
@@ -137,6 +168,19 @@ int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, con
 			*err = 404;
 		request_free(req);
 		return -1;
+	} else if (binary_post) {
+		/* Only used by the syncer for now */
+		if (!strcmp(uri, "/api/v1/sync")) {
+			if (!adm_syncer_auth(st)) {
+				*err = 401;
+			} else {
+				ntripsrv_deferred_output(st, api_sync_binary, req);
+				return 0;
+			}
+		} else
+			*err = 404;
+		request_free(req);
+		return -1;
 	}
 
 	/* Legacy access */
@@ -177,7 +221,8 @@ int admsrv(struct ntrip_state *st, const char *method, const char *root_uri, con
 		ntrip_set_state(st, NTRIP_WAIT_CLOSE);
 		return 0;
 	} else if (!strcmp(uri, "/net")) {
-		joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_output, st, api_ntrip_list_json, req);
+		adm_stream_setup(st, req, api_ntrip_list_stream);
+		joblist_append_ntrip_unlocked_content(st->caster->joblist, ntripsrv_deferred_stream, st, NULL, req);
 		return 0;
 	} else {
 		request_free(req);
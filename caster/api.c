@@ -2,8 +2,12 @@
 #include <string.h>
 
 #include <json-c/json_object.h>
+#include <json-c/json_tokener.h>
 
 #include "conf.h"
+#include "graylog_sender.h"
+#include "jobs.h"
+#include "json_stream.h"
 #include "livesource.h"
 #include "nodes.h"
 #include "ntrip_common.h"
@@ -14,91 +18,150 @@
  * JSON API routines.
  */
 
-static json_object *api_ntrip_json(struct ntrip_state *st) {
+/* Number of sessions listed at once under the ntrips lock */
+#define	API_NTRIP_BATCH	256
+
+static void api_timeval_stream(struct json_stream *js, const char *key, struct timeval *t) {
+	char iso_date[30];
+	iso_date_from_timeval(iso_date, sizeof iso_date, t);
+	json_stream_key(js, key);
+	json_stream_string(js, iso_date);
+}
+
+static void api_ntrip_stream(struct ntrip_state *st, struct json_stream *js) {
 	bufferevent_lock(st->bev);
 
-	json_object *new_obj = json_object_new_object();
+	json_stream_object_begin(js);
 
 	if (st->local) {
-		json_object *jip = st->local_addr[0] ? json_object_new_string(st->local_addr) : json_object_new_null();
-		json_object *jport = json_object_new_int(ip_port(&st->myaddr));
-		json_object *j = json_object_new_object();
-		json_object_object_add_ex(j, "ip", jip, JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(j, "port", jport, JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(new_obj, "local", j, JSON_C_CONSTANT_NEW);
+		json_stream_key(js, "local");
+		json_stream_object_begin(js);
+		json_stream_key(js, "ip");
+		json_stream_string(js, st->local_addr[0] ? st->local_addr : NULL);
+		json_stream_key(js, "port");
+		json_stream_int64(js, ip_port(&st->myaddr));
+		json_stream_object_end(js);
 	}
 	if (st->remote) {
-		json_object *jip = st->remote_addr[0] ? json_object_new_string(st->remote_addr) : json_object_new_null();
-		json_object *jport = json_object_new_int(ip_port(&st->peeraddr));
-		json_object_object_add_ex(new_obj, "ip", jip, JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(new_obj, "port", jport, JSON_C_CONSTANT_NEW);
+		json_stream_key(js, "ip");
+		json_stream_string(js, st->remote_addr[0] ? st->remote_addr : NULL);
+		json_stream_key(js, "port");
+		json_stream_int64(js, ip_port(&st->peeraddr));
 	}
 
-	json_object *jsonid = json_object_new_int64(st->id);
-	json_object *received_bytes = json_object_new_int64(st->received_bytes);
-	json_object *sent_bytes = json_object_new_int64(st->sent_bytes);
-	json_object_object_add_ex(new_obj, "id", jsonid, JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(new_obj, "received_bytes", received_bytes, JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(new_obj, "sent_bytes", sent_bytes, JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(new_obj, "type", json_object_new_string(st->type), JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(new_obj, "wildcard", json_object_new_boolean(st->wildcard), JSON_C_CONSTANT_NEW);
-	if (!strcmp(st->type, "source") || !strcmp(st->type, "source_fetcher"))
-		json_object_object_add_ex(new_obj, "mountpoint", json_object_new_string(st->mountpoint), JSON_C_CONSTANT_NEW);
-	else if (!strcmp(st->type, "client")) {
-		if (st->mountpoint != NULL)
-			json_object_object_add_ex(new_obj, "mountpoint", json_object_new_string(st->mountpoint), JSON_C_CONSTANT_NEW);
-		else
-			json_object_object_add_ex(new_obj, "mountpoint", json_object_new_null(), JSON_C_CONSTANT_NEW);
+	json_stream_key(js, "id");
+	json_stream_int64(js, st->id);
+	json_stream_key(js, "received_bytes");
+	json_stream_int64(js, st->received_bytes);
+	json_stream_key(js, "sent_bytes");
+	json_stream_int64(js, st->sent_bytes);
+	json_stream_key(js, "type");
+	json_stream_string(js, st->type);
+	json_stream_key(js, "wildcard");
+	json_stream_bool(js, st->wildcard);
+	if (!strcmp(st->type, "source") || !strcmp(st->type, "source_fetcher") || !strcmp(st->type, "client")) {
+		json_stream_key(js, "mountpoint");
+		json_stream_string(js, st->mountpoint);
 	}
 
-	if (st->user_agent)
-		json_object_object_add_ex(new_obj, "user_agent", json_object_new_string(st->user_agent), JSON_C_CONSTANT_NEW);
+	if (st->user_agent) {
+		json_stream_key(js, "user_agent");
+		json_stream_string(js, st->user_agent);
+	}
 
 	struct tcp_info ti;
 	socklen_t ti_len = sizeof ti;
 	if (getsockopt(st->fd, IPPROTO_TCP, TCP_INFO, &ti, &ti_len) >= 0) {
-		json_object *tcpi_obj = json_object_new_object();
-		json_object_object_add_ex(tcpi_obj, "rtt", json_object_new_int64(ti.tcpi_rtt), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(tcpi_obj, "rttvar", json_object_new_int64(ti.tcpi_rttvar), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(tcpi_obj, "snd_mss", json_object_new_int64(ti.tcpi_snd_mss), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(tcpi_obj, "rcv_mss", json_object_new_int64(ti.tcpi_rcv_mss), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(tcpi_obj, "last_data_recv", json_object_new_int64(ti.tcpi_last_data_recv), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(tcpi_obj, "rcv_wnd", json_object_new_int64(ti.tcpi_rcv_space), JSON_C_CONSTANT_NEW);
+		json_stream_key(js, "tcp_info");
+		json_stream_object_begin(js);
+		json_stream_key(js, "rtt");
+		json_stream_int64(js, ti.tcpi_rtt);
+		json_stream_key(js, "rttvar");
+		json_stream_int64(js, ti.tcpi_rttvar);
+		json_stream_key(js, "snd_mss");
+		json_stream_int64(js, ti.tcpi_snd_mss);
+		json_stream_key(js, "rcv_mss");
+		json_stream_int64(js, ti.tcpi_rcv_mss);
+		json_stream_key(js, "last_data_recv");
+		json_stream_int64(js, ti.tcpi_last_data_recv);
+		json_stream_key(js, "rcv_wnd");
+		json_stream_int64(js, ti.tcpi_rcv_space);
 #ifdef __FreeBSD__
 		// FreeBSD-specific
-		json_object_object_add_ex(tcpi_obj, "snd_wnd", json_object_new_int64(ti.tcpi_snd_wnd), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(tcpi_obj, "snd_rexmitpack", json_object_new_int64(ti.tcpi_snd_rexmitpack), JSON_C_CONSTANT_NEW);
+		json_stream_key(js, "snd_wnd");
+		json_stream_int64(js, ti.tcpi_snd_wnd);
+		json_stream_key(js, "snd_rexmitpack");
+		json_stream_int64(js, ti.tcpi_snd_rexmitpack);
 #endif
-		json_object_object_add_ex(new_obj, "tcp_info", tcpi_obj, JSON_C_CONSTANT_NEW);
+		json_stream_object_end(js);
 	}
 
-	timeval_to_json(&st->start, new_obj, "start");
+	api_timeval_stream(js, "start", &st->start);
+	json_stream_object_end(js);
 
 	bufferevent_unlock(st->bev);
-	return new_obj;
 }
 
 /*
- * Return a list of ntrip_state as a JSON object.
+ * Take a reference on a ntrip_state, unless it is already being freed.
  */
-struct mime_content *api_ntrip_list_json(struct caster_state *caster, struct request *req) {
-	char *s;
-	json_object *new_list = json_object_new_object();
-	struct ntrip_state *sst;
-
-	P_RWLOCK_RDLOCK(&caster->ntrips.lock);
-	TAILQ_FOREACH(sst, &caster->ntrips.queue, nextg) {
-		char idstr[40];
-		json_object *nj = api_ntrip_json(sst);
-		snprintf(idstr, sizeof idstr, "%lld", sst->id);
-		json_object_object_add(new_list, idstr, nj);
-	}
-	P_RWLOCK_UNLOCK(&caster->ntrips.lock);
+static int api_ntrip_tryref(struct ntrip_state *st) {
+	int refcnt = atomic_load(&st->refcnt);
+	while (refcnt > 0)
+		if (atomic_compare_exchange_weak(&st->refcnt, &refcnt, refcnt+1))
+			return 1;
+	return 0;
+}
 
-	s = mystrdup(json_object_to_json_string(new_list));
-	struct mime_content *m = mime_new(s, -1, "application/json", 1);
-	json_object_put(new_list);
-	return m;
+/*
+ * Stream the list of ntrip_state as a JSON object.
+ *
+ * Sessions are listed in batches, releasing the ntrips lock in between.
+ * A reference on the last listed session keeps it in the queue, so we can
+ * resume from there. As the queue is sorted by id, we can also resume
+ * after the last listed id if that session was being freed.
+ */
+void api_ntrip_list_stream(struct caster_state *caster, struct request *req, struct json_stream *js) {
+	struct ntrip_state *sst, *last = NULL, *cursor = NULL;
+	long long last_id = 0;
+
+	json_stream_object_begin(js);
+	do {
+		P_RWLOCK_RDLOCK(&caster->ntrips.lock);
+		sst = cursor ? TAILQ_NEXT(cursor, nextg) : TAILQ_FIRST(&caster->ntrips.queue);
+		while (sst && sst->id <= last_id)
+			sst = TAILQ_NEXT(sst, nextg);
+		for (int n = 0; sst && n < API_NTRIP_BATCH; sst = TAILQ_NEXT(sst, nextg), n++) {
+			char idstr[40];
+			snprintf(idstr, sizeof idstr, "%lld", sst->id);
+			json_stream_key(js, idstr);
+			api_ntrip_stream(sst, js);
+			last = sst;
+		}
+		if (last)
+			last_id = last->id;
+
+		struct ntrip_state *old_cursor = cursor;
+		cursor = (sst && last && api_ntrip_tryref(last)) ? last : NULL;
+		P_RWLOCK_UNLOCK(&caster->ntrips.lock);
+
+		if (old_cursor) {
+			struct bufferevent *bev = old_cursor->bev;
+			bufferevent_lock(bev);
+			ntrip_decref(old_cursor, "api_ntrip_list_stream");
+			bufferevent_unlock(bev);
+		}
+		if (json_stream_flush(js, 0) < 0)
+			break;
+	} while (sst != NULL);
+
+	if (cursor) {
+		struct bufferevent *bev = cursor->bev;
+		bufferevent_lock(bev);
+		ntrip_decref(cursor, "api_ntrip_list_stream");
+		bufferevent_unlock(bev);
+	}
+	json_stream_object_end(js);
 }
 
 /*
@@ -128,10 +191,47 @@ struct mime_content *api_rtcm_json(struct caster_state *caster, struct request *
 }
 
 /*
- * Return memory stats.
+ * Return memory stats: packet and job pool counters, and malloc stats.
  */
 struct mime_content *api_mem_json(struct caster_state *caster, struct request *req) {
-	struct mime_content *m = malloc_stats_dump(1);
+	json_object *j = json_object_new_object();
+	json_object_object_add_ex(j, "packet_pool", packet_pool_json(), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "job_pool", job_pool_json(), JSON_C_CONSTANT_NEW);
+
+	json_object *jlog = json_object_new_object();
+	json_object_object_add_ex(jlog, "dropped", json_object_new_uint64(log_dropped(&caster->flog)), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(jlog, "access_dropped", json_object_new_uint64(log_dropped(&caster->alog)), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "log", jlog, JSON_C_CONSTANT_NEW);
+
+	json_object *jgraylog = json_object_new_array();
+	struct config *config = caster_config_getref(caster);
+	struct caster_dynconfig *dyn = config->dyn;
+	for (int i = 0; i < dyn->graylog_count; i++)
+		if (dyn->graylog[i] != NULL)
+			json_object_array_add(jgraylog, ntrip_task_json(dyn->graylog[i]->task));
+	config_decref(config);
+	json_object_object_add_ex(j, "graylog", jgraylog, JSON_C_CONSTANT_NEW);
+
+	struct mime_content *mstats = malloc_stats_dump(1);
+	json_object *jmalloc = mstats ? json_tokener_parse(mstats->s) : NULL;
+	if (mstats)
+		mime_free(mstats);
+	json_object_object_add_ex(j, "malloc", jmalloc ? jmalloc : json_object_new_null(), JSON_C_CONSTANT_NEW);
+
+	char *s = mystrdup(json_object_to_json_string(j));
+	struct mime_content *m = mime_new(s, -1, "application/json", 1);
+	json_object_put(j);
+	return m;
+}
+
+/*
+ * Return the thread layout and per-thread load.
+ */
+struct mime_content *api_threads_json(struct caster_state *caster, struct request *req) {
+	json_object *j = caster->joblist ? jobs_threads_json(caster->joblist) : json_object_new_array();
+	char *s = mystrdup(json_object_to_json_string(j));
+	struct mime_content *m = mime_new(s, -1, "application/json", 1);
+	json_object_put(j);
 	return m;
 }
 
@@ -189,3 +289,15 @@ struct mime_content *api_sync_json(struct caster_state *caster, struct request *
 	struct mime_content *m = mime_new(s, -1, "application/json", 1);
 	return m;
 }
+
+/*
+ * Same as api_sync_json(), for livesource updates in binary encoding.
+ */
+struct mime_content *api_sync_binary(struct caster_state *caster, struct request *req) {
+	char result[40];
+	req->status = livesource_update_execute_binary(caster, caster->livesources, req);
+	snprintf(result, sizeof result, "{\"result\": %d}\n", req->status);
+	char *s = mystrdup(result);
+	struct mime_content *m = mime_new(s, -1, "application/json", 1);
+	return m;
+}
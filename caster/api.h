@@ -1,12 +1,16 @@
 #ifndef __API_H__
 #define __API_H__
 
-struct mime_content *api_ntrip_list_json(struct caster_state *caster, struct request *req);
+struct json_stream;
+
+void api_ntrip_list_stream(struct caster_state *caster, struct request *req, struct json_stream *js);
 struct mime_content *api_rtcm_json(struct caster_state *caster, struct request *req);
 struct mime_content *api_mem_json(struct caster_state *caster, struct request *req);
 struct mime_content *api_nodes_json(struct caster_state *caster, struct request *req);
+struct mime_content *api_threads_json(struct caster_state *caster, struct request *req);
 struct mime_content *api_reload_json(struct caster_state *caster, struct request *req);
 struct mime_content *api_drop_json(struct caster_state *caster, struct request *req);
 struct mime_content *api_sync_json(struct caster_state *caster, struct request *req);
+struct mime_content *api_sync_binary(struct caster_state *caster, struct request *req);
 
 #endif
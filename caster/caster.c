@@ -106,8 +106,10 @@ static struct caster_dynconfig *dynconfig_new(struct caster_state *caster) {
 	this->graylog_count = 0;
 	this->syncers = NULL;
 	this->syncers_count = 0;
-	this->rtcm_filter = NULL;
+	this->rtcm_filters = NULL;
+	this->rtcm_filters_count = 0;
 	this->rtcm_filter_dict = NULL;
+	this->rtcm_filter_user_dict = NULL;
 	this->caster = caster;
 	return this;
 }
@@ -133,9 +135,15 @@ dynconfig_free_rtcm_filters(struct caster_dynconfig *dyn) {
 		hash_table_free(dyn->rtcm_filter_dict);
 		dyn->rtcm_filter_dict = NULL;
 	}
-	if (dyn->rtcm_filter)
-		rtcm_filter_free(dyn->rtcm_filter);
-	dyn->rtcm_filter = NULL;
+	if (dyn->rtcm_filter_user_dict) {
+		hash_table_free(dyn->rtcm_filter_user_dict);
+		dyn->rtcm_filter_user_dict = NULL;
+	}
+	for (int i = 0; i < dyn->rtcm_filters_count; i++)
+		rtcm_filter_decref(dyn->rtcm_filters[i]);
+	free(dyn->rtcm_filters);
+	dyn->rtcm_filters = NULL;
+	dyn->rtcm_filters_count = 0;
 }
 
 static void
@@ -266,7 +274,7 @@ caster_new(const char *config_file, int nbase) {
 	P_RWLOCK_INIT(&this->configlock, NULL);
 	P_MUTEX_INIT(&this->configreload, NULL);
 
-	P_RWLOCK_INIT(&this->sourcetablestack.lock, NULL);
+	stack_init(&this->sourcetablestack);
 
 	atomic_init(&this->config, NULL);
 
@@ -304,8 +312,8 @@ caster_new(const char *config_file, int nbase) {
 	    || this->livesources == NULL
 		|| this->nodes == NULL) {
 		if (this->joblist) joblist_free(this->joblist);
-		if (r1 < 0) log_free(&this->flog);
-		if (r2 < 0) log_free(&this->alog);
+		if (r1 == 0) log_free(&this->flog);
+		if (r2 == 0) log_free(&this->alog);
 		if (this->ntrips.ipcount) hash_table_free(this->ntrips.ipcount);
 		if (this->livesources) livesource_table_free(this->livesources);
 		if (this->nodes) nodes_free(this->nodes);
@@ -321,7 +329,6 @@ caster_new(const char *config_file, int nbase) {
 	this->ntrips.nfree = 0;
 	this->rtcm_cache = hash_table_new(509, (void(*)(void *))rtcm_info_free);
 	this->hostname[sizeof(this->hostname)-1] = '\0';
-	TAILQ_INIT(&this->sourcetablestack.list);
 	return this;
 }
 
@@ -392,9 +399,13 @@ static int caster_reload_graylog(struct caster_state *this, struct config *new_c
 			new_config->graylog[i].retry_delay,
 			new_config->graylog[i].max_retry_delay,
 			new_config->graylog[i].bulk_max_size,
+			new_config->graylog[i].compression_level,
 			new_config->graylog[i].queue_max_size,
 			new_config->graylog[i].authorization,
-			new_config->graylog[i].drainfilename);
+			new_config->graylog[i].drainfilename,
+			new_config->graylog[i].spilldir,
+			new_config->graylog[i].spill_max_size,
+			new_config->graylog[i].spill_policy);
 		if (!new_graylog[i]) {
 			r = -1;
 			break;
@@ -460,15 +471,7 @@ void caster_free(struct caster_state *this) {
 
 	SSL_CTX_free(this->ssl_client_ctx);
 
-	P_RWLOCK_WRLOCK(&this->sourcetablestack.lock);
-	struct sourcetable *s;
-	while ((s = TAILQ_FIRST(&this->sourcetablestack.list))) {
-		TAILQ_REMOVE_HEAD(&this->sourcetablestack.list, next);
-		sourcetable_decref(s);
-	}
-	P_RWLOCK_UNLOCK(&this->sourcetablestack.lock);
-
-	P_RWLOCK_DESTROY(&this->sourcetablestack.lock);
+	stack_free(&this->sourcetablestack);
 	P_RWLOCK_DESTROY(&this->quotalock);
 	P_RWLOCK_DESTROY(&this->rtcm_lock);
 	P_RWLOCK_DESTROY(&this->ntrips.lock);
@@ -768,41 +771,70 @@ caster_reload_blocklist(struct caster_state *caster, struct config *new_config)
 	return r;
 }
 
+/*
+ * Add the keys of a filter dictionary to the main one.
+ * Keys already present are kept with their first filter.
+ */
+static void
+caster_rtcm_filter_dict_merge(struct caster_state *caster, struct hash_table *dict, struct hash_table *h, const char *what) {
+	struct hash_iterator hi;
+	struct element *e;
+	HASH_FOREACH(e, h, hi)
+		if (hash_table_add(dict, e->key, e->value) == -1)
+			logfmt(&caster->flog, LOG_WARNING, "rtcm_filter: %s %s already has a filter, ignored", what, e->key);
+}
+
 static int
 caster_reload_rtcm_filters(struct caster_state *caster, struct config *new_config, struct caster_dynconfig *newdyn) {
 	if (new_config->rtcm_filter_count == 0)
 		return 0;
-	if (new_config->rtcm_filter_count != 1)
-		return -1;
 
-	if (newdyn->rtcm_filter_dict)
-		hash_table_free(newdyn->rtcm_filter_dict);
-	newdyn->rtcm_filter_dict = hash_table_new(5, NULL);
-	if (newdyn->rtcm_filter_dict == NULL)
+	dynconfig_free_rtcm_filters(newdyn);
+	newdyn->rtcm_filters = (struct rtcm_filter **)calloc(new_config->rtcm_filter_count, sizeof(struct rtcm_filter *));
+	newdyn->rtcm_filter_dict = hash_table_new(5, hash_table_free_null);
+	newdyn->rtcm_filter_user_dict = hash_table_new(5, hash_table_free_null);
+	if (newdyn->rtcm_filters == NULL || newdyn->rtcm_filter_dict == NULL || newdyn->rtcm_filter_user_dict == NULL) {
+		dynconfig_free_rtcm_filters(newdyn);
 		return -1;
+	}
 
 	for (int i = 0; i < new_config->rtcm_filter_count; i++) {
+		struct config_rtcm_filter *config_filter = &new_config->rtcm_filter[i];
 		struct rtcm_filter *rtcm_filter;
+		if (!config_filter->apply && !config_filter->users) {
+			logfmt(&caster->flog, LOG_ERR, "rtcm_filter: no mountpoint or user to apply to in %s", caster->config_file);
+			return -1;
+		}
 		rtcm_filter = rtcm_filter_new(
-			new_config->rtcm_filter[i].pass,
-			new_config->rtcm_filter[i].convert_count ? new_config->rtcm_filter[i].convert[0].types : NULL,
-			new_config->rtcm_filter[i].convert_count ? new_config->rtcm_filter[i].convert[0].conversion : 0
+			config_filter->name,
+			config_filter->pass,
+			config_filter->convert_count ? config_filter->convert[0].types : NULL,
+			config_filter->convert_count ? config_filter->convert[0].conversion : 0
 		);
 		if (rtcm_filter == NULL) {
 			logfmt(&caster->flog, LOG_ERR, "Can't parse rtcm_filter configuration from %s", caster->config_file);
 			return -1;
 		}
-		struct hash_table *h = rtcm_filter_dict_parse(rtcm_filter, new_config->rtcm_filter[i].apply);
-		if (h == NULL) {
+		newdyn->rtcm_filters[newdyn->rtcm_filters_count++] = rtcm_filter;
+
+		struct hash_table *h = config_filter->apply ? rtcm_filter_dict_parse(rtcm_filter, config_filter->apply) : NULL;
+		struct hash_table *hu = config_filter->users ? rtcm_filter_dict_parse(rtcm_filter, config_filter->users) : NULL;
+		if ((config_filter->apply && h == NULL) || (config_filter->users && hu == NULL)) {
 			logfmt(&caster->flog, LOG_ERR, "Can't parse rtcm_filter configuration from %s", caster->config_file);
-			rtcm_filter_free(rtcm_filter);
+			if (h)
+				hash_table_free(h);
+			if (hu)
+				hash_table_free(hu);
 			return -1;
 		}
-		hash_table_update(newdyn->rtcm_filter_dict, h);
-		hash_table_free(h);
-		if (newdyn->rtcm_filter)
-			rtcm_filter_free(newdyn->rtcm_filter);
-		newdyn->rtcm_filter = rtcm_filter;
+		if (h) {
+			caster_rtcm_filter_dict_merge(caster, newdyn->rtcm_filter_dict, h, "mountpoint");
+			hash_table_free(h);
+		}
+		if (hu) {
+			caster_rtcm_filter_dict_merge(caster, newdyn->rtcm_filter_user_dict, hu, "user");
+			hash_table_free(hu);
+		}
 	}
 	return 0;
 }
@@ -65,8 +65,10 @@ struct caster_dynconfig {
 	int syncers_count;
 
 	/* RTCM filtering */
-	struct rtcm_filter *rtcm_filter;	// filters (max 1 currently)
+	struct rtcm_filter **rtcm_filters;	// filters
+	int rtcm_filters_count;
 	struct hash_table *rtcm_filter_dict;	// mountpoint => filter dictionary
+	struct hash_table *rtcm_filter_user_dict;	// user => filter dictionary
 
 	struct caster_state *caster;
 };
@@ -149,6 +151,16 @@ static inline struct event_base *caster_get_eventbase(struct caster_state *this)
 	return this->base[atomic_fetch_add(&this->basecounter, 1)%this->nbase];
 }
 
+/*
+ * Return the index of an event base in the caster event base table.
+ */
+static inline int caster_get_eventbase_index(struct caster_state *this, struct event_base *base) {
+	for (int i = 0; i < this->nbase; i++)
+		if (this->base[i] == base)
+			return i;
+	return 0;
+}
+
 static inline struct config *caster_config_getref(struct caster_state *caster) {
 	P_RWLOCK_RDLOCK(&caster->configlock);
 	struct config *config = atomic_load(&caster->config);
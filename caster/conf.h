@@ -4,6 +4,11 @@
 #define	DEBUG		1
 #define	DEBUG_EVENT	0
 
+/* Compile EDEBUG log calls, build with -DLOG_EDEBUG_ENABLED=0 to remove them */
+#ifndef LOG_EDEBUG_ENABLED
+#define	LOG_EDEBUG_ENABLED	DEBUG
+#endif
+
 #include <pthread.h>
 
 #define	P_RWLOCK_T			pthread_rwlock_t
@@ -94,7 +94,8 @@ static struct config_graylog default_config_graylog = {
 	.status_timeout = 20,
 	.retry_delay = 1,
 	.max_retry_delay = 60,
-	.port = 7777
+	.port = 7777,
+	.spill_max_size = 256*1024*1024
 };
 
 static struct config_threads default_config_threads = {
@@ -132,6 +133,14 @@ static const cyaml_strval_t facility_strings[] = {
 	{ "local7", LOG_LOCAL7 },
 };
 
+/*
+ * YAML mapping from spill queue policy to integer values
+ */
+static const cyaml_strval_t spill_policy_strings[] = {
+	{ "drop_oldest", SPILLQ_DROP_OLDEST },
+	{ "drop_new", SPILLQ_DROP_NEW }
+};
+
 /*
  * YAML mapping from RTCM conversion name to integer values
  */
@@ -195,6 +204,8 @@ static const cyaml_schema_field_t node_fields_schema[] = {
 		"authorization", CYAML_FLAG_POINTER, struct config_node, authorization, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_INT(
 		"retry_delay", CYAML_FLAG_OPTIONAL, struct config_node, retry_delay),
+	CYAML_FIELD_BOOL(
+		"sync_binary", CYAML_FLAG_OPTIONAL, struct config_node, sync_binary),
 	CYAML_FIELD_END
 };
 
@@ -223,6 +234,8 @@ static const cyaml_schema_field_t graylog_fields_schema[] = {
 		"retry_delay", CYAML_FLAG_OPTIONAL, struct config_graylog, retry_delay),
 	CYAML_FIELD_INT(
 		"bulk_max_size", CYAML_FLAG_OPTIONAL, struct config_graylog, bulk_max_size),
+	CYAML_FIELD_INT(
+		"compression_level", CYAML_FLAG_OPTIONAL, struct config_graylog, compression_level),
 	CYAML_FIELD_INT(
 		"queue_max_size", CYAML_FLAG_OPTIONAL, struct config_graylog, queue_max_size),
 	CYAML_FIELD_STRING_PTR(
@@ -241,6 +254,14 @@ static const cyaml_schema_field_t graylog_fields_schema[] = {
 			CYAML_ARRAY_LEN(log_level_strings)),
 	CYAML_FIELD_STRING_PTR(
 		"drainfile", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_graylog, drainfilename, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_STRING_PTR(
+		"spilldir", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_graylog, spilldir, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_INT(
+		"spill_max_size", CYAML_FLAG_OPTIONAL, struct config_graylog, spill_max_size),
+	CYAML_FIELD_ENUM(
+			"spill_policy", CYAML_FLAG_OPTIONAL,
+			struct config_graylog, spill_policy, spill_policy_strings,
+			CYAML_ARRAY_LEN(spill_policy_strings)),
 	CYAML_FIELD_END
 };
 
@@ -269,6 +290,8 @@ static const cyaml_schema_value_t syslog_schema = {
 static const cyaml_schema_field_t threads_fields_schema[] = {
 	CYAML_FIELD_INT(
 		"stacksize", CYAML_FLAG_OPTIONAL, struct config_threads, stacksize),
+	CYAML_FIELD_STRING_PTR(
+		"cpus", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_threads, cpus, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_END
 };
 
@@ -307,7 +330,11 @@ static const cyaml_schema_value_t rtcm_convert_schema = {
 
 static const cyaml_schema_field_t rtcm_filter_fields_schema[] = {
 	CYAML_FIELD_STRING_PTR(
-		"apply", CYAML_FLAG_POINTER, struct config_rtcm_filter, apply, 0, CYAML_UNLIMITED),
+		"name", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_rtcm_filter, name, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_STRING_PTR(
+		"apply", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_rtcm_filter, apply, 0, CYAML_UNLIMITED),
+	CYAML_FIELD_STRING_PTR(
+		"users", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config_rtcm_filter, users, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_STRING_PTR(
 		"pass", CYAML_FLAG_POINTER, struct config_rtcm_filter, pass, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_SEQUENCE(
@@ -402,7 +429,7 @@ static const cyaml_schema_field_t top_mapping_schema[] = {
 		"admin_user", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL, struct config, admin_user, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_SEQUENCE(
 		"threads", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
-		struct config, threads, &threads_schema, 0, 1),
+		struct config, threads, &threads_schema, 0, CYAML_UNLIMITED),
 	CYAML_FIELD_SEQUENCE(
 		"webroots", CYAML_FLAG_POINTER|CYAML_FLAG_OPTIONAL,
 		struct config, webroots, &webroots_schema, 0, CYAML_UNLIMITED),
@@ -531,6 +558,7 @@ struct config *config_parse(const char *filename, long long config_gen) {
 		DEFAULT_ASSIGN_ARRAY(this, i, graylog, default_config_graylog, port);
 		DEFAULT_ASSIGN_ARRAY(this, i, graylog, default_config_graylog, bulk_max_size);
 		DEFAULT_ASSIGN_ARRAY(this, i, graylog, default_config_graylog, queue_max_size);
+		DEFAULT_ASSIGN_ARRAY(this, i, graylog, default_config_graylog, spill_max_size);
 	}
 
 	for (int i = 0; i < this->bind_count; i++) {
@@ -622,6 +650,7 @@ void config_free(struct config *this) {
 		free((char *)this->graylog[i].uri);
 		free((char *)this->graylog[i].authorization);
 		free((char *)this->graylog[i].drainfilename);
+		free((char *)this->graylog[i].spilldir);
 	}
 	free(this->graylog);
 
@@ -629,7 +658,9 @@ void config_free(struct config *this) {
 		for (int j = 0; j < this->rtcm_filter[i].convert_count; j++)
 			free((char *)this->rtcm_filter[i].convert[j].types);
 		free(this->rtcm_filter[i].convert);
+		free((char *)this->rtcm_filter[i].name);
 		free((char *)this->rtcm_filter[i].apply);
+		free((char *)this->rtcm_filter[i].users);
 		free((char *)this->rtcm_filter[i].pass);
 	}
 	free(this->rtcm_filter);
@@ -638,6 +669,8 @@ void config_free(struct config *this) {
 		free((char *)this->trusted_http_proxy[i]);
 	free(this->trusted_http_proxy_prefixes);
 
+	for (int i = 0; i < this->threads_count; i++)
+		free((char *)this->threads[i].cpus);
 	free(this->threads);
 
 	free((char *)this->trusted_http_proxy);
@@ -11,6 +11,7 @@
 #include "ip.h"
 #include "log.h"
 #include "rtcm.h"
+#include "spillq.h"
 
 /*
  * Caster configuration structures.
@@ -75,6 +76,9 @@ struct config_node {
 	int status_timeout;
 
 	int retry_delay, max_retry_delay;
+
+	/* Try the compact binary encoding for livesource updates, fall back to Json if not supported */
+	int sync_binary;
 };
 
 struct config_endpoint {
@@ -112,11 +116,21 @@ struct config_graylog {
 	/* Maximum size for bulk mode, 0 to disable bulk mode */
 	size_t bulk_max_size;
 
+	/* gzip level (1-9) for bulk requests, 0 to disable compression */
+	int compression_level;
+
 	/* Maximum queue size for memory backlog */
 	size_t queue_max_size;
 
 	/* File template (see strftime(3)) for overflow files */
 	const char *drainfilename;
+
+	/* Directory for the spill queue, replayed to the server, instead of overflow files */
+	const char *spilldir;
+
+	/* Maximum size of the spill queue, and what to drop beyond */
+	size_t spill_max_size;
+	enum spillq_policy spill_policy;
 };
 
 struct config_syslog {
@@ -124,9 +138,16 @@ struct config_syslog {
 	int facility;
 };
 
+/*
+ * Thread group: each entry in the "threads" list is a group of
+ * event loops and workers, optionally pinned to a CPU set.
+ */
 struct config_threads {
 	/* Thread stack size */
 	size_t	stacksize;
+
+	/* CPU list, such as "0-7,16-23", NULL to not pin the threads */
+	const char *cpus;
 };
 
 struct config_webroots {
@@ -140,7 +161,9 @@ struct config_rtcm_convert {
 };
 
 struct config_rtcm_filter {
+	const char *name;	// optional filter name
 	const char *apply;	// ','-separated list of mountpoints
+	const char *users;	// ','-separated list of users
 	const char *pass;	// ','-separated list of RTCM types
 	struct config_rtcm_convert *convert;
 	int convert_count;
@@ -56,7 +56,9 @@ struct sourcetable_fetch_args *fetcher_sourcetable_new(struct caster_state *cast
 	this->task->write_timeout = config->sourcetable_fetch_timeout;
 	this->task->status_timeout = this->task->read_timeout;
 
-	this->sourcetable = NULL;
+	this->update = NULL;
+	this->current = NULL;
+	this->nrefresh = 0;
 	this->priority = priority;
 	this->refcnt = 1;
 	return this;
@@ -67,9 +69,19 @@ static void task_stop(struct sourcetable_fetch_args *this) {
 	/*
 	 * Needed in case a fetch is in progress right now
 	 */
-	if (this->sourcetable) {
-		sourcetable_decref(this->sourcetable);
-		this->sourcetable = NULL;
+	if (this->update) {
+		sourcetable_update_free(this->update);
+		this->update = NULL;
+	}
+}
+
+/*
+ * Forget the table in the stack, the next fetch will build a new one.
+ */
+static void drop_current(struct sourcetable_fetch_args *this) {
+	if (this->current) {
+		sourcetable_decref(this->current);
+		this->current = NULL;
 	}
 }
 
@@ -93,6 +105,7 @@ void fetcher_sourcetable_decref(struct sourcetable_fetch_args *this) {
 
 void fetcher_sourcetable_stop(struct sourcetable_fetch_args *this) {
 	task_stop(this);
+	drop_current(this);
 	stack_replace_host(this->task->caster, &this->task->caster->sourcetablestack, this->task->host, this->task->port, NULL);
 }
 
@@ -104,6 +117,9 @@ void fetcher_sourcetable_stop(struct sourcetable_fetch_args *this) {
 void fetcher_sourcetable_reload(struct sourcetable_fetch_args *this, int refresh_delay, int sourcetable_priority) {
 	task_stop(this);
 	this->task->refresh_delay = refresh_delay;
+	if (this->priority != sourcetable_priority)
+		/* The table needs to move in the stack */
+		drop_current(this);
 	this->priority = sourcetable_priority;
 	fetcher_sourcetable_start(this, 0);
 }
@@ -121,9 +137,9 @@ sourcetable_end_cb(int ok, void *arg, int n) {
 	if (!ok) {
 		gettimeofday(&t1, NULL);
 		timersub(&t1, &a->task->start, &t1);
-		if (a->sourcetable) {
-			sourcetable_decref(a->sourcetable);
-			a->sourcetable = NULL;
+		if (a->update) {
+			sourcetable_update_free(a->update);
+			a->update = NULL;
 		}
 		logfmt(&a->task->caster->flog, LOG_NOTICE, "sourcetable load failed or canceled, %.3f ms",
 			t1.tv_sec*1000 + t1.tv_usec/1000.);
@@ -133,36 +149,80 @@ sourcetable_end_cb(int ok, void *arg, int n) {
 	ntrip_task_reschedule(a->task, a);
 }
 
+/*
+ * Insert a fully fetched sourcetable in the stack.
+ */
+static void sourcetable_insert(struct sourcetable_fetch_args *a, struct timeval *fetch_time) {
+	struct sourcetable *sourcetable = a->update->added;
+
+	sourcetable->fetch_time = *fetch_time;
+	sourcetable->pullable = 1;
+	/* Unique enough to never match a previous table */
+	sourcetable->version = (unsigned long long)fetch_time->tv_sec*1000000 + fetch_time->tv_usec;
+	stack_replace_host(a->task->caster, &a->task->caster->sourcetablestack, a->task->host, a->task->port, sourcetable);
+	drop_current(a);
+	sourcetable_incref(sourcetable);
+	a->current = sourcetable;
+	a->nrefresh = 0;
+}
+
 static int sourcetable_line_cb(struct ntrip_state *st, void *arg_cb, const char *line, int n) {
 	struct timeval t1;
 	struct sourcetable_fetch_args *a = (struct sourcetable_fetch_args *)arg_cb;
 
-	if (a->sourcetable == NULL) {
+	if (a->update == NULL) {
 		sourcetable_end_cb(0, a, 0);
 		return 0;
 	}
 
 	if (!strcmp(line, "ENDSOURCETABLE")) {
-		struct sourcetable *sourcetable = a->sourcetable;
+		struct timeval fetch_time;
+		json_object *j = NULL;
+		int r;
 
-		gettimeofday(&t1, NULL);
-		timersub(&t1, &a->task->st->start, &t1);
-		gettimeofday(&sourcetable->fetch_time, NULL);
+		gettimeofday(&fetch_time, NULL);
+		timersub(&fetch_time, &a->task->st->start, &t1);
 
-		sourcetable->pullable = 1;
-		ntrip_log(st, LOG_INFO, "sourcetable loaded, %d entries, %.3f ms",
-			sourcetable_nentries(sourcetable, 0),
-			t1.tv_sec*1000 + t1.tv_usec/1000.);
-		stack_replace_host(a->task->caster, &a->task->caster->sourcetablestack, a->task->host, a->task->port, sourcetable);
-		if (st->config->dyn->syncers_count >= 1) {
-			json_object *j = sourcetable_json(sourcetable);
-			json_object *type = json_object_new_string("sourcetable");
-			json_object_object_add(j, "type", type);
-			syncer_queue_json(st->caster, j);
+		if (a->update->base == NULL) {
+			sourcetable_insert(a, &fetch_time);
+			r = 1;
+		} else {
+			r = sourcetable_update_apply(st->caster, &st->caster->sourcetablestack, a->update, &fetch_time, &j);
+			if (r < 0) {
+				/* The table changed behind our back: start over with a new table next time */
+				ntrip_log(st, LOG_NOTICE, "sourcetable modified meanwhile, will reload fully");
+				drop_current(a);
+			}
+		}
+
+		if (r >= 0) {
+			ntrip_log(st, LOG_INFO, "sourcetable %s, %d entries, %d new or modified, %.3f ms",
+				r ? "loaded" : "unchanged",
+				sourcetable_nentries(a->current, 0),
+				sourcetable_nentries(a->update->added, 0),
+				t1.tv_sec*1000 + t1.tv_usec/1000.);
+			a->nrefresh++;
+		}
+
+		if (r >= 0 && st->config->dyn->syncers_count >= 1) {
+			if (a->nrefresh % SOURCETABLE_SYNC_FULL_EVERY == 1) {
+				/* Full table, also to resynchronize nodes which missed updates */
+				if (j)
+					json_object_put(j);
+				j = sourcetable_json(a->current);
+			}
+			if (j) {
+				json_object *type = json_object_new_string("sourcetable");
+				json_object_object_add(j, "type", type);
+				syncer_queue_json(st->caster, j);
+				j = NULL;
+			}
 		}
+		if (j)
+			json_object_put(j);
 
-		sourcetable_decref(a->sourcetable);
-		a->sourcetable = NULL;
+		sourcetable_update_free(a->update);
+		a->update = NULL;
 		sourcetable_end_cb(1, a, 0);
 		return 1;
 	}
@@ -173,10 +233,10 @@ static int sourcetable_line_cb(struct ntrip_state *st, void *arg_cb, const char
 			return 0;
 	}
 
-	if (sourcetable_add(a->sourcetable, line, 1, st->caster) < 0) {
-		ntrip_log(st, LOG_INFO, "Error when inserting sourcetable line from %s:%d", a->sourcetable->caster, a->sourcetable->port);
-		sourcetable_decref(a->sourcetable);
-		a->sourcetable = NULL;
+	if (sourcetable_update_add(a->update, line, 1, st->caster) < 0) {
+		ntrip_log(st, LOG_INFO, "Error when inserting sourcetable line from %s:%d", a->task->host, a->task->port);
+		sourcetable_update_free(a->update);
+		a->update = NULL;
 		sourcetable_end_cb(0, a, 0);
 		return 1;
 	}
@@ -189,13 +249,17 @@ static int sourcetable_line_cb(struct ntrip_state *st, void *arg_cb, const char
 void
 fetcher_sourcetable_start_with_config(void *arg_cb, int n, struct config *new_config) {
 	struct sourcetable_fetch_args *a = (struct sourcetable_fetch_args *)arg_cb;
-	assert(a->sourcetable == NULL);
-	a->sourcetable = sourcetable_new(a->task->host, a->task->port, a->task->tls, a->json_config);
-	a->sourcetable->priority = a->priority;
+	assert(a->update == NULL);
+	a->update = sourcetable_update_new(a->current, a->task->host, a->task->port, a->task->tls, a->json_config);
+	if (a->update == NULL) {
+		logfmt(&a->task->caster->flog, LOG_CRIT, "Can't start sourcetable fetcher: out of memory");
+		return;
+	}
+	a->update->added->priority = a->priority;
 
 	if (ntrip_task_start(a->task, a, NULL, 0, new_config) < 0) {
-		sourcetable_decref(a->sourcetable);
-		a->sourcetable = NULL;
+		sourcetable_update_free(a->update);
+		a->update = NULL;
 	}
 }
 
@@ -4,9 +4,16 @@
 #include "caster.h"
 #include "sourcetable.h"
 
+/*
+ * Send the full table to other nodes every n refreshes, incremental updates otherwise
+ */
+#define	SOURCETABLE_SYNC_FULL_EVERY	10
+
 struct sourcetable_fetch_args {
 	_Atomic int refcnt;
-	struct sourcetable *sourcetable;
+	struct sourcetable_update *update;	// fetch in progress
+	struct sourcetable *current;	// last table inserted in the stack, to update in place
+	int nrefresh;			// number of refreshes since current was inserted
 	int priority;			// priority in a sourcetable stack
 	struct ntrip_task *task;
 
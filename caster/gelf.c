@@ -1,6 +1,12 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
 #include <json-c/json.h>
 
 #include "gelf.h"
+#include "json.h"
+#include "packet.h"
 #include "util.h"
 
 /*
@@ -19,6 +25,7 @@ void gelf_init(struct gelf_entry *g, int level, const char *hostname, int thread
 	g->thread_id = thread_id;
 	g->connection_id = 0;
 	g->nograylog = 0;
+	g->log_prefix = NULL;
 	gettimeofday(&g->ts, NULL);
 }
 
@@ -42,3 +49,91 @@ json_object *gelf_json(struct gelf_entry *g) {
 	json_object_object_add_ex(new_obj, "timestamp", json_object_new_double((double)g->ts.tv_sec + g->ts.tv_usec/1000000.), JSON_C_CONSTANT_NEW);
 	return new_obj;
 }
+
+/*
+ * Append a constant string, return the end pointer.
+ */
+static char *gelf_copy(char *d, const char *s, size_t len) {
+	memcpy(d, s, len);
+	return d + len;
+}
+
+#define	GELF_COPY(d, s)	gelf_copy((d), (s), sizeof(s)-1)
+
+/*
+ * Serialize a GELF structure directly to a packet, without going through json-c.
+ * The keys are in the same order as gelf_json().
+ *
+ * Return NULL if out of memory.
+ */
+struct packet *gelf_packet(struct gelf_entry *g) {
+	char thread_id[16], remote_port[16], level[16], connection_id[24], timestamp[32];
+	int thread_id_len = 0, remote_port_len = 0, connection_id_len = 0;
+	size_t len = 2;
+
+	/*
+	 * First pass: format numbers and compute the exact length.
+	 */
+	if (g->thread_id >= 0) {
+		thread_id_len = snprintf(thread_id, sizeof thread_id, "%d", g->thread_id);
+		len += sizeof("\"_thread_id\":,")-1 + thread_id_len;
+	}
+	if (g->remote_ip) {
+		remote_port_len = snprintf(remote_port, sizeof remote_port, "%d", g->remote_port);
+		len += sizeof("\"_remote_ip\":,\"_remote_port\":,")-1
+			+ json_quoted_len(g->remote_ip) + remote_port_len;
+	}
+	int level_len = snprintf(level, sizeof level, "%d", g->level);
+	len += sizeof("\"level\":,\"short_message\":,\"host\":,\"version\":\"1.1\",")-1
+		+ level_len + json_quoted_len(g->short_message) + json_quoted_len(g->hostname);
+	if (g->connection_id) {
+		connection_id_len = snprintf(connection_id, sizeof connection_id, "%llu", g->connection_id);
+		len += sizeof("\"_connection_id\":,")-1 + connection_id_len;
+	}
+	int timestamp_len = snprintf(timestamp, sizeof timestamp, "%.17g", (double)g->ts.tv_sec + g->ts.tv_usec/1000000.);
+	if (timestamp_len > 0 && timestamp_len < sizeof timestamp - 2 && strspn(timestamp, "-0123456789") == timestamp_len) {
+		/* Looks like an integer, make it clear it is not, like json-c */
+		memcpy(timestamp+timestamp_len, ".0", 3);
+		timestamp_len += 2;
+	}
+	len += sizeof("\"timestamp\":")-1 + timestamp_len;
+
+	struct packet *p = packet_new(len);
+	if (p == NULL)
+		return NULL;
+
+	/*
+	 * Second pass: fill the packet.
+	 */
+	char *d = (char *)p->data;
+	*d++ = '{';
+	if (thread_id_len) {
+		d = GELF_COPY(d, "\"_thread_id\":");
+		d = gelf_copy(d, thread_id, thread_id_len);
+		*d++ = ',';
+	}
+	if (g->remote_ip) {
+		d = GELF_COPY(d, "\"_remote_ip\":");
+		d = json_quote(d, g->remote_ip);
+		d = GELF_COPY(d, ",\"_remote_port\":");
+		d = gelf_copy(d, remote_port, remote_port_len);
+		*d++ = ',';
+	}
+	d = GELF_COPY(d, "\"level\":");
+	d = gelf_copy(d, level, level_len);
+	d = GELF_COPY(d, ",\"short_message\":");
+	d = json_quote(d, g->short_message);
+	d = GELF_COPY(d, ",\"host\":");
+	d = json_quote(d, g->hostname);
+	d = GELF_COPY(d, ",\"version\":\"1.1\",");
+	if (connection_id_len) {
+		d = GELF_COPY(d, "\"_connection_id\":");
+		d = gelf_copy(d, connection_id, connection_id_len);
+		*d++ = ',';
+	}
+	d = GELF_COPY(d, "\"timestamp\":");
+	d = gelf_copy(d, timestamp, timestamp_len);
+	*d++ = '}';
+	assert(d == (char *)p->data + len);
+	return p;
+}
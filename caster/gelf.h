@@ -17,9 +17,13 @@ struct gelf_entry {
 	int thread_id;					// Thread id or -1
 	unsigned long long connection_id;		// IP connection id
 	char nograylog;					// Skip sending to graylog
+	const char *log_prefix;				// Prepended to the message in log files
 };
 
+struct packet;
+
 void gelf_init(struct gelf_entry *g, int level, const char *hostname, int thread_id);
 json_object *gelf_json(struct gelf_entry *g);
+struct packet *gelf_packet(struct gelf_entry *g);
 
 #endif
@@ -0,0 +1,200 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "conf.h"
+#include "geoindex.h"
+#include "sourceline.h"
+
+/* Earth radius in meters, as in distance() */
+#define	EARTH_RADIUS	6371000.
+
+/* Safety margin in degrees to compensate for float rounding in distance() */
+#define	GEOINDEX_MARGIN	0.01
+
+static int geoindex_lat_band(float lat) {
+	int band = (int)floor(lat) + 90;
+	if (band < 0)
+		return 0;
+	if (band > 179)
+		return 179;
+	return band;
+}
+
+static int geoindex_lon_cell(int lon) {
+	int cell = (lon + 180) % 360;
+	return cell < 0 ? cell + 360 : cell;
+}
+
+static int geoindex_cell(pos_t *pos) {
+	return geoindex_lat_band(pos->lat)*360 + geoindex_lon_cell((int)floor(pos->lon));
+}
+
+struct geoindex *geoindex_new(void) {
+	struct geoindex *this = (struct geoindex *)malloc(sizeof(struct geoindex));
+	if (this == NULL)
+		return NULL;
+	this->entries = NULL;
+	this->n = 0;
+	this->size = 0;
+	this->sorted = 1;
+	this->ndeleted = 0;
+	return this;
+}
+
+void geoindex_free(struct geoindex *this) {
+	free(this->entries);
+	free(this);
+}
+
+/*
+ * Add a sourceline to the index.
+ *
+ * The entry is appended: the index needs a geoindex_sort() afterwards
+ * to use the grid, otherwise lookups fall back to a linear scan.
+ */
+int geoindex_add(struct geoindex *this, struct sourceline *sourceline) {
+	if (this->n == this->size) {
+		int newsize = this->size ? this->size*2 : 64;
+		struct geoindex_entry *new_entries = (struct geoindex_entry *)realloc(this->entries, newsize*sizeof(struct geoindex_entry));
+		if (new_entries == NULL)
+			return -1;
+		this->entries = new_entries;
+		this->size = newsize;
+	}
+	struct geoindex_entry *e = &this->entries[this->n];
+	e->cell = geoindex_cell(&sourceline->pos);
+	e->pos = sourceline->pos;
+	e->sourceline = sourceline;
+	if (this->n && this->entries[this->n-1].cell > e->cell)
+		this->sorted = 0;
+	this->n++;
+	return 0;
+}
+
+static int _cmp_cell(const void *p1, const void *p2) {
+	const struct geoindex_entry *e1 = (const struct geoindex_entry *)p1;
+	const struct geoindex_entry *e2 = (const struct geoindex_entry *)p2;
+	return (e1->cell > e2->cell) - (e1->cell < e2->cell);
+}
+
+/*
+ * Remove the entries marked deleted, then sort the index if needed.
+ */
+void geoindex_sort(struct geoindex *this) {
+	if (this->ndeleted) {
+		int n = 0;
+		for (int i = 0; i < this->n; i++)
+			if (this->entries[i].sourceline != NULL)
+				this->entries[n++] = this->entries[i];
+		this->n = n;
+		this->ndeleted = 0;
+	}
+	if (this->sorted)
+		return;
+	qsort(this->entries, this->n, sizeof(struct geoindex_entry), _cmp_cell);
+	this->sorted = 1;
+}
+
+/*
+ * Return the index of the first entry with a cell number >= cell.
+ */
+static int geoindex_lower_bound(struct geoindex *this, int cell) {
+	int lo = 0, hi = this->n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (this->entries[mid].cell < cell)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void geoindex_scan(struct geoindex *this, int first_cell, int last_cell, pos_t *pos, float max_dist, geoindex_cb cb, void *arg) {
+	for (int i = geoindex_lower_bound(this, first_cell); i < this->n && this->entries[i].cell <= last_cell; i++) {
+		struct geoindex_entry *e = &this->entries[i];
+		if (e->sourceline == NULL)
+			continue;
+		float dist = distance(&e->pos, pos);
+		if (dist < max_dist)
+			cb(e->sourceline, dist, arg);
+	}
+}
+
+/*
+ * Remove a sourceline from the index.
+ *
+ * The entry is only marked deleted, so removals don't move the other
+ * entries: the next geoindex_sort() compacts the index once.
+ *
+ * Return 0 if found, -1 if not.
+ */
+int geoindex_del(struct geoindex *this, struct sourceline *sourceline) {
+	int cell = geoindex_cell(&sourceline->pos);
+	int i = this->sorted ? geoindex_lower_bound(this, cell) : 0;
+	for (; i < this->n; i++) {
+		if (this->entries[i].sourceline == sourceline) {
+			this->entries[i].sourceline = NULL;
+			this->ndeleted++;
+			return 0;
+		}
+		if (this->sorted && this->entries[i].cell > cell)
+			break;
+	}
+	return -1;
+}
+
+/*
+ * Call cb for every entry within max_dist meters of pos.
+ */
+void geoindex_foreach(struct geoindex *this, pos_t *pos, float max_dist, geoindex_cb cb, void *arg) {
+	/* Angular search radius */
+	double r = max_dist / EARTH_RADIUS;
+
+	if (!this->sorted || r >= M_PI/2) {
+		for (int i = 0; i < this->n; i++) {
+			struct geoindex_entry *e = &this->entries[i];
+			if (e->sourceline == NULL)
+				continue;
+			float dist = distance(&e->pos, pos);
+			if (dist < max_dist)
+				cb(e->sourceline, dist, arg);
+		}
+		return;
+	}
+
+	double dlat = r*(180./M_PI) + GEOINDEX_MARGIN;
+	int band_lo = geoindex_lat_band(pos->lat - dlat);
+	int band_hi = geoindex_lat_band(pos->lat + dlat);
+
+	/*
+	 * Longitude half-width of the spherical cap around pos,
+	 * or the full circle if the cap contains a pole.
+	 */
+	double coslat = cos(pos->lat*(M_PI/180.));
+	int full_lon = 1;
+	int lon_lo = 0, lon_hi = 0;
+	if (sin(r) < coslat) {
+		double dlon = asin(sin(r)/coslat)*(180./M_PI) + GEOINDEX_MARGIN;
+		lon_lo = (int)floor(pos->lon - dlon);
+		lon_hi = (int)floor(pos->lon + dlon);
+		full_lon = (lon_hi - lon_lo >= 359);
+	}
+
+	for (int band = band_lo; band <= band_hi; band++) {
+		int base = band*360;
+		if (full_lon) {
+			geoindex_scan(this, base, base+359, pos, max_dist, cb, arg);
+			continue;
+		}
+		int c_lo = geoindex_lon_cell(lon_lo);
+		int c_hi = geoindex_lon_cell(lon_hi);
+		if (c_lo <= c_hi)
+			geoindex_scan(this, base+c_lo, base+c_hi, pos, max_dist, cb, arg);
+		else {
+			/* Wrap around the antimeridian */
+			geoindex_scan(this, base+c_lo, base+359, pos, max_dist, cb, arg);
+			geoindex_scan(this, base, base+c_hi, pos, max_dist, cb, arg);
+		}
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef __GEOINDEX_H__
+#define __GEOINDEX_H__
+
+#include "util.h"
+
+struct sourceline;
+
+/*
+ * Spatial index of sourcelines.
+ *
+ * Entries are bucketed in 1x1 degree cells and kept sorted by cell number,
+ * so a position lookup only needs to scan the cells overlapping
+ * the search radius.
+ *
+ * The index does not hold references to the sourcelines: they are
+ * owned by the sourcetable it belongs to.
+ */
+
+struct geoindex_entry {
+	int cell;
+	pos_t pos;
+	struct sourceline *sourceline;
+};
+
+struct geoindex {
+	struct geoindex_entry *entries;
+	int n, size;
+	int sorted;		// entries are sorted by cell, lookups can use the grid
+	int ndeleted;		// entries marked deleted, removed by geoindex_sort()
+};
+
+/*
+ * Callback for geoindex_foreach(), called for every entry within range.
+ */
+typedef void (*geoindex_cb)(struct sourceline *sourceline, float dist, void *arg);
+
+struct geoindex *geoindex_new(void);
+void geoindex_free(struct geoindex *this);
+int geoindex_add(struct geoindex *this, struct sourceline *sourceline);
+int geoindex_del(struct geoindex *this, struct sourceline *sourceline);
+void geoindex_sort(struct geoindex *this);
+void geoindex_foreach(struct geoindex *this, pos_t *pos, float max_dist, geoindex_cb cb, void *arg);
+
+#endif
@@ -20,10 +20,18 @@ void graylog_sender_queue(struct graylog_sender *this, const char *json) {
 		logfmt(&this->task->caster->flog, LOG_CRIT, "No configured ports to listen to, aborting.");
 		return;
 	}
-	ntrip_task_queue(this->task, packet);
+	graylog_sender_queue_packet(this, packet);
 	packet_decref(packet);
 }
 
+/*
+ * Queue an already serialized GELF/JSON log entry.
+ * The caller keeps its reference to the packet.
+ */
+void graylog_sender_queue_packet(struct graylog_sender *this, struct packet *packet) {
+	ntrip_task_queue(this->task, packet);
+}
+
 /*
  * Callback called at the end of the http session.
  *
@@ -56,7 +64,8 @@ status_cb(void *arg, int status, int n) {
 struct graylog_sender *graylog_sender_new(struct caster_state *caster,
 	const char *host, unsigned short port, const char *uri, int tls,
 	int status_timeout, int retry_delay, int max_retry_delay,
-	int bulk_max_size, int queue_max_size, const char *authkey, const char *drainfilename) {
+	int bulk_max_size, int compression_level, int queue_max_size, const char *authkey, const char *drainfilename,
+	const char *spilldir, size_t spill_max_size, enum spillq_policy spill_policy) {
 
 	struct graylog_sender *this = (struct graylog_sender *)malloc(sizeof(struct graylog_sender));
 	if (this == NULL)
@@ -82,6 +91,19 @@ struct graylog_sender *graylog_sender_new(struct caster_state *caster,
 	this->task->use_mimeq = 1;
 	this->task->nograylog = 1;
 
+	if (ntrip_task_set_compression(this->task, compression_level) < 0) {
+		logfmt(&caster->flog, LOG_ERR, "Invalid graylog compression_level %d", compression_level);
+		ntrip_task_decref(this->task);
+		free(this);
+		return NULL;
+	}
+
+	if (spilldir && ntrip_task_set_spill(this->task, spilldir, spill_max_size, spill_policy) < 0) {
+		ntrip_task_decref(this->task);
+		free(this);
+		return NULL;
+	}
+
 	if (evhttp_add_header(&this->task->headers, "Authorization", authkey) < 0) {
 		ntrip_task_decref(this->task);
 		free(this);
@@ -11,10 +11,12 @@ struct graylog_sender {
 };
 
 void graylog_sender_queue(struct graylog_sender *this, const char *json);
+void graylog_sender_queue_packet(struct graylog_sender *this, struct packet *packet);
 struct graylog_sender *graylog_sender_new(struct caster_state *caster,
 	const char *host, unsigned short port, const char *uri, int tls,
 	int status_timeout, int retry_delay, int max_retry_delay,
-	int bulk_max_size, int queue_max_size, const char *authkey, const char *drainfilename);
+	int bulk_max_size, int compression_level, int queue_max_size, const char *authkey, const char *drainfilename,
+	const char *spilldir, size_t spill_max_size, enum spillq_policy spill_policy);
 void graylog_sender_free(struct graylog_sender *this);
 void graylog_sender_stop(struct graylog_sender *this);
 void graylog_sender_start_with_config(void *arg_cb, int n, struct config *new_config);
@@ -3,43 +3,63 @@
 #include <string.h>
 
 #include "hash.h"
-#include "queue.h"
 #include "util.h"
 
+/* Max load factor, in 1/8ths */
+#define	HASH_MAX_LOAD	7
+#define	HASH_MIN_SLOTS	8
+
+/*
+ * Hash a key: FNV-1a with a final avalanche, so the low bits
+ * used for the slot number depend on all key bytes.
+ */
+static unsigned int hash_key(const char *key) {
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	unsigned char c;
+	while ((c = *key++)) {
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return (unsigned int)hash;
+}
+
 /*
- * Convert a key to a bucket number.
+ * Distance of a slot from the ideal slot for its hash.
  */
-static unsigned int hash_key(struct hash_table *this, const char *key) {
-	unsigned int hash = 441;
-	int c;
-	while ((c = *key++))
-		hash = hash*37 + c;
-	return hash % this->n_buckets;
+static inline unsigned int hash_probe_distance(struct hash_table *this, unsigned int hash, unsigned int slot) {
+	return (slot - (hash & this->mask)) & this->mask;
+}
+
+static struct hash_slot *hash_slots_new(unsigned int nslots) {
+	return (struct hash_slot *)calloc(nslots, sizeof(struct hash_slot));
 }
 
 /*
- * Create a hash table with the indicated number of buckets.
+ * Create a hash table.
+ * n_buckets is a hint for the initial number of slots.
  */
 struct hash_table *hash_table_new(int n_buckets, void free_callback(void *)) {
-	struct elementlisthead *element_lists;
 	if (n_buckets <= 0)
 		return NULL;
+	unsigned int nslots = HASH_MIN_SLOTS;
+	while (nslots < n_buckets)
+		nslots *= 2;
+
 	struct hash_table *this = (struct hash_table *)malloc(sizeof(struct hash_table));
-	element_lists = (struct elementlisthead *)malloc(n_buckets*sizeof(struct elementlisthead));
-	if (this == NULL || element_lists == NULL) {
+	struct hash_slot *slots = hash_slots_new(nslots);
+	if (this == NULL || slots == NULL) {
 		free(this);
-		free(element_lists);
+		free(slots);
 		return NULL;
 	}
 
-	this->element_lists = element_lists;
-	this->n_buckets = n_buckets;
+	this->slots = slots;
+	this->mask = nslots - 1;
 	this->nentries = 0;
 	this->free_callback = free_callback ? free_callback : free;
-
-	/* Initialize the bucket lists */
-	for (int h = 0; h < n_buckets; h++)
-		SLIST_INIT(&this->element_lists[h]);
 	return this;
 }
 
@@ -47,7 +67,6 @@ struct hash_table *hash_table_new(int n_buckets, void free_callback(void *)) {
  * Free an element.
  */
 static void _hash_table_free_element(struct hash_table *this, struct element *e, int callback) {
-	strfree((char *)(e->key));
 	if (callback)
 		this->free_callback(e->value);
 	free(e);
@@ -60,50 +79,95 @@ void hash_table_free_null(void *value) {
  * Free a complete hash table.
  */
 void hash_table_free(struct hash_table *this) {
-	struct element *e;
 	int n = 0;
 
-	for (int h = 0; h < this->n_buckets; h++) {
-		struct elementlisthead *t = &this->element_lists[h];
-		while ((e = SLIST_FIRST(t))) {
-			SLIST_REMOVE_HEAD(t, next);
-			_hash_table_free_element(this, e, 1);
+	for (unsigned int i = 0; i <= this->mask; i++)
+		if (this->slots[i].e) {
+			_hash_table_free_element(this, this->slots[i].e, 1);
 			n++;
 		}
-	}
 
 	assert(n == this->nentries);
-	free(this->element_lists);
+	free(this->slots);
 	free(this);
 }
 
 /*
- * Find an element.
- * Return its pointer if found, else NULL.
- * Remove from the hash table if del is not 0.
+ * Insert an element known not to be in the table, Robin Hood style:
+ * an element further from its ideal slot takes the place of a closer one,
+ * which is then moved further.
  */
-static struct element *hash_table_find(struct hash_table *this, const char *key, unsigned int *hk, int del) {
-	unsigned int h = hash_key(this, key);
-	if (hk) *hk = h;
-
-	struct elementlisthead *head = &this->element_lists[h];
-	struct elementlisthead *t = head;
-	struct element *e;
-	struct element *last = NULL;
-	SLIST_FOREACH(e, t, next) {
-		if (!strcmp(key, e->key)) {
-			if (del) {
-				if (last)
-					SLIST_REMOVE_AFTER(last, next);
-				else
-					SLIST_REMOVE_HEAD(head, next);
-				this->nentries--;
-			}
-			return e;
+static void hash_slot_insert(struct hash_table *this, unsigned int hash, struct element *e) {
+	unsigned int i = hash & this->mask;
+	unsigned int dist = 0;
+
+	while (this->slots[i].e) {
+		unsigned int d = hash_probe_distance(this, this->slots[i].hash, i);
+		if (d < dist) {
+			struct hash_slot tmp = this->slots[i];
+			this->slots[i].hash = hash;
+			this->slots[i].e = e;
+			hash = tmp.hash;
+			e = tmp.e;
+			dist = d;
 		}
-		last = e;
+		i = (i + 1) & this->mask;
+		dist++;
 	}
-	return NULL;
+	this->slots[i].hash = hash;
+	this->slots[i].e = e;
+}
+
+/*
+ * Double the number of slots.
+ */
+static int hash_table_grow(struct hash_table *this) {
+	unsigned int old_nslots = this->mask + 1;
+	struct hash_slot *old_slots = this->slots;
+	struct hash_slot *slots = hash_slots_new(old_nslots*2);
+	if (slots == NULL)
+		return -1;
+
+	this->slots = slots;
+	this->mask = old_nslots*2 - 1;
+	for (unsigned int i = 0; i < old_nslots; i++)
+		if (old_slots[i].e)
+			hash_slot_insert(this, old_slots[i].hash, old_slots[i].e);
+	free(old_slots);
+	return 0;
+}
+
+/*
+ * Find the slot of a key.
+ * Return its number if found, else -1.
+ */
+static int hash_table_find(struct hash_table *this, const char *key, unsigned int hash) {
+	unsigned int i = hash & this->mask;
+
+	for (unsigned int dist = 0; this->slots[i].e; dist++) {
+		/* Robin Hood invariant: the key would have been placed before this one */
+		if (hash_probe_distance(this, this->slots[i].hash, i) < dist)
+			return -1;
+		if (this->slots[i].hash == hash && !strcmp(key, this->slots[i].e->key))
+			return i;
+		i = (i + 1) & this->mask;
+	}
+	return -1;
+}
+
+/*
+ * Remove the element at a given slot, shifting the following
+ * elements back to keep probe sequences without holes.
+ */
+static void hash_slot_remove(struct hash_table *this, unsigned int i) {
+	unsigned int next = (i + 1) & this->mask;
+	while (this->slots[next].e && hash_probe_distance(this, this->slots[next].hash, next) > 0) {
+		this->slots[i] = this->slots[next];
+		i = next;
+		next = (next + 1) & this->mask;
+	}
+	this->slots[i].e = NULL;
+	this->nentries--;
 }
 
 /*
@@ -128,20 +192,20 @@ void hash_table_update(struct hash_table *this, struct hash_table *updates) {
  * Insert an element.
  */
 int hash_table_add(struct hash_table *this, const char *key, void *value) {
-	unsigned int h;
-	struct element *e = hash_table_find(this, key, &h, 0);
-	if (e != NULL)
+	unsigned int hash = hash_key(key);
+	if (hash_table_find(this, key, hash) >= 0)
 		return -1;
-	e = (struct element *)malloc(sizeof(struct element));
-	if (e == NULL)
+	if ((this->nentries + 1)*8 > (this->mask + 1)*HASH_MAX_LOAD && hash_table_grow(this) < 0)
 		return -2;
-	e->key = mystrdup(key);
-	if (e->key == NULL) {
-		free(e);
+
+	size_t keylen = strlen(key);
+	struct element *e = (struct element *)malloc(sizeof(struct element) + keylen + 1);
+	if (e == NULL)
 		return -2;
-	}
+	memcpy(e->keybuf, key, keylen + 1);
+	e->key = e->keybuf;
 	e->value = value;
-	SLIST_INSERT_HEAD(&this->element_lists[h], e, next);
+	hash_slot_insert(this, hash, e);
 	this->nentries++;
 	return 0;
 }
@@ -150,8 +214,8 @@ int hash_table_add(struct hash_table *this, const char *key, void *value) {
  * Get an element, return its pointer or NULL if not found.
  */
 struct element *hash_table_get_element(struct hash_table *this, const char *key) {
-	unsigned int h;
-	return hash_table_find(this, key, &h, 0);
+	int i = hash_table_find(this, key, hash_key(key));
+	return i < 0 ? NULL : this->slots[i].e;
 }
 
 /*
@@ -167,10 +231,11 @@ void *hash_table_get(struct hash_table *this, const char *key) {
  * Return 0 if found, -1 if not.
  */
 int hash_table_del(struct hash_table *this, const char *key) {
-	unsigned int h;
-	struct element *e = hash_table_find(this, key, &h, 1);
-	if (e == NULL)
+	int i = hash_table_find(this, key, hash_key(key));
+	if (i < 0)
 		return -1;
+	struct element *e = this->slots[i].e;
+	hash_slot_remove(this, i);
 	_hash_table_free_element(this, e, 1);
 	return 0;
 }
@@ -180,11 +245,13 @@ int hash_table_del(struct hash_table *this, const char *key) {
  * Return pointer if found, NULL if not.
  */
 void *hash_table_get_del(struct hash_table *this, const char *key) {
-	unsigned int h;
-	struct element *e = hash_table_find(this, key, &h, 1);
-	void *value = e != NULL ? e->value : NULL;
-	if (e != NULL)
-		_hash_table_free_element(this, e, 0);
+	int i = hash_table_find(this, key, hash_key(key));
+	if (i < 0)
+		return NULL;
+	struct element *e = this->slots[i].e;
+	void *value = e->value;
+	hash_slot_remove(this, i);
+	_hash_table_free_element(this, e, 0);
 	return value;
 }
 
@@ -225,8 +292,7 @@ int hash_len(struct hash_table *this) {
  * Initialize an iterator.
  */
 void hash_iterator_init(struct hash_iterator *this, struct hash_table *ht) {
-	this->bucket_number = -1;
-	this->e = NULL;
+	this->slot = -1;
 	this->ht = ht;
 }
 
@@ -234,23 +300,14 @@ void hash_iterator_init(struct hash_iterator *this, struct hash_table *ht) {
  * Return the next element, or NULL when finished.
  */
 struct element *hash_iterator_next(struct hash_iterator *this) {
-	if (this->e) {
-		this->e = SLIST_NEXT(this->e, next);
-		if (this->e)
-			return this->e;
-	}
-
-	while (this->e == NULL) {
-		this->bucket_number++;
-		if (this->bucket_number == this->ht->n_buckets) {
-			/* Make sure we crash if the iterator is ever used again */
-			this->ht = NULL;
-			this->e = NULL;
-			return NULL;
-		}
-		this->e = SLIST_FIRST(&this->ht->element_lists[this->bucket_number]);
+	while (++this->slot <= this->ht->mask) {
+		struct element *e = this->ht->slots[this->slot].e;
+		if (e)
+			return e;
 	}
-	return this->e;
+	/* Make sure we crash if the iterator is ever used again */
+	this->ht = NULL;
+	return NULL;
 }
 
 static int _cmp_keys(const void *p1, const void *p2) {
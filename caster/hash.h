@@ -5,17 +5,16 @@
  * Handle a key-value store
  */
 
-#include <sys/queue.h>
-
-SLIST_HEAD(elementlisthead, element);
-
 /*
  * Individual element
+ *
+ * Elements are allocated separately from the slot array, in one block
+ * with their key, so element pointers remain valid when the table grows.
  */
 struct element {
 	const char *key;
 	void *value;
-	SLIST_ENTRY(element) next;
+	char keybuf[];		// inline key storage
 };
 
 /*
@@ -24,19 +23,30 @@ struct element {
  */
 typedef void (*hash_free_callback)(void *);
 
+/*
+ * Slot in the open-addressing array.
+ * The full key hash is kept to skip most key comparisons and for resizing.
+ */
+struct hash_slot {
+	unsigned int hash;
+	struct element *e;	// NULL if empty
+};
+
 /*
  * Main table
+ *
+ * Open addressing with linear probing and Robin Hood insertion,
+ * so that probe sequences stay short. Grows automatically.
  */
 struct hash_table {
 	int nentries;				// total number of entries
-	int n_buckets;				// size of element_lists
-	struct elementlisthead *element_lists;	// 1 element per hash bucket
+	unsigned int mask;			// number of slots - 1, a power of 2 minus 1
+	struct hash_slot *slots;
 	void (*free_callback)(void *);
 };
 
 struct hash_iterator {
-	int bucket_number;
-	struct element *e;
+	int slot;
 	struct hash_table *ht;
 };
 
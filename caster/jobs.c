@@ -1,5 +1,9 @@
 #include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
@@ -16,70 +20,455 @@
 
 
 /*
- * Create a job list.
+ * Lock-free MPMC ring, after Dmitry Vyukov's bounded queue.
+ *
+ * Each cell has a sequence number telling whether it is ready
+ * for the writer (seq == position) or the reader (seq == position+1).
+ */
+static int job_ring_init(struct job_ring *this, size_t size) {
+	this->cells = (struct job_ring_cell *)malloc(sizeof(struct job_ring_cell)*size);
+	if (this->cells == NULL)
+		return -1;
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&this->cells[i].seq, i);
+	this->mask = size-1;
+	atomic_init(&this->head, 0);
+	atomic_init(&this->tail, 0);
+	return 0;
+}
+
+/*
+ * Return -1 if full.
+ */
+static int job_ring_push(struct job_ring *this, void *item) {
+	struct job_ring_cell *cell;
+	size_t pos = atomic_load_explicit(&this->tail, memory_order_relaxed);
+	while (1) {
+		cell = &this->cells[pos & this->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&this->tail, &pos, pos+1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (dif < 0)
+			return -1;
+		else
+			pos = atomic_load_explicit(&this->tail, memory_order_relaxed);
+	}
+	cell->item = item;
+	atomic_store_explicit(&cell->seq, pos+1, memory_order_release);
+	return 0;
+}
+
+/*
+ * Return NULL if empty.
+ */
+static void *job_ring_pop(struct job_ring *this) {
+	struct job_ring_cell *cell;
+	size_t pos = atomic_load_explicit(&this->head, memory_order_relaxed);
+	while (1) {
+		cell = &this->cells[pos & this->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&this->head, &pos, pos+1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&this->head, memory_order_relaxed);
+	}
+	void *item = cell->item;
+	atomic_store_explicit(&cell->seq, pos + this->mask + 1, memory_order_release);
+	return item;
+}
+
+/*
+ * Per-worker deque.
+ *
+ * Only the owner pushes, so bottom has a single writer. Takers compete
+ * on top with a CAS: the owner cannot overwrite a slot before top moves past it.
+ */
+static int job_deque_init(struct job_deque *this, size_t size) {
+	this->items = (_Atomic(void *) *)malloc(sizeof(_Atomic(void *))*size);
+	if (this->items == NULL)
+		return -1;
+	this->mask = size-1;
+	atomic_init(&this->top, 0);
+	atomic_init(&this->bottom, 0);
+	return 0;
+}
+
+/*
+ * Return -1 if full.
+ */
+static int job_deque_push(struct job_deque *this, void *item) {
+	size_t b = atomic_load_explicit(&this->bottom, memory_order_relaxed);
+	size_t t = atomic_load_explicit(&this->top, memory_order_acquire);
+	if (b - t > this->mask)
+		return -1;
+	atomic_store_explicit(&this->items[b & this->mask], item, memory_order_relaxed);
+	atomic_store_explicit(&this->bottom, b+1, memory_order_release);
+	return 0;
+}
+
+/*
+ * Take the oldest item, from the owner or another worker.
+ * Return NULL if empty.
+ */
+static void *job_deque_take(struct job_deque *this) {
+	size_t t = atomic_load_explicit(&this->top, memory_order_acquire);
+	while (1) {
+		size_t b = atomic_load_explicit(&this->bottom, memory_order_acquire);
+		if (t >= b)
+			return NULL;
+		void *item = atomic_load_explicit(&this->items[t & this->mask], memory_order_relaxed);
+		if (atomic_compare_exchange_weak_explicit(&this->top, &t, t+1,
+			memory_order_seq_cst, memory_order_acquire))
+			return item;
+	}
+}
+
+/*
+ * Job pool.
+ *
+ * Jobs are usually allocated in event loop threads and released in workers.
+ * As for packets, each thread keeps a small cache of free jobs; the overflow
+ * is moved in batches to a global free list, from which caches are refilled.
+ */
+#define	JOB_POOL_LOCAL_MAX	128	// max cached jobs per thread
+#define	JOB_POOL_BATCH		64	// jobs moved at once to/from the global list
+#define	JOB_POOL_GLOBAL_MAX	16384	// max jobs in the global list, the rest is freed
+
+/* Free jobs are linked through their own storage */
+struct job_free {
+	struct job_free *next;
+};
+
+struct job_pool_local {
+	struct job_free *head;
+	int n;
+};
+
+struct job_pool {
+	P_MUTEX_T lock;
+	struct job_free *head;
+	int n;
+
+	_Atomic unsigned long long local_hits;	// allocated from the thread cache
+	_Atomic unsigned long long global_hits;	// allocated after a refill from the global list
+	_Atomic unsigned long long misses;	// allocated with malloc()
+	_Atomic unsigned long long released;	// returned to malloc()
+};
+
+static _Thread_local struct job_pool_local job_pool_local;
+
+/* Thread-exit destructor to flush the thread cache, set on first use */
+static pthread_key_t job_pool_key;
+static pthread_once_t job_pool_once = PTHREAD_ONCE_INIT;
+static _Thread_local int job_pool_registered;
+
+static struct job_pool job_pool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Refill the thread cache from the global list.
+ */
+static void job_pool_refill(void) {
+	struct job_pool_local *local = &job_pool_local;
+
+	P_MUTEX_LOCK(&job_pool.lock);
+	struct job_free *first = job_pool.head, *last = NULL;
+	int n = 0;
+	for (struct job_free *f = first; f != NULL && n < JOB_POOL_BATCH; f = f->next) {
+		last = f;
+		n++;
+	}
+	if (n) {
+		job_pool.head = last->next;
+		job_pool.n -= n;
+	}
+	P_MUTEX_UNLOCK(&job_pool.lock);
+
+	if (n) {
+		last->next = local->head;
+		local->head = first;
+		local->n += n;
+	}
+}
+
+/*
+ * Move n jobs from the thread cache to the global list,
+ * or back to malloc() if the global list is full.
+ */
+static void job_pool_spill(int n) {
+	struct job_pool_local *local = &job_pool_local;
+	if (n == 0)
+		return;
+
+	struct job_free *first = local->head, *last = first;
+	for (int i = 1; i < n; i++)
+		last = last->next;
+	local->head = last->next;
+	local->n -= n;
+
+	P_MUTEX_LOCK(&job_pool.lock);
+	if (job_pool.n < JOB_POOL_GLOBAL_MAX) {
+		last->next = job_pool.head;
+		job_pool.head = first;
+		job_pool.n += n;
+		first = NULL;
+	}
+	P_MUTEX_UNLOCK(&job_pool.lock);
+
+	if (first != NULL) {
+		last->next = NULL;
+		while (first) {
+			struct job_free *next = first->next;
+			free(first);
+			first = next;
+		}
+		atomic_fetch_add_explicit(&job_pool.released, n, memory_order_relaxed);
+	}
+}
+
+/*
+ * Thread exit: move all cached jobs to the global list,
+ * or back to malloc() beyond its maximum size.
+ */
+static void job_pool_thread_free(void *arg) {
+	struct job_pool_local *local = (struct job_pool_local *)arg;
+	int released = 0;
+
+	P_MUTEX_LOCK(&job_pool.lock);
+	while (local->head) {
+		struct job_free *f = local->head;
+		local->head = f->next;
+		if (job_pool.n < JOB_POOL_GLOBAL_MAX) {
+			f->next = job_pool.head;
+			job_pool.head = f;
+			job_pool.n++;
+		} else {
+			free(f);
+			released++;
+		}
+	}
+	local->n = 0;
+	P_MUTEX_UNLOCK(&job_pool.lock);
+	if (released)
+		atomic_fetch_add_explicit(&job_pool.released, released, memory_order_relaxed);
+	/* Register again if jobs are freed by a later destructor */
+	job_pool_registered = 0;
+}
+
+static void job_pool_key_create(void) {
+	pthread_key_create(&job_pool_key, job_pool_thread_free);
+}
+
+/*
+ * Arrange for the thread cache to be flushed when the thread exits.
+ */
+static inline void job_pool_register(void) {
+	if (job_pool_registered)
+		return;
+	pthread_once(&job_pool_once, job_pool_key_create);
+	pthread_setspecific(job_pool_key, &job_pool_local);
+	job_pool_registered = 1;
+}
+
+/*
+ * Shutdown: free the cache of the current thread and the global list.
+ * The other threads are expected to have exited.
+ */
+static void job_pool_flush(void) {
+	struct job_pool_local *local = &job_pool_local;
+	struct job_free *f, *next;
+	int released = 0;
+
+	for (f = local->head; f != NULL; f = next) {
+		next = f->next;
+		free(f);
+		released++;
+	}
+	local->head = NULL;
+	local->n = 0;
+
+	P_MUTEX_LOCK(&job_pool.lock);
+	f = job_pool.head;
+	job_pool.head = NULL;
+	job_pool.n = 0;
+	P_MUTEX_UNLOCK(&job_pool.lock);
+	for (; f != NULL; f = next) {
+		next = f->next;
+		free(f);
+		released++;
+	}
+	if (released)
+		atomic_fetch_add_explicit(&job_pool.released, released, memory_order_relaxed);
+}
+
+static struct job *job_alloc(void) {
+	struct job_pool_local *local = &job_pool_local;
+	struct job *j;
+	if (local->head != NULL)
+		atomic_fetch_add_explicit(&job_pool.local_hits, 1, memory_order_relaxed);
+	else {
+		job_pool_register();
+		job_pool_refill();
+		if (local->head != NULL)
+			atomic_fetch_add_explicit(&job_pool.global_hits, 1, memory_order_relaxed);
+	}
+	if (local->head != NULL) {
+		j = (struct job *)local->head;
+		local->head = local->head->next;
+		local->n--;
+	} else {
+		j = (struct job *)malloc(sizeof(struct job));
+		if (j != NULL)
+			atomic_fetch_add_explicit(&job_pool.misses, 1, memory_order_relaxed);
+	}
+	return j;
+}
+
+static void job_release(struct job *j) {
+	struct job_pool_local *local = &job_pool_local;
+	job_pool_register();
+	if (local->n == JOB_POOL_LOCAL_MAX)
+		job_pool_spill(JOB_POOL_BATCH);
+	struct job_free *f = (struct job_free *)j;
+	f->next = local->head;
+	local->head = f;
+	local->n++;
+}
+
+/*
+ * Return pool statistics as a JSON object.
+ */
+json_object *job_pool_json(void) {
+	json_object *j = json_object_new_object();
+	unsigned long long local_hits = atomic_load_explicit(&job_pool.local_hits, memory_order_relaxed);
+	unsigned long long global_hits = atomic_load_explicit(&job_pool.global_hits, memory_order_relaxed);
+	unsigned long long misses = atomic_load_explicit(&job_pool.misses, memory_order_relaxed);
+	unsigned long long allocs = local_hits + global_hits + misses;
+	P_MUTEX_LOCK(&job_pool.lock);
+	int n = job_pool.n;
+	P_MUTEX_UNLOCK(&job_pool.lock);
+
+	json_object_object_add_ex(j, "local_hits", json_object_new_uint64(local_hits), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "global_hits", json_object_new_uint64(global_hits), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "misses", json_object_new_uint64(misses), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "released", json_object_new_uint64(atomic_load_explicit(&job_pool.released, memory_order_relaxed)), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "global_free", json_object_new_int(n), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "hit_rate", json_object_new_double(allocs ? (double)(local_hits + global_hits)/allocs : 0.), JSON_C_CONSTANT_NEW);
+	return j;
+}
+
+/* Worker running on the current thread, if any */
+static _Thread_local struct jobs_worker *jobs_worker_self;
+
+/* Thread group of the current thread */
+static _Thread_local int jobs_thread_group;
+
+static void jobs_group_init(struct jobs_group *this) {
+	this->first_worker = 0;
+	this->nworkers = 0;
+	this->cpus = NULL;
+	CPU_ZERO(&this->cpuset);
+}
+
+/*
+ * Create a job list, with a single thread group until the threads are started.
  */
 struct joblist *joblist_new(struct caster_state *caster) {
 	struct joblist *this = (struct joblist *)malloc(sizeof(struct joblist));
 	if (this != NULL) {
+		jobs_group_init(&this->groups[0]);
+		if (job_ring_init(&this->groups[0].ring, JOBS_RING_SIZE) < 0) {
+			free(this);
+			return NULL;
+		}
 		if (pthread_cond_init(&this->condjob, NULL) != 0) {
 			caster_log_error(this->caster, "pthread_cond_init");
+			free(this->groups[0].ring.cells);
 			free(this);
 			return NULL;
 		}
-		this->ntrip_njobs = 0;
-		this->append_ntrip_njobs = 0;
-		this->njobs = 0;
-		this->append_njobs = 0;
+		this->ngroups = 1;
 		this->caster = caster;
 		this->nthreads = 0;
 		this->threads = NULL;
+		this->main_thread = pthread_self();
+		this->nworkers = 0;
+		this->workers = NULL;
+		atomic_init(&this->nidle, 0);
+		atomic_init(&this->noverflow, 0);
 		STAILQ_INIT(&this->ntrip_queue);
-		STAILQ_INIT(&this->append_queue);
 		STAILQ_INIT(&this->jobq);
-		STAILQ_INIT(&this->append_jobq);
 		P_MUTEX_INIT(&this->condlock, NULL);
 		P_MUTEX_INIT(&this->mutex, NULL);
-		P_MUTEX_INIT(&this->append_mutex, NULL);
 	}
 	return this;
 }
 
 /*
- * Required lock (if st queue): ntrip_state
+ * Release a job without running it.
+ */
+static void _job_free(struct job *j) {
+	if (j->type == JOB_NTRIP_UNLOCKED_CONTENT)
+		ntrip_decref(j->ntrip_unlocked_content.st, "_joblist_drain");
+	else if (j->type == JOB_NTRIP_LIVESOURCE) {
+		ntrip_decref(j->ntrip_livesource.st, "_joblist_drain");
+		livesource_decref(j->ntrip_livesource.livesource);
+	} else if (j->type == JOB_NTRIP_PACKET) {
+		ntrip_decref(j->ntrip_packet.st, "_joblist_drain");
+		packet_decref(j->ntrip_packet.packet);
+	}
+	job_release(j);
+}
+
+/*
+ * Required lock: ntrip_state
  */
-static int _joblist_drain(struct jobq *jobq, P_MUTEX_T *mutex) {
+static int _joblist_drain(struct jobq *jobq) {
 	struct job *j;
 	int n = 0;
-	if (mutex)
-		P_MUTEX_LOCK(mutex);
 	while ((j = STAILQ_FIRST(jobq))) {
 		STAILQ_REMOVE_HEAD(jobq, next);
-		if (mutex)
-			P_MUTEX_UNLOCK(mutex);
-		if (j->type == JOB_NTRIP_UNLOCKED_CONTENT)
-			ntrip_decref(j->ntrip_unlocked_content.st, "_joblist_drain");
-		else if (j->type == JOB_NTRIP_LIVESOURCE) {
-			ntrip_decref(j->ntrip_livesource.st, "_joblist_drain");
-			livesource_decref(j->ntrip_livesource.livesource);
-		} else if (j->type == JOB_NTRIP_PACKET) {
-			ntrip_decref(j->ntrip_packet.st, "_joblist_drain");
-			packet_decref(j->ntrip_packet.packet);
-		}
+		_job_free(j);
 		n++;
-		free(j);
-		if (mutex)
-			P_MUTEX_LOCK(mutex);
 	}
-	if (mutex)
-		P_MUTEX_UNLOCK(mutex);
 	return n;
 }
 
+/*
+ * Release a work item without running it.
+ */
+static void _joblist_item_drain(void *item) {
+	if ((uintptr_t)item & JOB_ITEM_NTRIP)
+		joblist_drain((struct ntrip_state *)((uintptr_t)item & ~(uintptr_t)JOB_ITEM_NTRIP));
+	else
+		_job_free((struct job *)item);
+}
+
 /*
  * Free a job list.
  */
 void joblist_free(struct joblist *this) {
 	struct ntrip_state *st;
+	struct job *j;
+	void *item;
+
+	for (int g = 0; g < this->ngroups; g++)
+		while ((item = job_ring_pop(&this->groups[g].ring)))
+			_joblist_item_drain(item);
+	for (int i = 0; i < this->nworkers; i++) {
+		while ((item = job_deque_take(&this->workers[i].deque)))
+			_joblist_item_drain(item);
+		free(this->workers[i].deque.items);
+	}
+	free(this->workers);
+
 	P_MUTEX_LOCK(&this->mutex);
 	while ((st = STAILQ_FIRST(&this->ntrip_queue))) {
 		STAILQ_REMOVE_HEAD(&this->ntrip_queue, next);
@@ -87,201 +476,302 @@ void joblist_free(struct joblist *this) {
 		joblist_drain(st);
 		P_MUTEX_LOCK(&this->mutex);
 	}
+	while ((j = STAILQ_FIRST(&this->jobq))) {
+		STAILQ_REMOVE_HEAD(&this->jobq, next);
+		P_MUTEX_UNLOCK(&this->mutex);
+		_job_free(j);
+		P_MUTEX_LOCK(&this->mutex);
+	}
 	P_MUTEX_UNLOCK(&this->mutex);
-	_joblist_drain(&this->jobq, &this->mutex);
-	P_MUTEX_LOCK(&this->append_mutex);
-	while ((st = STAILQ_FIRST(&this->append_queue))) {
-		STAILQ_REMOVE_HEAD(&this->append_queue, next);
-		P_MUTEX_UNLOCK(&this->append_mutex);
-		joblist_drain(st);
-		P_MUTEX_LOCK(&this->append_mutex);
+	for (int g = 0; g < this->ngroups; g++) {
+		free(this->groups[g].ring.cells);
+		strfree(this->groups[g].cpus);
 	}
-	P_MUTEX_UNLOCK(&this->append_mutex);
-	_joblist_drain(&this->append_jobq, &this->append_mutex);
 	P_MUTEX_DESTROY(&this->mutex);
-	P_MUTEX_DESTROY(&this->append_mutex);
 	P_MUTEX_DESTROY(&this->condlock);
 	if (pthread_cond_destroy(&this->condjob) != 0)
 		caster_log_error(this->caster, "pthread_cond_destroy");
 	free(this);
+	job_pool_flush();
 }
 
 /*
- * Run jobs in a job list, on a FIFO basis.
- *
- * Simultaneously run by all workers.
+ * Return the thread group for a new work item: the group of the ntrip_state
+ * event base if any, else the group of the current thread.
  */
-void joblist_run(struct joblist *this) {
-	struct job *j;
-	struct ntrip_state *st;
+static int joblist_item_group(struct joblist *this, struct ntrip_state *st) {
+	if (this->ngroups == 1)
+		return 0;
+	if (st != NULL && st->bev != NULL)
+		return caster_get_eventbase_index(this->caster, bufferevent_get_base(st->bev)) % this->ngroups;
+	return jobs_thread_group < this->ngroups ? jobs_thread_group : 0;
+}
 
-	/*
-	 * Initial lock acquisition on the job lists
-	 */
-	P_MUTEX_LOCK(&this->mutex);
+/*
+ * Queue a work item for a thread group: on the current worker deque if called
+ * from a worker of the group, else on the group ring, or the overflow queues
+ * if they are full.
+ * Then wake up an idle worker, if any.
+ */
+static void joblist_push(struct joblist *this, void *item, int group) {
+	struct jobs_worker *self = jobs_worker_self;
+	int pushed = self != NULL && self->joblist == this && self->group == group
+		&& job_deque_push(&self->deque, item) == 0;
+	if (!pushed && job_ring_push(&this->groups[group].ring, item) < 0) {
+		P_MUTEX_LOCK(&this->mutex);
+		if ((uintptr_t)item & JOB_ITEM_NTRIP)
+			STAILQ_INSERT_TAIL(&this->ntrip_queue,
+				(struct ntrip_state *)((uintptr_t)item & ~(uintptr_t)JOB_ITEM_NTRIP), next);
+		else
+			STAILQ_INSERT_TAIL(&this->jobq, (struct job *)item, next);
+		atomic_fetch_add(&this->noverflow, 1);
+		P_MUTEX_UNLOCK(&this->mutex);
+	}
 
 	/*
-	 * Now run jobs forever.
+	 * Pairs with the nidle increment in joblist_wait(): either we see
+	 * the idle worker, or it sees our item before sleeping.
 	 */
-	while(1) {
-		/*
-		 * Check the independent/unlocked queues
-		 */
-		j = STAILQ_FIRST(&this->jobq);
-		if (j == NULL) {
-			assert(this->njobs == 0);
-			/* Empty queue, check the corresponding append queue */
-			P_MUTEX_LOCK(&this->append_mutex);
-			STAILQ_SWAP(&this->jobq, &this->append_jobq, job);
-			assert(this->append_njobs >= 0);
-			int tmpn = this->njobs;
-			this->njobs = this->append_njobs;
-			this->append_njobs = tmpn;
-			P_MUTEX_UNLOCK(&this->append_mutex);
-			j = STAILQ_FIRST(&this->jobq);
-		}
-		assert(this->njobs >= 0);
-		if (j) {
-			assert(this->njobs > 0);
-			STAILQ_REMOVE_HEAD(&this->jobq, next);
-			this->njobs--;
-			P_MUTEX_UNLOCK(&this->mutex);
-			if (j->type == JOB_REDISTRIBUTE)
-				j->redistribute.cb(j->redistribute.arg);
-			else if (j->type == JOB_NTRIP_UNLOCKED)
-				j->ntrip_unlocked.cb(j->ntrip_unlocked.st);
-			else if (j->type == JOB_NTRIP_LIVESOURCE) {
-				j->ntrip_livesource.cb(j->ntrip_livesource.st, j->ntrip_livesource.livesource, j->ntrip_livesource.arg1);
-				struct bufferevent *bev = j->ntrip_livesource.st->bev;
-				bufferevent_lock(bev);
-				ntrip_decref(j->ntrip_livesource.st, "joblist_run");
-				bufferevent_unlock(bev);
-				livesource_decref(j->ntrip_livesource.livesource);
-			} else if (j->type == JOB_NTRIP_PACKET) {
-				j->ntrip_packet.cb(j->ntrip_packet.st, j->ntrip_packet.packet, j->ntrip_packet.arg1);
-				struct bufferevent *bev = j->ntrip_packet.st->bev;
-				bufferevent_lock(bev);
-				ntrip_decref(j->ntrip_packet.st, "joblist_run");
-				packet_decref(j->ntrip_packet.packet);
-				bufferevent_unlock(bev);
-			} else if (j->type == JOB_NTRIP_UNLOCKED_CONTENT) {
-				j->ntrip_unlocked_content.cb(j->ntrip_unlocked_content.st, j->ntrip_unlocked_content.content_cb, j->ntrip_unlocked_content.req);
-				struct bufferevent *bev = j->ntrip_unlocked_content.st->bev;
-				bufferevent_lock(bev);
-				ntrip_decref(j->ntrip_unlocked_content.st, "joblist_run");
-				bufferevent_unlock(bev);
-			} else if (j->type == JOB_STOP_THREAD) {
-				logfmt(&this->caster->flog, LOG_INFO, "Exiting thread %d", (long)pthread_getspecific(this->caster->thread_id));
-				pthread_exit(NULL);
-			} else
-				abort();
-			free(j);
-			P_MUTEX_LOCK(&this->mutex);
-		}
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&this->nidle, memory_order_relaxed) > 0) {
+		P_MUTEX_LOCK(&this->condlock);
+		if (pthread_cond_signal(&this->condjob) != 0)
+			caster_log_error(this->caster, "pthread_cond_signal");
+		P_MUTEX_UNLOCK(&this->condlock);
+	}
+}
 
-		/*
-		 * Check the locked ntrip_state work queues
-		 */
-		st = STAILQ_FIRST(&this->ntrip_queue);
-		if (st == NULL) {
-			/*
-			 * Work queue is empty, check the append queue for a refill.
-			 */
-			P_MUTEX_LOCK(&this->append_mutex);
-			st = STAILQ_FIRST(&this->append_queue);
-			if (st == NULL) {
-				P_MUTEX_UNLOCK(&this->append_mutex);
-				if (j != NULL)
-					/* jobq wasn't empty last time we checked, restart */
-					continue;
-				/*
-				 * All queues empty => wait.
-				 */
-				P_MUTEX_UNLOCK(&this->mutex);
-				P_MUTEX_LOCK(&this->condlock);
-				if (pthread_cond_wait(&this->condjob, &this->condlock) != 0)
-					caster_log_error(this->caster, "pthread_cond_wait");
-				P_MUTEX_UNLOCK(&this->condlock);
-				P_MUTEX_LOCK(&this->mutex);
-				continue;
-			}
-			/*
-			 * Fill the work queue, empty the append queue.
-			 */
-			STAILQ_SWAP(&this->ntrip_queue, &this->append_queue, ntrip_state);
-			int tmpn = this->ntrip_njobs;
-			this->ntrip_njobs = this->append_ntrip_njobs;
-			this->append_ntrip_njobs = tmpn;
-			P_MUTEX_UNLOCK(&this->append_mutex);
-			P_MUTEX_LOCK(&this->condlock);
-			pthread_cond_broadcast(&this->condjob);
-			P_MUTEX_UNLOCK(&this->condlock);
+static void *joblist_overflow_pop(struct joblist *this) {
+	void *item = NULL;
+	P_MUTEX_LOCK(&this->mutex);
+	struct job *j = STAILQ_FIRST(&this->jobq);
+	if (j != NULL) {
+		STAILQ_REMOVE_HEAD(&this->jobq, next);
+		item = j;
+	} else {
+		struct ntrip_state *st = STAILQ_FIRST(&this->ntrip_queue);
+		if (st != NULL) {
+			STAILQ_REMOVE_HEAD(&this->ntrip_queue, next);
+			item = (void *)((uintptr_t)st | JOB_ITEM_NTRIP);
 		}
+	}
+	if (item)
+		atomic_fetch_sub(&this->noverflow, 1);
+	P_MUTEX_UNLOCK(&this->mutex);
+	return item;
+}
 
-		/*
-		 * We have the first ready session in the queue, remove it
-		 * so we can release the lock on the list.
-		 */
+static void *joblist_shared_pop(struct joblist *this, struct jobs_group *group) {
+	void *item = job_ring_pop(&group->ring);
+	if (item == NULL && atomic_load_explicit(&this->noverflow, memory_order_relaxed) > 0)
+		item = joblist_overflow_pop(this);
+	return item;
+}
 
-		STAILQ_REMOVE_HEAD(&this->ntrip_queue, next);
-		this->ntrip_njobs--;
+/*
+ * Steal an item from the workers of a group, starting at a random one.
+ */
+static void *joblist_steal(struct joblist *this, struct jobs_worker *self, struct jobs_group *group) {
+	void *item = NULL;
+	if (group->nworkers == 0)
+		return NULL;
+	int start = rand_r(&self->seed) % group->nworkers;
+	for (int i = 0; i < group->nworkers && item == NULL; i++) {
+		struct jobs_worker *victim = &this->workers[group->first_worker + (start + i) % group->nworkers];
+		if (victim != self)
+			item = job_deque_take(&victim->deque);
+	}
+	return item;
+}
 
-		struct bufferevent *bev = st->bev;
+/* Counters are only written by their owner, no need for an atomic increment */
+static inline void jobs_counter_incr(_Atomic unsigned long long *counter) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed)+1, memory_order_relaxed);
+}
 
-		/*
-		 * Get a lock on bev before unlocking the queue, to avoid having st freed in our back.
-		 *
-		 * libevent locks the bufferevent during joblist_append() if threading is activated,
-		 * so in the following callbacks we need to get our own locks beginning
-		 * with bufferevent to avoid deadlocks due to lock order reversal.
-		 *
-		 * The bufferevent is associated with the ntrip_state, it's the same for all jobs in the queue,
-		 * so we only need to lock it once.
-		 */
-		struct config *c = caster_config_getref(st->caster);
+/*
+ * Get the next work item for a worker: from its own deque, its group queues,
+ * or stolen from another worker of the group.
+ * Other groups are only looked at when our group has nothing left.
+ *
+ * The shared queues are checked first from time to time, so that a worker
+ * busy with its own jobs does not starve them.
+ */
+static void *joblist_get(struct joblist *this, struct jobs_worker *self) {
+	void *item = NULL;
+	struct jobs_group *group = &this->groups[self->group];
+	if ((self->tick++ & 63) == 0)
+		item = joblist_shared_pop(this, group);
+	if (item == NULL)
+		item = job_deque_take(&self->deque);
+	if (item == NULL)
+		item = joblist_shared_pop(this, group);
+	if (item == NULL && (item = joblist_steal(this, self, group)))
+		jobs_counter_incr(&self->nsteals);
+	for (int i = 1; i < this->ngroups && item == NULL; i++) {
+		struct jobs_group *other = &this->groups[(self->group + i) % this->ngroups];
+		item = job_ring_pop(&other->ring);
+		if (item == NULL)
+			item = joblist_steal(this, self, other);
+		if (item != NULL)
+			jobs_counter_incr(&self->nremote);
+	}
+	return item;
+}
+
+/*
+ * Wait for a work item: spin a little, then park until signalled.
+ */
+static void *joblist_wait(struct joblist *this, struct jobs_worker *self) {
+	void *item;
+	for (int i = 0; i < JOBS_IDLE_SPINS; i++) {
+		if ((item = joblist_get(this, self)))
+			return item;
+		sched_yield();
+	}
+	P_MUTEX_LOCK(&this->condlock);
+	jobs_counter_incr(&self->nparks);
+	atomic_fetch_add(&this->nidle, 1);
+	atomic_thread_fence(memory_order_seq_cst);
+	while ((item = joblist_get(this, self)) == NULL)
+		if (pthread_cond_wait(&this->condjob, &this->condlock) != 0)
+			caster_log_error(this->caster, "pthread_cond_wait");
+	atomic_fetch_sub(&this->nidle, 1);
+	P_MUTEX_UNLOCK(&this->condlock);
+	return item;
+}
+
+/*
+ * Run a job without a lock.
+ */
+static void joblist_run_job(struct joblist *this, struct job *j) {
+	if (j->type == JOB_REDISTRIBUTE)
+		j->redistribute.cb(j->redistribute.arg);
+	else if (j->type == JOB_NTRIP_UNLOCKED)
+		j->ntrip_unlocked.cb(j->ntrip_unlocked.st);
+	else if (j->type == JOB_NTRIP_LIVESOURCE) {
+		j->ntrip_livesource.cb(j->ntrip_livesource.st, j->ntrip_livesource.livesource, j->ntrip_livesource.arg1);
+		struct bufferevent *bev = j->ntrip_livesource.st->bev;
 		bufferevent_lock(bev);
-		st->newjobs = 0;
-		st->tmpconfig = c;
+		ntrip_decref(j->ntrip_livesource.st, "joblist_run");
+		bufferevent_unlock(bev);
+		livesource_decref(j->ntrip_livesource.livesource);
+	} else if (j->type == JOB_NTRIP_PACKET) {
+		j->ntrip_packet.cb(j->ntrip_packet.st, j->ntrip_packet.packet, j->ntrip_packet.arg1);
+		struct bufferevent *bev = j->ntrip_packet.st->bev;
+		bufferevent_lock(bev);
+		ntrip_decref(j->ntrip_packet.st, "joblist_run");
+		packet_decref(j->ntrip_packet.packet);
+		bufferevent_unlock(bev);
+	} else if (j->type == JOB_NTRIP_UNLOCKED_CONTENT) {
+		j->ntrip_unlocked_content.cb(j->ntrip_unlocked_content.st, j->ntrip_unlocked_content.content_cb, j->ntrip_unlocked_content.req);
+		struct bufferevent *bev = j->ntrip_unlocked_content.st->bev;
+		bufferevent_lock(bev);
+		ntrip_decref(j->ntrip_unlocked_content.st, "joblist_run");
+		bufferevent_unlock(bev);
+	} else if (j->type == JOB_STOP_THREAD) {
+		logfmt(&this->caster->flog, LOG_INFO, "Exiting thread %d", (long)pthread_getspecific(this->caster->thread_id));
+		/* Cached jobs are handed over to the other threads on exit */
+		job_release(j);
+		jobs_worker_self = NULL;
+		pthread_exit(NULL);
+	} else
+		abort();
+	job_release(j);
+}
 
-		P_MUTEX_UNLOCK(&this->mutex);
+/*
+ * Run the pending jobs of a ntrip_state.
+ */
+static void joblist_run_ntrip(struct joblist *this, struct ntrip_state *st) {
+	struct job *j;
+	struct bufferevent *bev = st->bev;
 
-		/*
-		 * Run the jobs.
-		 */
+	/*
+	 * The ntrip_state can't be freed in our back: st->newjobs is still -1 until
+	 * we get the lock, which makes ntrip_deferred_run() wait.
+	 *
+	 * libevent locks the bufferevent during joblist_append() if threading is activated,
+	 * so in the following callbacks we need to get our own locks beginning
+	 * with bufferevent to avoid deadlocks due to lock order reversal.
+	 *
+	 * The bufferevent is associated with the ntrip_state, it's the same for all jobs in the queue,
+	 * so we only need to lock it once.
+	 */
+	struct config *c = caster_config_getref(st->caster);
+	bufferevent_lock(bev);
+	st->newjobs = 0;
+	st->tmpconfig = c;
 
-		while ((j = STAILQ_FIRST(&st->jobq))) {
-			STAILQ_REMOVE_HEAD(&st->jobq, next);
-			st->njobs--;
-			if (st->newjobs > 0)
-				st->newjobs--;
-			if (ntrip_get_state(st) != NTRIP_END) {
-				switch (j->type) {
-				case JOB_LIBEVENT_RW:
-					j->rw.cb(bev, (void *)st);
-					break;
-				case JOB_LIBEVENT_EVENT:
-					j->event.cb(bev, j->event.events, (void *)st);
-					break;
-				case JOB_NTRIP_LOCK:
-					j->ntrip_locked.cb(st);
-					break;
-				default:
-					abort();
-					break;
-				}
+	/*
+	 * Run the jobs.
+	 */
+
+	while ((j = STAILQ_FIRST(&st->jobq))) {
+		STAILQ_REMOVE_HEAD(&st->jobq, next);
+		st->njobs--;
+		if (st->newjobs > 0)
+			st->newjobs--;
+		if (ntrip_get_state(st) != NTRIP_END) {
+			switch (j->type) {
+			case JOB_LIBEVENT_RW:
+				j->rw.cb(bev, (void *)st);
+				break;
+			case JOB_LIBEVENT_EVENT:
+				j->event.cb(bev, j->event.events, (void *)st);
+				break;
+			case JOB_NTRIP_LOCK:
+				j->ntrip_locked.cb(st);
+				break;
+			default:
+				abort();
+				break;
 			}
-			free(j);
 		}
+		job_release(j);
+	}
 
-		st->tmpconfig = NULL;
-		config_decref(c);
-		bufferevent_unlock(bev);
+	st->tmpconfig = NULL;
+	config_decref(c);
+	bufferevent_unlock(bev);
 
-		ntrip_deferred_run(this->caster);
-		/*
-		 * Lock the list again for the next job.
-		 */
-		P_MUTEX_LOCK(&this->mutex);
+	ntrip_deferred_run(this->caster);
+}
+
+/*
+ * Run jobs from the job queues, forever.
+ *
+ * Simultaneously run by all workers, each with its own deque.
+ */
+void joblist_run(struct joblist *this, struct jobs_worker *self) {
+	jobs_worker_self = self;
+	while(1) {
+		void *item = joblist_get(this, self);
+		if (item == NULL)
+			item = joblist_wait(this, self);
+		jobs_counter_incr(&self->njobs);
+		if ((uintptr_t)item & JOB_ITEM_NTRIP)
+			joblist_run_ntrip(this, (struct ntrip_state *)((uintptr_t)item & ~(uintptr_t)JOB_ITEM_NTRIP));
+		else
+			joblist_run_job(this, (struct job *)item);
+	}
+}
+
+/*
+ * Return the ntrip_state an unlocked job works for, if any.
+ */
+static struct ntrip_state *job_ntrip_state(struct job *j) {
+	switch (j->type) {
+	case JOB_NTRIP_UNLOCKED:
+		return j->ntrip_unlocked.st;
+	case JOB_NTRIP_LIVESOURCE:
+		return j->ntrip_livesource.st;
+	case JOB_NTRIP_PACKET:
+		return j->ntrip_packet.st;
+	case JOB_NTRIP_UNLOCKED_CONTENT:
+		return j->ntrip_unlocked_content.st;
+	default:
+		return NULL;
 	}
 }
 
@@ -302,30 +792,22 @@ static int job_equal(struct job *j1, struct job *j2) {
  *
  * If st != NULL:
  *	append to this ntrip_state's job queue.
- *	required lock: ntrip_state.
+ *	required lock: ntrip_state, which protects st->jobq, st->njobs and st->newjobs.
  *
  * If st == NULL:
- *	append to the main job queue.
+ *	append to the main job queues.
  *	no required lock.
  */
 static void _joblist_append_generic(struct joblist *this, struct ntrip_state *st, struct job *tmpj) {
 	struct job *j = NULL;
 	if (st == NULL) {
-		j = (struct job *)malloc(sizeof(struct job));
+		j = job_alloc();
 		if (j == NULL) {
 			ntrip_log(st, LOG_CRIT, "Out of memory, cannot allocate job.");
 			return;
 		}
 		memcpy(j, tmpj, sizeof(*j));
-		P_MUTEX_LOCK(&this->append_mutex);
-		assert(this->append_njobs >= 0);
-		STAILQ_INSERT_TAIL(&this->append_jobq, j, next);
-		this->append_njobs++;
-		P_MUTEX_UNLOCK(&this->append_mutex);
-		P_MUTEX_LOCK(&this->condlock);
-		if (pthread_cond_signal(&this->condjob) != 0)
-			caster_log_error(this->caster, "pthread_cond_signal");
-		P_MUTEX_UNLOCK(&this->condlock);
+		joblist_push(this, j, joblist_item_group(this, job_ntrip_state(j)));
 		return;
 	}
 
@@ -338,8 +820,6 @@ static void _joblist_append_generic(struct joblist *this, struct ntrip_state *st
 	if (ntrip_get_state(st) == NTRIP_END)
 		return;
 
-	P_MUTEX_LOCK(&this->append_mutex);
-
 	/*
 	 * Check whether the ntrip_state queue is empty.
 	 * If it is, we will need to insert the ntrip_state in the main job queue.
@@ -349,38 +829,39 @@ static void _joblist_append_generic(struct joblist *this, struct ntrip_state *st
 	 */
 	int jobq_was_empty = STAILQ_EMPTY(&st->jobq);
 
-	struct job *lastj = STAILQ_LAST(&st->jobq, job, next);
-
 	if (jobq_was_empty)
 		assert(!st->njobs && st->newjobs <= 0);
 	else
 		assert(st->njobs /* && st->newjobs == -1 */);
 
 	/*
-	 * Check the last recorded callback, if any. Skip if identical to the new one.
+	 * Coalesce with an identical pending job, if any.
+	 *
+	 * Callbacks work on the current ntrip_state (input buffer, last position...),
+	 * so a single pending run is enough, and it will see the latest data.
+	 * This bounds the queue length to the number of distinct job kinds,
+	 * which keeps the scan short.
 	 */
-	if (lastj == NULL || !job_equal(lastj, tmpj)) {
-		j = (struct job *)malloc(sizeof(struct job));
-		if (j == NULL) {
-			P_MUTEX_UNLOCK(&this->append_mutex);
-			ntrip_log(st, LOG_CRIT, "Out of memory, cannot allocate job.");
+	struct job *pj;
+	STAILQ_FOREACH(pj, &st->jobq, next)
+		if (job_equal(pj, tmpj))
 			return;
-		}
 
-		/*
-		 * Create and insert a new job record in the queue for this ntrip_state.
-		 */
-		*j = *tmpj;
-		STAILQ_INSERT_TAIL(&st->jobq, j, next);
-		st->njobs++;
-		if (st->newjobs >= 0)
-			st->newjobs++;
-	}
+	j = job_alloc();
 	if (j == NULL) {
-		P_MUTEX_UNLOCK(&this->append_mutex);
+		ntrip_log(st, LOG_CRIT, "Out of memory, cannot allocate job.");
 		return;
 	}
 
+	/*
+	 * Create and insert a new job record in the queue for this ntrip_state.
+	 */
+	*j = *tmpj;
+	STAILQ_INSERT_TAIL(&st->jobq, j, next);
+	st->njobs++;
+	if (st->newjobs >= 0)
+		st->newjobs++;
+
 	assert(jobq_was_empty ? (st->newjobs == 1 || st->newjobs == -1) : 1);
 
 	int inserted, njobs = st->njobs, newjobs = st->newjobs;
@@ -388,35 +869,27 @@ static void _joblist_append_generic(struct joblist *this, struct ntrip_state *st
 		/*
 		 * Insertion needed in the main job queue.
 		 */
-		assert(st->newjobs != -1);
 		inserted = 1;
-		STAILQ_INSERT_TAIL(&this->append_queue, st, next);
-		this->append_ntrip_njobs++;
 		st->newjobs = -1;
 	} else {
 		assert(st->newjobs == -1);
 		inserted = 0;
 	}
 
-	P_MUTEX_UNLOCK(&this->append_mutex);
-
-	/* Log message out of locks to avoid deadlocks */
-	struct config *c = caster_config_getref(st->caster);
-	st->tmpconfig = c;
-	(void)ntrip_refresh_config(st);
-	ntrip_log(st, LOG_EDEBUG, "job appended, ntrip %s in joblist ntrip_queue njobs %d newjobs %d",
-		inserted?"inserted":"already in",
-		njobs, newjobs);
-	st->tmpconfig = NULL;
-	config_decref(c);
+	/* Log message before queueing, a worker may run the jobs as soon as we unlock */
+	if (ntrip_log_enabled(st, LOG_EDEBUG)) {
+		struct config *c = caster_config_getref(st->caster);
+		st->tmpconfig = c;
+		(void)ntrip_refresh_config(st);
+		ntrip_log(st, LOG_EDEBUG, "job appended, ntrip %s in joblist ntrip_queue njobs %d newjobs %d",
+			inserted?"inserted":"already in",
+			njobs, newjobs);
+		st->tmpconfig = NULL;
+		config_decref(c);
+	}
 
-	/*
-	 * Signal waiting workers there is a new job.
-	 */
-	P_MUTEX_LOCK(&this->condlock);
-	if (pthread_cond_signal(&this->condjob) != 0)
-		caster_log_error(this->caster, "pthread_cond_signal");
-	P_MUTEX_UNLOCK(&this->condlock);
+	if (inserted)
+		joblist_push(this, (void *)((uintptr_t)st | JOB_ITEM_NTRIP), joblist_item_group(this, st));
 }
 
 /*
@@ -561,7 +1034,7 @@ void joblist_append_stop(struct joblist *this) {
  */
 void joblist_drain(struct ntrip_state *st) {
 	int old_newjobs = st->newjobs;
-	int n = _joblist_drain(&st->jobq, NULL);
+	int n = _joblist_drain(&st->jobq);
 	st->njobs -= n;
 	if (old_newjobs > 0)
 		st->newjobs = st->newjobs > n ? st->newjobs-n : 0;
@@ -576,6 +1049,8 @@ struct thread_start_args {
 	struct caster_state *caster;
 	char do_eventloop;
 	struct event_base *event_base;
+	struct jobs_worker *worker;
+	int group;
 };
 
 void *jobs_start_routine(void *arg) {
@@ -583,84 +1058,267 @@ void *jobs_start_routine(void *arg) {
 	int do_eventloop = start_args->do_eventloop;
 	struct caster_state *caster = start_args->caster;
 	struct event_base *event_base = start_args->event_base;
+	struct jobs_worker *worker = start_args->worker;
 	pthread_setspecific(caster->thread_id, (void *)(start_args->thread_id));
-	printf("started thread %lu as %s worker\n", start_args->thread_id, do_eventloop?"event":"generic");
+	jobs_thread_group = start_args->group;
 	free(start_args);
 	if (do_eventloop)
 		event_base_loop(event_base, EVLOOP_NO_EXIT_ON_EMPTY);
 	else
-		joblist_run(caster->joblist);
+		joblist_run(caster->joblist, worker);
 	return NULL;
 }
 
+/*
+ * Parse a CPU list such as "0-7,16-23" into a CPU set.
+ * Return the number of CPUs, or -1 if invalid.
+ */
+int jobs_parse_cpus(const char *s, jobs_cpuset_t *cpuset) {
+	CPU_ZERO(cpuset);
+	while (1) {
+		char *end;
+		long first, last;
+		while (*s == ' ')
+			s++;
+		if (*s < '0' || *s > '9')
+			return -1;
+		first = last = strtol(s, &end, 10);
+		s = end;
+		if (*s == '-') {
+			s++;
+			if (*s < '0' || *s > '9')
+				return -1;
+			last = strtol(s, &end, 10);
+			s = end;
+		}
+		if (last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, cpuset);
+		while (*s == ' ')
+			s++;
+		if (*s == '\0')
+			break;
+		if (*s++ != ',')
+			return -1;
+	}
+	return CPU_COUNT(cpuset);
+}
+
+/*
+ * Set up the thread groups from the configuration.
+ *
+ * Group 0 is kept as is, as jobs may already be queued on its ring.
+ */
+static int jobs_groups_new(struct joblist *this, struct config *config) {
+	int ngroups = config->threads_count;
+	if (ngroups > JOBS_MAX_GROUPS) {
+		logfmt(&this->caster->flog, LOG_WARNING, "Too many thread groups, only using the first %d", JOBS_MAX_GROUPS);
+		ngroups = JOBS_MAX_GROUPS;
+	}
+	for (int g = 1; g < ngroups; g++) {
+		jobs_group_init(&this->groups[g]);
+		if (job_ring_init(&this->groups[g].ring, JOBS_RING_SIZE) < 0)
+			return -1;
+		this->ngroups = g+1;
+	}
+	for (int g = 0; g < ngroups; g++) {
+		struct jobs_group *group = &this->groups[g];
+		const char *cpus = config->threads[g].cpus;
+		if (cpus == NULL)
+			continue;
+		if (jobs_parse_cpus(cpus, &group->cpuset) <= 0) {
+			logfmt(&this->caster->flog, LOG_ERR, "Invalid CPU list \"%s\" for thread group %d", cpus, g);
+			return -1;
+		}
+		group->cpus = mystrdup(cpus);
+		if (group->cpus == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Allocate the per-worker deques, spread evenly over the thread groups.
+ */
+static int jobs_workers_new(struct joblist *this, int nworkers) {
+	this->workers = (struct jobs_worker *)calloc(nworkers, sizeof(struct jobs_worker));
+	if (this->workers == NULL)
+		return -1;
+	for (int i = 0; i < nworkers; i++) {
+		struct jobs_worker *w = &this->workers[i];
+		if (job_deque_init(&w->deque, JOBS_DEQUE_SIZE) < 0) {
+			for (int j = 0; j < i; j++)
+				free(this->workers[j].deque.items);
+			free(this->workers);
+			this->workers = NULL;
+			return -1;
+		}
+		w->joblist = this;
+		w->index = i;
+		w->tick = 0;
+		w->seed = i+1;
+		atomic_init(&w->njobs, 0);
+		atomic_init(&w->nsteals, 0);
+		atomic_init(&w->nremote, 0);
+		atomic_init(&w->nparks, 0);
+	}
+	for (int g = 0; g < this->ngroups; g++) {
+		struct jobs_group *group = &this->groups[g];
+		group->first_worker = g*nworkers/this->ngroups;
+		group->nworkers = (g+1)*nworkers/this->ngroups - group->first_worker;
+		for (int i = 0; i < group->nworkers; i++)
+			this->workers[group->first_worker+i].group = g;
+	}
+	this->nworkers = nworkers;
+	return 0;
+}
+
+/*
+ * Start the event loop and worker threads.
+ *
+ * Event loop i runs event base i+1, and belongs to group (i+1) % ngroups,
+ * the main thread runs event base 0 in group 0.
+ * Workers are spread evenly over the groups, by contiguous ranges.
+ *
+ * The layout is fixed for the lifetime of the process: later
+ * configuration reloads do not change it.
+ */
 int jobs_start_threads(struct joblist *this, int nthreads, int neventloops) {
 	int err = 0;
-	pthread_t *p = (pthread_t *)malloc(sizeof(pthread_t)*nthreads);
+	struct config *config = this->caster->config;
+
+	if (jobs_groups_new(this, config) < 0)
+		return -1;
+
+	struct jobs_thread *p = (struct jobs_thread *)malloc(sizeof(struct jobs_thread)*nthreads);
 	if (p == NULL) {
 		return -1;
 	}
+	if (jobs_workers_new(this, nthreads - neventloops) < 0) {
+		free(p);
+		return -1;
+	}
 
 	pthread_key_create(&this->caster->thread_id, NULL);
 	pthread_setspecific(this->caster->thread_id, 0);
 
-	// Set stack size to the configured value
-	size_t stacksize = this->caster->config->threads[0].stacksize;
-	pthread_attr_t attr;
-	pthread_attr_init(&attr);
-	pthread_attr_setstacksize(&attr, stacksize);
-	printf("Setting thread stack size to %zu bytes\n", stacksize);
+	jobs_thread_group = 0;
+	this->main_thread = pthread_self();
+	if (this->groups[0].cpus) {
+		int r = pthread_setaffinity_np(this->main_thread, sizeof(jobs_cpuset_t), &this->groups[0].cpuset);
+		if (r != 0)
+			logfmt(&this->caster->flog, LOG_ERR, "Can't pin main thread to CPUs %s: %s", this->groups[0].cpus, strerror(r));
+	}
+
+	for (int g = 0; g < this->ngroups; g++)
+		logfmt(&this->caster->flog, LOG_INFO, "Thread group %d: %d workers, CPUs %s, stack size %zu bytes",
+			g, this->groups[g].nworkers, this->groups[g].cpus ? this->groups[g].cpus : "any",
+			config->threads[g].stacksize);
 
 	int i;
 	for (i = 0; i < nthreads; i++) {
 		struct thread_start_args *args = (struct thread_start_args *)malloc(sizeof(struct thread_start_args));
 		args->do_eventloop = (i < neventloops);
-		if (args->do_eventloop)
+		if (args->do_eventloop) {
 			args->event_base = this->caster->base[i+1];
-		else
+			args->worker = NULL;
+			args->group = (i+1) % this->ngroups;
+		} else {
 			args->event_base = NULL;
+			args->worker = &this->workers[i - neventloops];
+			args->group = args->worker->group;
+		}
 		args->thread_id = i+1;
 		args->caster = this->caster;
-		int r = pthread_create(&p[i], &attr, jobs_start_routine, args);
+		p[i].group = args->group;
+		p[i].worker = args->worker;
+
+		struct jobs_group *group = &this->groups[args->group];
+
+		// Set stack size and CPU set to the configured values for the group
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, config->threads[args->group].stacksize);
+		if (group->cpus)
+			pthread_attr_setaffinity_np(&attr, sizeof(jobs_cpuset_t), &group->cpuset);
+
+		int r = pthread_create(&p[i].thread, &attr, jobs_start_routine, args);
+		pthread_attr_destroy(&attr);
 		if (r != 0) {
+			logfmt(&this->caster->flog, LOG_ERR, "Can't start thread %d: %s", i+1, strerror(r));
 			err = 1;
 			free(args);
 			break;
 		}
 	}
-	pthread_attr_destroy(&attr);
 
+	this->threads = p;
 	if (err) {
 		this->nthreads = i;
 		jobs_stop_threads(this);
 		return -1;
 	}
 
-	this->threads = p;
 	this->nthreads = nthreads;
 	return 0;
 }
 
+/*
+ * Stop the workers, and wait for all threads to exit.
+ */
 void jobs_stop_threads(struct joblist *this) {
-	for (int i = 0; i < this->nthreads; i++) {
+	for (int i = 0; i < this->nthreads; i++)
 		joblist_append_stop(this);
-		sched_yield();
-	}
-
-	int r, nlive;
 
-	do {
-		nlive = 0;
-		for (int i = 0; i < this->nthreads; i++) {
-			r = pthread_kill(this->threads[i], 0);
-			if (r == 0)
-				nlive++;
-		}
-		if (nlive != 0) {
-			logfmt(&this->caster->flog, LOG_INFO, "%d thread(s) still active, waiting", nlive);
-			sleep(1);
-		}
-	} while (nlive);
+	for (int i = 0; i < this->nthreads; i++) {
+		int r = pthread_join(this->threads[i].thread, NULL);
+		if (r != 0)
+			logfmt(&this->caster->flog, LOG_ERR, "pthread_join failed for thread %d: %s", i+1, strerror(r));
+	}
 	free(this->threads);
 	this->threads = NULL;
 	this->nthreads = 0;
 }
+
+/*
+ * Return the CPU time used by a thread in seconds, or -1 if not available.
+ */
+static double jobs_thread_cpu_time(pthread_t thread) {
+	clockid_t clock_id;
+	struct timespec ts;
+	if (pthread_getcpuclockid(thread, &clock_id) != 0 || clock_gettime(clock_id, &ts) < 0)
+		return -1;
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static json_object *jobs_thread_json(struct joblist *this, long id, const char *type, pthread_t thread, int group, struct jobs_worker *w) {
+	json_object *j = json_object_new_object();
+	json_object_object_add_ex(j, "id", json_object_new_int64(id), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "type", json_object_new_string(type), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "group", json_object_new_int(group), JSON_C_CONSTANT_NEW);
+	const char *cpus = this->groups[group].cpus;
+	json_object_object_add_ex(j, "cpus", cpus ? json_object_new_string(cpus) : json_object_new_null(), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "cpu_time", json_object_new_double(jobs_thread_cpu_time(thread)), JSON_C_CONSTANT_NEW);
+	if (w != NULL) {
+		json_object_object_add_ex(j, "jobs", json_object_new_uint64(atomic_load_explicit(&w->njobs, memory_order_relaxed)), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "steals", json_object_new_uint64(atomic_load_explicit(&w->nsteals, memory_order_relaxed)), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "remote", json_object_new_uint64(atomic_load_explicit(&w->nremote, memory_order_relaxed)), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "parks", json_object_new_uint64(atomic_load_explicit(&w->nparks, memory_order_relaxed)), JSON_C_CONSTANT_NEW);
+	}
+	return j;
+}
+
+/*
+ * Return the thread layout and per-thread load as a JSON array.
+ */
+json_object *jobs_threads_json(struct joblist *this) {
+	json_object *j = json_object_new_array();
+	json_object_array_add(j, jobs_thread_json(this, 0, "main", this->main_thread, 0, NULL));
+	for (int i = 0; i < this->nthreads; i++) {
+		struct jobs_thread *t = &this->threads[i];
+		json_object_array_add(j, jobs_thread_json(this, i+1, t->worker ? "worker" : "event",
+			t->thread, t->group, t->worker));
+	}
+	return j;
+}
@@ -1,10 +1,29 @@
 #ifndef __JOBS_H__
 #define __JOBS_H__
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif
+
 #include <event2/bufferevent.h>
+#include <json-c/json_object.h>
+
 #include "hash.h"
 #include "queue.h"
 
+/* CPU set for thread affinity, named differently on FreeBSD */
+#ifdef __FreeBSD__
+typedef cpuset_t jobs_cpuset_t;
+#else
+typedef cpu_set_t jobs_cpuset_t;
+#endif
+
 struct request;
 
 enum job_type {
@@ -119,35 +138,117 @@ STAILQ_HEAD (ntripq, ntrip_state);
 TAILQ_HEAD (general_ntripq, ntrip_state);
 
 /*
- *  FIFO lists for worker threads to get new jobs.
+ * Capacities of the lock-free job rings and deques, must be powers of 2.
  */
-struct joblist {
-	/* The work queue for ntrip_states with a lock */
-	struct ntripq ntrip_queue;
-	/* Main work queue for jobs without a lock */
-	struct jobq jobq;
+#define	JOBS_RING_SIZE		8192
+#define	JOBS_DEQUE_SIZE		1024
 
-	/* Number of jobs in ntrip_queue and jobq */
-	int ntrip_njobs, njobs;
+/* Spins before an idle worker parks */
+#define	JOBS_IDLE_SPINS		64
 
-	/* Append-only queues, separated to simplify locking */
+/*
+ * Work items are either a struct job * for jobs without a lock,
+ * or a struct ntrip_state * with this tag bit set for ntrip_states with pending jobs.
+ */
+#define	JOB_ITEM_NTRIP		1
 
-	/* Append work queue for ntrip_states with a lock */
-	struct ntripq append_queue;
-	/* Append work queue for jobs without a lock */
-	struct jobq append_jobq;
+/*
+ * Bounded lock-free MPMC ring, for jobs appended outside of workers.
+ */
+struct job_ring_cell {
+	_Atomic size_t seq;
+	void *item;
+};
+
+struct job_ring {
+	struct job_ring_cell *cells;
+	size_t mask;
+	_Alignas(64) _Atomic size_t head;	// next cell to read
+	_Alignas(64) _Atomic size_t tail;	// next cell to write
+};
+
+/*
+ * Per-worker deque: the owner pushes at the bottom, the owner and other
+ * workers (stealing) take from the top, keeping jobs in FIFO order.
+ */
+struct job_deque {
+	_Atomic(void *) *items;
+	size_t mask;
+	_Alignas(64) _Atomic size_t top;
+	_Alignas(64) _Atomic size_t bottom;
+};
 
-	/* Number of jobs in append_queue and append_jobq */
-	int append_ntrip_njobs, append_njobs;
+struct jobs_worker {
+	struct job_deque deque;
+	struct joblist *joblist;
+	int index;
+	int group;			// thread group index
+	unsigned int tick;		// number of items taken, for fairness
+	unsigned int seed;		// for random victim selection
+
+	/* Statistics, only written by the worker */
+	_Atomic unsigned long long njobs;	// items run
+	_Atomic unsigned long long nsteals;	// items taken from another worker of the group
+	_Atomic unsigned long long nremote;	// items taken from another group
+	_Atomic unsigned long long nparks;	// times parked waiting for an item
+};
 
-	/* Mutexes protecting access to the queues */
+/* Max number of thread groups */
+#define	JOBS_MAX_GROUPS		16
+
+/*
+ * Thread group, from an entry in the "threads" configuration:
+ * event loops and workers sharing a CPU set, typically a NUMA node.
+ *
+ * Event base i belongs to group i % ngroups. Jobs for a ntrip_state
+ * are queued on the group of its event base, and preferably run
+ * by the workers of that group.
+ */
+struct jobs_group {
+	/* Jobs appended by non-worker threads (event loops, main thread) */
+	struct job_ring ring;
+
+	/* Workers of this group, contiguous in the joblist worker table */
+	int first_worker, nworkers;
+
+	char *cpus;			// CPU list from the configuration, NULL if not pinned
+	jobs_cpuset_t cpuset;
+};
+
+/*
+ * Thread started by jobs_start_threads().
+ */
+struct jobs_thread {
+	pthread_t thread;
+	int group;
+	struct jobs_worker *worker;	// NULL for event loops
+};
+
+/*
+ * Job queues for worker threads to get new jobs.
+ */
+struct joblist {
+	/* Thread groups, with their job rings */
+	struct jobs_group groups[JOBS_MAX_GROUPS];
+	int ngroups;
+
+	/*
+	 * Overflow queues, only used when the ring or a deque is full.
+	 */
+	struct ntripq ntrip_queue;
+	struct jobq jobq;
+	_Atomic int noverflow;		// number of items in both overflow queues
 	P_MUTEX_T mutex;		// ntrip_queue and jobq
-	P_MUTEX_T append_mutex;		// append_queue and append_jobq
+
+	/* Per-worker deques */
+	struct jobs_worker *workers;
+	int nworkers;
 
 	/*
-	 * Used to signal workers a new job has been appended
-	 * or the work queue has been refilled.
+	 * Used to wake up idle workers when a new job has been appended.
+	 * Only signalled if nidle > 0.
 	 */
+	_Atomic int nidle;
 	pthread_cond_t condjob;
 	pthread_mutex_t condlock;
 
@@ -155,13 +256,14 @@ struct joblist {
 	struct caster_state *caster;
 
 	/* Pointer to threads */
-	pthread_t *threads;
+	struct jobs_thread *threads;
 	int nthreads;		// number of threads
+	pthread_t main_thread;
 };
 
 struct joblist *joblist_new(struct caster_state *caster);
 void joblist_free(struct joblist *this);
-void joblist_run(struct joblist *this);
+void joblist_run(struct joblist *this, struct jobs_worker *self);
 void joblist_append(struct joblist *this, void (*cb)(struct bufferevent *bev, void *arg), void (*cbe)(struct bufferevent *bev, short events, void *arg), struct bufferevent *bev, void *arg, short events);
 void joblist_append_ntrip_locked(struct joblist *this, struct ntrip_state *st, void (*cb)(struct ntrip_state *arg));
 void joblist_append_redistribute(struct joblist *this, void (*cb)(struct redistribute_cb_args *redis_args), struct redistribute_cb_args *redis_args);
@@ -179,6 +281,9 @@ void joblist_append_ntrip_unlocked_content(
 	struct request *req);
 void joblist_append_stop(struct joblist *this);
 void joblist_drain(struct ntrip_state *st);
+json_object *job_pool_json(void);
+json_object *jobs_threads_json(struct joblist *this);
+int jobs_parse_cpus(const char *s, jobs_cpuset_t *cpuset);
 void *jobs_start_routine(void *arg);
 int jobs_start_threads(struct joblist *this, int nthreads, int neventloops);
 void jobs_stop_threads(struct joblist *this);
@@ -94,3 +94,51 @@ json_object *json_file_read(const char *dir, const char *filename) {
 	mime_free(m);
 	return j;
 }
+
+/*
+ * Length of a string once quoted and escaped as a JSON string.
+ */
+size_t json_quoted_len(const char *s) {
+	size_t len = 2;
+	for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+		if (*p >= 0x20 && *p != '"' && *p != '\\')
+			len++;
+		else if (*p == '"' || *p == '\\' || *p == '\n' || *p == '\r' || *p == '\t')
+			len += 2;
+		else
+			len += 6;
+	}
+	return len;
+}
+
+/*
+ * Write a quoted and escaped JSON string, return the end pointer.
+ * The destination must have room for json_quoted_len(s) bytes.
+ */
+char *json_quote(char *d, const char *s) {
+	static const char hex[] = "0123456789abcdef";
+	*d++ = '"';
+	for (const unsigned char *p = (const unsigned char *)s; *p; p++) {
+		unsigned char c = *p;
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			*d++ = c;
+			continue;
+		}
+		*d++ = '\\';
+		switch (c) {
+		case '"': *d++ = '"'; break;
+		case '\\': *d++ = '\\'; break;
+		case '\n': *d++ = 'n'; break;
+		case '\r': *d++ = 'r'; break;
+		case '\t': *d++ = 't'; break;
+		default:
+			memcpy(d, "u00", 3);
+			d[3] = hex[c >> 4];
+			d[4] = hex[c & 15];
+			d += 5;
+			break;
+		}
+	}
+	*d++ = '"';
+	return d;
+}
@@ -1,8 +1,14 @@
 #ifndef __JSON_H__
 #define __JSON_H__
 
+#include <stddef.h>
+
+#include <json-c/json_object.h>
+
 int json_get_source_action(const char *sourcetable_line, json_object *sources);
 int json_get_authentication(json_object *config, const char *mountpoint, const char **user, const char **password);
 json_object *json_file_read(const char *dir, const char *filename);
+size_t json_quoted_len(const char *s);
+char *json_quote(char *d, const char *s);
 
 #endif
\ No newline at end of file
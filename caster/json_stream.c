@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "conf.h"
+#include "json.h"
+#include "json_stream.h"
+#include "ntrip_common.h"
+
+/*
+ * Streaming Json writer, for large API replies.
+ */
+
+/*
+ * Called from the event loop when the destination output changes.
+ * Wake up the writer once enough has been sent.
+ *
+ * Called with the destination bufferevent locked.
+ */
+static void json_stream_drain_cb(struct evbuffer *output, const struct evbuffer_cb_info *info, void *arg) {
+	struct json_stream *this = (struct json_stream *)arg;
+	if (info->n_deleted == 0 || info->orig_size + info->n_added - info->n_deleted > JSON_STREAM_LOW_WATER)
+		return;
+	pthread_mutex_lock(&this->drain_mutex);
+	this->drained = 1;
+	pthread_cond_signal(&this->drain_cond);
+	pthread_mutex_unlock(&this->drain_mutex);
+}
+
+int json_stream_init(struct json_stream *this, struct ntrip_state *st, int chunked) {
+	this->buf = evbuffer_new();
+	if (this->buf == NULL)
+		return -1;
+	this->st = st;
+	this->chunked = chunked;
+	this->depth = 0;
+	this->first[0] = 1;
+	this->after_key = 0;
+	this->error = 0;
+	this->drain_cb = NULL;
+	this->drained = 0;
+	this->waited = 0;
+	this->max_wait = JSON_STREAM_MAX_WAIT;
+	if (st != NULL && threads) {
+		pthread_mutex_init(&this->drain_mutex, NULL);
+		pthread_cond_init(&this->drain_cond, NULL);
+		this->drain_cb = evbuffer_add_cb(bufferevent_get_output(st->bev), json_stream_drain_cb, this);
+		if (this->drain_cb == NULL) {
+			pthread_mutex_destroy(&this->drain_mutex);
+			pthread_cond_destroy(&this->drain_cond);
+			evbuffer_free(this->buf);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void json_stream_free(struct json_stream *this) {
+	if (this->drain_cb) {
+		/* Waits for a running callback, as it holds the evbuffer lock */
+		evbuffer_remove_cb_entry(bufferevent_get_output(this->st->bev), this->drain_cb);
+		pthread_mutex_destroy(&this->drain_mutex);
+		pthread_cond_destroy(&this->drain_cond);
+	}
+	evbuffer_free(this->buf);
+}
+
+/*
+ * Insert a separator if needed before a value or key.
+ */
+static void json_stream_prefix(struct json_stream *this) {
+	if (this->after_key) {
+		this->after_key = 0;
+		return;
+	}
+	if (!this->first[this->depth])
+		evbuffer_add(this->buf, ",", 1);
+	this->first[this->depth] = 0;
+}
+
+static void json_stream_open(struct json_stream *this, char c) {
+	json_stream_prefix(this);
+	if (this->depth == JSON_STREAM_MAX_DEPTH-1) {
+		this->error = 1;
+		return;
+	}
+	evbuffer_add(this->buf, &c, 1);
+	this->first[++this->depth] = 1;
+}
+
+static void json_stream_close(struct json_stream *this, char c) {
+	if (this->depth == 0) {
+		this->error = 1;
+		return;
+	}
+	evbuffer_add(this->buf, &c, 1);
+	this->depth--;
+}
+
+void json_stream_object_begin(struct json_stream *this) {
+	json_stream_open(this, '{');
+}
+
+void json_stream_object_end(struct json_stream *this) {
+	json_stream_close(this, '}');
+}
+
+void json_stream_array_begin(struct json_stream *this) {
+	json_stream_open(this, '[');
+}
+
+void json_stream_array_end(struct json_stream *this) {
+	json_stream_close(this, ']');
+}
+
+/*
+ * Write a quoted and escaped string, directly in the output buffer.
+ */
+static void json_stream_quote(struct json_stream *this, const char *s) {
+	struct evbuffer_iovec v;
+	size_t len = json_quoted_len(s);
+	if (evbuffer_reserve_space(this->buf, len, &v, 1) < 1) {
+		this->error = 1;
+		return;
+	}
+	json_quote((char *)v.iov_base, s);
+	v.iov_len = len;
+	evbuffer_commit_space(this->buf, &v, 1);
+}
+
+void json_stream_key(struct json_stream *this, const char *key) {
+	json_stream_prefix(this);
+	json_stream_quote(this, key);
+	evbuffer_add(this->buf, ":", 1);
+	this->after_key = 1;
+}
+
+void json_stream_string(struct json_stream *this, const char *s) {
+	if (s == NULL) {
+		json_stream_null(this);
+		return;
+	}
+	json_stream_prefix(this);
+	json_stream_quote(this, s);
+}
+
+void json_stream_int64(struct json_stream *this, long long v) {
+	json_stream_prefix(this);
+	evbuffer_add_printf(this->buf, "%lld", v);
+}
+
+/*
+ * Write a double, in the same format as json-c.
+ */
+void json_stream_double(struct json_stream *this, double v) {
+	char s[32];
+	json_stream_prefix(this);
+	int len = snprintf(s, sizeof s, "%.17g", v);
+	if (len > 0 && len < sizeof s - 2 && strspn(s, "-0123456789") == len) {
+		/* Looks like an integer, make it clear it is not */
+		memcpy(s+len, ".0", 3);
+		len += 2;
+	}
+	evbuffer_add(this->buf, s, len);
+}
+
+void json_stream_bool(struct json_stream *this, int v) {
+	json_stream_prefix(this);
+	if (v)
+		evbuffer_add(this->buf, "true", 4);
+	else
+		evbuffer_add(this->buf, "false", 5);
+}
+
+void json_stream_null(struct json_stream *this) {
+	json_stream_prefix(this);
+	evbuffer_add(this->buf, "null", 4);
+}
+
+/*
+ * Write a json-c object, for small items which already have a Json builder.
+ */
+void json_stream_json(struct json_stream *this, json_object *j) {
+	if (j == NULL) {
+		json_stream_null(this);
+		return;
+	}
+	json_stream_prefix(this);
+	const char *s = json_object_to_json_string_ext(j, JSON_C_TO_STRING_PLAIN);
+	evbuffer_add(this->buf, s, strlen(s));
+}
+
+static long json_stream_ms_since(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec)*1000L + (now.tv_nsec - start->tv_nsec)/1000000L;
+}
+
+/*
+ * Wait until the destination output is drained below JSON_STREAM_LOW_WATER,
+ * the destination is gone, or the total wait exceeds max_wait.
+ *
+ * The drain mutex is never held while locking the bufferevent, as
+ * json_stream_drain_cb() takes them in the reverse order.
+ */
+static void json_stream_wait(struct json_stream *this) {
+	struct ntrip_state *st = this->st;
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (1) {
+		bufferevent_lock(st->bev);
+		size_t len = evbuffer_get_length(output);
+		int end = (ntrip_get_state(st) == NTRIP_END);
+		bufferevent_unlock(st->bev);
+		long remain = this->max_wait - this->waited - json_stream_ms_since(&start);
+		if (end || (len > JSON_STREAM_LOW_WATER && remain <= 0)) {
+			this->error = 1;
+			break;
+		}
+		if (len <= JSON_STREAM_LOW_WATER)
+			break;
+
+		long delay = remain < JSON_STREAM_WAIT_DELAY ? remain : JSON_STREAM_WAIT_DELAY;
+		pthread_mutex_lock(&this->drain_mutex);
+		if (!this->drained) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += delay/1000;
+			ts.tv_nsec += (delay%1000)*1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&this->drain_cond, &this->drain_mutex, &ts);
+		}
+		this->drained = 0;
+		pthread_mutex_unlock(&this->drain_mutex);
+	}
+	this->waited += json_stream_ms_since(&start);
+}
+
+/*
+ * Send pending output to the destination, if larger than a chunk or force is set.
+ *
+ * In threaded mode, wait for the destination output to drain if it is above
+ * JSON_STREAM_HIGH_WATER, so that a slow client doesn't make us buffer
+ * the whole reply.
+ *
+ * Must be called without any lock held, as it locks the destination ntrip_state.
+ * Return -1 if the destination is gone or too slow, 0 otherwise.
+ */
+int json_stream_flush(struct json_stream *this, int force) {
+	size_t len = evbuffer_get_length(this->buf);
+	if (this->st == NULL || this->error || len == 0 || (!force && len < JSON_STREAM_CHUNK_SIZE))
+		return this->error ? -1 : 0;
+
+	struct ntrip_state *st = this->st;
+	int wait = 0;
+	bufferevent_lock(st->bev);
+	if (ntrip_get_state(st) == NTRIP_END) {
+		this->error = 1;
+		evbuffer_drain(this->buf, len);
+	} else {
+		struct evbuffer *output = bufferevent_get_output(st->bev);
+		if (this->chunked) {
+			int hlen = evbuffer_add_printf(output, "%zx\r\n", len);
+			if (hlen > 0)
+				st->sent_bytes += hlen;
+		}
+		/* Moves the data without copying it */
+		evbuffer_add_buffer(output, this->buf);
+		st->sent_bytes += len;
+		if (this->chunked) {
+			evbuffer_add(output, "\r\n", 2);
+			st->sent_bytes += 2;
+		}
+		wait = (this->drain_cb != NULL && evbuffer_get_length(output) > JSON_STREAM_HIGH_WATER);
+	}
+	bufferevent_unlock(st->bev);
+	if (wait)
+		json_stream_wait(this);
+	return this->error ? -1 : 0;
+}
+
+/*
+ * Send remaining output and the final empty chunk.
+ */
+int json_stream_end(struct json_stream *this) {
+	json_stream_flush(this, 1);
+	if (this->st == NULL || this->error || !this->chunked)
+		return this->error ? -1 : 0;
+
+	struct ntrip_state *st = this->st;
+	bufferevent_lock(st->bev);
+	if (ntrip_get_state(st) != NTRIP_END) {
+		evbuffer_add(bufferevent_get_output(st->bev), "0\r\n\r\n", 5);
+		st->sent_bytes += 5;
+	} else
+		this->error = 1;
+	bufferevent_unlock(st->bev);
+	return this->error ? -1 : 0;
+}
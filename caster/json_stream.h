@@ -0,0 +1,69 @@
+#ifndef __JSON_STREAM_H__
+#define __JSON_STREAM_H__
+
+#include <pthread.h>
+
+#include <event2/buffer.h>
+#include <json-c/json_object.h>
+
+/*
+ * Streaming Json writer.
+ *
+ * Output is accumulated in a small buffer, sent to the destination
+ * ntrip_state as HTTP chunks whenever it exceeds JSON_STREAM_CHUNK_SIZE,
+ * so that large API replies are never built as a whole in memory.
+ *
+ * In threaded mode, the writer pauses when the destination output buffer
+ * exceeds JSON_STREAM_HIGH_WATER, until the event loop drains it below
+ * JSON_STREAM_LOW_WATER. In unthreaded mode, the event loop can't run until
+ * the reply is complete, so there is no such limit.
+ *
+ * The total pause for a reply is limited to JSON_STREAM_MAX_WAIT, so that
+ * stalled clients can't tie up the worker threads: the stream then fails,
+ * and the caller is expected to close the connection.
+ */
+
+#define	JSON_STREAM_MAX_DEPTH	16
+#define	JSON_STREAM_CHUNK_SIZE	16384
+#define	JSON_STREAM_HIGH_WATER	(4*JSON_STREAM_CHUNK_SIZE)
+#define	JSON_STREAM_LOW_WATER	JSON_STREAM_CHUNK_SIZE
+#define	JSON_STREAM_WAIT_DELAY	1000	// ms, to check the destination is still there
+#define	JSON_STREAM_MAX_WAIT	10000	// ms, total for a reply
+
+struct ntrip_state;
+
+struct json_stream {
+	struct evbuffer *buf;		// pending output
+	struct ntrip_state *st;		// destination, NULL to keep everything in buf
+	int chunked;			// use HTTP chunked encoding
+	int depth;
+	char first[JSON_STREAM_MAX_DEPTH];	// no value yet at this depth
+	int after_key;			// an object key was just written
+	int error;			// destination gone, too slow, or out of memory
+
+	/* Wakeup when the destination output is drained, threaded mode only */
+	struct evbuffer_cb_entry *drain_cb;	// NULL if unused
+	pthread_mutex_t drain_mutex;
+	pthread_cond_t drain_cond;
+	int drained;
+	long waited;			// ms, total pause so far
+	long max_wait;			// ms, defaults to JSON_STREAM_MAX_WAIT
+};
+
+int json_stream_init(struct json_stream *this, struct ntrip_state *st, int chunked);
+void json_stream_free(struct json_stream *this);
+void json_stream_object_begin(struct json_stream *this);
+void json_stream_object_end(struct json_stream *this);
+void json_stream_array_begin(struct json_stream *this);
+void json_stream_array_end(struct json_stream *this);
+void json_stream_key(struct json_stream *this, const char *key);
+void json_stream_string(struct json_stream *this, const char *s);
+void json_stream_int64(struct json_stream *this, long long v);
+void json_stream_double(struct json_stream *this, double v);
+void json_stream_bool(struct json_stream *this, int v);
+void json_stream_null(struct json_stream *this);
+void json_stream_json(struct json_stream *this, json_object *j);
+int json_stream_flush(struct json_stream *this, int force);
+int json_stream_end(struct json_stream *this);
+
+#endif
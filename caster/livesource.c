@@ -5,6 +5,7 @@
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/event.h>
 
 #include <json-c/json.h>
 #include <json-c/json_object_iterator.h>
@@ -13,25 +14,40 @@
 #include "caster.h"
 #include "endpoints.h"
 #include "jobs.h"
+#include "json_stream.h"
 #include "livesource.h"
 #include "nodes.h"
 #include "ntrip_common.h"
 #include "ntripsrv.h"
 #include "packet.h"
 #include "queue.h"
+#include "sync_binary.h"
+#include "syncer.h"
 #include "util.h"
 
 static const char *livesource_states[4] = {"INIT", "FETCH_PENDING", "RUNNING", NULL};
 static const char *livesource_types[3] = {"DIRECT", "FETCHED", NULL};
 static const char *livesource_update_types[4] = {"none", "add", "del", "update"};
+static const enum sync_binary_update livesource_update_binary_types[4] = {
+	SYNC_BINARY_CHECKSERIAL, SYNC_BINARY_ADD, SYNC_BINARY_DEL, SYNC_BINARY_UPDATE
+};
+
+/*
+ * An incremental update for the syncers, in both encodings.
+ */
+struct livesource_sync {
+	json_object *json;
+	struct packet *binary;
+};
 
 static void livesource_free(struct livesource *this);
 static void livesource_end(struct livesource *this);
 static void _livesource_del_subscriber_unlocked(struct ntrip_state *st);
-static json_object *livesource_update_json(struct livesource *this,
+static void livesource_sync_new(struct livesource_sync *this, struct livesource *ls,
 	struct caster_state *caster, enum livesource_update_type utype);
+static void livesource_sync_queue(struct livesource_sync *this, struct caster_state *caster);
 static struct livesource *livesource_find_unlocked(struct caster_state *this, struct ntrip_state *st, char *mountpoint, pos_t *mountpoint_pos,
-	int find_on_demand, int create_on_demand, int sourceline_on_demand, enum livesource_state *new_state, json_object **jp);
+	int find_on_demand, int create_on_demand, int sourceline_on_demand, enum livesource_state *new_state, struct livesource_sync *syncp);
 
 /*
  * Create a remote livesource record
@@ -44,6 +60,7 @@ static struct livesource_remote *livesource_remote_new(const char *mountpoint) {
 			free(this);
 			return NULL;
 		}
+		this->id = 0;
 	}
 	return this;
 }
@@ -54,6 +71,8 @@ static void livesource_remote_free(struct livesource_remote *this) {
 }
 
 static void livesources_remote_free(struct livesources_remote *this) {
+	if (this->ids != NULL)
+		hash_table_free(this->ids);
 	if (this->hash != NULL)
 		hash_table_free(this->hash);
 	strfree(this->start_date);
@@ -73,6 +92,7 @@ static struct livesources_remote *livesources_remote_new(const char *hostname, c
 
 	this->endpoints = NULL;
 	this->endpoint_count = 0;
+	this->ids = NULL;
 
 	char *dup_start_date = mystrdup(start_date);
 	char *dup_hostname = mystrdup(hostname);
@@ -93,6 +113,12 @@ void livesource_table_free(struct livesources *this) {
 		hash_table_free(this->hash);
 	if (this->remote != NULL)
 		hash_table_free(this->remote);
+	if (this->changelog != NULL) {
+		for (int i = 0; i < this->changelog_len; i++)
+			strfree(this->changelog[(this->changelog_start + i) % LIVESOURCE_CHANGELOG_SIZE].mountpoint);
+		free(this->changelog);
+	}
+	P_MUTEX_DESTROY(&this->changelog_lock);
 	P_RWLOCK_DESTROY(&this->lock);
 	strfree(this->start_date);
 	strfree(this->hostname);
@@ -106,9 +132,14 @@ struct livesources *livesource_table_new(const char *hostname, struct timeval *s
 		return NULL;
 
 	P_RWLOCK_INIT(&this->lock, NULL);
+	P_MUTEX_INIT(&this->changelog_lock, NULL);
 	this->serial = 0;
+	this->next_id = 0;
 	this->hash = hash_table_new(509, (void(*)(void *))livesource_decref);
 	this->remote = hash_table_new(113, (void(*)(void *))livesources_remote_free);
+	this->changelog = (struct livesource_change *)malloc(sizeof(struct livesource_change)*LIVESOURCE_CHANGELOG_SIZE);
+	this->changelog_start = 0;
+	this->changelog_len = 0;
 
 	char iso_date[40];
 	iso_date_from_timeval(iso_date, sizeof iso_date, start_date);
@@ -116,7 +147,7 @@ struct livesources *livesource_table_new(const char *hostname, struct timeval *s
 	this->hostname = mystrdup(hostname);
 
 	if (this->start_date == NULL || this->hostname == NULL
-		|| this->hash == NULL || this->remote == NULL)
+		|| this->hash == NULL || this->remote == NULL || this->changelog == NULL)
 		livesource_table_free(this);
 	return this;
 }
@@ -130,11 +161,13 @@ struct livesource *livesource_new(char *mountpoint, enum livesource_type type, e
 		free(this);
 		return NULL;
 	}
-	TAILQ_INIT(&this->subscribers);
+	this->shards = NULL;
+	this->nshards = 0;
 	this->nsubs = 0;
-	this->npackets = 0;
+	atomic_init(&this->npackets, 0);
 	this->state = state;
 	this->type = type;
+	this->id = 0;
 	atomic_init(&this->refcnt, 1);
 
 	P_RWLOCK_INIT(&this->lock, NULL);
@@ -153,42 +186,72 @@ struct livesource *livesource_new(char *mountpoint, enum livesource_type type, e
  *	unsubscribe & kill subscribers flagged as backlogged
  */
 static int livesource_kill_subscribers_unlocked(struct livesource *this, int kill_backlogged, size_t backlog_evbuffer) {
-	struct subscriber *np, *tnp;
+	struct subscriber *np;
 	int killed = 0;
-	TAILQ_FOREACH_SAFE(np, &this->subscribers, next, tnp) {
-		/* Keep pointers and values because np, st or bev may be freed during the loop */
-		struct ntrip_state *st = np->ntrip_state;
-		struct bufferevent *bev = st->bev;
-		int virtual = np->virtual;
-		int backlogged = np->backlog_len > backlog_evbuffer;
 
-		bufferevent_lock(bev);
+	for (int j = 0; j < this->nshards; j++) {
+		struct livesource_shard *shard = this->shards[j];
+		if (shard == NULL)
+			continue;
 
-		if (kill_backlogged ? backlogged : !virtual) {
-			if (kill_backlogged && backlogged) {
-				size_t backlog_len = np->backlog_len;
-				ntrip_log(st, LOG_NOTICE, "dropping due to backlog len %ld (max %ld) on output for %s", backlog_len, backlog_evbuffer, this->mountpoint);
-			} else
-				ntrip_log(st, LOG_NOTICE, "dropping due to closed source");
-			killed++;
-		} else if (kill_backlogged == 0 && virtual) {
-			/*
-			 * Try to resubscribe virtual sources to a new source
-			 */
-			joblist_append_ntrip_locked(st->caster->joblist, st, &ntripsrv_redo_virtual_pos);
-		}
+		/*
+		 * Walk backwards, since a removal moves the last entry
+		 * to the removed one, and we have already seen it.
+		 */
+		for (int i = shard->nsubs - 1; i >= 0; i--) {
+			if (i >= shard->nsubs)
+				continue;
+			np = shard->subscribers[i];
+
+			/* Keep pointers and values because np, st or bev may be freed during the loop */
+			struct ntrip_state *st = np->ntrip_state;
+			struct bufferevent *bev = st->bev;
+			int virtual = np->virtual;
+			size_t backlog_len = atomic_load_explicit(&np->backlog_len, memory_order_relaxed);
+			int backlogged = backlog_len > backlog_evbuffer;
 
-		if (kill_backlogged == 0 || backlogged) {
-			_livesource_del_subscriber_unlocked(st);
-			if (!backlogged && !virtual)
-				ntrip_decref_end(st, "livesource_kill_subscribers_unlocked");
+			bufferevent_lock(bev);
+
+			if (kill_backlogged ? backlogged : !virtual) {
+				if (kill_backlogged && backlogged) {
+					ntrip_log(st, LOG_NOTICE, "dropping due to backlog len %ld (max %ld) on output for %s", backlog_len, backlog_evbuffer, this->mountpoint);
+				} else
+					ntrip_log(st, LOG_NOTICE, "dropping due to closed source");
+				killed++;
+			} else if (kill_backlogged == 0 && virtual) {
+				/*
+				 * Try to resubscribe virtual sources to a new source
+				 */
+				joblist_append_ntrip_locked(st->caster->joblist, st, &ntripsrv_redo_virtual_pos);
+			}
+
+			if (kill_backlogged == 0 || backlogged) {
+				_livesource_del_subscriber_unlocked(st);
+				if (!backlogged && !virtual)
+					ntrip_decref_end(st, "livesource_kill_subscribers_unlocked");
+			}
+			bufferevent_unlock(bev);
 		}
-		bufferevent_unlock(bev);
 	}
 	return killed;
 }
 
+static void livesource_shard_free(struct livesource_shard *this) {
+	if (this->ev)
+		event_free(this->ev);
+	/* Each queued packet holds a livesource reference, so the queue is empty by now */
+	assert(this->queue_len == 0);
+	free(this->queue);
+	free(this->subscribers);
+	P_MUTEX_DESTROY(&this->queue_lock);
+	free(this);
+}
+
 static void livesource_free(struct livesource *this) {
+	for (int i = 0; i < this->nshards; i++)
+		if (this->shards[i])
+			livesource_shard_free(this->shards[i]);
+	free(this->shards);
 	P_RWLOCK_DESTROY(&this->lock);
 	strfree(this->mountpoint);
 	free(this);
@@ -213,15 +276,100 @@ void livesource_incref(struct livesource *this) {
 }
 
 void livesource_set_state(struct livesource *this, struct caster_state *caster, enum livesource_state state) {
-	json_object *j = NULL;
+	struct livesource_sync sync = {NULL, NULL};
 	P_RWLOCK_WRLOCK(&this->lock);
 	if (this->state != state) {
 		this->state = state;
-		j = livesource_update_json(this, caster, LIVESOURCE_UPDATE_STATUS);
-		caster->livesources->serial++;
+		livesource_sync_new(&sync, this, caster, LIVESOURCE_UPDATE_STATUS);
+		stack_invalidate(&caster->sourcetablestack);
 	}
 	P_RWLOCK_UNLOCK(&this->lock);
-	syncer_queue_json(caster, j);
+	livesource_sync_queue(&sync, caster);
+}
+
+static void livesource_shard_cb(evutil_socket_t fd, short what, void *arg);
+
+/*
+ * Get the shard for an event base, create it if needed.
+ *
+ * Required lock (write): livesource
+ */
+static struct livesource_shard *livesource_get_shard(struct livesource *this, struct caster_state *caster, int index) {
+	if (index >= this->nshards) {
+		struct livesource_shard **new_shards = (struct livesource_shard **)realloc(this->shards, (index+1)*sizeof(struct livesource_shard *));
+		if (new_shards == NULL)
+			return NULL;
+		for (int i = this->nshards; i <= index; i++)
+			new_shards[i] = NULL;
+		this->shards = new_shards;
+		this->nshards = index+1;
+	}
+	if (this->shards[index])
+		return this->shards[index];
+
+	struct livesource_shard *shard = (struct livesource_shard *)malloc(sizeof(struct livesource_shard));
+	if (shard == NULL)
+		return NULL;
+	shard->subscribers = NULL;
+	shard->nsubs = 0;
+	shard->size_subscribers = 0;
+	shard->livesource = this;
+	shard->caster = caster;
+	shard->ev = NULL;
+	shard->queue = NULL;
+	shard->queue_start = 0;
+	shard->queue_len = 0;
+	shard->queue_size = 0;
+	shard->queue_bytes = 0;
+	shard->overflow = 0;
+	if (threads && caster->nbase > 1) {
+		shard->ev = event_new(caster->base[index], -1, 0, livesource_shard_cb, shard);
+		if (shard->ev == NULL) {
+			free(shard);
+			return NULL;
+		}
+	}
+	P_MUTEX_INIT(&shard->queue_lock, NULL);
+	this->shards[index] = shard;
+	return shard;
+}
+
+/*
+ * Append a subscriber to the subscriber array of its shard.
+ *
+ * Required lock (write): livesource
+ */
+static int _livesource_subscribers_append(struct livesource *this, struct subscriber *sub) {
+	struct livesource_shard *shard = livesource_get_shard(this, sub->ntrip_state->caster, sub->shard);
+	if (shard == NULL)
+		return -1;
+	if (shard->nsubs == shard->size_subscribers) {
+		int newsize = shard->size_subscribers ? shard->size_subscribers*2 : 16;
+		struct subscriber **new = (struct subscriber **)realloc(shard->subscribers, newsize*sizeof(struct subscriber *));
+		if (new == NULL)
+			return -1;
+		shard->subscribers = new;
+		shard->size_subscribers = newsize;
+	}
+	sub->index = shard->nsubs;
+	shard->subscribers[shard->nsubs++] = sub;
+	this->nsubs++;
+	return 0;
+}
+
+/*
+ * Remove a subscriber from its shard array, moving the last entry to its place.
+ *
+ * Required lock (write): livesource
+ */
+static void _livesource_subscribers_remove(struct livesource *this, struct subscriber *sub) {
+	struct livesource_shard *shard = this->shards[sub->shard];
+	int i = sub->index;
+	assert(i < shard->nsubs && shard->subscribers[i] == sub);
+	struct subscriber *last = shard->subscribers[--shard->nsubs];
+	shard->subscribers[i] = last;
+	last->index = i;
+	this->nsubs--;
 }
 
 /*
@@ -231,7 +379,8 @@ void livesource_add_subscriber(struct ntrip_state *st, struct livesource *this,
 	struct subscriber *sub = (struct subscriber *)malloc(sizeof(struct subscriber));
 	if (sub != NULL) {
 		sub->livesource = this;
-		sub->backlog_len = 0;
+		atomic_init(&sub->backlog_len, 0);
+		sub->rtcm_filter = NULL;
 
 		bufferevent_lock(st->bev);
 		int cancel = (ntrip_get_state(st) == NTRIP_END);
@@ -241,6 +390,11 @@ void livesource_add_subscriber(struct ntrip_state *st, struct livesource *this,
 			st->subscription = sub;
 			sub->ntrip_state = st;
 			sub->virtual = virtual?*virtual:0;
+			/* Keep our own reference, so the fan-out loop doesn't need the ntrip_state lock */
+			sub->rtcm_filter = st->rtcm_filter;
+			if (sub->rtcm_filter)
+				rtcm_filter_incref(sub->rtcm_filter);
+			sub->shard = caster_get_eventbase_index(st->caster, bufferevent_get_base(st->bev));
 		}
 		bufferevent_unlock(st->bev);
 		if (cancel) {
@@ -249,8 +403,17 @@ void livesource_add_subscriber(struct ntrip_state *st, struct livesource *this,
 		}
 
 		P_RWLOCK_WRLOCK(&this->lock);
-		TAILQ_INSERT_TAIL(&this->subscribers, sub, next);
-		this->nsubs++;
+		if (_livesource_subscribers_append(this, sub) < 0) {
+			P_RWLOCK_UNLOCK(&this->lock);
+			bufferevent_lock(st->bev);
+			st->subscription = NULL;
+			ntrip_log(st, LOG_ERR, "Can't subscribe to %s: out of memory", this->mountpoint);
+			bufferevent_unlock(st->bev);
+			if (sub->rtcm_filter)
+				rtcm_filter_decref(sub->rtcm_filter);
+			free(sub);
+			return;
+		}
 		livesource_incref(this);
 		P_RWLOCK_UNLOCK(&this->lock);
 
@@ -266,10 +429,11 @@ void livesource_add_subscriber(struct ntrip_state *st, struct livesource *this,
 static void _livesource_del_subscriber_unlocked(struct ntrip_state *st) {
 	if (st->subscription) {
 		struct subscriber *sub = st->subscription;
-		TAILQ_REMOVE(&sub->livesource->subscribers, sub, next);
-		sub->livesource->nsubs--;
+		_livesource_subscribers_remove(sub->livesource, sub);
 		livesource_decref(sub->livesource);
 		sub->ntrip_state->subscription = NULL;
+		if (sub->rtcm_filter)
+			rtcm_filter_decref(sub->rtcm_filter);
 		free(sub);
 	}
 }
@@ -293,30 +457,35 @@ void livesource_del_subscriber(struct ntrip_state *st) {
 	}
 }
 
+/* Max number of distinct filters with a concatenated batch in livesource_shard_send() */
+#define	LIVESOURCE_MAX_FILTER_BATCHES	8
+
 /*
- * Send a packet to all source subscribers
+ * Send a batch of packets to the subscribers of a shard.
+ * Return the number of backlogged subscribers found.
  *
- * Required locks: ntrip_state, packet
+ * The batch is concatenated once per filter, so that most subscribers
+ * get it in a single evbuffer operation. Subscribers waiting for a position
+ * packet get the packets one by one.
+ *
+ * Only a read lock is held on the livesource during the walk, as
+ * subscribers are only added or removed with the write lock.
+ *
+ * Required lock (read): livesource
  */
-int livesource_send_subscribers(struct livesource *this, struct packet *packet, struct caster_state *caster) {
+static int livesource_shard_send(struct livesource_shard *this, struct packet **packets, int npackets, time_t t) {
 	struct subscriber *np;
-	struct packet *pconv = NULL, *p;
-	time_t t = time(NULL);
-	int n = 0;
-	int is_pos = rtcm_packet_is_pos(packet);
-
-	if (this == NULL)
-		/* Dead livesource */
-		return 0;
-
-	P_RWLOCK_WRLOCK(&this->lock);
-
-	this->npackets++;
-
+	/* Concatenated batches, by filter (NULL for unfiltered) */
+	struct {
+		struct rtcm_filter *filter;
+		struct packet *packet;
+	} batches[LIVESOURCE_MAX_FILTER_BATCHES];
+	int nbatches = 0;
 	int nbacklogged = 0;
-	size_t backlog_evbuffer = atomic_load(&caster->backlog_evbuffer);
+	size_t backlog_evbuffer = atomic_load(&this->caster->backlog_evbuffer);
 
-	TAILQ_FOREACH(np, &this->subscribers, next) {
+	for (int i = 0; i < this->nsubs; i++) {
+		np = this->subscribers[i];
 		struct ntrip_state *st = np->ntrip_state;
 		struct bufferevent *bev = st->bev;
 		if (ntrip_get_state(st) == NTRIP_END) {
@@ -324,73 +493,268 @@ int livesource_send_subscribers(struct livesource *this, struct packet *packet,
 			bufferevent_lock(bev);
 			ntrip_log(st, LOG_DEBUG, "livesource_send_subscribers: dropping, state=%d", ntrip_get_state(st));
 			bufferevent_unlock(bev);
-			n++;
 			continue;
 		}
 		size_t backlog_len = evbuffer_get_length(bufferevent_get_output(bev));
-		np->backlog_len = backlog_len;
+		atomic_store_explicit(&np->backlog_len, backlog_len, memory_order_relaxed);
 		if (backlog_len > backlog_evbuffer) {
 			nbacklogged++;
-			n++;
 			continue;
 		}
-		if (atomic_load(&st->rtcm_client_state) == NTRIP_RTCM_POS_WAIT) {
-			if (!is_pos) {
-				n++;
-				continue;
+		struct rtcm_filter *filter = np->rtcm_filter;
+
+		if (npackets == 1 || atomic_load(&st->rtcm_client_state) == NTRIP_RTCM_POS_WAIT) {
+			for (int j = 0; j < npackets; j++) {
+				struct packet *p = packets[j];
+				if (atomic_load(&st->rtcm_client_state) == NTRIP_RTCM_POS_WAIT) {
+					if (!rtcm_packet_is_pos(p))
+						continue;
+					atomic_store(&st->rtcm_client_state, NTRIP_RTCM_POS_OK);
+				}
+				if (filter)
+					p = rtcm_filter_packet(filter, st, p);
+				if (p)
+					packet_send(p, st, t);
 			}
-			atomic_store(&st->rtcm_client_state, NTRIP_RTCM_POS_OK);
+			continue;
 		}
-		p = packet;
-		if (atomic_load(&st->use_rtcm_filter)) {
-			bufferevent_lock(bev);
-			if (!rtcm_filter_pass(st->config->dyn->rtcm_filter, packet)) {
-				if (!pconv)
-					pconv = rtcm_filter_convert(st->config->dyn->rtcm_filter, st, packet);
-				p = pconv;
+
+		int b;
+		for (b = 0; b < nbatches; b++)
+			if (batches[b].filter == filter)
+				break;
+		if (b == nbatches) {
+			if (nbatches == LIVESOURCE_MAX_FILTER_BATCHES) {
+				/* Too many distinct filters, send packets one by one */
+				for (int j = 0; j < npackets; j++) {
+					struct packet *p = filter ? rtcm_filter_packet(filter, st, packets[j]) : packets[j];
+					if (p)
+						packet_send(p, st, t);
+				}
+				continue;
 			}
-			bufferevent_unlock(bev);
+			struct packet *filtered[npackets];
+			for (int j = 0; j < npackets; j++)
+				filtered[j] = filter ? rtcm_filter_packet(filter, st, packets[j]) : packets[j];
+			batches[b].filter = filter;
+			batches[b].packet = packet_new_concat(filtered, npackets);
+			nbatches++;
 		}
-		if (p)
-			packet_send(p, st, t);
+		if (batches[b].packet && batches[b].packet->datalen)
+			packet_send(batches[b].packet, st, t);
+	}
+
+	for (int b = 0; b < nbatches; b++)
+		if (batches[b].packet)
+			packet_decref(batches[b].packet);
+	for (int j = 0; j < npackets; j++)
+		assert(packets[j]->refcnt > 0);
+	return nbacklogged;
+}
+
+/*
+ * Get rid of backlogged connections
+ */
+static void livesource_drop_backlogged(struct livesource *this, struct caster_state *caster, int nbacklogged) {
+	size_t backlog_evbuffer = atomic_load(&caster->backlog_evbuffer);
+	P_RWLOCK_WRLOCK(&this->lock);
+	int found_backlogs = livesource_kill_subscribers_unlocked(this, 1, backlog_evbuffer);
+	P_RWLOCK_UNLOCK(&this->lock);
+	if (found_backlogs == nbacklogged)
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d backlogged clients dropped from %s", nbacklogged, this->mountpoint);
+	else
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d (expected %d) backlogged clients dropped from %s", found_backlogs, nbacklogged, this->mountpoint);
+}
+
+/*
+ * Unsubscribe all subscribers of a shard, after packets for them were dropped.
+ * Return the number of subscribers dropped.
+ *
+ * Required lock (write): livesource
+ */
+static int livesource_shard_drop_subscribers(struct livesource_shard *this) {
+	int n = 0;
+	/* Walk backwards, since a removal moves the last entry to the removed one */
+	for (int i = this->nsubs - 1; i >= 0; i--) {
+		struct ntrip_state *st = this->subscribers[i]->ntrip_state;
+		struct bufferevent *bev = st->bev;
+		bufferevent_lock(bev);
+		ntrip_log(st, LOG_NOTICE, "dropping due to fan-out queue overflow for %s", this->livesource->mountpoint);
+		_livesource_del_subscriber_unlocked(st);
+		bufferevent_unlock(bev);
 		n++;
 	}
+	return n;
+}
 
-	assert(n == this->nsubs);
-	if (pconv)
-		packet_decref(pconv);
+/*
+ * Queue a batch of packets to be sent from the shard event loop.
+ *
+ * Each queued packet holds a reference on the livesource.
+ *
+ * If the shard event loop is too late, drop the packets and flag the shard,
+ * so that its subscribers are dropped as backlogged.
+ *
+ * Required lock (read): livesource
+ */
+static void livesource_shard_queue(struct livesource_shard *this, struct packet **packets, int npackets) {
+	size_t backlog_evbuffer = atomic_load(&this->caster->backlog_evbuffer);
+	size_t len = 0;
+	for (int j = 0; j < npackets; j++)
+		len += packets[j]->datalen;
+
+	P_MUTEX_LOCK(&this->queue_lock);
+	if (this->queue_len && this->queue_bytes + len > backlog_evbuffer) {
+		this->overflow = 1;
+		P_MUTEX_UNLOCK(&this->queue_lock);
+		return;
+	}
+	if (this->queue_len + npackets > this->queue_size) {
+		int newsize = this->queue_size ? this->queue_size*2 : 16;
+		while (newsize < this->queue_len + npackets)
+			newsize *= 2;
+		struct packet **newqueue = (struct packet **)malloc(newsize*sizeof(struct packet *));
+		if (newqueue == NULL) {
+			P_MUTEX_UNLOCK(&this->queue_lock);
+			logfmt(&this->caster->flog, LOG_CRIT, "RTCM: Not enough memory, dropping %d packets for %s", npackets, this->livesource->mountpoint);
+			return;
+		}
+		for (int i = 0; i < this->queue_len; i++)
+			newqueue[i] = this->queue[(this->queue_start+i) % this->queue_size];
+		free(this->queue);
+		this->queue = newqueue;
+		this->queue_start = 0;
+		this->queue_size = newsize;
+	}
+	int activate = (this->queue_len == 0);
+	for (int j = 0; j < npackets; j++) {
+		packet_incref(packets[j]);
+		livesource_incref(this->livesource);
+		this->queue[(this->queue_start+this->queue_len) % this->queue_size] = packets[j];
+		this->queue_len++;
+	}
+	this->queue_bytes += len;
+	P_MUTEX_UNLOCK(&this->queue_lock);
 
-	assert(packet->refcnt > 0);
+	/* The callback empties the queue, so only activate on the first packets */
+	if (activate)
+		event_active(this->ev, 0, 0);
+}
 
-	/*
-	 * Get rid of backlogged connections
-	 */
-	if (nbacklogged) {
-		int found_backlogs = livesource_kill_subscribers_unlocked(this, 1, backlog_evbuffer);
-		if (found_backlogs == nbacklogged)
-			logfmt(&caster->flog, LOG_INFO, "RTCM: %d backlogged clients dropped from %s", nbacklogged, this->mountpoint);
+/*
+ * Shard fan-out callback, run from the event loop of the shard.
+ */
+static void livesource_shard_cb(evutil_socket_t fd, short what, void *arg) {
+	struct livesource_shard *this = (struct livesource_shard *)arg;
+	struct livesource *livesource = this->livesource;
+	struct caster_state *caster = this->caster;
+	struct packet *packets[LIVESOURCE_BATCH_MAX];
+	time_t t = time(NULL);
+	int nbacklogged = 0;
+	int ndone = 0;
+
+	int overflow = 0;
+
+	while (1) {
+		int n = 0;
+		P_MUTEX_LOCK(&this->queue_lock);
+		while (this->queue_len && n < LIVESOURCE_BATCH_MAX) {
+			packets[n] = this->queue[this->queue_start];
+			this->queue_bytes -= packets[n++]->datalen;
+			this->queue_start = (this->queue_start+1) % this->queue_size;
+			this->queue_len--;
+		}
+		if (n == 0) {
+			/* Packets may have been dropped up to now */
+			overflow = this->overflow;
+			this->overflow = 0;
+		}
+		P_MUTEX_UNLOCK(&this->queue_lock);
+		if (n == 0)
+			break;
+
+		P_RWLOCK_RDLOCK(&livesource->lock);
+		nbacklogged += livesource_shard_send(this, packets, n, t);
+		P_RWLOCK_UNLOCK(&livesource->lock);
+		for (int j = 0; j < n; j++)
+			packet_decref(packets[j]);
+		ndone += n;
+	}
+
+	if (nbacklogged)
+		livesource_drop_backlogged(livesource, caster, nbacklogged);
+
+	if (overflow) {
+		P_RWLOCK_WRLOCK(&livesource->lock);
+		int n = livesource_shard_drop_subscribers(this);
+		P_RWLOCK_UNLOCK(&livesource->lock);
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d clients dropped from %s, fan-out queue full", n, livesource->mountpoint);
+	}
+
+	/* Release the references held by the queued packets; this may free the shard */
+	while (ndone--)
+		livesource_decref(livesource);
+}
+
+/*
+ * Send a batch of packets to all source subscribers, in order.
+ *
+ * Sending the packets received from a source in one go saves lock
+ * round-trips and subscriber checks compared to one call per packet.
+ *
+ * In threaded mode, the packets are queued once to each shard,
+ * and sent to subscribers from the shard event loop.
+ *
+ * Required locks: ntrip_state, packet
+ */
+int livesource_send_subscribers(struct livesource *this, struct packet **packets, int npackets, struct caster_state *caster) {
+	time_t t = time(NULL);
+	int nbacklogged = 0;
+
+	if (this == NULL)
+		/* Dead livesource */
+		return 0;
+
+	assert(npackets <= LIVESOURCE_BATCH_MAX);
+
+	P_RWLOCK_RDLOCK(&this->lock);
+
+	int prev_npackets = atomic_fetch_add(&this->npackets, npackets);
+	int total_npackets = prev_npackets + npackets;
+	int n = this->nsubs;
+
+	for (int i = 0; i < this->nshards; i++) {
+		struct livesource_shard *shard = this->shards[i];
+		if (shard == NULL || shard->nsubs == 0)
+			continue;
+		if (shard->ev)
+			livesource_shard_queue(shard, packets, npackets);
 		else
-			logfmt(&caster->flog, LOG_INFO, "RTCM: %d (expected %d) backlogged clients dropped from %s", found_backlogs, nbacklogged, this->mountpoint);
+			nbacklogged += livesource_shard_send(shard, packets, npackets, t);
 	}
+
 	P_RWLOCK_UNLOCK(&this->lock);
 
-	if (n && (this->npackets == 1 || (this->npackets % 100 == 0)))
-		logfmt(&caster->flog, LOG_INFO, "RTCM: %d packets sent, current one to %d subscribers for %s", this->npackets, n, this->mountpoint);
+	if (nbacklogged)
+		livesource_drop_backlogged(this, caster, nbacklogged);
+
+	if (n && (prev_npackets == 0 || prev_npackets/100 != total_npackets/100))
+		logfmt(&caster->flog, LOG_INFO, "RTCM: %d packets sent, current ones to %d subscribers for %s", total_npackets, n, this->mountpoint);
 	return n;
 }
 
 void livesource_del(struct ntrip_state *st, struct livesource *this) {
-	json_object *j;
+	struct livesource_sync sync;
 
 	P_RWLOCK_WRLOCK(&st->caster->livesources->lock);
 	const char *lstype = livesource_types[this->type];
-	j = livesource_update_json(this, st->caster, LIVESOURCE_UPDATE_DEL);
+	livesource_sync_new(&sync, this, st->caster, LIVESOURCE_UPDATE_DEL);
 	int e = hash_table_del(st->caster->livesources->hash, this->mountpoint);
 	assert(e == 0);
-	st->caster->livesources->serial++;
+	stack_invalidate(&st->caster->sourcetablestack);
 	P_RWLOCK_UNLOCK(&st->caster->livesources->lock);
 	livesource_end(this);
-	syncer_queue_json(st->caster, j);
+	livesource_sync_queue(&sync, st->caster);
 
 	ntrip_log(st, LOG_INFO, "Unregistered livesource %s type %s", st->mountpoint, lstype);
 }
@@ -405,7 +769,7 @@ void livesource_del(struct ntrip_state *st, struct livesource *this) {
  *	-1: other error
  */
 int livesource_connected(struct ntrip_state *st, char *mountpoint) {
-	json_object *j = NULL;
+	struct livesource_sync sync;
 	struct livesource *existing_livesource;
 
 	assert(st->own_livesource == NULL && st->subscription == NULL);
@@ -441,12 +805,13 @@ int livesource_connected(struct ntrip_state *st, char *mountpoint) {
 	livesource_incref(np);
 	st->own_livesource = np;
 
-	j = livesource_update_json(np, st->caster, LIVESOURCE_UPDATE_ADD);
-	st->caster->livesources->serial++;
+	np->id = ++st->caster->livesources->next_id;
+	livesource_sync_new(&sync, np, st->caster, LIVESOURCE_UPDATE_ADD);
+	stack_invalidate(&st->caster->sourcetablestack);
 	assert(atomic_load(&np->refcnt) == 2);
 	P_RWLOCK_UNLOCK(&st->caster->livesources->lock);
 	ntrip_log(st, LOG_INFO, "livesource %s created RUNNING", mountpoint);
-	syncer_queue_json(st->caster, j);
+	livesource_sync_queue(&sync, st->caster);
 	return 1;
 }
 
@@ -477,12 +842,14 @@ static int livesource_find_remote_endpoint(struct caster_state *this, struct ntr
  */
 static struct livesource *livesource_find_unlocked(struct caster_state *this, struct ntrip_state *st,
 		char *mountpoint, pos_t *mountpoint_pos, int find_on_demand, int create_on_demand, int sourceline_on_demand,
-		enum livesource_state *new_state, json_object **jp) {
+		enum livesource_state *new_state, struct livesource_sync *syncp) {
 	struct livesource *np;
 	struct livesource *result = NULL;
 
-	if (jp)
-		*jp = NULL;
+	if (syncp) {
+		syncp->json = NULL;
+		syncp->binary = NULL;
+	}
 
 	np = (struct livesource *)hash_table_get(this->livesources->hash, mountpoint);
 
@@ -509,9 +876,8 @@ static struct livesource *livesource_find_unlocked(struct caster_state *this, st
 			return NULL;
 		}
 		assert(r != -1);
-		if (*jp)
-			*jp = livesource_update_json(np, this, LIVESOURCE_UPDATE_ADD);
-		this->livesources->serial++;
+		np->id = ++this->livesources->next_id;
+		livesource_sync_new(syncp, np, this, LIVESOURCE_UPDATE_ADD);
 		ntrip_log(st, LOG_INFO, "Trying to subscribe to on-demand source %s", mountpoint);
 		struct redistribute_cb_args *redis_args = redistribute_args_new(this, np,
 			&e, mountpoint, mountpoint_pos, st->config->reconnect_delay, 0, st->config->on_demand_source_timeout);
@@ -533,7 +899,7 @@ static struct livesource *livesource_find_unlocked(struct caster_state *this, st
  * Find a livesource by mountpoint name.
  */
 struct livesource *livesource_find_on_demand(struct caster_state *this, struct ntrip_state *st, char *mountpoint, pos_t *mountpoint_pos, int on_demand, int sourceline_on_demand, enum livesource_state *new_state) {
-	json_object *j;
+	struct livesource_sync sync;
 
 	if (on_demand) {
 		/* Get a write lock as we may have to create a new entry */
@@ -541,10 +907,10 @@ struct livesource *livesource_find_on_demand(struct caster_state *this, struct n
 	} else {
 		P_RWLOCK_RDLOCK(&this->livesources->lock);
 	}
-	struct livesource *result = livesource_find_unlocked(this, st, mountpoint, mountpoint_pos, on_demand, on_demand, sourceline_on_demand, new_state, &j);
+	struct livesource *result = livesource_find_unlocked(this, st, mountpoint, mountpoint_pos, on_demand, on_demand, sourceline_on_demand, new_state, &sync);
 	P_RWLOCK_UNLOCK(&this->livesources->lock);
 
-	syncer_queue_json(this, j);
+	livesource_sync_queue(&sync, this);
 	return result;
 }
 
@@ -636,58 +1002,106 @@ static json_object *livesource_list_local_json(struct caster_state *caster, stru
 }
 
 /*
- * Return the full list of remote livesources as JSON.
+ * Stream a livesource table, local or remote.
+ *
+ * Required lock: livesources
  */
-static json_object *_livesource_list_remote_json(struct livesources *this, struct livesources_remote *thisr) {
-	json_object *jmain;
-	json_object *new_list;
-
-	jmain = json_object_new_object();
-	json_object_object_add_ex(jmain, "hostname", json_object_new_string(thisr->hostname), JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(jmain, "serial", json_object_new_int64(thisr->serial), JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(jmain, "start_date", json_object_new_string(thisr->start_date), JSON_C_CONSTANT_NEW);
-
-	new_list = json_object_new_object();
+static void _livesource_list_stream(struct json_stream *js, struct hash_table *hash, int local) {
 	struct hash_iterator hi;
 	struct element *e;
-	P_RWLOCK_RDLOCK(&this->lock);
-	HASH_FOREACH(e, thisr->hash, hi) {
-		json_object *j = livesource_remote_json((struct livesource_remote *)e->value);
-		json_object_object_add(new_list, e->key, j);
+
+	json_stream_key(js, "livesources");
+	json_stream_object_begin(js);
+	HASH_FOREACH(e, hash, hi) {
+		json_object *j = local ? livesource_json((struct livesource *)e->value, LIVESOURCE_UPDATE_NONE)
+			: livesource_remote_json((struct livesource_remote *)e->value);
+		json_stream_key(js, e->key);
+		json_stream_json(js, j);
+		json_object_put(j);
 	}
-	json_object *jendpoints = endpoints_to_json(thisr->endpoints, thisr->endpoint_count);
-	P_RWLOCK_UNLOCK(&this->lock);
-	json_object_object_add_ex(jmain, "endpoints", jendpoints, JSON_C_CONSTANT_NEW);
-	json_object_object_add_ex(jmain, "livesources", new_list, JSON_C_CONSTANT_NEW);
-	return jmain;
+	json_stream_object_end(js);
 }
 
 /*
- * Return the full list of livesources, local + remote, as JSON.
+ * Stream a remote livesource table.
+ *
+ * Required lock: livesources
  */
-static struct mime_content *_livesource_list_json(struct caster_state *caster) {
-	char *s;
-	json_object *jmain = json_object_new_object();
-
-	json_object *j = livesource_list_local_json(caster, caster->livesources);
-	json_object_object_add_ex(jmain, "LOCAL", j, JSON_C_CONSTANT_NEW);
+static void _livesource_remote_stream(struct json_stream *js, const char *key, struct livesources_remote *thisr) {
+	json_stream_key(js, key);
+	json_stream_object_begin(js);
+	json_stream_key(js, "hostname");
+	json_stream_string(js, thisr->hostname);
+	json_stream_key(js, "serial");
+	json_stream_int64(js, thisr->serial);
+	json_stream_key(js, "start_date");
+	json_stream_string(js, thisr->start_date);
+	json_stream_key(js, "endpoints");
+	json_object *jendpoints = endpoints_to_json(thisr->endpoints, thisr->endpoint_count);
+	json_stream_json(js, jendpoints);
+	json_object_put(jendpoints);
+	_livesource_list_stream(js, thisr->hash, 0);
+	json_stream_object_end(js);
+}
 
-	P_RWLOCK_RDLOCK(&caster->livesources->lock);
+/*
+ * Stream the full list of livesources, local + remote, as JSON.
+ *
+ * Output is flushed between tables, with no lock held.
+ * Remote tables are looked up again by name after each flush,
+ * skipping those removed meanwhile.
+ */
+void livesource_list_stream(struct caster_state *caster, struct request *req, struct json_stream *js) {
+	struct livesources *this = caster->livesources;
 	struct hash_iterator hi;
 	struct element *e;
-	HASH_FOREACH(e, caster->livesources->remote, hi) {
-		j = _livesource_list_remote_json(caster->livesources, (struct livesources_remote *)e->value);
-		json_object_object_add(jmain, e->key, j);
+
+	json_stream_object_begin(js);
+
+	json_stream_key(js, "LOCAL");
+	json_stream_object_begin(js);
+	P_RWLOCK_RDLOCK(&this->lock);
+	json_stream_key(js, "hostname");
+	json_stream_string(js, this->hostname);
+	json_stream_key(js, "serial");
+	json_stream_int64(js, this->serial);
+	json_stream_key(js, "start_date");
+	json_stream_string(js, this->start_date);
+	json_stream_key(js, "endpoints");
+	struct config *config = caster_config_getref(caster);
+	json_stream_json(js, config->endpoints_json);
+	config_decref(config);
+	_livesource_list_stream(js, this->hash, 1);
+
+	/* Names of the remote tables, to release the lock between them */
+	int n = 0;
+	HASH_FOREACH(e, this->remote, hi)
+		n++;
+	char **keys = (char **)malloc(sizeof(char *)*(n ? n : 1));
+	n = 0;
+	if (keys != NULL)
+		HASH_FOREACH(e, this->remote, hi) {
+			char *key = mystrdup(e->key);
+			if (key != NULL)
+				keys[n++] = key;
+		}
+	P_RWLOCK_UNLOCK(&this->lock);
+	json_stream_object_end(js);
+
+	for (int i = 0; i < n; i++) {
+		if (json_stream_flush(js, 0) < 0)
+			break;
+		P_RWLOCK_RDLOCK(&this->lock);
+		struct livesources_remote *thisr = (struct livesources_remote *)hash_table_get(this->remote, keys[i]);
+		if (thisr != NULL)
+			_livesource_remote_stream(js, keys[i], thisr);
+		P_RWLOCK_UNLOCK(&this->lock);
 	}
-	P_RWLOCK_UNLOCK(&caster->livesources->lock);
-	s = mystrdup(json_object_to_json_string(jmain));
-	struct mime_content *m = mime_new(s, -1, "application/json", 1);
-	json_object_put(jmain);
-	return m;
-}
+	for (int i = 0; i < n; i++)
+		strfree(keys[i]);
+	free(keys);
 
-struct mime_content *livesource_list_json(struct caster_state *caster, struct request *req) {
-	return _livesource_list_json(caster);
+	json_stream_object_end(js);
 }
 
 /*
@@ -726,6 +1140,248 @@ static json_object *livesource_update_json(struct livesource *this,
 	return j;
 }
 
+/*
+ * Binary encoding routines.
+ */
+
+static void _livesource_binary_table(struct sync_binary_writer *w, struct livesources *this, enum sync_binary_update utype) {
+	sync_binary_record_begin(w, SYNC_BINARY_REC_TABLE);
+	sync_binary_put_string(w, this->hostname);
+	sync_binary_put_string(w, this->start_date);
+	sync_binary_put_u64(w, this->serial);
+	sync_binary_put_u8(w, utype);
+	sync_binary_record_end(w);
+}
+
+/*
+ * Encode a livesource, only sending the mountpoint when it is not known to the receiver.
+ */
+static void _livesource_binary(struct sync_binary_writer *w, struct livesource *this, int add_mountpoint) {
+	sync_binary_record_begin(w, SYNC_BINARY_REC_LIVESOURCE);
+	sync_binary_put_u32(w, this->id);
+	sync_binary_put_u8(w, this->state);
+	sync_binary_put_u8(w, this->type);
+	if (add_mountpoint)
+		sync_binary_put_string(w, this->mountpoint);
+	sync_binary_record_end(w);
+}
+
+/*
+ * Generate a binary packet for a full table update.
+ */
+struct packet *livesource_full_update_binary(struct caster_state *caster, struct livesources *this) {
+	struct sync_binary_writer w;
+	struct hash_iterator hi;
+	struct element *e;
+
+	if (sync_binary_writer_init(&w) < 0)
+		return NULL;
+
+	P_RWLOCK_RDLOCK(&this->lock);
+	_livesource_binary_table(&w, this, SYNC_BINARY_FULLTABLE);
+
+	struct config *config = caster_config_getref(caster);
+	for (int i = 0; i < config->endpoint_count; i++) {
+		sync_binary_record_begin(&w, SYNC_BINARY_REC_ENDPOINT);
+		sync_binary_put_string(&w, config->endpoint[i].host);
+		sync_binary_put_u16(&w, config->endpoint[i].port);
+		sync_binary_put_u8(&w, config->endpoint[i].tls);
+		sync_binary_record_end(&w);
+	}
+	config_decref(config);
+
+	HASH_FOREACH(e, this->hash, hi)
+		_livesource_binary(&w, (struct livesource *)e->value, 1);
+	P_RWLOCK_UNLOCK(&this->lock);
+
+	struct packet *p = sync_binary_packet(&w);
+	sync_binary_writer_free(&w);
+	return p;
+}
+
+/*
+ * Generate a binary packet to request a serial + start_date check.
+ */
+struct packet *livesource_checkserial_binary(struct livesources *this) {
+	struct sync_binary_writer w;
+	if (sync_binary_writer_init(&w) < 0)
+		return NULL;
+	_livesource_binary_table(&w, this, SYNC_BINARY_CHECKSERIAL);
+	struct packet *p = sync_binary_packet(&w);
+	sync_binary_writer_free(&w);
+	return p;
+}
+
+/*
+ * Generate a binary incremental update packet from a local livesource record.
+ */
+static struct packet *livesource_update_binary(struct livesource *this,
+	struct caster_state *caster, enum livesource_update_type utype) {
+	struct sync_binary_writer w;
+	if (sync_binary_writer_init(&w) < 0)
+		return NULL;
+	_livesource_binary_table(&w, caster->livesources, livesource_update_binary_types[utype]);
+	_livesource_binary(&w, this, utype == LIVESOURCE_UPDATE_ADD);
+	struct packet *p = sync_binary_packet(&w);
+	sync_binary_writer_free(&w);
+	return p;
+}
+
+/*
+ * Record a change in the changelog.
+ *
+ * Required lock: changelog
+ */
+static void _livesource_changelog_add(struct livesources *this, struct livesource *ls, enum livesource_update_type utype) {
+	struct livesource_change *c;
+	if (this->changelog_len == LIVESOURCE_CHANGELOG_SIZE) {
+		/* Full, drop the oldest entry */
+		c = &this->changelog[this->changelog_start];
+		strfree(c->mountpoint);
+		this->changelog_start = (this->changelog_start + 1) % LIVESOURCE_CHANGELOG_SIZE;
+		this->changelog_len--;
+	}
+	char *mountpoint = mystrdup(ls->mountpoint);
+	if (mountpoint == NULL) {
+		/* Out of memory: make the log unusable, to force full tables */
+		for (int i = 0; i < this->changelog_len; i++)
+			strfree(this->changelog[(this->changelog_start + i) % LIVESOURCE_CHANGELOG_SIZE].mountpoint);
+		this->changelog_len = 0;
+		return;
+	}
+	c = &this->changelog[(this->changelog_start + this->changelog_len) % LIVESOURCE_CHANGELOG_SIZE];
+	c->serial = this->serial;
+	c->utype = utype;
+	c->mountpoint = mountpoint;
+	c->id = ls->id;
+	c->state = ls->state;
+	c->type = ls->type;
+	this->changelog_len++;
+}
+
+/*
+ * Record a change in the local table, and increment its serial.
+ * If this is not NULL, also generate an incremental update for the syncers, in both encodings.
+ *
+ * Required lock: livesources or livesource
+ */
+static void livesource_sync_new(struct livesource_sync *this, struct livesource *ls,
+	struct caster_state *caster, enum livesource_update_type utype) {
+	struct livesources *livesources = caster->livesources;
+	P_MUTEX_LOCK(&livesources->changelog_lock);
+	if (this != NULL) {
+		this->json = livesource_update_json(ls, caster, utype);
+		this->binary = livesource_update_binary(ls, caster, utype);
+	}
+	_livesource_changelog_add(livesources, ls, utype);
+	livesources->serial++;
+	P_MUTEX_UNLOCK(&livesources->changelog_lock);
+}
+
+/*
+ * Find the changelog position for a serial.
+ * Return -1 if it was dropped from the changelog, or is in the future.
+ *
+ * Required lock: changelog
+ */
+static int _livesource_changelog_find(struct livesources *this, unsigned long long serial) {
+	unsigned long long first = this->serial - this->changelog_len;
+	if (serial < first || serial > this->serial)
+		return -1;
+	return serial - first;
+}
+
+/*
+ * Generate a Json packet replaying the changes since serial.
+ *
+ * Return 1 if *jp is set, 0 if there is nothing to replay,
+ * -1 if the changes are no longer available.
+ */
+int livesource_replay_json(struct livesources *this, unsigned long long serial, json_object **jp) {
+	int r = 1;
+	*jp = NULL;
+	P_MUTEX_LOCK(&this->changelog_lock);
+	int pos = _livesource_changelog_find(this, serial);
+	if (pos < 0)
+		r = -1;
+	else if (pos == this->changelog_len)
+		r = 0;
+	else {
+		json_object *j = json_object_new_object();
+		json_object *jupdates = json_object_new_array_ext(this->changelog_len - pos);
+		for (int i = pos; i < this->changelog_len; i++) {
+			struct livesource_change *c = &this->changelog[(this->changelog_start + i) % LIVESOURCE_CHANGELOG_SIZE];
+			json_object *ju = json_object_new_object();
+			json_object *jl = _livesource_common_json(c->mountpoint, c->state, c->type, c->utype != LIVESOURCE_UPDATE_DEL);
+			json_object_object_add_ex(ju, "livesource", jl, JSON_C_CONSTANT_NEW);
+			json_object_object_add_ex(ju, "type", json_object_new_string(livesource_update_types[c->utype]), JSON_C_CONSTANT_NEW);
+			json_object_array_add(jupdates, ju);
+		}
+		json_object_object_add_ex(j, "updates", jupdates, JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "start_date", json_object_new_string(this->start_date), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "hostname", json_object_new_string(this->hostname), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "serial", json_object_new_int64(serial), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(j, "type", json_object_new_string("replay"), JSON_C_CONSTANT_NEW);
+		*jp = j;
+	}
+	P_MUTEX_UNLOCK(&this->changelog_lock);
+	return r;
+}
+
+/*
+ * Same as livesource_replay_json(), in binary encoding.
+ * Also return -1 if out of memory.
+ */
+int livesource_replay_binary(struct livesources *this, unsigned long long serial, struct packet **pp) {
+	struct sync_binary_writer w;
+	int r = 1;
+	*pp = NULL;
+	if (sync_binary_writer_init(&w) < 0)
+		return -1;
+	P_MUTEX_LOCK(&this->changelog_lock);
+	int pos = _livesource_changelog_find(this, serial);
+	if (pos < 0)
+		r = -1;
+	else if (pos == this->changelog_len)
+		r = 0;
+	else {
+		sync_binary_record_begin(&w, SYNC_BINARY_REC_TABLE);
+		sync_binary_put_string(&w, this->hostname);
+		sync_binary_put_string(&w, this->start_date);
+		sync_binary_put_u64(&w, serial);
+		sync_binary_put_u8(&w, SYNC_BINARY_REPLAY);
+		sync_binary_record_end(&w);
+		for (int i = pos; i < this->changelog_len; i++) {
+			struct livesource_change *c = &this->changelog[(this->changelog_start + i) % LIVESOURCE_CHANGELOG_SIZE];
+			sync_binary_record_begin(&w, SYNC_BINARY_REC_CHANGE);
+			sync_binary_put_u8(&w, livesource_update_binary_types[c->utype]);
+			sync_binary_put_u32(&w, c->id);
+			sync_binary_put_u8(&w, c->state);
+			sync_binary_put_u8(&w, c->type);
+			if (c->utype == LIVESOURCE_UPDATE_ADD)
+				sync_binary_put_string(&w, c->mountpoint);
+			sync_binary_record_end(&w);
+		}
+	}
+	P_MUTEX_UNLOCK(&this->changelog_lock);
+	if (r == 1) {
+		*pp = sync_binary_packet(&w);
+		if (*pp == NULL)
+			r = -1;
+	}
+	sync_binary_writer_free(&w);
+	return r;
+}
+
+/*
+ * Queue an incremental update to the syncers, and release it.
+ */
+static void livesource_sync_queue(struct livesource_sync *this, struct caster_state *caster) {
+	syncer_queue_update(caster, this->json, this->binary);
+	this->json = NULL;
+	this->binary = NULL;
+}
+
 /*
  * Update receipt routines.
  */
@@ -749,58 +1405,94 @@ static enum livesource_type convert_type(const char *type) {
 }
 
 /*
- * Execute a differential update.
+ * Check a remote table exists, and an update has the expected start_date and serial.
+ *
+ * On a serial mismatch, return 409 and our serial in a reply header,
+ * so that the sender can replay the changes we missed.
+ *
+ * Required lock: livesources
  */
-static int livesource_update_execute_diff(struct caster_state *caster, struct livesources *this, json_object *j, const char *hostname) {
-	struct json_object *jserial = json_object_object_get(j, "serial");
-	struct json_object *jstart_date = json_object_object_get(j, "start_date");
-	const char *type = json_object_get_string(json_object_object_get(j, "type"));
-	int r;
-
-	if (type == NULL || jserial == NULL || jstart_date == NULL)
-		return 503;
-
-	unsigned long long serial = json_object_get_int64(jserial);
+static int _livesources_remote_check(struct caster_state *caster, struct livesources *this, struct request *req,
+	const char *hostname, const char *start_date, unsigned long long serial, struct livesources_remote **plrlist) {
 	struct livesources_remote *lrlist = (struct livesources_remote *)hash_table_get(this->remote, hostname);
+	*plrlist = NULL;
 
 	if (lrlist == NULL) {
 		logfmt(&caster->flog, LOG_NOTICE, "update failed, hostname %s not found", hostname);
 		return 404;
 	}
 
-	const char *start_date = json_object_get_string(jstart_date);
 	if (strcmp(start_date, lrlist->start_date)) {
 		logfmt(&caster->flog, LOG_NOTICE, "bad start_date %s wanted %s", start_date, lrlist->start_date);
 		return 404;
 	}
 
 	if (serial != lrlist->serial) {
+		char serial_str[24];
 		logfmt(&caster->flog, LOG_NOTICE, "bad serial %llu wanted %llu", serial, lrlist->serial);
-		return 404;
+		snprintf(serial_str, sizeof serial_str, "%llu", lrlist->serial);
+		if (request_add_header(req, "X-Sync-Serial", serial_str) < 0)
+			return 404;
+		return 409;
 	}
+	*plrlist = lrlist;
+	return 200;
+}
 
-	if (!strcmp(type, "checkserial"))
-		return 200;
-
-	struct json_object *ls = json_object_object_get(j, "livesource");
-	if (ls == NULL) {
-		logfmt(&caster->flog, LOG_NOTICE, "'livesource' not found");
-		return 404;
+/*
+ * Index a remote livesource by its id.
+ * Return 0, -1 if the id is already used, -2 if out of memory.
+ */
+static int _livesources_remote_add_id(struct livesources_remote *this, struct livesource_remote *lr) {
+	char idkey[20];
+	if (this->ids == NULL) {
+		this->ids = hash_table_new(509, hash_table_free_null);
+		if (this->ids == NULL)
+			return -2;
 	}
-	const char *mountpoint = json_object_get_string(json_object_object_get(ls, "mountpoint"));
+	snprintf(idkey, sizeof idkey, "%lx", lr->id);
+	return hash_table_add(this->ids, idkey, lr);
+}
 
-	struct livesource_remote *lr = (struct livesource_remote *)hash_table_get(lrlist->hash, mountpoint);
+/*
+ * Apply a differential update to a remote table.
+ *
+ * With the binary encoding, deletions and updates only provide
+ * the livesource id, and mountpoint is NULL.
+ *
+ * Required lock: livesources
+ */
+static int _livesources_remote_apply(struct caster_state *caster, struct livesources_remote *lrlist,
+	enum livesource_update_type utype, const char *mountpoint, unsigned long id,
+	enum livesource_state state, enum livesource_type type) {
+	struct livesource_remote *lr;
+	char idkey[20];
+	int r;
 
-	if (!strcmp(type, "add")) {
+	if (mountpoint == NULL) {
+		snprintf(idkey, sizeof idkey, "%lx", id);
+		lr = lrlist->ids ? (struct livesource_remote *)hash_table_get(lrlist->ids, idkey) : NULL;
+		if (lr == NULL) {
+			logfmt(&caster->flog, LOG_NOTICE, "update failed: unknown livesource id %lu", id);
+			return 404;
+		}
+		mountpoint = lr->mountpoint;
+	} else
+		lr = (struct livesource_remote *)hash_table_get(lrlist->hash, mountpoint);
+
+	if (utype == LIVESOURCE_UPDATE_ADD) {
 		if (lr) {
 			logfmt(&caster->flog, LOG_NOTICE, "update failed: %s exists", mountpoint);
 			return 404;
 		}
 		lr = livesource_remote_new(mountpoint);
-		const char *lstype = json_object_get_string(json_object_object_get(ls, "type"));
-		const char *lsstate = json_object_get_string(json_object_object_get(ls, "state"));
-		lr->state = convert_state(lsstate);
-		lr->type = convert_type(lstype);
+		if (lr == NULL) {
+			logfmt(&caster->flog, LOG_CRIT, "update failed on mountpoint %s: out of memory", mountpoint);
+			return 503;
+		}
+		lr->state = state;
+		lr->type = type;
+		lr->id = id;
 		r = hash_table_add(lrlist->hash, mountpoint, lr);
 		assert(r != -1);
 		if (r == -2) {
@@ -809,30 +1501,119 @@ static int livesource_update_execute_diff(struct caster_state *caster, struct li
 			logfmt(&caster->flog, LOG_CRIT, "update failed on mountpoint %s: out of memory", mountpoint);
 			return 503;
 		}
-	} else if (!strcmp(type, "del")) {
+		if (id && (r = _livesources_remote_add_id(lrlist, lr)) < 0) {
+			hash_table_del(lrlist->hash, mountpoint);
+			if (r == -1) {
+				logfmt(&caster->flog, LOG_NOTICE, "update failed on mountpoint %s: id %lu exists", mountpoint, id);
+				return 409;
+			}
+			logfmt(&caster->flog, LOG_CRIT, "update failed on mountpoint %s: out of memory", mountpoint);
+			return 503;
+		}
+	} else if (utype == LIVESOURCE_UPDATE_DEL) {
 		if (!lr) {
 			logfmt(&caster->flog, LOG_NOTICE, "update failed: mountpoint %s does not exist", mountpoint);
 			return 503;
 		}
+		if (lr->id && lrlist->ids) {
+			snprintf(idkey, sizeof idkey, "%lx", lr->id);
+			hash_table_del(lrlist->ids, idkey);
+		}
 		hash_table_del(lrlist->hash, mountpoint);
-	} else if (!strcmp(type, "update")) {
+	} else {
 		if (!lr) {
 			logfmt(&caster->flog, LOG_NOTICE, "update failed: mountpoint %s does not exist", mountpoint);
 			return 503;
 		}
-		const char *lstype = json_object_get_string(json_object_object_get(ls, "type"));
-		const char *lsstate = json_object_get_string(json_object_object_get(ls, "state"));
-		lr->state = convert_state(lsstate);
-		lr->type = convert_type(lstype);
-	} else {
-		logfmt(&caster->flog, LOG_NOTICE, "update failed: unknown type %s", type);
-		return 503;
+		lr->state = state;
+		lr->type = type;
 	}
 
 	lrlist->serial++;
 	return 200;
 }
 
+/*
+ * Apply a single Json update (add, del or update) to a remote table.
+ *
+ * Required lock: livesources
+ */
+static int _livesource_update_apply_json(struct caster_state *caster, struct livesources_remote *lrlist,
+	const char *type, struct json_object *ls) {
+	enum livesource_update_type utype;
+
+	if (ls == NULL) {
+		logfmt(&caster->flog, LOG_NOTICE, "'livesource' not found");
+		return 404;
+	}
+	const char *mountpoint = json_object_get_string(json_object_object_get(ls, "mountpoint"));
+
+	if (type == NULL) {
+		logfmt(&caster->flog, LOG_NOTICE, "update failed: missing type");
+		return 503;
+	} else if (!strcmp(type, "add"))
+		utype = LIVESOURCE_UPDATE_ADD;
+	else if (!strcmp(type, "del"))
+		utype = LIVESOURCE_UPDATE_DEL;
+	else if (!strcmp(type, "update"))
+		utype = LIVESOURCE_UPDATE_STATUS;
+	else {
+		logfmt(&caster->flog, LOG_NOTICE, "update failed: unknown type %s", type);
+		return 503;
+	}
+	if (mountpoint == NULL)
+		return 503;
+
+	enum livesource_state lsstate = -1;
+	enum livesource_type lstype = -1;
+	if (utype != LIVESOURCE_UPDATE_DEL) {
+		lstype = convert_type(json_object_get_string(json_object_object_get(ls, "type")));
+		lsstate = convert_state(json_object_get_string(json_object_object_get(ls, "state")));
+	}
+	return _livesources_remote_apply(caster, lrlist, utype, mountpoint, 0, lsstate, lstype);
+}
+
+/*
+ * Execute a differential update, or a replay of several of them.
+ */
+static int livesource_update_execute_diff(struct caster_state *caster, struct livesources *this, struct request *req,
+	json_object *j, const char *hostname) {
+	struct json_object *jserial = json_object_object_get(j, "serial");
+	struct json_object *jstart_date = json_object_object_get(j, "start_date");
+	const char *type = json_object_get_string(json_object_object_get(j, "type"));
+	struct livesources_remote *lrlist;
+
+	if (type == NULL || jserial == NULL || jstart_date == NULL)
+		return 503;
+
+	unsigned long long serial = json_object_get_int64(jserial);
+	const char *start_date = json_object_get_string(jstart_date);
+	int r = _livesources_remote_check(caster, this, req, hostname, start_date, serial, &lrlist);
+	if (r != 200)
+		return r;
+
+	if (!strcmp(type, "checkserial"))
+		return 200;
+
+	if (!strcmp(type, "replay")) {
+		struct json_object *jupdates = json_object_object_get(j, "updates");
+		if (jupdates == NULL || json_object_get_type(jupdates) != json_type_array)
+			return 503;
+		size_t n = json_object_array_length(jupdates);
+		for (size_t i = 0; i < n; i++) {
+			struct json_object *ju = json_object_array_get_idx(jupdates, i);
+			r = _livesource_update_apply_json(caster, lrlist,
+				json_object_get_string(json_object_object_get(ju, "type")),
+				json_object_object_get(ju, "livesource"));
+			if (r != 200)
+				return r;
+		}
+		return 200;
+	}
+
+	return _livesource_update_apply_json(caster, lrlist, type, json_object_object_get(j, "livesource"));
+}
+
 /*
  * Convert a full table update.
  */
@@ -874,10 +1655,13 @@ static struct livesources_remote *livesource_process_fulltable(struct caster_sta
 		lr->type = convert_type(lstype);
 
 		int r = hash_table_add(remote->hash, mountpoint, lr);
-		assert(r != -1);
-		if (r == -2) {
+		if (r == -1) {
 			logfmt(&caster->flog, LOG_WARNING, "duplicate mountpoint %s in livesource table, ignoring", mountpoint);
 			livesource_remote_free(lr);
+		} else if (r == -2) {
+			livesource_remote_free(lr);
+			livesources_remote_free(remote);
+			return NULL;
 		}
 		json_object_iter_next(&it);
 	}
@@ -910,17 +1694,14 @@ void livesources_remote_replace(struct caster_state *caster, const char *hostnam
 }
 
 /*
- * Execute a full table update.
+ * Install a received full table, and remember the sending node on the connection.
  */
-static int livesource_update_execute_fulltable(struct caster_state *caster, struct livesources *this, struct request *req, json_object *j, const char *hostname) {
-	struct livesources_remote *remote;
-	remote = livesource_process_fulltable(caster, this, j, hostname);
-	if (remote == NULL)
-		return 503;
+static int _livesource_fulltable_install(struct caster_state *caster, struct request *req,
+	const char *hostname, struct livesources_remote *remote, json_object *jendpoints) {
+	unsigned long long serial = remote->serial;
 
 	livesources_remote_replace(caster, hostname, remote);
 
-	struct json_object *jendpoints = json_object_object_get(j, "endpoints");
 	if (req->st->node != NULL)
 		json_object_put(req->st->node);
 	req->st->node = json_object_get(jendpoints);
@@ -929,10 +1710,21 @@ static int livesource_update_execute_fulltable(struct caster_state *caster, stru
 		strfree(req->st->syncer_id);
 	req->st->syncer_id = mystrdup(hostname);
 
-	logfmt(&caster->flog, LOG_EDEBUG, "reload table %s serial %ld done", hostname, remote->serial);
+	logfmt(&caster->flog, LOG_EDEBUG, "reload table %s serial %llu done", hostname, serial);
 	return 200;
 }
 
+/*
+ * Execute a full table update.
+ */
+static int livesource_update_execute_fulltable(struct caster_state *caster, struct livesources *this, struct request *req, json_object *j, const char *hostname) {
+	struct livesources_remote *remote;
+	remote = livesource_process_fulltable(caster, this, j, hostname);
+	if (remote == NULL)
+		return 503;
+	return _livesource_fulltable_install(caster, req, hostname, remote, json_object_object_get(j, "endpoints"));
+}
+
 /*
  * Main routine to execute a received update.
  */
@@ -954,7 +1746,159 @@ int livesource_update_execute(struct caster_state *caster, struct livesources *t
 	}
 
 	P_RWLOCK_WRLOCK(&this->lock);
-	int r = livesource_update_execute_diff(caster, this, j, hostname);
+	int r = livesource_update_execute_diff(caster, this, req, j, hostname);
 	P_RWLOCK_UNLOCK(&this->lock);
 	return r;
 }
+
+/*
+ * Check the state and type of a livesource record, as they are used as array indexes.
+ */
+static int livesource_binary_valid(enum livesource_state state, enum livesource_type type) {
+	return state <= LIVESOURCE_RUNNING && type <= LIVESOURCE_TYPE_FETCHED;
+}
+
+/*
+ * Convert a full table update in binary encoding.
+ *
+ * Return NULL on error, with *status set to 400 for a malformed table
+ * or 503 if out of memory.
+ */
+static struct livesources_remote *livesource_process_fulltable_binary(struct caster_state *caster,
+	struct sync_binary_reader *r, const char *hostname, const char *start_date, unsigned long long serial, int *status) {
+	char s[SYNC_BINARY_STRING_MAX];
+	int n;
+
+	*status = 503;
+	struct livesources_remote *remote = livesources_remote_new(hostname, start_date, serial);
+	if (remote == NULL)
+		return NULL;
+
+	while ((n = sync_binary_next_record(r)) == 1) {
+		if (r->type == SYNC_BINARY_REC_ENDPOINT) {
+			struct endpoint *pe = (struct endpoint *)realloc(remote->endpoints,
+				sizeof(struct endpoint)*(remote->endpoint_count+1));
+			if (pe == NULL)
+				break;
+			remote->endpoints = pe;
+			if (sync_binary_get_string(r, s, sizeof s) <= 0)
+				/* Missing host, same as in the Json version */
+				break;
+			unsigned short port = sync_binary_get_u16(r);
+			int tls = sync_binary_get_u8(r);
+			endpoint_init(pe + remote->endpoint_count, s, port, tls);
+			remote->endpoint_count++;
+		} else if (r->type == SYNC_BINARY_REC_LIVESOURCE) {
+			unsigned long id = sync_binary_get_u32(r);
+			enum livesource_state state = sync_binary_get_u8(r);
+			enum livesource_type type = sync_binary_get_u8(r);
+			if (sync_binary_get_string(r, s, sizeof s) < 0 || !livesource_binary_valid(state, type)) {
+				*status = 400;
+				break;
+			}
+
+			struct livesource_remote *lr = livesource_remote_new(s);
+			if (lr == NULL)
+				break;
+			lr->state = state;
+			lr->type = type;
+			lr->id = id;
+			int e = hash_table_add(remote->hash, s, lr);
+			if (e == -1) {
+				logfmt(&caster->flog, LOG_WARNING, "duplicate mountpoint %s in livesource table, ignoring", s);
+				livesource_remote_free(lr);
+			} else if (e == -2) {
+				livesource_remote_free(lr);
+				break;
+			} else if (id && (e = _livesources_remote_add_id(remote, lr)) < 0) {
+				if (e == -1) {
+					logfmt(&caster->flog, LOG_NOTICE, "duplicate id %lu in livesource table", id);
+					*status = 400;
+				}
+				break;
+			}
+		}
+	}
+	if (n != 0) {
+		/* Truncated message, out of memory or bad contents */
+		if (n < 0)
+			*status = 400;
+		livesources_remote_free(remote);
+		return NULL;
+	}
+	return remote;
+}
+
+/*
+ * Apply a single livesource update in binary encoding to a remote table.
+ *
+ * Required lock: livesources
+ */
+static int _livesource_update_apply_binary(struct caster_state *caster, struct livesources_remote *lrlist,
+	struct sync_binary_reader *r, enum sync_binary_update utype) {
+	char mountpoint[SYNC_BINARY_STRING_MAX];
+	unsigned long id = sync_binary_get_u32(r);
+	enum livesource_state state = sync_binary_get_u8(r);
+	enum livesource_type type = sync_binary_get_u8(r);
+	if (utype == SYNC_BINARY_ADD)
+		sync_binary_get_string(r, mountpoint, sizeof mountpoint);
+	if (r->error || id == 0 || utype < SYNC_BINARY_ADD || utype > SYNC_BINARY_UPDATE
+	    || !livesource_binary_valid(state, type))
+		return 400;
+	return _livesources_remote_apply(caster, lrlist,
+		utype == SYNC_BINARY_ADD ? LIVESOURCE_UPDATE_ADD :
+		utype == SYNC_BINARY_DEL ? LIVESOURCE_UPDATE_DEL : LIVESOURCE_UPDATE_STATUS,
+		utype == SYNC_BINARY_ADD ? mountpoint : NULL, id, state, type);
+}
+
+/*
+ * Main routine to execute a received update in binary encoding.
+ */
+int livesource_update_execute_binary(struct caster_state *caster, struct livesources *this, struct request *req) {
+	struct sync_binary_reader r;
+	char hostname[SYNC_BINARY_STRING_MAX], start_date[SYNC_BINARY_STRING_MAX];
+
+	if (sync_binary_reader_init(&r, (const unsigned char *)req->st->content, req->st->content_length) < 0
+	    || sync_binary_next_record(&r) != 1 || r.type != SYNC_BINARY_REC_TABLE)
+		return 400;
+
+	sync_binary_get_string(&r, hostname, sizeof hostname);
+	sync_binary_get_string(&r, start_date, sizeof start_date);
+	unsigned long long serial = sync_binary_get_u64(&r);
+	enum sync_binary_update utype = sync_binary_get_u8(&r);
+	if (r.error)
+		return 400;
+
+	if (utype == SYNC_BINARY_FULLTABLE) {
+		int status;
+		struct livesources_remote *remote = livesource_process_fulltable_binary(caster, &r, hostname, start_date, serial, &status);
+		if (remote == NULL)
+			return status;
+		json_object *jendpoints = endpoints_to_json(remote->endpoints, remote->endpoint_count);
+		nodes_add_node(caster->nodes, hostname, json_object_get(jendpoints));
+		status = _livesource_fulltable_install(caster, req, hostname, remote, jendpoints);
+		json_object_put(jendpoints);
+		return status;
+	}
+
+	nodes_add_node(caster->nodes, hostname, NULL);
+
+	P_RWLOCK_WRLOCK(&this->lock);
+	struct livesources_remote *lrlist;
+	int status = _livesources_remote_check(caster, this, req, hostname, start_date, serial, &lrlist);
+	if (status == 200 && utype == SYNC_BINARY_REPLAY) {
+		int n;
+		while (status == 200 && (n = sync_binary_next_record(&r)) == 1)
+			if (r.type == SYNC_BINARY_REC_CHANGE)
+				status = _livesource_update_apply_binary(caster, lrlist, &r, sync_binary_get_u8(&r));
+		if (status == 200 && n != 0)
+			status = 400;
+	} else if (status == 200 && utype != SYNC_BINARY_CHECKSERIAL) {
+		if (sync_binary_next_record(&r) != 1 || r.type != SYNC_BINARY_REC_LIVESOURCE)
+			status = 400;
+		else
+			status = _livesource_update_apply_binary(caster, lrlist, &r, utype);
+	}
+	P_RWLOCK_UNLOCK(&this->lock);
+	return status;
+}
@@ -25,19 +25,49 @@ enum livesource_update_type {
 	LIVESOURCE_UPDATE_STATUS
 };
 
+/* Max number of packets sent at once to subscribers */
+#define	LIVESOURCE_BATCH_MAX	16
+
 /*
  * A source subscription for a client.
  */
 struct subscriber {
-	TAILQ_ENTRY(subscriber) next;
 	struct livesource *livesource;
 	struct ntrip_state *ntrip_state;
 
-	// backlog len at last send
-	size_t backlog_len;
+	// backlog len at last send, updated by concurrent senders under the read lock
+	_Atomic size_t backlog_len;
 	int virtual;
+	struct rtcm_filter *rtcm_filter;	// from the ntrip_state, resolved at subscribe time
+	int shard;		// livesource shard, by event base
+	int index;		// position in the shard subscriber array
+};
+
+/*
+ * Subscribers of a livesource attached to a given event base.
+ *
+ * In threaded mode, packets are queued to the shard and sent
+ * to subscribers from the event loop of the shard.
+ */
+struct livesource_shard {
+	struct subscriber **subscribers;	// compact array, for a fast walk
+	int nsubs, size_subscribers;
+
+	struct livesource *livesource;
+	struct caster_state *caster;
+	struct event *ev;			// fan-out event, NULL if not threaded
+
+	/*
+	 * Packets waiting for fan-out, as a ring buffer.
+	 * Limited to backlog_evbuffer bytes, like subscriber output buffers:
+	 * beyond, packets are dropped and the shard subscribers with them.
+	 */
+	P_MUTEX_T queue_lock;
+	struct packet **queue;
+	int queue_start, queue_len, queue_size;
+	size_t queue_bytes;
+	int overflow;				// packets were dropped
 };
-TAILQ_HEAD (subscribersq, subscriber);
 
 /*
  * A live source: either one that sends us its stream directly,
@@ -46,11 +76,13 @@ TAILQ_HEAD (subscribersq, subscriber);
 struct livesource {
 	P_RWLOCK_T lock;
 	char *mountpoint;
-	struct subscribersq subscribers;
-	int nsubs;
-	int npackets;
+	struct livesource_shard **shards;	// indexed by event base, NULL if unused
+	int nshards;
+	int nsubs;				// total for all shards
+	_Atomic int npackets;
 	enum livesource_state state;
 	enum livesource_type type;
+	unsigned long id;			// key for the binary sync encoding, unique in the table
 	_Atomic int refcnt;
 };
 
@@ -61,6 +93,7 @@ struct livesource_remote {
 	char *mountpoint;
 	enum livesource_state state;
 	enum livesource_type type;
+	unsigned long id;			// key from the binary sync encoding, 0 if none
 };
 
 /*
@@ -68,6 +101,7 @@ struct livesource_remote {
  */
 struct livesources_remote {
 	struct hash_table *hash;
+	struct hash_table *ids;			// same livesources by id, no reference; NULL if none
 	unsigned long long serial;
 	char *start_date;
 	char *hostname;
@@ -75,6 +109,21 @@ struct livesources_remote {
 	int endpoint_count;
 };
 
+/* Number of recent changes kept to resynchronize other nodes */
+#define	LIVESOURCE_CHANGELOG_SIZE	1024
+
+/*
+ * A change in the local livesource table.
+ */
+struct livesource_change {
+	unsigned long long serial;		// table serial before the change
+	enum livesource_update_type utype;
+	char *mountpoint;
+	unsigned long id;
+	enum livesource_state state;
+	enum livesource_type type;
+};
+
 /*
  * Table of livesources.
  */
@@ -85,6 +134,15 @@ struct livesources {
 	struct hash_table *remote;
 	P_RWLOCK_T lock;
 	unsigned long long serial;
+	unsigned long next_id;			// last livesource id
+
+	/*
+	 * Recent changes, as a ring buffer, to replay them to other nodes.
+	 * The lock also serializes serial increments.
+	 */
+	P_MUTEX_T changelog_lock;
+	struct livesource_change *changelog;
+	int changelog_start, changelog_len;
 
 	// This is used to disambiguate a rolled-back serial sequence
 	char *start_date;
@@ -110,14 +168,20 @@ void livesource_incref(struct livesource *this);
 void livesource_set_state(struct livesource *this, struct caster_state *caster, enum livesource_state state);
 void livesource_add_subscriber(struct ntrip_state *st, struct livesource *this, void *arg1);
 void livesource_del_subscriber(struct ntrip_state *st);
-int livesource_send_subscribers(struct livesource *this, struct packet *packet, struct caster_state *caster);
+int livesource_send_subscribers(struct livesource *this, struct packet **packets, int npackets, struct caster_state *caster);
 struct livesource *livesource_find(struct caster_state *this, struct ntrip_state *st, char *mountpoint, pos_t *mountpoint_pos);
 
-struct mime_content *livesource_list_json(struct caster_state *caster, struct request *req);
+struct json_stream;
+void livesource_list_stream(struct caster_state *caster, struct request *req, struct json_stream *js);
 
 json_object *livesource_full_update_json(struct caster_state *caster, struct livesources *this);
 json_object *livesource_checkserial_json(struct livesources *this);
+struct packet *livesource_full_update_binary(struct caster_state *caster, struct livesources *this);
+struct packet *livesource_checkserial_binary(struct livesources *this);
+int livesource_replay_json(struct livesources *this, unsigned long long serial, json_object **jp);
+int livesource_replay_binary(struct livesources *this, unsigned long long serial, struct packet **pp);
 void livesources_remote_replace(struct caster_state *caster, const char *hostname, struct livesources_remote *new_remote);
 int livesource_update_execute(struct caster_state *caster, struct livesources *this, struct request *req);
+int livesource_update_execute_binary(struct caster_state *caster, struct livesources *this, struct request *req);
 
 #endif /* __LIVESOURCE_H__ */
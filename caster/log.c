@@ -1,19 +1,383 @@
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "graylog_sender.h"
+#include "packet.h"
 #include "log.h"
+#include "util.h"
 
 #define max(a,b)	((a)>=(b)?(a):(b))
 
+/*
+ * Asynchronous log writer.
+ *
+ * Each thread has its own single-producer ring for each log, so that
+ * queueing a line requires no lock. The rings are registered in the
+ * log, and drained by its writer thread.
+ *
+ * The writer thread exists even in unthreaded mode, so the locks
+ * below are real pthread locks, not the P_* macros.
+ */
+
+/*
+ * Record in a ring, followed by the text.
+ * Records are contiguous: when a record does not fit at the end
+ * of the ring, the end is filled with a padding record.
+ */
+struct log_record {
+	uint32_t size;		// record size, header included, multiple of LOG_RECORD_ALIGN
+	uint32_t len;		// text length
+	uint16_t date_len;	// length of the date prefix, not sent to syslog
+	uint8_t level;
+	uint8_t flags;
+	uint32_t unused;
+};
+
+#define	LOG_RECORD_ALIGN	sizeof(struct log_record)
+#define	LOG_RECORD_FILE		1	// write to the log file
+#define	LOG_RECORD_SYSLOG	2	// send to syslog
+
+struct log_ring {
+	struct log_ring *next;		// in the log ring list
+	char *buf;
+	size_t mask;
+	size_t drained;			// writer only: next head, once written
+	_Atomic int refcnt;		// owner thread + log
+	_Atomic int orphan;		// owner thread gone, free once drained
+	_Alignas(64) _Atomic size_t head;	// next record to write out
+	_Alignas(64) _Atomic size_t tail;	// next free position
+};
+
+/* Thread cache of rings, by log id */
+#define	LOG_THREAD_CACHE	4
+
+struct log_thread {
+	struct {
+		unsigned long id;
+		struct log_ring *ring;
+	} cache[LOG_THREAD_CACHE];
+	int next;			// next cache slot to evict
+};
+
+static _Thread_local struct log_thread *log_thread;
+static pthread_key_t log_thread_key;
+static pthread_once_t log_thread_once = PTHREAD_ONCE_INIT;
+static _Atomic unsigned long log_next_id = 1;
+
+static struct log_ring *log_ring_new(void) {
+	struct log_ring *this = (struct log_ring *)malloc(sizeof(struct log_ring));
+	if (this == NULL)
+		return NULL;
+	this->buf = (char *)malloc(LOG_RING_SIZE);
+	if (this->buf == NULL) {
+		free(this);
+		return NULL;
+	}
+	this->mask = LOG_RING_SIZE-1;
+	this->drained = 0;
+	atomic_init(&this->refcnt, 2);
+	atomic_init(&this->orphan, 0);
+	atomic_init(&this->head, 0);
+	atomic_init(&this->tail, 0);
+	return this;
+}
+
+static void log_ring_decref(struct log_ring *this) {
+	if (atomic_fetch_sub(&this->refcnt, 1) == 1) {
+		free(this->buf);
+		free(this);
+	}
+}
+
+/*
+ * Called by the owner thread when it is done with the ring.
+ */
+static void log_ring_release(struct log_ring *this) {
+	atomic_store_explicit(&this->orphan, 1, memory_order_release);
+	log_ring_decref(this);
+}
+
+/*
+ * Queue a line.
+ * Return -1 if the ring is full, 1 if it just became a quarter full, else 0.
+ */
+static int log_ring_push(struct log_ring *this, int level, int flags, int date_len, const char *text, size_t len) {
+	size_t ring_size = this->mask+1;
+	size_t size = (sizeof(struct log_record) + len + LOG_RECORD_ALIGN-1) & ~(LOG_RECORD_ALIGN-1);
+	size_t tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&this->head, memory_order_acquire);
+	size_t contiguous = ring_size - (tail & this->mask);
+	size_t padding = contiguous < size ? contiguous : 0;
+
+	size_t used = tail - head;
+	if (size + padding > ring_size - used)
+		return -1;
+
+	struct log_record *rec;
+	if (padding) {
+		rec = (struct log_record *)(this->buf + (tail & this->mask));
+		rec->size = padding;
+		rec->flags = 0;
+		tail += padding;
+	}
+	rec = (struct log_record *)(this->buf + (tail & this->mask));
+	rec->size = size;
+	rec->len = len;
+	rec->date_len = date_len;
+	rec->level = level;
+	rec->flags = flags;
+	memcpy(rec+1, text, len);
+	atomic_store_explicit(&this->tail, tail + size, memory_order_release);
+	return (used < ring_size/4 && used + padding + size >= ring_size/4) ? 1 : 0;
+}
+
+/*
+ * Thread exit: hand over our rings to the writers.
+ */
+static void log_thread_free(void *arg) {
+	struct log_thread *t = (struct log_thread *)arg;
+	for (int i = 0; i < LOG_THREAD_CACHE; i++)
+		if (t->cache[i].ring)
+			log_ring_release(t->cache[i].ring);
+	free(t);
+}
+
+static void log_thread_key_create(void) {
+	pthread_key_create(&log_thread_key, log_thread_free);
+}
+
+/*
+ * Return the ring of the current thread for a log, creating it if needed.
+ */
+static struct log_ring *log_get_ring(struct log *this) {
+	struct log_thread *t = log_thread;
+	if (t == NULL) {
+		pthread_once(&log_thread_once, log_thread_key_create);
+		t = (struct log_thread *)calloc(1, sizeof(struct log_thread));
+		if (t == NULL)
+			return NULL;
+		pthread_setspecific(log_thread_key, t);
+		log_thread = t;
+	}
+	for (int i = 0; i < LOG_THREAD_CACHE; i++)
+		if (t->cache[i].ring && t->cache[i].id == this->id)
+			return t->cache[i].ring;
+
+	struct log_ring *ring = log_ring_new();
+	if (ring == NULL)
+		return NULL;
+
+	/* Use a free slot, or evict one, most likely for a log which is gone */
+	int slot;
+	for (slot = 0; slot < LOG_THREAD_CACHE && t->cache[slot].ring; slot++);
+	if (slot == LOG_THREAD_CACHE) {
+		slot = t->next;
+		t->next = (t->next + 1) % LOG_THREAD_CACHE;
+		log_ring_release(t->cache[slot].ring);
+	}
+	t->cache[slot].id = this->id;
+	t->cache[slot].ring = ring;
+
+	ring->next = atomic_load(&this->rings);
+	while (!atomic_compare_exchange_weak(&this->rings, &ring->next, ring));
+	return ring;
+}
+
+/*
+ * Write buffers to the log file, then release the ring space.
+ */
+static void log_writer_flush(struct log *this, struct iovec *iov, int niov) {
+	pthread_rwlock_rdlock(&this->lock);
+	int fd = this->fd == -1 ? STDERR_FILENO : this->fd;
+	while (niov > 0) {
+		ssize_t r = writev(fd, iov, niov);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		while (niov > 0 && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			iov->iov_base = (char *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	pthread_rwlock_unlock(&this->lock);
+
+	for (struct log_ring *ring = atomic_load(&this->rings); ring; ring = ring->next)
+		atomic_store_explicit(&ring->head, ring->drained, memory_order_release);
+}
+
+/*
+ * Remove the drained rings of exited threads.
+ */
+static void log_writer_gc(struct log *this) {
+	struct log_ring *prev = NULL, *ring = atomic_load(&this->rings);
+	while (ring) {
+		struct log_ring *next = ring->next;
+		if (!atomic_load_explicit(&ring->orphan, memory_order_acquire)
+		    || ring->drained != atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+			prev = ring;
+			ring = next;
+			continue;
+		}
+		if (prev == NULL) {
+			struct log_ring *head = ring;
+			if (!atomic_compare_exchange_strong(&this->rings, &head, next)) {
+				/* New rings were inserted in front of us */
+				for (prev = head; prev->next != ring; prev = prev->next);
+				prev->next = next;
+			}
+		} else
+			prev->next = next;
+		log_ring_decref(ring);
+		ring = next;
+	}
+}
+
+/*
+ * Write out all queued lines.
+ * Return the number of lines written.
+ */
+static int log_writer_drain(struct log *this) {
+	struct iovec iov[LOG_WRITER_IOV];
+	char dropped_line[100];
+	int niov = 0, n = 0;
+
+	unsigned long long dropped = atomic_load(&this->dropped);
+	if (dropped != this->dropped_reported) {
+		struct timeval ts;
+		char date[36];
+		gettimeofday(&ts, NULL);
+		logdate(date, sizeof date, &ts);
+		iov[niov].iov_base = dropped_line;
+		iov[niov++].iov_len = snprintf(dropped_line, sizeof dropped_line, "%s %llu log lines dropped\n",
+			date, dropped - this->dropped_reported);
+		this->dropped_reported = dropped;
+	}
+
+	for (struct log_ring *ring = atomic_load(&this->rings); ring; ring = ring->next) {
+		size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		while (ring->drained != tail) {
+			struct log_record *rec = (struct log_record *)(ring->buf + (ring->drained & ring->mask));
+			char *text = (char *)(rec+1);
+			if (rec->flags & LOG_RECORD_SYSLOG)
+				syslog(rec->level|atomic_load(&this->syslog_facility), "%.*s",
+					(int)(rec->len - rec->date_len), text + rec->date_len);
+			if (rec->flags & LOG_RECORD_FILE) {
+				if (niov == LOG_WRITER_IOV) {
+					log_writer_flush(this, iov, niov);
+					niov = 0;
+				}
+				iov[niov].iov_base = text;
+				iov[niov++].iov_len = rec->len;
+			}
+			if (rec->flags)
+				n++;
+			ring->drained += rec->size;
+		}
+	}
+	log_writer_flush(this, iov, niov);
+	log_writer_gc(this);
+	return n;
+}
+
+static int log_pending(struct log *this) {
+	if (atomic_load(&this->dropped) != this->dropped_reported)
+		return 1;
+	for (struct log_ring *ring = atomic_load(&this->rings); ring; ring = ring->next)
+		if (ring->drained != atomic_load_explicit(&ring->tail, memory_order_acquire))
+			return 1;
+	return 0;
+}
+
+/*
+ * Writer thread: write out queued lines, then sleep for LOG_WRITER_DELAY
+ * to let new lines accumulate, unless woken up by a filling ring.
+ *
+ * Pending lines are all written before exiting.
+ */
+static void *log_writer(void *arg) {
+	struct log *this = (struct log *)arg;
+	while (1) {
+		int stop = atomic_load(&this->writer_stop);
+		int n = log_writer_drain(this);
+		if (stop) {
+			if (n == 0 && !log_pending(this))
+				break;
+			continue;
+		}
+
+		pthread_mutex_lock(&this->writer_mutex);
+		atomic_store(&this->writer_sleeping, 1);
+		/* Pairs with the fence in log_queue() */
+		atomic_thread_fence(memory_order_seq_cst);
+		if (!atomic_load(&this->writer_stop)) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOG_WRITER_DELAY*1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&this->writer_cond, &this->writer_mutex, &ts);
+		}
+		atomic_store(&this->writer_sleeping, 0);
+		pthread_mutex_unlock(&this->writer_mutex);
+	}
+	return NULL;
+}
+
+static void log_writer_wakeup(struct log *this) {
+	pthread_mutex_lock(&this->writer_mutex);
+	pthread_cond_signal(&this->writer_cond);
+	pthread_mutex_unlock(&this->writer_mutex);
+}
+
+/*
+ * Queue a formatted line for the writer thread.
+ */
+static void log_queue(struct log *this, int level, int flags, int date_len, const char *line, size_t len) {
+	struct log_ring *ring = log_get_ring(this);
+	int r = ring ? log_ring_push(ring, level, flags, date_len, line, len) : -1;
+	if (r < 0)
+		atomic_fetch_add_explicit(&this->dropped, 1, memory_order_relaxed);
+	if (r == 0)
+		return;
+
+	/* Our ring is filling up: wake up the writer if it is sleeping */
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&this->writer_sleeping, memory_order_relaxed))
+		log_writer_wakeup(this);
+}
+
+static int log_open(const char *filename) {
+	return open(filename, O_WRONLY|O_APPEND|O_CREAT, 0666);
+}
+
+/*
+ * Open a log and start its writer thread.
+ * On failure, everything is already released.
+ */
 int log_init(struct log *this, const char *filename, log_cb_t log_cb,
 	int log_level, int graylog_level,  int syslog_level, int syslog_facility, void *arg) {
-	P_RWLOCK_INIT(&this->lock, NULL);
+	pthread_rwlock_init(&this->lock, NULL);
+	pthread_mutex_init(&this->writer_mutex, NULL);
+	pthread_cond_init(&this->writer_cond, NULL);
 	this->log_cb = log_cb;
 	this->state = arg;
 	this->syslog_facility = syslog_facility;
@@ -21,80 +385,98 @@ int log_init(struct log *this, const char *filename, log_cb_t log_cb,
 	this->graylog_level = graylog_level;
 	this->log_level = log_level;
 	this->max_log_level = max(max(syslog_level, graylog_level), log_level);
+	this->id = atomic_fetch_add(&log_next_id, 1);
+	atomic_init(&this->rings, NULL);
+	this->writer_started = 0;
+	atomic_init(&this->writer_sleeping, 0);
+	atomic_init(&this->writer_stop, 0);
+	atomic_init(&this->dropped, 0);
+	this->dropped_reported = 0;
 
-	// If filename is NULL, can't assign stderr to this->logfile as this causes weird side effects
-	// Use NULL instead.
+	// If filename is NULL, use stderr.
 
-	this->logfile = NULL;
+	this->fd = -1;
 	if (filename) {
-		this->logfile = fopen(filename, "a+");
-		if (!this->logfile) {
+		this->fd = log_open(filename);
+		if (this->fd < 0) {
 			fprintf(stderr, "Can't open log file %s: %s\n", filename, strerror(errno));
+			log_free(this);
 			return -1;
 		}
 	}
-	if (this->logfile)
-		setlinebuf(this->logfile);
+	if (pthread_create(&this->writer, NULL, log_writer, this) != 0) {
+		fprintf(stderr, "Can't start log writer thread\n");
+		log_free(this);
+		return -1;
+	}
+	this->writer_started = 1;
 	return 0;
 }
 
+/*
+ * Switch to a new log file, typically after a SIGHUP.
+ *
+ * Lines already queued are written to the new file.
+ */
 int log_reopen(struct log *this, const char *filename,
 	int log_level, int graylog_level, int syslog_level, int syslog_facility) {
-	FILE *newfile =	fopen(filename, "a+");
-	if (!newfile) {
+	int newfd = log_open(filename);
+	if (newfd < 0) {
 		fprintf(stderr, "Can't reopen log file %s: %s\n", filename, strerror(errno));
 		return -1;
 	}
-	setlinebuf(newfile);
-	P_RWLOCK_WRLOCK(&this->lock);
+	pthread_rwlock_wrlock(&this->lock);
 	atomic_store(&this->syslog_facility, syslog_facility);
 	atomic_store(&this->syslog_level, syslog_level);
 	atomic_store(&this->graylog_level, graylog_level);
 	atomic_store(&this->log_level, log_level);
 	atomic_store(&this->max_log_level, max(max(syslog_level, graylog_level), log_level));
-	if (this->logfile)
-		fclose(this->logfile);
-	this->logfile = newfile;
-	P_RWLOCK_UNLOCK(&this->lock);
+	if (this->fd != -1)
+		close(this->fd);
+	this->fd = newfd;
+	pthread_rwlock_unlock(&this->lock);
 	return 0;
 }
 
+/*
+ * Stop the writer thread once all lines are written, and free the log.
+ */
 void log_free(struct log *this) {
-	P_RWLOCK_WRLOCK(&this->lock);
-	if (this->logfile)
-		fclose(this->logfile);
-	P_RWLOCK_UNLOCK(&this->lock);
-	P_RWLOCK_DESTROY(&this->lock);
-}
-
-static void logfmt_file(struct log *this, struct gelf_entry *g, int level, const char *fmt, ...) {
-	va_list ap;
-	char date[36];
-	logdate(date, sizeof date, &g->ts);
-	va_start(ap, fmt);
-	P_RWLOCK_WRLOCK(&this->lock);
-	FILE *out = this->logfile?this->logfile:stderr;
-	fputs(date, out);
-	fputc(' ', out);
-	vfprintf(out, fmt, ap);
-	P_RWLOCK_UNLOCK(&this->lock);
-	va_end(ap);
+	if (this->writer_started) {
+		atomic_store(&this->writer_stop, 1);
+		log_writer_wakeup(this);
+		pthread_join(this->writer, NULL);
+	}
+	struct log_ring *ring = atomic_load(&this->rings);
+	while (ring) {
+		struct log_ring *next = ring->next;
+		log_ring_decref(ring);
+		ring = next;
+	}
+	pthread_rwlock_wrlock(&this->lock);
+	if (this->fd != -1)
+		close(this->fd);
+	pthread_rwlock_unlock(&this->lock);
+	pthread_rwlock_destroy(&this->lock);
+	pthread_mutex_destroy(&this->writer_mutex);
+	pthread_cond_destroy(&this->writer_cond);
 }
 
-static void logfmt_syslog(struct log *this, struct gelf_entry *g, int level, const char *fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	vsyslog((level>LOG_DEBUG?LOG_DEBUG:level)|atomic_load(&this->syslog_facility), fmt, ap);
-	va_end(ap);
+/*
+ * Return the number of lines dropped so far because a ring was full.
+ */
+unsigned long long log_dropped(struct log *this) {
+	return atomic_load(&this->dropped);
 }
 
 static void logfmt_graylog(struct log *this, struct caster_state *caster, struct gelf_entry *g) {
 	if (atomic_load(&caster->graylog_log_level) == -1)
 		return;
-	json_object *j = gelf_json(g);
-	const char *s = json_object_to_json_string(j);
-	graylog_sender_queue(caster->config->dyn->graylog[0], s);
-	json_object_put(j);
+	struct packet *p = gelf_packet(g);
+	if (p == NULL)
+		return;
+	graylog_sender_queue_packet(caster->config->dyn->graylog[0], p);
+	packet_decref(p);
 }
 
 void
@@ -105,6 +487,11 @@ logfmt_g(struct log *this, struct gelf_entry *g, int level, const char *fmt, ...
 	va_end(ap);
 }
 
+void
+vlogfmt_g(struct log *this, struct gelf_entry *g, int level, const char *fmt, va_list ap) {
+	this->log_cb(this->state, g, level, fmt, ap);
+}
+
 void
 logfmt(struct log *this, int level, const char *fmt, ...) {
 	va_list ap;
@@ -113,6 +500,31 @@ logfmt(struct log *this, int level, const char *fmt, ...) {
 	va_end(ap);
 }
 
+/*
+ * Same as logdate(), with the date up to the second cached per thread.
+ * Return the length.
+ */
+static int log_date(char *date, size_t len, struct timeval *ts) {
+	static _Thread_local time_t cached_sec = -1;
+	static _Thread_local char cached_date[24];
+	static _Thread_local int cached_len;
+	if (ts->tv_sec != cached_sec) {
+		struct tm t;
+		localtime_r(&ts->tv_sec, &t);
+		cached_len = strftime(cached_date, sizeof cached_date, "%Y-%m-%d %H:%M:%S", &t);
+		cached_sec = ts->tv_sec;
+	}
+	memcpy(date, cached_date, cached_len);
+	return cached_len + snprintf(date+cached_len, len-cached_len, ".%03ld", (long)ts->tv_usec/1000);
+}
+
+/*
+ * Format and send a message to all sinks accepting its level.
+ *
+ * Nothing is formatted if no sink accepts the level. Otherwise the line
+ * is formatted in a single pass into a stack buffer, and the message part
+ * reused as the graylog short message.
+ */
 void
 vlogall(struct caster_state *caster, struct gelf_entry *g, struct log *log, int level, const char *fmt, va_list ap) {
 	struct gelf_entry localg;
@@ -120,6 +532,23 @@ vlogall(struct caster_state *caster, struct gelf_entry *g, struct log *log, int
 	if (level < 0)
 		return;
 
+	int flags = 0;
+	if (level <= atomic_load_explicit(&log->log_level, memory_order_relaxed))
+		flags |= LOG_RECORD_FILE;
+	if (level <= atomic_load_explicit(&log->syslog_level, memory_order_relaxed))
+		flags |= LOG_RECORD_SYSLOG;
+	int to_graylog = (g == NULL || !g->nograylog)
+		&& level <= atomic_load_explicit(&log->graylog_level, memory_order_relaxed)
+		&& atomic_load(&caster->graylog_log_level) != -1 && caster->config;
+
+	if (!flags && !to_graylog) {
+		if (g != NULL) {
+			free(g->short_message);
+			g->short_message = NULL;
+		}
+		return;
+	}
+
 	int thread_id = threads?(long)pthread_getspecific(caster->thread_id):-1;
 
 	if (g == NULL) {
@@ -130,32 +559,41 @@ vlogall(struct caster_state *caster, struct gelf_entry *g, struct log *log, int
 		g->thread_id = thread_id;
 	}
 
-	char *msg;
-	vasprintf(&msg, fmt, ap);
-
-	if (level <= atomic_load(&log->log_level)) {
-		if (threads)
-			logfmt_file(log, g, level, "[%lu] %s\n", (long)thread_id, msg);
-		else
-			logfmt_file(log, g, level, "%s\n", msg);
+	/*
+	 * Format the line: date, thread id, prefix, message, newline.
+	 * Keep room for the newline, which replaces the final '\0'.
+	 */
+	char line[LOG_LINE_MAX];
+	int date_len, len;
+	date_len = log_date(line, 36, &g->ts);
+	line[date_len++] = ' ';
+	len = date_len;
+	if (threads)
+		len += snprintf(line+len, sizeof line - len, "[%d] ", thread_id);
+	if (g->log_prefix) {
+		int prefix_len = snprintf(line+len, sizeof line - len, "%s", g->log_prefix);
+		if (prefix_len > 0 && prefix_len < sizeof line - len)
+			len += prefix_len;
 	}
+	char *msg = line+len;
+	int msg_len = vsnprintf(msg, sizeof line - len - 1, fmt, ap);
+	if (msg_len < 0)
+		msg_len = 0;
+	else if (msg_len > sizeof line - len - 2)
+		msg_len = sizeof line - len - 2;
+	len += msg_len;
 
-	if (level <= atomic_load(&log->syslog_level)) {
-		if (threads)
-			logfmt_syslog(log, g, level, "[%lu] %s\n", (long)thread_id, msg);
-		else
-			logfmt_syslog(log, g, level, "%s\n", msg);
+	if (flags) {
+		line[len] = '\n';
+		log_queue(log, level > LOG_DEBUG ? LOG_DEBUG : level, flags, date_len, line, len+1);
+		line[len] = '\0';
 	}
 
-	if (!g->nograylog && atomic_load(&caster->graylog_log_level) != -1 && caster->config
-	    && level <= atomic_load(&log->graylog_level)) {
-		if (g->short_message == NULL) {
-			g->short_message = msg;
-			msg = NULL;
-		}
+	if (to_graylog) {
+		if (g->short_message == NULL)
+			g->short_message = mystrdup(msg);
 		logfmt_graylog(log, caster, g);
 	}
 	free(g->short_message);
 	g->short_message = NULL;
-	free(msg);
 }
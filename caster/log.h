@@ -1,6 +1,7 @@
 #ifndef __LOG_H__
 #define __LOG_H__
 
+#include <stdatomic.h>
 #include <stdio.h>
 
 #include "conf.h"
@@ -8,14 +9,55 @@
 
 typedef void (*log_cb_t)(void *, struct gelf_entry *, int, const char *, va_list);
 
+/*
+ * Log lines are formatted by the logging thread, queued on a per-thread
+ * lock-free ring, and written by a dedicated writer thread for each log,
+ * so that event loops never wait for a lock or disk I/O.
+ *
+ * When a ring is full, the line is dropped and counted.
+ */
+
+/* Size of the per-thread rings, must be a power of 2 */
+#define	LOG_RING_SIZE		65536
+
+/* Max length of a log line, longer lines are truncated */
+#define	LOG_LINE_MAX		16000
+
+/* Max number of buffers in a single writev() call */
+#define	LOG_WRITER_IOV		256
+
+/*
+ * Delay in milliseconds between writer runs, to batch lines.
+ * The writer is woken up earlier when a ring is a quarter full.
+ */
+#define	LOG_WRITER_DELAY	50
+
+struct log_ring;
+
 struct log {
-	FILE *logfile;		// NULL causes use of stderr instead
+	int fd;			// -1 causes use of stderr instead
 	void *state;
 	_Atomic int syslog_facility;
 	_Atomic int max_log_level;
 	_Atomic int syslog_level, graylog_level, log_level;
 	log_cb_t log_cb;
-	P_RWLOCK_T lock;
+	pthread_rwlock_t lock;	// fd
+
+	/* Unique id, to find our ring in the thread ring cache */
+	unsigned long id;
+
+	/* Per-thread rings: threads insert at the head, only the writer removes */
+	_Atomic(struct log_ring *) rings;
+
+	/* Writer thread */
+	pthread_t writer;
+	int writer_started;
+	_Atomic int writer_sleeping, writer_stop;
+	pthread_mutex_t writer_mutex;
+	pthread_cond_t writer_cond;
+
+	_Atomic unsigned long long dropped;	// lines dropped because a ring was full
+	unsigned long long dropped_reported;	// writer only
 };
 
 /* Log levels, same as syslog and GEF + LOG_EDEBUG */
@@ -30,14 +72,26 @@ struct log {
 #define	LOG_DEBUG	7	/* debug-level messages */
 #define	LOG_EDEBUG	8	/* extended debug messages */
 
+/* False for levels compiled out, known at compile time for constant levels */
+#define	LOG_LEVEL_COMPILED(level)	((level) < LOG_EDEBUG || LOG_EDEBUG_ENABLED)
+
+/*
+ * Cheap check before formatting: whether any sink may accept this level.
+ */
+static inline int log_enabled(struct log *this, int level) {
+	return level >= 0 && level <= atomic_load_explicit(&this->max_log_level, memory_order_relaxed);
+}
+
 struct caster_state;
 
 int log_init(struct log *this, const char *filename, log_cb_t log_cb,
 	int log_level, int graylog_level, int syslog_level, int syslog_facility, void *arg);
 int log_reopen(struct log *this, const char *filename, int log_level, int graylog_level, int syslog_level, int syslog_facility);
 void logfmt_g(struct log *this, struct gelf_entry *g, int level, const char *fmt, ...);
+void vlogfmt_g(struct log *this, struct gelf_entry *g, int level, const char *fmt, va_list ap);
 void logfmt(struct log *this, int level, const char *fmt, ...);
 void log_free(struct log *this);
+unsigned long long log_dropped(struct log *this);
 void vlogall(struct caster_state *caster, struct gelf_entry *g, struct log *log, int level, const char *fmt, va_list ap);
 
 #endif
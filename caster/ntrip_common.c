@@ -114,7 +114,7 @@ struct ntrip_state *ntrip_new(struct caster_state *caster, struct bufferevent *b
 	this->query_string = NULL;
 	this->content_type = NULL;
 	this->client = 0;
-	atomic_store(&this->use_rtcm_filter, 0);
+	this->rtcm_filter = NULL;
 	atomic_store(&this->rtcm_client_state, NTRIP_RTCM_POS_WAIT);
 	this->node = NULL;
 	this->syncer_id = NULL;
@@ -405,6 +405,8 @@ static void _ntrip_free(struct ntrip_state *this, char *orig, int unlink) {
 	 */
 	ntrip_log(this, LOG_EDEBUG, "freeing bev %p", this->bev);
 	my_bufferevent_free(this, this->bev);
+	if (this->rtcm_filter)
+		rtcm_filter_decref(this->rtcm_filter);
 	config_decref(this->config);
 	free(this);
 }
@@ -679,6 +681,7 @@ _ntrip_log(struct log *log, struct ntrip_state *this, int level, const char *fmt
 	int thread_id;
 	char addrport[64];
 	char addr[40];
+	char prefix[96];
 
 	thread_id = threads?(long)pthread_getspecific(this->caster->thread_id):-1;
 	gelf_init(&g, level, this->caster->hostname, thread_id);
@@ -710,11 +713,10 @@ _ntrip_log(struct log *log, struct ntrip_state *this, int level, const char *fmt
 		strcpy(addrport, "-");
 	}
 
-	vasprintf(&g.short_message, fmt, ap);
-
-	logfmt_g(log, &g, level, "%s %lld %s", addrport, this->id, g.short_message);
-
-	free(g.short_message);
+	/* The message itself is only formatted once, after the prefix */
+	snprintf(prefix, sizeof prefix, "%s %lld ", addrport, this->id);
+	g.log_prefix = prefix;
+	vlogfmt_g(log, &g, level, fmt, ap);
 }
 
 void ntrip_alog(void *arg, const char *fmt, ...) {
@@ -725,10 +727,12 @@ void ntrip_alog(void *arg, const char *fmt, ...) {
 	va_end(ap);
 }
 
-void ntrip_log(void *arg, int level, const char *fmt, ...) {
+/*
+ * Log a message for a ntrip_state, through the ntrip_log() macro
+ * which checks the level first.
+ */
+void ntrip_log_fmt(void *arg, int level, const char *fmt, ...) {
 	struct ntrip_state *this = (struct ntrip_state *)arg;
-	if (level < 0 || level > this->caster->flog.max_log_level)
-		return;
 	va_list ap;
 	va_start(ap, fmt);
 	_ntrip_log(&this->caster->flog, this, level, fmt, ap);
@@ -208,7 +208,7 @@ struct ntrip_state {
 	char wildcard;				// Flag: set for a source if the mountpoint is unregistered (wildcard entry)
 
 	char *query_string;			// HTTP GET query string, if any.
-	_Atomic char use_rtcm_filter;		// Flag: filter outgoing packets by type
+	struct rtcm_filter *rtcm_filter;	// filter for outgoing packets, if any
 
 	/*
 	 * Relevant sourceline if the connection is from a source.
@@ -271,7 +271,23 @@ void ntrip_unregister_livesource(struct ntrip_state *this);
 void ntrip_notify_close(struct ntrip_state *st);
 unsigned short ntrip_peer_port(struct ntrip_state *this);
 void ntrip_alog(void *arg, const char *fmt, ...);
-void ntrip_log(void *arg, int level, const char *fmt, ...);
+void ntrip_log_fmt(void *arg, int level, const char *fmt, ...);
+
+/*
+ * Whether a ntrip_log() call at this level may be logged.
+ * A macro, as struct caster_state may not be complete yet here.
+ */
+#define	ntrip_log_enabled(arg, level)	\
+	(LOG_LEVEL_COMPILED(level) && log_enabled(&((struct ntrip_state *)(arg))->caster->flog, (level)))
+
+/*
+ * Check the level before evaluating the arguments and formatting,
+ * as most calls on hot paths are for debug levels.
+ */
+#define	ntrip_log(arg, level, ...) do {					\
+		if (ntrip_log_enabled((arg), (level)))			\
+			ntrip_log_fmt((arg), (level), __VA_ARGS__);	\
+	} while (0)
 int ntrip_handle_raw(struct ntrip_state *st);
 int ntrip_filter_run_input(struct ntrip_state *st);
 int ntrip_handle_raw_chunk(struct ntrip_state *st);
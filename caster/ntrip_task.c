@@ -1,16 +1,20 @@
 #include <assert.h>
 
 #include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #include <event2/http.h>
 #include <event2/buffer.h>
+#include <zlib.h>
 
 #include "conf.h"
 #include "ntripcli.h"
 #include "ntrip_task.h"
+#include "spillq.h"
 #include "util.h"
 
 static void
@@ -67,6 +71,7 @@ struct ntrip_task *ntrip_task_new(struct caster_state *caster,
 	this->end_cb = NULL;
 	this->line_cb = NULL;
 	this->status_cb = NULL;
+	this->header_cb = NULL;
 	this->connect_cb = connect_cb;
 	this->st = NULL;
 	this->caster = caster;
@@ -90,9 +95,159 @@ struct ntrip_task *ntrip_task_new(struct caster_state *caster,
 	this->queue_size = 0;
 	this->nograylog = 0;
 	this->drainfilename = drainfilename?mystrdup(drainfilename):NULL;
+	this->compression_level = 0;
+	this->zstream = NULL;
+	this->spill = NULL;
+	atomic_init(&this->spill_drop_log, 0);
+	atomic_init(&this->bulk_bytes_in, 0);
+	atomic_init(&this->bulk_bytes_out, 0);
 	return this;
 }
 
+/*
+ * Set the gzip compression level for bulk requests, 0 to disable.
+ * Return -1 if the level is invalid.
+ */
+int ntrip_task_set_compression(struct ntrip_task *this, int level) {
+	if (level < 0 || level > Z_BEST_COMPRESSION)
+		return -1;
+	P_RWLOCK_WRLOCK(&this->mimeq_lock);
+	if (this->zstream && level != this->compression_level) {
+		deflateEnd(this->zstream);
+		free(this->zstream);
+		this->zstream = NULL;
+	}
+	this->compression_level = level;
+	P_RWLOCK_UNLOCK(&this->mimeq_lock);
+	return 0;
+}
+
+/*
+ * Write items to a spill queue in a directory, relative to the configuration
+ * directory, so that they survive a restart or a crash, and are kept
+ * instead of draining the queue when it overflows.
+ * The queue is limited to max_size bytes (0 = unlimited), applying policy beyond.
+ * Return -1 if the directory can't be used.
+ */
+int ntrip_task_set_spill(struct ntrip_task *this, const char *dir, size_t max_size, enum spillq_policy policy) {
+	char *path = joinpath(this->caster->config_dir, dir);
+	if (path == NULL)
+		return -1;
+	this->spill = spillq_open(path, &this->caster->flog);
+	strfree(path);
+	if (this->spill == NULL)
+		return -1;
+	spillq_set_limit(this->spill, max_size, policy);
+	return 0;
+}
+
+/*
+ * Move spilled items to the queue, as far as its maximum size allows.
+ * An item is always taken if the queue is empty, so a large one can't block the others.
+ *
+ * Required lock: mimeq_lock
+ */
+static void ntrip_task_replay(struct ntrip_task *this) {
+	struct packet *p;
+
+	while (this->queue_size < this->queue_max_size || STAILQ_EMPTY(&this->mimeq)) {
+		size_t room = STAILQ_EMPTY(&this->mimeq) ? SIZE_MAX : this->queue_max_size - this->queue_size;
+		if ((p = spillq_read(this->spill, this, room)) == NULL)
+			break;
+		struct mime_content *m = mime_new_from_packet("application/json", p);
+		packet_decref(p);
+		if (m == NULL)
+			break;
+		m->spilled = 1;
+		STAILQ_INSERT_TAIL(&this->mimeq, m, next);
+		this->queue_size += m->len;
+	}
+}
+
+/*
+ * Content-Encoding for the next request, or NULL if not compressed.
+ */
+const char *ntrip_task_content_encoding(struct ntrip_task *this) {
+	return (this->bulk_max_size && this->compression_level) ? "gzip" : NULL;
+}
+
+/*
+ * Feed data to the compressor, appending its output to the buffer.
+ */
+static int ntrip_task_deflate(z_stream *z, const void *data, size_t len, int flush, struct evbuffer *output) {
+	struct evbuffer_iovec v;
+	int r;
+	z->next_in = (Bytef *)data;
+	z->avail_in = len;
+	do {
+		if (evbuffer_reserve_space(output, 16384, &v, 1) < 1)
+			return -1;
+		z->next_out = v.iov_base;
+		z->avail_out = v.iov_len;
+		r = deflate(z, flush);
+		v.iov_len -= z->avail_out;
+		if (r == Z_STREAM_ERROR || evbuffer_commit_space(output, &v, 1) < 0)
+			return -1;
+	} while (z->avail_out == 0);
+	return (flush == Z_FINISH && r != Z_STREAM_END) ? -1 : 0;
+}
+
+/*
+ * Compress n packets, joined by '\n', as a gzip stream.
+ * Return the compressed size, or -1 on error.
+ *
+ * Required lock: ntrip_state, for the compressor
+ */
+ssize_t ntrip_task_compress_bulk(struct ntrip_task *this, struct packet **packets, int n, struct evbuffer *output) {
+	size_t in = 0, before = evbuffer_get_length(output);
+
+	if (this->zstream == NULL) {
+		z_stream *z = (z_stream *)calloc(1, sizeof(z_stream));
+		if (z == NULL)
+			return -1;
+		/* 15 + 16: maximum window, with a gzip header */
+		if (deflateInit2(z, this->compression_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(z);
+			return -1;
+		}
+		this->zstream = z;
+	} else if (deflateReset(this->zstream) != Z_OK)
+		return -1;
+
+	for (int i = 0; i < n; i++) {
+		if (ntrip_task_deflate(this->zstream, packets[i]->data, packets[i]->datalen, Z_NO_FLUSH, output) < 0
+		 || ntrip_task_deflate(this->zstream, "\n", 1, Z_NO_FLUSH, output) < 0)
+			return -1;
+		in += packets[i]->datalen + 1;
+	}
+	if (ntrip_task_deflate(this->zstream, NULL, 0, Z_FINISH, output) < 0)
+		return -1;
+
+	size_t out = evbuffer_get_length(output) - before;
+	atomic_fetch_add_explicit(&this->bulk_bytes_in, in, memory_order_relaxed);
+	atomic_fetch_add_explicit(&this->bulk_bytes_out, out, memory_order_relaxed);
+	return out;
+}
+
+/*
+ * Queue and bulk statistics.
+ */
+json_object *ntrip_task_json(struct ntrip_task *this) {
+	json_object *j = json_object_new_object();
+	P_RWLOCK_RDLOCK(&this->mimeq_lock);
+	json_object_object_add_ex(j, "queue_size", json_object_new_uint64(this->queue_size), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "compression_level", json_object_new_int(this->compression_level), JSON_C_CONSTANT_NEW);
+	P_RWLOCK_UNLOCK(&this->mimeq_lock);
+	unsigned long long in = atomic_load_explicit(&this->bulk_bytes_in, memory_order_relaxed);
+	unsigned long long out = atomic_load_explicit(&this->bulk_bytes_out, memory_order_relaxed);
+	json_object_object_add_ex(j, "bulk_bytes_in", json_object_new_uint64(in), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "bulk_bytes_out", json_object_new_uint64(out), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "compression_ratio", json_object_new_double(out ? (double)in/out : 0.), JSON_C_CONSTANT_NEW);
+	if (this->spill)
+		json_object_object_add_ex(j, "spill", spillq_json(this->spill), JSON_C_CONSTANT_NEW);
+	return j;
+}
+
 /*
  * Protected access to clear the st pointer and
  * return a counted reference to its previous value, if not NULL.
@@ -222,7 +377,7 @@ void ntrip_task_reschedule(struct ntrip_task *this, void *arg_cb) {
  * Drain the queue, possibly storing the content in a file.
  * Keep the items currently being sent.
  */
-static size_t ntrip_task_drain_queue(struct ntrip_task *this) {
+size_t ntrip_task_drain_queue(struct ntrip_task *this) {
 	struct mimeq tmp_mimeq;
 	struct mime_content *m;
 
@@ -277,29 +432,54 @@ static size_t ntrip_task_drain_queue(struct ntrip_task *this) {
  * Insert a new item in the queue, checking accepted size.
  */
 void ntrip_task_queue(struct ntrip_task *this, struct packet *packet) {
+	ntrip_task_queue_mime(this, packet, "application/json");
+}
+
+/*
+ * Same as ntrip_task_queue(), for an item of the provided MIME type.
+ */
+void ntrip_task_queue_mime(struct ntrip_task *this, struct packet *packet, const char *mime_type) {
 	if (atomic_load_explicit(&this->state, memory_order_relaxed) == TASK_END)
 		return;
-	struct mime_content *m = mime_new_from_packet("application/json", packet);
-	if (m == NULL) {
-		logfmt(&this->caster->flog, LOG_CRIT, "Out of memory when allocating log output, dropping");
-		return;
-	}
-	size_t len = m->len;
-
-	P_RWLOCK_WRLOCK(&this->mimeq_lock);
-	if (len + this->queue_size > this->queue_max_size) {
-		P_RWLOCK_UNLOCK(&this->mimeq_lock);
-		size_t len = ntrip_task_drain_queue(this);
-		logfmt(&this->caster->flog, LOG_CRIT, "Backlog queue was %d bytes, drained", len);
-	} else
-		P_RWLOCK_UNLOCK(&this->mimeq_lock);
+	size_t len = packet->datalen;
 
 	if (this->bulk_max_size && len > this->bulk_max_size - 1) {
 		logfmt(&this->caster->flog, LOG_ERR, "Log message %d bytes, bigger than max %d bytes, dropping",
-				m->len, this->bulk_max_size-1);
-		mime_free(m);
+				len, this->bulk_max_size-1);
+		return;
+	}
+
+	if (this->spill) {
+		/*
+		 * Write-ahead: the spill queue keeps everything until acknowledged,
+		 * in order. Only a copy to a mapped file, without mimeq_lock.
+		 */
+		if (spillq_append(this->spill, packet->data, len) < 0) {
+			/*
+			 * Counted in the spill queue statistics.
+			 * Not logged to graylog, as it would come back here.
+			 */
+			time_t now = time(NULL);
+			if (atomic_exchange_explicit(&this->spill_drop_log, now, memory_order_relaxed) != now) {
+				struct gelf_entry g;
+				gelf_init(&g, LOG_CRIT, this->caster->hostname, -1);
+				g.nograylog = 1;
+				logfmt_g(&this->caster->flog, &g, LOG_CRIT, "Can't spill %zu bytes to %s, dropping", len, this->spill->dir);
+			}
+		}
 	} else {
+		struct mime_content *m = mime_new_from_packet(mime_type, packet);
+		if (m == NULL) {
+			logfmt(&this->caster->flog, LOG_CRIT, "Out of memory when allocating log output, dropping");
+			return;
+		}
 		P_RWLOCK_WRLOCK(&this->mimeq_lock);
+		if (len + this->queue_size > this->queue_max_size) {
+			P_RWLOCK_UNLOCK(&this->mimeq_lock);
+			size_t len = ntrip_task_drain_queue(this);
+			logfmt(&this->caster->flog, LOG_CRIT, "Backlog queue was %d bytes, drained", len);
+			P_RWLOCK_WRLOCK(&this->mimeq_lock);
+		}
 		STAILQ_INSERT_TAIL(&this->mimeq, m, next);
 		this->queue_size += len;
 		P_RWLOCK_UNLOCK(&this->mimeq_lock);
@@ -336,11 +516,29 @@ void ntrip_task_send_next_request(struct ntrip_state *st) {
 	size_t size = 0;
 
 	P_RWLOCK_WRLOCK(&task->mimeq_lock);
+	if (task->spill)
+		ntrip_task_replay(task);
 	if (task->bulk_max_size) {
 		/*
 		 * Bulk mode
 		 */
 
+		/*
+		 * Drop replayed items too large for a bulk request,
+		 * after a configuration change, as they would block the queue.
+		 */
+		while ((m = STAILQ_FIRST(&task->mimeq)) && m->len + 1 > task->bulk_max_size) {
+			ntrip_log(st, LOG_ERR, "Log message %zu bytes, bigger than max %zu bytes, dropping",
+				m->len, task->bulk_max_size-1);
+			STAILQ_REMOVE_HEAD(&task->mimeq, next);
+			task->queue_size -= m->len;
+			if (m->spilled)
+				spillq_ack(task->spill, task);
+			mime_free(m);
+			if (STAILQ_EMPTY(&task->mimeq) && task->spill)
+				ntrip_task_replay(task);
+		}
+
 		/*
 		 * Count how many elements we can send under the max size
 		 */
@@ -363,21 +561,83 @@ void ntrip_task_send_next_request(struct ntrip_state *st) {
 		mc.len = size;
 		mc.mime_type = task->bulk_content_type;
 
-		/* Send the HTTP request followed by the MIME items joined by '\n' */
-		ntripcli_send_request(st, &mc, 0);
-		STAILQ_FOREACH(m, &task->mimeq, next) {
-			if (n == 0)
-				break;
-			if (packet_send(m->packet, st, time(NULL)) < 0
-			 || evbuffer_add_reference(output, "\n", 1, NULL, NULL) < 0) {
+		if (task->compression_level) {
+			/*
+			 * Compress first, as the request needs the final Content-Length.
+			 *
+			 * Compress without mimeq_lock, so queueing is not blocked meanwhile:
+			 * the items are marked pending, which keeps them at the head of the queue,
+			 * and we hold references on their packets.
+			 */
+			struct packet **packets = (struct packet **)malloc(n * sizeof(struct packet *));
+			if (packets == NULL) {
 				P_RWLOCK_UNLOCK(&task->mimeq_lock);
 				ntrip_log(st, LOG_CRIT, "Not enough memory, dropping connection to %s:%d", st->host, st->port);
 				ntrip_task_clear_st(task);
 				ntrip_decref_end(st, "ntrip_task_send_next_request");
 				return;
 			}
-			st->task->pending++;
-			n--;
+			int i = 0;
+			STAILQ_FOREACH(m, &task->mimeq, next) {
+				if (i == n)
+					break;
+				packet_incref(m->packet);
+				packets[i++] = m->packet;
+			}
+			task->pending = n;
+			P_RWLOCK_UNLOCK(&task->mimeq_lock);
+
+			struct evbuffer *zbuf = evbuffer_new();
+			ssize_t zlen = zbuf ? ntrip_task_compress_bulk(task, packets, n, zbuf) : -1;
+			for (i = 0; i < n; i++)
+				packet_decref(packets[i]);
+			free(packets);
+
+			int r = -1;
+			if (zlen >= 0) {
+				ntrip_log(st, LOG_DEBUG, "Bulk request: %d items, %zu bytes compressed to %zd", n, size, zlen);
+				mc.len = zlen;
+				ntripcli_send_request(st, &mc, 0);
+				r = evbuffer_add_buffer(output, zbuf);
+			}
+			if (zbuf)
+				evbuffer_free(zbuf);
+			if (r < 0) {
+				P_RWLOCK_WRLOCK(&task->mimeq_lock);
+				task->pending = 0;
+				P_RWLOCK_UNLOCK(&task->mimeq_lock);
+				if (zlen < 0)
+					ntrip_log(st, LOG_CRIT, "Compression failed, dropping connection to %s:%d", st->host, st->port);
+				else
+					ntrip_log(st, LOG_CRIT, "Not enough memory, dropping connection to %s:%d", st->host, st->port);
+				ntrip_task_clear_st(task);
+				ntrip_decref_end(st, "ntrip_task_send_next_request");
+				return;
+			}
+			st->last_send = time(NULL);
+			st->sent_bytes += zlen;
+			struct timeval read_timeout = { task->status_timeout };
+			bufferevent_set_timeouts(st->bev, &read_timeout, NULL);
+			return;
+		} else {
+			/* Send the HTTP request followed by the MIME items joined by '\n' */
+			ntripcli_send_request(st, &mc, 0);
+			STAILQ_FOREACH(m, &task->mimeq, next) {
+				if (n == 0)
+					break;
+				if (packet_send(m->packet, st, time(NULL)) < 0
+				 || evbuffer_add_reference(output, "\n", 1, NULL, NULL) < 0) {
+					P_RWLOCK_UNLOCK(&task->mimeq_lock);
+					ntrip_log(st, LOG_CRIT, "Not enough memory, dropping connection to %s:%d", st->host, st->port);
+					ntrip_task_clear_st(task);
+					ntrip_decref_end(st, "ntrip_task_send_next_request");
+					return;
+				}
+				st->task->pending++;
+				n--;
+			}
+			atomic_fetch_add_explicit(&task->bulk_bytes_in, size, memory_order_relaxed);
+			atomic_fetch_add_explicit(&task->bulk_bytes_out, size, memory_order_relaxed);
 		}
 	} else {
 		/* Regular mode: 1 request per MIME item */
@@ -419,6 +679,8 @@ void ntrip_task_ack_pending(struct ntrip_task *this) {
 		STAILQ_REMOVE_HEAD(&this->mimeq, next);
 		this->queue_size -= m->len;
 		this->pending--;
+		if (m->spilled)
+			spillq_ack(this->spill, this);
 		mime_free(m);
 	}
 	assert(this->pending == 0);
@@ -427,6 +689,18 @@ void ntrip_task_ack_pending(struct ntrip_task *this) {
 
 static void ntrip_task_free(struct ntrip_task *this) {
 	ntrip_task_stop(this);
+	if (this->spill) {
+		/* Unacknowledged items are still on disk, in order, for the next reader */
+		struct mime_content *m;
+		P_RWLOCK_WRLOCK(&this->mimeq_lock);
+		while ((m = STAILQ_FIRST(&this->mimeq))) {
+			STAILQ_REMOVE_HEAD(&this->mimeq, next);
+			this->queue_size -= m->len;
+			mime_free(m);
+		}
+		P_RWLOCK_UNLOCK(&this->mimeq_lock);
+		spillq_close(this->spill, this);
+	}
 	ntrip_task_drain_queue(this);
 
 	ntrip_task_clear_st(this);
@@ -436,6 +710,10 @@ static void ntrip_task_free(struct ntrip_task *this) {
 	strfree(this->host);
 	strfree((char *)this->uri);
 	strfree((char *)this->drainfilename);
+	if (this->zstream) {
+		deflateEnd(this->zstream);
+		free(this->zstream);
+	}
 	if (this->ev)
 		event_free(this->ev);
 	P_RWLOCK_UNLOCK(&this->mimeq_lock);
@@ -3,10 +3,12 @@
 
 #include <sys/time.h>
 
+#include <event2/buffer.h>
 #include <event2/event_struct.h>
 
 #include "conf.h"
 #include "ntrip_common.h"
+#include "spillq.h"
 
 enum task_state {
 	TASK_INIT,
@@ -66,6 +68,10 @@ struct ntrip_task {
 	void (*status_cb)(void *arg, int status, int);
 	void *status_cb_arg;
 
+	/* HTTP header callback, if set headers are also read on non-200 replies */
+	void (*header_cb)(void *arg, const char *key, const char *value, int);
+	void *header_cb_arg;
+
 	void (*connect_cb)(struct ntrip_state *st);
 
 	/* Current ntrip_state, if any */
@@ -109,12 +115,28 @@ struct ntrip_task {
 	/* MIME type for bulk requests */
 	const char *bulk_content_type;
 
+	/* gzip level for bulk requests, 0 = no compression */
+	int compression_level;
+	struct z_stream_s *zstream;		// reused across bulk requests
+
+	/* Bulk bytes before and after compression, for statistics */
+	_Atomic unsigned long long bulk_bytes_in, bulk_bytes_out;
+
 	/* Flag: don't send logs for this task to graylog, to avoid loops */
 	char nograylog;
 
 	/* strftime(3) format file name for overflow files */
 	const char *drainfilename;
 
+	/*
+	 * Spill queue, or NULL. When set, all items are written there first,
+	 * and the memory queue only holds items read back from it.
+	 */
+	struct spillq *spill;
+
+	/* Last time a spill failure was logged, to log at most once per second */
+	_Atomic time_t spill_drop_log;
+
 	/* Specific timeout, or 0 to use the defaults */
 	int read_timeout;
 	int write_timeout;
@@ -124,6 +146,7 @@ struct ntrip_task *ntrip_task_new(struct caster_state *caster,
 	const char *host, unsigned short port, const char *uri, int tls, int refresh_delay,
 	size_t bulk_max_size, size_t queue_max_size, const char *type, const char *drainfilename);
 void ntrip_task_ack_pending(struct ntrip_task *this);
+size_t ntrip_task_drain_queue(struct ntrip_task *this);
 void ntrip_task_incref(struct ntrip_task *this);
 void ntrip_task_decref(struct ntrip_task *this);
 struct ntrip_state *ntrip_task_clear_get_st(struct ntrip_task *this, int getref);
@@ -134,7 +157,13 @@ int ntrip_task_start(struct ntrip_task *this, void *reschedule_arg, struct lives
 void ntrip_task_stop(struct ntrip_task *this);
 void ntrip_task_reschedule(struct ntrip_task *this, void *arg_cb);
 void ntrip_task_queue(struct ntrip_task *this, struct packet *packet);
+void ntrip_task_queue_mime(struct ntrip_task *this, struct packet *packet, const char *mime_type);
 void ntrip_task_send_next_request(struct ntrip_state *st);
+int ntrip_task_set_compression(struct ntrip_task *this, int level);
+int ntrip_task_set_spill(struct ntrip_task *this, const char *dir, size_t max_size, enum spillq_policy policy);
+const char *ntrip_task_content_encoding(struct ntrip_task *this);
+ssize_t ntrip_task_compress_bulk(struct ntrip_task *this, struct packet **packets, int n, struct evbuffer *output);
+json_object *ntrip_task_json(struct ntrip_task *this);
 
 void ntrip_task_reload(struct ntrip_task *this,
 	const char *host, unsigned short port, const char *uri, int tls,
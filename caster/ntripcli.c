@@ -48,6 +48,7 @@ static char *ntripcli_http_request_str(struct ntrip_state *st,
 	}
 	unsigned long long content_len = 0;
 	char content_len_str[20];
+	const char *content_encoding = (m && st->task) ? ntrip_task_content_encoding(st->task) : NULL;
 	if (m)
 		content_len = m->len;
 	snprintf(content_len_str, sizeof content_len_str, "%lld", content_len);
@@ -57,6 +58,7 @@ static char *ntripcli_http_request_str(struct ntrip_state *st,
 	 || evhttp_add_header(&headers, "User-Agent", client_user_agent) < 0
 	 || evhttp_add_header(&headers, "Content-Length", content_len_str) < 0
 	 || (m && evhttp_add_header(&headers, "Content-Type", m->mime_type) < 0)
+	 || (content_encoding && evhttp_add_header(&headers, "Content-Encoding", content_encoding) < 0)
 	 || evhttp_add_header(&headers, "Connection", st->connection_keepalive?"keep-alive":"close") < 0
 	 || (version == 2 && evhttp_add_header(&headers, "Ntrip-Version", client_ntrip_version) < 0)) {
 		evhttp_clear_headers(&headers);
@@ -195,7 +197,7 @@ void ntripcli_readcb(struct bufferevent *bev, void *arg) {
 			if (st->task && st->task->status_cb)
 				st->task->status_cb(st->task->status_cb_arg, status_code, st->task->cb_arg2);
 
-			if (st->status_code == 200)
+			if (st->status_code == 200 || (st->task && st->task->header_cb))
 				ntrip_set_state(st, NTRIP_WAIT_HTTP_HEADER);
 			else {
 				ntrip_log(st, LOG_NOTICE, "failed request on %s, status_code %d", st->uri, st->status_code);
@@ -215,7 +217,11 @@ void ntripcli_readcb(struct bufferevent *bev, void *arg) {
 				break;
 			if (len == 0) {
 				ntrip_log(st, LOG_DEBUG, "[End headers]");
-				if (st->chunk_state == CHUNK_INIT && ntrip_chunk_decode_init(st) < 0) {
+				if (st->status_code != 200) {
+					/* Headers were only read for the header callback */
+					ntrip_log(st, LOG_NOTICE, "failed request on %s, status_code %d", st->uri, st->status_code);
+					end = 1;
+				} else if (st->chunk_state == CHUNK_INIT && ntrip_chunk_decode_init(st) < 0) {
 					end = 1;
 				} else if (strlen(st->mountpoint)) {
 					ntrip_set_state(st, NTRIP_REGISTER_SOURCE);
@@ -246,6 +252,9 @@ void ntripcli_readcb(struct bufferevent *bev, void *arg) {
 					break;
 				}
 
+				if (st->task && st->task->header_cb)
+					st->task->header_cb(st->task->header_cb_arg, key, value, st->task->cb_arg2);
+
 				if (!strcasecmp(key, "transfer-encoding")) {
 					if (!strcasecmp(value, "chunked"))
 						st->chunk_state = CHUNK_INIT;
@@ -17,6 +17,7 @@
 #include "file.h"
 #include "http.h"
 #include "jobs.h"
+#include "json_stream.h"
 #include "ntrip_common.h"
 #include "packet.h"
 #include "redistribute.h"
@@ -39,6 +40,7 @@ static struct httpcode httpcodes[] = {
 	{405, "Method Not Allowed"},
 	{409, "Conflict"},
 	{413, "Content Too Large"},
+	{415, "Unsupported Media Type"},
 	{431, "Request Header Fields Too Large"},
 	{500, "Internal Server Error"},
 	{501, "Not Implemented"},
@@ -102,12 +104,7 @@ send_server_reply(struct ntrip_state *this, struct evbuffer *ev,
 }
 
 static int ntripsrv_send_sourcetable(struct ntrip_state *this, struct evbuffer *output) {
-	struct sourcetable *sourcetable = stack_flatten(this->caster, &this->caster->sourcetablestack);
-	if (sourcetable == NULL)
-		return 503;
-
-	struct mime_content *m = sourcetable_get(sourcetable);
-	sourcetable_decref(sourcetable);
+	struct mime_content *m = stack_sourcetable_get(this->caster, &this->caster->sourcetablestack);
 	if (m == NULL)
 		return 503;
 
@@ -165,7 +162,7 @@ void ntripsrv_deferred_output(
 	/* Check for NTRIP_END, as we should never get back from this state */
 	if (ntrip_get_state(st) != NTRIP_END) {
 		struct evbuffer *output = bufferevent_get_output(st->bev);
-		send_server_reply(st, output, req->status, NULL, NULL, m);
+		send_server_reply(st, output, req->status, req->headers, NULL, m);
 
 		if (st->connection_keepalive && st->received_keepalive)
 			ntrip_set_state(st, NTRIP_WAIT_HTTP_METHOD);
@@ -178,6 +175,55 @@ void ntripsrv_deferred_output(
 		request_free(req);
 }
 
+/*
+ * Stream a Json reply from req->stream_cb, without any lock held, on the provided ntrip_state.
+ *
+ * The reply uses HTTP chunked encoding if the client supports it,
+ * otherwise its end is marked by closing the connection.
+ *
+ * content_cb is unused, for compatibility with joblist_append_ntrip_unlocked_content().
+ */
+void ntripsrv_deferred_stream(
+	struct ntrip_state *st,
+	struct mime_content *(*content_cb)(struct caster_state *caster, struct request *req),
+	struct request *req) {
+	struct json_stream js;
+	struct evkeyvalq headers;
+
+	bufferevent_lock(st->bev);
+	if (ntrip_get_state(st) == NTRIP_END || json_stream_init(&js, st, req->chunked) < 0) {
+		bufferevent_unlock(st->bev);
+		request_free(req);
+		return;
+	}
+	if (!req->chunked)
+		st->connection_keepalive = 0;
+	TAILQ_INIT(&headers);
+	if (req->chunked)
+		evhttp_add_header(&headers, "Transfer-Encoding", "chunked");
+	ntripsrv_send_stream_result_ok(st, bufferevent_get_output(st->bev), "application/json", &headers);
+	evhttp_clear_headers(&headers);
+	bufferevent_unlock(st->bev);
+
+	req->stream_cb(st->caster, req, &js);
+	int r = json_stream_end(&js);
+	json_stream_free(&js);
+
+	bufferevent_lock(st->bev);
+	if (ntrip_get_state(st) != NTRIP_END) {
+		if (r < 0) {
+			/* Client too slow, or out of memory: the reply is incomplete */
+			ntrip_log(st, LOG_NOTICE, "Json reply incomplete, closing");
+			ntrip_decref_end(st, "ntripsrv_deferred_stream");
+		} else if (req->chunked && st->connection_keepalive && st->received_keepalive)
+			ntrip_set_state(st, NTRIP_WAIT_HTTP_METHOD);
+		else
+			ntrip_set_state(st, NTRIP_WAIT_CLOSE);
+	}
+	bufferevent_unlock(st->bev);
+	request_free(req);
+}
+
 /*
  * Check password in the base
  *
@@ -261,36 +307,36 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 	struct timeval t0, t1;
 	gettimeofday(&t0, NULL);
 
-	struct sourcetable *pos_sourcetable = stack_flatten_dist(st->caster, &st->caster->sourcetablestack, &st->last_pos, st->lookup_dist);
-	if (pos_sourcetable == NULL)
-		return;
+	/*
+	 * Get the nearest bases from the spatial index of each table in the stack,
+	 * enough to adapt the lookup distance and display the 10 closest.
+	 */
+	int target = st->config->nearest_base_count_target;
+	if (target > NEAREST_MAX_RESULTS)
+		target = NEAREST_MAX_RESULTS;
+	int k = target > 10 ? target : 10;
+	struct spos nearest[k];
+	int ntotal;
+	int n = stack_find_nearest(st->caster, &st->caster->sourcetablestack, &st->last_pos, st->lookup_dist, nearest, k, &ntotal);
+	struct dist_table s = { st->last_pos, nearest, n, NULL, 0 };
 
 	gettimeofday(&t1, NULL);
 	timersub(&t1, &t0, &t1);
-	ntrip_log(st, LOG_EDEBUG, "stack_flatten_dist %.3f ms", t1.tv_sec*1000+t1.tv_usec/1000.);
-
-	struct dist_table *s = sourcetable_find_pos(pos_sourcetable, &st->last_pos);
-	if (s == NULL) {
-		sourcetable_decref(pos_sourcetable);
-		return;
-	}
+	ntrip_log(st, LOG_EDEBUG, "stack_find_nearest %.3f ms", t1.tv_sec*1000+t1.tv_usec/1000.);
 
 	float last_lookup_dist = st->lookup_dist;
 
-	if (st->config->nearest_base_count_target > 0) {
-		if (s->size_dist_array < st->config->nearest_base_count_target) {
+	if (target > 0) {
+		if (ntotal < target) {
 			st->lookup_dist *= 2;
 			if (st->lookup_dist > st->config->max_nearest_lookup_distance_m)
 				st->lookup_dist = st->config->max_nearest_lookup_distance_m;
 		} else
-			st->lookup_dist = s->dist_array[st->config->nearest_base_count_target-1].dist + 1000;
+			st->lookup_dist = nearest[target-1].dist + 1000;
 	}
 
-	if (s->size_dist_array == 0) {
-		dist_table_free(s);
-		sourcetable_decref(pos_sourcetable);
+	if (n == 0)
 		return;
-	}
 
 	st->last_recompute_pos = st->last_pos;
 	st->last_recompute_date = t0;
@@ -298,16 +344,16 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 	gettimeofday(&t1, NULL);
 	timersub(&t1, &t0, &t1);
 
-	ntrip_log(st, LOG_DEBUG, "GGAOK pos (%f, %f) list of %d lookup dist %.3f km, %.3f ms", st->last_pos.lat, st->last_pos.lon, s->size_dist_array, last_lookup_dist/1000, t1.tv_sec*1000+t1.tv_usec/1000.);
-	dist_table_display(st, s, 10);
+	ntrip_log(st, LOG_DEBUG, "GGAOK pos (%f, %f) list of %d lookup dist %.3f km, %.3f ms", st->last_pos.lat, st->last_pos.lon, ntotal, last_lookup_dist/1000, t1.tv_sec*1000+t1.tv_usec/1000.);
+	dist_table_display(st, &s, 10);
 
-	if (s->dist_array[0].dist > st->max_min_dist) {
-		st->max_min_dist = s->dist_array[0].dist;
+	if (nearest[0].dist > st->max_min_dist) {
+		st->max_min_dist = nearest[0].dist;
 		ntrip_log(st, LOG_DEBUG, "New maximum distance to source: %.2f", st->max_min_dist);
 	} else
 		ntrip_log(st, LOG_DEBUG, "Current maximum distance to source: %.2f", st->max_min_dist);
 
-	char *m = s->dist_array[0].mountpoint;
+	char *m = nearest[0].mountpoint;
 
 	int current_livesource_live = 0;
 	if (st->virtual_mountpoint)
@@ -325,13 +371,13 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 
 		float current_dist = st->virtual_mountpoint ? (distance(&st->mountpoint_pos, &st->last_pos)-st->config->hysteresis_m) : 1e10;
 
-		if (current_livesource_live && current_dist < s->dist_array[0].dist) {
+		if (current_livesource_live && current_dist < nearest[0].dist) {
 			ntrip_log(st, LOG_DEBUG, "Virtual source ignoring switch from %s to %s due to %.2f hysteresis", st->virtual_mountpoint, m, st->config->hysteresis_m);
 		} else {
 			enum livesource_state source_state;
-			struct livesource *l = livesource_find_on_demand(st->caster, st, m, &s->dist_array[0].pos, 1, s->dist_array[0].on_demand, &source_state);
+			struct livesource *l = livesource_find_on_demand(st->caster, st, m, &nearest[0].pos, 1, nearest[0].on_demand, &source_state);
 			if (l) {
-				if (source_state == LIVESOURCE_RUNNING || (s->dist_array[0].on_demand && source_state == LIVESOURCE_FETCH_PENDING)) {
+				if (source_state == LIVESOURCE_RUNNING || (nearest[0].on_demand && source_state == LIVESOURCE_FETCH_PENDING)) {
 					struct packet *packet_pos = ntrip_get_rtcm_pos(st, m);
 					if (packet_pos) {
 						atomic_store(&st->rtcm_client_state, NTRIP_RTCM_POS_OK);
@@ -339,7 +385,7 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 						packet_decref(packet_pos);
 					} else
 						atomic_store(&st->rtcm_client_state, NTRIP_RTCM_POS_WAIT);
-					st->tmp_pos = s->dist_array[0].pos;
+					st->tmp_pos = nearest[0].pos;
 					joblist_append_ntrip_livesource(st->caster->joblist, redistribute_switch_source, st, l, NULL);
 				}
 				livesource_decref(l);
@@ -347,8 +393,7 @@ void ntripsrv_redo_virtual_pos(struct ntrip_state *st) {
 		}
 	}
 
-	sourcetable_decref(pos_sourcetable);
-	dist_table_free(s);
+	spos_release(nearest, n);
 }
 
 static int _handle_forwarded_header(struct ntrip_state *st, struct config *config, char *value) {
@@ -592,8 +637,10 @@ void ntripsrv_readcb(struct bufferevent *bev, void *arg) {
 					int subscribe_ok = 0;
 
 					if (*mountpoint) {
-						if (config->dyn->rtcm_filter && rtcm_filter_check_mountpoint(config->dyn, mountpoint))
-							atomic_store(&st->use_rtcm_filter, 1);
+						/* Resolve the filter now, subscribers keep a reference to it */
+						if (st->rtcm_filter)
+							rtcm_filter_decref(st->rtcm_filter);
+						st->rtcm_filter = rtcm_filter_lookup(config->dyn, mountpoint, st->user);
 						/*
 						 * Find both a relevant source line and a live source (actually live or on-demand).
 						 */
@@ -19,6 +19,10 @@ void ntripsrv_deferred_output(
 	struct ntrip_state *st,
 	struct mime_content *(*content_cb)(struct caster_state *caster, struct request *req),
 	struct request *req);
+void ntripsrv_deferred_stream(
+	struct ntrip_state *st,
+	struct mime_content *(*content_cb)(struct caster_state *caster, struct request *req),
+	struct request *req);
 int check_password(struct ntrip_state *this, const char *mountpoint, const char *user, const char *passwd);
 
 void ntripsrv_readcb(struct bufferevent *bev, void *arg);
@@ -4,14 +4,327 @@
 #include "packet.h"
 #include "ntrip_common.h"
 
+/*
+ * Packet pools.
+ *
+ * Packets are allocated from size classes, the largest one fitting
+ * a maximum-size RTCM frame. Each thread keeps a small cache of free
+ * packets per class; the overflow is moved in batches to a global
+ * free list shared by all threads, from which caches are refilled.
+ *
+ * This matters because packets are usually allocated in the thread
+ * reading a source and released in the threads sending to subscribers.
+ */
+#define	PACKET_POOL_NCLASSES	3
+#define	PACKET_POOL_LOCAL_MAX	64	// max cached packets per thread and class
+#define	PACKET_POOL_BATCH	32	// packets moved at once to/from the global list
+#define	PACKET_POOL_GLOBAL_MAX	4096	// max packets in a global list, the rest is freed
+
+static const size_t packet_pool_size[PACKET_POOL_NCLASSES] = {64, 256, 1029};
+
+/* Free packets are linked through their own storage */
+struct packet_free {
+	struct packet_free *next;
+};
+
+struct packet_pool_local {
+	struct packet_free *head;
+	int n;
+};
+
+struct packet_pool {
+	P_MUTEX_T lock;
+	struct packet_free *head;
+	int n;
+
+	_Atomic unsigned long long local_hits;	// allocated from the thread cache
+	_Atomic unsigned long long global_hits;	// allocated after a refill from the global list
+	_Atomic unsigned long long misses;	// allocated with malloc()
+	_Atomic unsigned long long released;	// returned to malloc()
+};
+
+static _Thread_local struct packet_pool_local packet_pool_local[PACKET_POOL_NCLASSES];
+
+/* Thread-exit destructor to flush the thread caches, set on first use */
+static pthread_key_t packet_pool_key;
+static pthread_once_t packet_pool_once = PTHREAD_ONCE_INIT;
+static _Thread_local int packet_pool_registered;
+
+static struct packet_pool packet_pool[PACKET_POOL_NCLASSES] = {
+	{.lock = PTHREAD_MUTEX_INITIALIZER},
+	{.lock = PTHREAD_MUTEX_INITIALIZER},
+	{.lock = PTHREAD_MUTEX_INITIALIZER}
+};
+
+/* Packets too large for any class */
+static _Atomic unsigned long long packet_oversize;
+
+static inline int packet_pool_class(size_t len) {
+	for (int i = 0; i < PACKET_POOL_NCLASSES; i++)
+		if (len <= packet_pool_size[i])
+			return i;
+	return -1;
+}
+
+/*
+ * Refill the thread cache from the global list.
+ */
+static void packet_pool_refill(int class) {
+	struct packet_pool *pool = &packet_pool[class];
+	struct packet_pool_local *local = &packet_pool_local[class];
+
+	P_MUTEX_LOCK(&pool->lock);
+	struct packet_free *first = pool->head, *last = NULL;
+	int n = 0;
+	for (struct packet_free *f = first; f != NULL && n < PACKET_POOL_BATCH; f = f->next) {
+		last = f;
+		n++;
+	}
+	if (n) {
+		pool->head = last->next;
+		pool->n -= n;
+	}
+	P_MUTEX_UNLOCK(&pool->lock);
+
+	if (n) {
+		last->next = local->head;
+		local->head = first;
+		local->n += n;
+	}
+}
+
+/*
+ * Move a batch from a full thread cache to the global list,
+ * or back to malloc() if the global list is full.
+ */
+static void packet_pool_spill(int class) {
+	struct packet_pool *pool = &packet_pool[class];
+	struct packet_pool_local *local = &packet_pool_local[class];
+
+	struct packet_free *first = local->head, *last = first;
+	for (int n = 1; n < PACKET_POOL_BATCH; n++)
+		last = last->next;
+	local->head = last->next;
+	local->n -= PACKET_POOL_BATCH;
+
+	P_MUTEX_LOCK(&pool->lock);
+	if (pool->n < PACKET_POOL_GLOBAL_MAX) {
+		last->next = pool->head;
+		pool->head = first;
+		pool->n += PACKET_POOL_BATCH;
+		first = NULL;
+	}
+	P_MUTEX_UNLOCK(&pool->lock);
+
+	if (first != NULL) {
+		last->next = NULL;
+		while (first) {
+			struct packet_free *next = first->next;
+			free(first);
+			first = next;
+		}
+		atomic_fetch_add_explicit(&pool->released, PACKET_POOL_BATCH, memory_order_relaxed);
+	}
+}
+
+/*
+ * Thread exit: move all cached packets to the global lists,
+ * or back to malloc() beyond their maximum size.
+ */
+static void packet_pool_thread_free(void *arg) {
+	struct packet_pool_local *locals = (struct packet_pool_local *)arg;
+	for (int class = 0; class < PACKET_POOL_NCLASSES; class++) {
+		struct packet_pool *pool = &packet_pool[class];
+		struct packet_pool_local *local = &locals[class];
+		int released = 0;
+
+		P_MUTEX_LOCK(&pool->lock);
+		while (local->head) {
+			struct packet_free *f = local->head;
+			local->head = f->next;
+			if (pool->n < PACKET_POOL_GLOBAL_MAX) {
+				f->next = pool->head;
+				pool->head = f;
+				pool->n++;
+			} else {
+				free(f);
+				released++;
+			}
+		}
+		local->n = 0;
+		P_MUTEX_UNLOCK(&pool->lock);
+		if (released)
+			atomic_fetch_add_explicit(&pool->released, released, memory_order_relaxed);
+	}
+	/* Register again if packets are freed by a later destructor */
+	packet_pool_registered = 0;
+}
+
+static void packet_pool_key_create(void) {
+	pthread_key_create(&packet_pool_key, packet_pool_thread_free);
+}
+
+/*
+ * Arrange for the thread caches to be flushed when the thread exits.
+ */
+static inline void packet_pool_register(void) {
+	if (packet_pool_registered)
+		return;
+	pthread_once(&packet_pool_once, packet_pool_key_create);
+	pthread_setspecific(packet_pool_key, packet_pool_local);
+	packet_pool_registered = 1;
+}
+
 struct packet *packet_new(size_t len_raw) {
-	struct packet *this = (struct packet *)malloc(sizeof(struct packet) + len_raw);
+	struct packet *this;
+	int class = packet_pool_class(len_raw);
+
+	if (class < 0) {
+		this = (struct packet *)malloc(sizeof(struct packet) + len_raw);
+		if (this == NULL)
+			return NULL;
+		atomic_fetch_add_explicit(&packet_oversize, 1, memory_order_relaxed);
+	} else {
+		struct packet_pool_local *local = &packet_pool_local[class];
+		struct packet_pool *pool = &packet_pool[class];
+		if (local->head != NULL)
+			atomic_fetch_add_explicit(&pool->local_hits, 1, memory_order_relaxed);
+		else {
+			packet_pool_register();
+			packet_pool_refill(class);
+			if (local->head != NULL)
+				atomic_fetch_add_explicit(&pool->global_hits, 1, memory_order_relaxed);
+		}
+		if (local->head != NULL) {
+			this = (struct packet *)local->head;
+			local->head = local->head->next;
+			local->n--;
+		} else {
+			this = (struct packet *)malloc(sizeof(struct packet) + packet_pool_size[class]);
+			if (this == NULL)
+				return NULL;
+			atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+		}
+	}
 	this->datalen = len_raw;
+	this->pool = class;
+	atomic_init(&this->conv, NULL);
 	atomic_init(&this->refcnt, 1);
 	this->is_rtcm = 0;
 	return this;
 }
 
+/*
+ * Release a packet, called when the last reference is dropped.
+ */
+void packet_free(struct packet *this) {
+	struct packet_conv *c = atomic_load_explicit(&this->conv, memory_order_acquire);
+	while (c) {
+		struct packet_conv *next = c->next;
+		if (c->packet)
+			packet_decref(c->packet);
+		free(c);
+		c = next;
+	}
+
+	int class = this->pool;
+	if (class < 0) {
+		free((void *)this);
+		return;
+	}
+	struct packet_pool_local *local = &packet_pool_local[class];
+	packet_pool_register();
+	if (local->n == PACKET_POOL_LOCAL_MAX)
+		packet_pool_spill(class);
+	struct packet_free *f = (struct packet_free *)this;
+	f->next = local->head;
+	local->head = f;
+	local->n++;
+}
+
+/*
+ * Find a cached conversion of a packet for a filter.
+ */
+struct packet_conv *packet_conv_find(struct packet *this, unsigned long long filter_id) {
+	for (struct packet_conv *c = atomic_load_explicit(&this->conv, memory_order_acquire); c; c = c->next)
+		if (c->filter_id == filter_id)
+			return c;
+	return NULL;
+}
+
+/*
+ * Cache a conversion of a packet for a filter, taking over the reference on conv.
+ *
+ * Entries are only added, without a lock, until the packet is freed.
+ * If another thread cached a conversion for the same filter first,
+ * ours is dropped.
+ *
+ * Return the cached converted packet, valid as long as the original packet.
+ */
+struct packet *packet_conv_add(struct packet *this, unsigned long long filter_id, struct packet *conv) {
+	struct packet_conv *c = (struct packet_conv *)malloc(sizeof(struct packet_conv));
+	if (c == NULL) {
+		/* Can't cache: the caller gets nothing to send */
+		if (conv)
+			packet_decref(conv);
+		return NULL;
+	}
+	c->filter_id = filter_id;
+	c->packet = conv;
+	c->next = atomic_load_explicit(&this->conv, memory_order_acquire);
+	while (1) {
+		for (struct packet_conv *o = c->next; o; o = o->next)
+			if (o->filter_id == filter_id) {
+				if (conv)
+					packet_decref(conv);
+				free(c);
+				return o->packet;
+			}
+		if (atomic_compare_exchange_weak_explicit(&this->conv, &c->next, c, memory_order_acq_rel, memory_order_acquire))
+			return conv;
+	}
+}
+
+/*
+ * Return pool statistics as a JSON object.
+ */
+json_object *packet_pool_json(void) {
+	json_object *j = json_object_new_object();
+	json_object *jclasses = json_object_new_array_ext(PACKET_POOL_NCLASSES);
+	unsigned long long total_hits = 0, total_allocs = 0;
+
+	for (int i = 0; i < PACKET_POOL_NCLASSES; i++) {
+		struct packet_pool *pool = &packet_pool[i];
+		unsigned long long local_hits = atomic_load_explicit(&pool->local_hits, memory_order_relaxed);
+		unsigned long long global_hits = atomic_load_explicit(&pool->global_hits, memory_order_relaxed);
+		unsigned long long misses = atomic_load_explicit(&pool->misses, memory_order_relaxed);
+		unsigned long long allocs = local_hits + global_hits + misses;
+		P_MUTEX_LOCK(&pool->lock);
+		int n = pool->n;
+		P_MUTEX_UNLOCK(&pool->lock);
+
+		json_object *jc = json_object_new_object();
+		json_object_object_add_ex(jc, "size", json_object_new_int64(packet_pool_size[i]), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jc, "local_hits", json_object_new_uint64(local_hits), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jc, "global_hits", json_object_new_uint64(global_hits), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jc, "misses", json_object_new_uint64(misses), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jc, "released", json_object_new_uint64(atomic_load_explicit(&pool->released, memory_order_relaxed)), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jc, "global_free", json_object_new_int(n), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jc, "hit_rate", json_object_new_double(allocs ? (double)(local_hits + global_hits)/allocs : 0.), JSON_C_CONSTANT_NEW);
+		json_object_array_add(jclasses, jc);
+
+		total_hits += local_hits + global_hits;
+		total_allocs += allocs;
+	}
+	unsigned long long oversize = atomic_load_explicit(&packet_oversize, memory_order_relaxed);
+	total_allocs += oversize;
+
+	json_object_object_add_ex(j, "classes", jclasses, JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "oversize", json_object_new_uint64(oversize), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "hit_rate", json_object_new_double(total_allocs ? (double)total_hits/total_allocs : 0.), JSON_C_CONSTANT_NEW);
+	return j;
+}
+
 /*
  * Create packet with a copy of a null-terminated string.
  */
@@ -25,6 +338,27 @@ struct packet *packet_new_from_string(const char *s) {
 	return p;
 }
 
+/*
+ * Create a packet with the concatenated contents of a list of packets.
+ * NULL entries are skipped.
+ */
+struct packet *packet_new_concat(struct packet **packets, int npackets) {
+	size_t len = 0;
+	for (int i = 0; i < npackets; i++)
+		if (packets[i])
+			len += packets[i]->datalen;
+	struct packet *p = packet_new(len);
+	if (p == NULL)
+		return NULL;
+	unsigned char *data = p->data;
+	for (int i = 0; i < npackets; i++)
+		if (packets[i]) {
+			memcpy(data, packets[i]->data, packets[i]->datalen);
+			data += packets[i]->datalen;
+		}
+	return p;
+}
+
 /*
  * Packet freeing callback
  */
@@ -4,10 +4,21 @@
 #include <assert.h>
 #include <stdatomic.h>
 
+#include <json-c/json_object.h>
+
 #include "conf.h"
 
 struct ntrip_state;
 
+/*
+ * Conversion of a packet cached for a RTCM filter.
+ */
+struct packet_conv {
+	unsigned long long filter_id;
+	struct packet *packet;		// converted packet, NULL if dropped by the filter
+	struct packet_conv *next;
+};
+
 /*
  * A raw packet.
  * Variable-length structure, varies according to packet size.
@@ -15,6 +26,8 @@ struct ntrip_state;
 struct packet {
 	_Atomic int refcnt;
 	int is_rtcm;		// Checked to be a valid RTCM packet
+	int pool;		// pool size class, -1 if allocated with malloc()
+	_Atomic(struct packet_conv *) conv;	// cached conversions, by filter
 	size_t datalen;
 	unsigned char data[];
 };
@@ -22,6 +35,11 @@ struct packet {
 struct caster_state;
 struct packet *packet_new(size_t len_raw);
 struct packet *packet_new_from_string(const char *s);
+struct packet *packet_new_concat(struct packet **packets, int npackets);
+void packet_free(struct packet *packet);
+struct packet_conv *packet_conv_find(struct packet *this, unsigned long long filter_id);
+struct packet *packet_conv_add(struct packet *this, unsigned long long filter_id, struct packet *conv);
+json_object *packet_pool_json(void);
 int packet_send(struct packet *packet, struct ntrip_state *st, time_t t);
 
 static inline void packet_incref(struct packet *packet) {
@@ -29,10 +47,14 @@ static inline void packet_incref(struct packet *packet) {
 	atomic_fetch_add(&packet->refcnt, 1);
 }
 
+/*
+ * acq_rel: the thread releasing the last reference must see all writes
+ * (conversions cached by other threads) before recycling the packet.
+ */
 static inline void packet_decref(struct packet *packet) {
 	assert(packet->refcnt > 0);
-	if (atomic_fetch_add_explicit(&packet->refcnt, -1, memory_order_relaxed) == 1)
-		free((void *)packet);
+	if (atomic_fetch_add_explicit(&packet->refcnt, -1, memory_order_acq_rel) == 1)
+		packet_free(packet);
 }
 
 #endif
@@ -1,5 +1,8 @@
 #include <stdlib.h>
+#include <sys/queue.h>
 
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
 #include <json-c/json_object.h>
 
 #include "request.h"
@@ -12,6 +15,9 @@ struct request *request_new() {
 		this->status = 200;
 		this->json = NULL;
 		this->st = NULL;
+		this->headers = NULL;
+		this->stream_cb = NULL;
+		this->chunked = 0;
 	}
 	return this;
 }
@@ -21,5 +27,22 @@ void request_free(struct request *this) {
 		json_object_put(this->json);
 	if (this->hash != NULL)
 		hash_table_free(this->hash);
+	if (this->headers != NULL) {
+		evhttp_clear_headers(this->headers);
+		free(this->headers);
+	}
 	free(this);
 }
+
+/*
+ * Add a header to the reply.
+ */
+int request_add_header(struct request *this, const char *key, const char *value) {
+	if (this->headers == NULL) {
+		this->headers = (struct evkeyvalq *)malloc(sizeof(struct evkeyvalq));
+		if (this->headers == NULL)
+			return -1;
+		TAILQ_INIT(this->headers);
+	}
+	return evhttp_add_header(this->headers, key, value);
+}
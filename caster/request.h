@@ -2,16 +2,24 @@
 #define __REQUEST_H__
 
 struct caster_state;
+struct evkeyvalq;
 struct json_object;
+struct json_stream;
 
 struct request {
 	struct ntrip_state *st;
 	struct hash_table *hash;
 	struct json_object *json;
 	unsigned short status;
+	struct evkeyvalq *headers;	// additional reply headers, if any
+
+	/* For replies streamed as Json instead of returned by a content callback */
+	void (*stream_cb)(struct caster_state *caster, struct request *req, struct json_stream *js);
+	int chunked;			// client accepts HTTP chunked encoding
 };
 
 struct request *request_new();
 void request_free(struct request *this);
+int request_add_header(struct request *this, const char *key, const char *value);
 
 #endif
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <event2/buffer.h>
@@ -182,9 +184,11 @@ static unsigned long crc24q[] = {
     0xFCD11CCE, 0xFD575035, 0xFE5BC9C3, 0xFFDD8538
 };
 
-/* Compute and return CRC24Q (RTCM) checksum on a byte string. */
-static unsigned long rtcm_crc24q_hash(unsigned char *data, size_t len) {
-	unsigned long crc = 0;
+/*
+ * Update a CRC24Q (RTCM) checksum with a byte string, to compute it in several steps.
+ * Bytewise version, kept as a reference for tests.
+ */
+unsigned long rtcm_crc24q_update_bytewise(unsigned long crc, const unsigned char *data, size_t len) {
 	for (int d = 0; d < len; d++) {
 		crc = (crc << 8) ^ crc24q[(data[d] ^ (crc>>16)) & 0xff];
 	}
@@ -193,6 +197,49 @@ static unsigned long rtcm_crc24q_hash(unsigned char *data, size_t len) {
 	return crc;
 }
 
+/*
+ * Slicing-by-8 tables: crc24q_slice[k][b] is the CRC of byte b followed
+ * by k zero bytes, left-aligned on 32 bits.
+ */
+static uint32_t crc24q_slice[8][256];
+static pthread_once_t crc24q_slice_once = PTHREAD_ONCE_INIT;
+
+static void rtcm_crc24q_slice_init(void) {
+	for (int b = 0; b < 256; b++)
+		crc24q_slice[0][b] = (crc24q[b] & 0xffffff) << 8;
+	for (int k = 1; k < 8; k++)
+		for (int b = 0; b < 256; b++) {
+			uint32_t c = crc24q_slice[k-1][b];
+			crc24q_slice[k][b] = (c << 8) ^ crc24q_slice[0][c >> 24];
+		}
+}
+
+/*
+ * Update a CRC24Q (RTCM) checksum with a byte string, to compute it in several steps.
+ * Slicing-by-8 version: processes 8 bytes per iteration with independent table lookups.
+ */
+unsigned long rtcm_crc24q_update(unsigned long crc, const unsigned char *data, size_t len) {
+	pthread_once(&crc24q_slice_once, rtcm_crc24q_slice_init);
+
+	uint32_t c = (crc & 0xffffff) << 8;
+	const uint32_t (*t)[256] = crc24q_slice;
+
+	for (; len >= 8; data += 8, len -= 8) {
+		uint32_t w = c ^ ((uint32_t)data[0]<<24 | (uint32_t)data[1]<<16 | (uint32_t)data[2]<<8 | data[3]);
+		c = t[7][w >> 24] ^ t[6][(w >> 16) & 0xff] ^ t[5][(w >> 8) & 0xff] ^ t[4][w & 0xff]
+			^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+	}
+	for (; len; data++, len--)
+		c = (c << 8) ^ t[0][(c >> 24) ^ *data];
+
+	return c >> 8;
+}
+
+/* Compute and return CRC24Q (RTCM) checksum on a byte string. */
+unsigned long rtcm_crc24q_hash(const unsigned char *data, size_t len) {
+	return rtcm_crc24q_update(0, data, len);
+}
+
 int rtcm_crc_check(struct packet *p) {
 	int len = p->datalen;
 	if (len < 4)
@@ -596,6 +643,26 @@ struct packet *rtcm_filter_convert(struct rtcm_filter *this, struct ntrip_state
 	return p;
 }
 
+/*
+ * Return the packet to send through a filter: the packet itself if it passes,
+ * its conversion if any, or NULL if it is dropped.
+ *
+ * Conversions are cached on the packet, so they are computed once
+ * per packet and filter, whatever the number of subscribers and threads.
+ * The returned packet is valid as long as the original packet.
+ */
+struct packet *rtcm_filter_packet(struct rtcm_filter *this, struct ntrip_state *st, struct packet *packet) {
+	if (rtcm_filter_pass(this, packet))
+		return packet;
+	if (!packet->is_rtcm || !rtcm_typeset_check(&this->convert, rtcm_get_type(packet)))
+		return NULL;
+
+	struct packet_conv *c = packet_conv_find(packet, this->id);
+	if (c != NULL)
+		return c->packet;
+	return packet_conv_add(packet, this->id, rtcm_filter_convert(this, st, packet));
+}
+
 /*
  * rtcm_info routines
  */
@@ -638,7 +705,7 @@ struct packet *rtcm_info_pos_packet(struct rtcm_info *this, struct caster_state
 }
 
 /*
- * Return a comma-separated list of keys in a hash table.
+ * Parse a comma-separated list of keys into a hash table, pointing to the filter.
  * Trim leading and trailing white space in keys.
  */
 struct hash_table *rtcm_filter_dict_parse(struct rtcm_filter *this, const char *apply) {
@@ -647,7 +714,7 @@ struct hash_table *rtcm_filter_dict_parse(struct rtcm_filter *this, const char *
 	char *dupkey;
 	int err = 0;
 
-	struct hash_table *h = hash_table_new(5, NULL);
+	struct hash_table *h = hash_table_new(5, hash_table_free_null);
 	if (h == NULL)
 		return NULL;
 
@@ -673,7 +740,7 @@ struct hash_table *rtcm_filter_dict_parse(struct rtcm_filter *this, const char *
 		}
 		memcpy(dupkey, key, len);
 		dupkey[len] = '\0';
-		int e = hash_table_add(h, dupkey, NULL);
+		int e = hash_table_add(h, dupkey, this);
 		strfree(dupkey);
 		if (e == -2) {
 			/* Out of memory */
@@ -690,33 +757,60 @@ struct hash_table *rtcm_filter_dict_parse(struct rtcm_filter *this, const char *
 	return h;
 }
 
-void rtcm_filter_free(struct rtcm_filter *this) {
+static void rtcm_filter_free(struct rtcm_filter *this) {
+	strfree(this->name);
 	free(this);
 }
 
-struct rtcm_filter *rtcm_filter_new(const char *pass, const char *convert, enum rtcm_conversion conversion) {
+void rtcm_filter_incref(struct rtcm_filter *this) {
+	atomic_fetch_add(&this->refcnt, 1);
+}
+
+void rtcm_filter_decref(struct rtcm_filter *this) {
+	if (atomic_fetch_add_explicit(&this->refcnt, -1, memory_order_relaxed) == 1)
+		rtcm_filter_free(this);
+}
+
+struct rtcm_filter *rtcm_filter_new(const char *name, const char *pass, const char *convert, enum rtcm_conversion conversion) {
+	static _Atomic unsigned long long last_id;
 	struct rtcm_filter *this = (struct rtcm_filter *)malloc(sizeof(struct rtcm_filter));
 	if (this == NULL)
 		return NULL;
 
+	this->name = NULL;
 	int r = rtcm_typeset_parse(&this->pass, pass);
 	if (r >=0 && convert)
 		r = rtcm_typeset_parse(&this->convert, convert);
 	else
 		rtcm_typeset_init(&this->convert);
+	if (r >= 0 && name) {
+		this->name = mystrdup(name);
+		if (this->name == NULL)
+			r = -1;
+	}
 	if (r < 0) {
 		rtcm_filter_free(this);
 		return NULL;
 	}
 	this->conversion = conversion;
+	this->id = atomic_fetch_add(&last_id, 1) + 1;
+	atomic_init(&this->refcnt, 1);
 	return this;
 }
 
 /*
- * Return whether a mountpoint has a filter.
+ * Find the filter for a client, by user first, then by mountpoint.
+ * Return a new reference, or NULL if no filter applies.
  */
-int rtcm_filter_check_mountpoint(struct caster_dynconfig *dyn, const char *mountpoint) {
-	return hash_table_get_element(dyn->rtcm_filter_dict, mountpoint) != NULL;
+struct rtcm_filter *rtcm_filter_lookup(struct caster_dynconfig *dyn, const char *mountpoint, const char *user) {
+	struct rtcm_filter *filter = NULL;
+	if (user && dyn->rtcm_filter_user_dict)
+		filter = (struct rtcm_filter *)hash_table_get(dyn->rtcm_filter_user_dict, user);
+	if (filter == NULL && mountpoint && dyn->rtcm_filter_dict)
+		filter = (struct rtcm_filter *)hash_table_get(dyn->rtcm_filter_dict, mountpoint);
+	if (filter)
+		rtcm_filter_incref(filter);
+	return filter;
 }
 
 /*
@@ -794,75 +888,170 @@ static void rtcm_handler(struct ntrip_state *st, struct packet *p, void *arg1) {
 		joblist_append_ntrip_packet(st->caster->joblist, rtcm_handler_pos, st, p, st->rtcm_info);
 }
 
+/* Max number of buffer extents scanned in place before falling back to a pullup */
+#define	RTCM_NVEC	8
+
+/*
+ * Look for a RTCM preamble in the input buffer, without copying.
+ *
+ * Return 1 and its offset in *pos if found, otherwise 0 and in *pos the
+ * number of bytes scanned, which can't contain a preamble.
+ */
+static int rtcm_find_preamble(struct evbuffer *input, size_t *pos) {
+	struct evbuffer_iovec vec[RTCM_NVEC];
+	int n = evbuffer_peek(input, -1, NULL, vec, RTCM_NVEC);
+	size_t offset = 0;
+
+	if (n > RTCM_NVEC)
+		n = RTCM_NVEC;
+	for (int i = 0; i < n; i++) {
+		unsigned char *preamble = memchr(vec[i].iov_base, 0xd3, vec[i].iov_len);
+		if (preamble != NULL) {
+			*pos = offset + (preamble - (unsigned char *)vec[i].iov_base);
+			return 1;
+		}
+		offset += vec[i].iov_len;
+	}
+	*pos = offset;
+	return 0;
+}
+
+/*
+ * Check the CRC of a RTCM frame of length len at the start of the input buffer.
+ *
+ * The CRC is computed in place across the buffer extents, so that
+ * the frame is only copied once, to its packet.
+ */
+static int rtcm_frame_crc_check(struct evbuffer *input, size_t len) {
+	struct evbuffer_iovec vec[RTCM_NVEC];
+	int n = evbuffer_peek(input, len, NULL, vec, RTCM_NVEC);
+
+	if (n > RTCM_NVEC) {
+		/* Too fragmented, make it contiguous */
+		vec[0].iov_base = evbuffer_pullup(input, len);
+		vec[0].iov_len = len;
+		n = 1;
+	}
+
+	unsigned long crc = 0;
+	unsigned char packet_crc[3];
+	size_t ncrc = len - 3;		// bytes left to checksum
+	size_t left = len;		// bytes left in the frame
+	for (int i = 0; i < n && left; i++) {
+		unsigned char *data = (unsigned char *)vec[i].iov_base;
+		size_t vlen = vec[i].iov_len < left ? vec[i].iov_len : left;
+		size_t clen = vlen < ncrc ? vlen : ncrc;
+		crc = rtcm_crc24q_update(crc, data, clen);
+		ncrc -= clen;
+		/* Collect the trailing CRC bytes, possibly across extents */
+		for (size_t j = clen; j < vlen; j++)
+			packet_crc[3 - (left - j)] = data[j];
+		left -= vlen;
+	}
+	return crc == (packet_crc[0]<<16) + (packet_crc[1]<<8) + packet_crc[2];
+}
+
+/*
+ * Extract the next packet from an input buffer: either non-RTCM data
+ * up to the next RTCM preamble, or a full RTCM frame.
+ *
+ * Return the frame type, and the new packet in *packet if any.
+ */
+enum rtcm_frame rtcm_packet_extract(struct evbuffer *input, struct packet **packet) {
+	size_t len;
+	size_t max_len = evbuffer_get_length(input);
+	enum rtcm_frame r;
+
+	*packet = NULL;
+	if (max_len == 0)
+		return RTCM_FRAME_NEED_MORE;
+
+	if (!rtcm_find_preamble(input, &len) || len) {
+		r = RTCM_FRAME_RAW;
+	} else {
+		unsigned char header[3];
+		if (evbuffer_copyout(input, header, 3) < 3)
+			return RTCM_FRAME_NEED_MORE;
+		/*
+		 * Compute RTCM length from packet header
+		 */
+		len = (header[1] & 3)*256 + header[2] + 6;
+		if (len > max_len)
+			return RTCM_FRAME_NEED_MORE;
+		r = rtcm_frame_crc_check(input, len) ? RTCM_FRAME_RTCM : RTCM_FRAME_BAD_CRC;
+	}
+
+	struct packet *p = packet_new(len);
+	if (p == NULL) {
+		evbuffer_drain(input, len);
+		return RTCM_FRAME_NOMEM;
+	}
+	evbuffer_remove(input, p->data, len);
+	p->is_rtcm = (r == RTCM_FRAME_RTCM);
+	*packet = p;
+	return r;
+}
+
+/*
+ * Send a batch of packets to the source subscribers and release them.
+ */
+static void rtcm_packet_flush(struct ntrip_state *st, struct packet **packets, int npackets) {
+	if (npackets == 0)
+		return;
+	if (livesource_send_subscribers(st->own_livesource, packets, npackets, st->caster))
+		st->last_useful = time(NULL);
+	for (int i = 0; i < npackets; i++)
+		packet_decref(packets[i]);
+}
+
 /*
  * Handle receipt and retransmission of all complete RTCM packets.
+ *
+ * The packets available in the input buffer are sent to subscribers
+ * in batches, typically a full epoch from the source at once.
+ *
  * Return 0 if more data is needed,
  *	1 if at least one packet has been processed.
  */
 int rtcm_packet_handle(struct ntrip_state *st) {
-	unsigned short len_rtcm;
-	struct evbuffer_ptr p;
 	struct evbuffer *input = st->input;
+	struct packet *packets[LIVESOURCE_BATCH_MAX];
+	int npackets = 0;
 	int r = 0;
 
 	while (1) {
-		/*
-		 * Look for 0xd3 header byte
-		 */
-		evbuffer_ptr_set(input, &p, 0, EVBUFFER_PTR_SET);
-		p = evbuffer_search(input, "\xd3", 1, &p);
-		int max_len = evbuffer_get_length(input);
-		int len = p.pos < 0 ? max_len : p.pos;
-		if (len) {
-			struct packet *not_rtcmp = packet_new(len);
-			evbuffer_remove(input, not_rtcmp->data, len);
-			st->received_bytes += len;
-			ntrip_log(st, LOG_INFO, "resending %zd bytes", len);
-			if (livesource_send_subscribers(st->own_livesource, not_rtcmp, st->caster))
-				st->last_useful = time(NULL);
-			r = 1;
-			packet_decref(not_rtcmp);
-			max_len -= len;
-		}
-		if (max_len == 0)
-			return r;
-
-		unsigned char *mem = evbuffer_pullup(input, 3);
-		if (mem == NULL) {
-			ntrip_log(st, LOG_DEBUG, "RTCM: not enough data, waiting");
-			return r;
-		}
-
-		/*
-		 * Compute RTCM length from packet header
-		 */
-		len_rtcm = (mem[1] & 3)*256 + mem[2] + 6;
-		if (len_rtcm > max_len) {
+		struct packet *p;
+		size_t len = evbuffer_get_length(input);
+		enum rtcm_frame frame = rtcm_packet_extract(input, &p);
+		st->received_bytes += len - evbuffer_get_length(input);
+
+		switch (frame) {
+		case RTCM_FRAME_NEED_MORE:
+			if (len)
+				ntrip_log(st, LOG_DEBUG, "RTCM: not enough data, waiting");
+			rtcm_packet_flush(st, packets, npackets);
 			return r;
-		}
-
-		struct packet *rtcmp = packet_new(len_rtcm);
-		st->received_bytes += len_rtcm;
-		if (rtcmp == NULL) {
-			evbuffer_drain(input, len_rtcm);
+		case RTCM_FRAME_NOMEM:
 			ntrip_log(st, LOG_CRIT, "RTCM: Not enough memory, dropping packet");
 			continue;
-		}
-
-		evbuffer_remove(input, &rtcmp->data[0], len_rtcm);
-
-		if (rtcm_crc_check(rtcmp)) {
-			rtcmp->is_rtcm = 1;
-			unsigned short type = rtcm_get_type(rtcmp);
-			ntrip_log(st, LOG_DEBUG, "RTCM source %s size %d type %d", st->mountpoint, len_rtcm, type);
-			//rtcm_packet_dump(st, rtcmp);
-			rtcm_handler(st, rtcmp, st->rtcm_info);
-		} else
+		case RTCM_FRAME_RAW:
+			ntrip_log(st, LOG_INFO, "resending %zd bytes", p->datalen);
+			break;
+		case RTCM_FRAME_RTCM:
+			ntrip_log(st, LOG_DEBUG, "RTCM source %s size %zd type %d", st->mountpoint, p->datalen, rtcm_get_type(p));
+			//rtcm_packet_dump(st, p);
+			rtcm_handler(st, p, st->rtcm_info);
+			break;
+		case RTCM_FRAME_BAD_CRC:
 			ntrip_log(st, LOG_INFO, "RTCM: bad checksum!");
+			break;
+		}
 
-		if (livesource_send_subscribers(st->own_livesource, rtcmp, st->caster))
-			st->last_useful = time(NULL);
-		packet_decref(rtcmp);
+		packets[npackets++] = p;
+		if (npackets == LIVESOURCE_BATCH_MAX) {
+			rtcm_packet_flush(st, packets, npackets);
+			npackets = 0;
+		}
 		r = 1;
 	}
 }
@@ -12,6 +12,7 @@
 
 struct ntrip_state;
 struct caster_dynconfig;
+struct evbuffer;
 
 #define	RTCM_1K_MIN	1000
 #define	RTCM_1K_MAX	1230
@@ -38,25 +39,45 @@ struct rtcm_info {
 	struct timeval date1005, date1006, posdate;
 };
 
+/*
+ * Result of RTCM framing on an input buffer
+ */
+enum rtcm_frame {
+	RTCM_FRAME_NEED_MORE,		// incomplete frame, no packet
+	RTCM_FRAME_RAW,			// non-RTCM data
+	RTCM_FRAME_RTCM,		// RTCM frame with a valid CRC
+	RTCM_FRAME_BAD_CRC,		// RTCM frame with a bad CRC
+	RTCM_FRAME_NOMEM		// frame dropped, out of memory
+};
+
 /*
  * RTCM filter description
  */
 struct rtcm_filter {
+	char *name;				// optional name, for logs
+	unsigned long long id;			// unique id, key for conversions cached on packets
 	struct rtcm_typeset pass;		// types to pass directly
 	struct rtcm_typeset convert;		// types to convert
 	enum rtcm_conversion conversion;	// type of conversion
+	_Atomic int refcnt;
 };
 
+unsigned long rtcm_crc24q_update_bytewise(unsigned long crc, const unsigned char *data, size_t len);
+unsigned long rtcm_crc24q_update(unsigned long crc, const unsigned char *data, size_t len);
+unsigned long rtcm_crc24q_hash(const unsigned char *data, size_t len);
 int rtcm_crc_check(struct packet *p);
+enum rtcm_frame rtcm_packet_extract(struct evbuffer *input, struct packet **packet);
 int rtcm_typeset_parse(struct rtcm_typeset *this, const char *typelist);
 char *rtcm_typeset_str(struct rtcm_typeset *this);
 struct packet *rtcm_convert_msm7(struct packet *p, int msm_version);
 struct hash_table *rtcm_filter_dict_parse(struct rtcm_filter *this, const char *apply);
-void rtcm_filter_free(struct rtcm_filter *this);
-struct rtcm_filter *rtcm_filter_new(const char *pass, const char *convert, enum rtcm_conversion conversion);
-int rtcm_filter_check_mountpoint(struct caster_dynconfig *dyn, const char *mountpoint);
+void rtcm_filter_incref(struct rtcm_filter *this);
+void rtcm_filter_decref(struct rtcm_filter *this);
+struct rtcm_filter *rtcm_filter_new(const char *name, const char *pass, const char *convert, enum rtcm_conversion conversion);
+struct rtcm_filter *rtcm_filter_lookup(struct caster_dynconfig *dyn, const char *mountpoint, const char *user);
 int rtcm_filter_pass(struct rtcm_filter *this, struct packet *packet);
 struct packet *rtcm_filter_convert(struct rtcm_filter *this, struct ntrip_state *st, struct packet *p);
+struct packet *rtcm_filter_packet(struct rtcm_filter *this, struct ntrip_state *st, struct packet *packet);
 struct rtcm_info *rtcm_info_new();
 void rtcm_info_free(struct rtcm_info *this);
 struct packet *rtcm_info_pos_packet(struct rtcm_info *this, struct caster_state *caster);
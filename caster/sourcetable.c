@@ -7,6 +7,7 @@
 #include <json-c/json_object.h>
 #include <json-c/json_object_iterator.h>
 
+#include "json_stream.h"
 #include "livesource.h"
 #include "log.h"
 #include "ntrip_common.h"
@@ -93,6 +94,8 @@ static struct sourcetable *sourcetable_from_json(json_object *j, struct caster_s
 
 	tmp_sourcetable->pullable = json_object_get_boolean(jpull);
 	tmp_sourcetable->priority = jprio?json_object_get_int(jprio):0;
+	json_object *jversion = json_object_object_get(j, "version");
+	tmp_sourcetable->version = jversion?json_object_get_int64(jversion):0;
 
 	struct json_object_iterator it;
 	struct json_object_iterator itEnd;
@@ -123,11 +126,13 @@ struct sourcetable *sourcetable_new(const char *host, unsigned short port, int t
 	char *duphost = (host == NULL) ? NULL : mystrdup(host);
 	char *header = mystrdup("");
 	struct hash_table *kv = hash_table_new(509, (void (*)(void *))sourceline_decref);
-	if ((host != NULL && duphost == NULL) || header == NULL || this == NULL || kv == NULL) {
+	struct geoindex *geoindex = geoindex_new();
+	if ((host != NULL && duphost == NULL) || header == NULL || this == NULL || kv == NULL || geoindex == NULL) {
 		strfree(duphost);
 		strfree(header);
 		free(this);
 		if (kv) hash_table_free(kv);
+		if (geoindex) geoindex_free(geoindex);
 		return NULL;
 	}
 
@@ -140,8 +145,14 @@ struct sourcetable *sourcetable_new(const char *host, unsigned short port, int t
 	this->local = 0;
 	this->priority = 0;
 	this->key_val = kv;
+	this->index = NULL;
+	this->index_size = 0;
+	this->index_sorted = 1;
+	this->geoindex = geoindex;
+	atomic_init(&this->body, NULL);
 	struct timeval t = { 0, 0 };
 	this->fetch_time = t;
+	this->version = 0;
 	this->nvirtual = 0;
 	this->tls = tls;
 	this->json_config = json_config;
@@ -159,6 +170,10 @@ static void sourcetable_free(struct sourcetable *this) {
 	strfree((char *)this->filename);
 
 	hash_table_free(this->key_val);
+	free(this->index);
+	geoindex_free(this->geoindex);
+	if (this->body)
+		packet_decref(this->body);
 
 	P_RWLOCK_DESTROY(&this->lock);
 	free(this);
@@ -175,85 +190,139 @@ void sourcetable_decref(struct sourcetable *this) {
 		sourcetable_free(this);
 }
 
+static int _cmp_sourceline_key(const void *p1, const void *p2) {
+	struct sourceline *s1 = *(struct sourceline **)p1;
+	struct sourceline *s2 = *(struct sourceline **)p2;
+	return strcmp(s1->key, s2->key);
+}
+
 /*
- * Return sourcetable as a string.
+ * Sort the indexes of a sourcetable.
+ *
+ * Required lock (write): sourcetable
  */
-struct mime_content *sourcetable_get(struct sourcetable *this) {
-	struct sourceline *n;
+static void _sourcetable_sort_unlocked(struct sourcetable *this) {
+	geoindex_sort(this->geoindex);
+	if (!this->index_sorted) {
+		qsort(this->index, hash_len(this->key_val), sizeof(struct sourceline *), _cmp_sourceline_key);
+		this->index_sorted = 1;
+	}
+}
+
+/*
+ * Read-lock a sourcetable, sorting its key index first if needed.
+ */
+static void sourcetable_rdlock_sorted(struct sourcetable *this) {
 	P_RWLOCK_RDLOCK(&this->lock);
+	while (!this->index_sorted) {
+		P_RWLOCK_UNLOCK(&this->lock);
+		P_RWLOCK_WRLOCK(&this->lock);
+		_sourcetable_sort_unlocked(this);
+		P_RWLOCK_UNLOCK(&this->lock);
+		P_RWLOCK_RDLOCK(&this->lock);
+	}
+}
+
+/*
+ * Render the sourcetable body in a new packet.
+ */
+static struct packet *_sourcetable_render(struct sourcetable *this) {
+	struct sourceline *n;
+	struct packet *p = NULL;
+	sourcetable_rdlock_sorted(this);
 
 	/*
 	 * Compute string size for the final sourcetable.
 	 */
 
-	int len = strlen(this->header)+17;
+	size_t header_len = strlen(this->header);
+	size_t len = header_len + 16;
+	int ne = hash_len(this->key_val);
 
-	struct element *e;
-	struct hash_iterator hi;
-	HASH_FOREACH(e, this->key_val, hi) {
-		n = (struct sourceline *)e->value;
-		len += strlen(n->value) + 2;
-	}
-
-	char *s = (char *)strmalloc(len);
+	for (int i = 0; i < ne; i++)
+		len += strlen(this->index[i]->value) + 2;
 
 	/*
 	 * Build the result per se
 	 */
-	if (s != NULL) {
-		struct element **ep;
-		int ne;
-		ep = hash_array(this->key_val, &ne);
-
-		strcpy(s, this->header);
+	p = packet_new(len);
+	if (p != NULL) {
+		char *s = (char *)p->data;
+		memcpy(s, this->header, header_len);
+		s += header_len;
 		for (int i = 0; i < ne; i++) {
-			e = ep[i];
-			n = (struct sourceline *)e->value;
-			strcat(s, n->value);
-			strcat(s, "\r\n");
+			n = this->index[i];
+			size_t vlen = strlen(n->value);
+			memcpy(s, n->value, vlen);
+			s += vlen;
+			memcpy(s, "\r\n", 2);
+			s += 2;
 		}
-		strcat(s, "ENDSOURCETABLE\r\n");
-		hash_array_free(ep);
+		memcpy(s, "ENDSOURCETABLE\r\n", 16);
 	}
 	P_RWLOCK_UNLOCK(&this->lock);
-	if (s == NULL)
+	return p;
+}
+
+/*
+ * Return sourcetable as a string.
+ */
+struct mime_content *sourcetable_get(struct sourcetable *this) {
+	struct packet *p = _sourcetable_render(this);
+	if (p == NULL)
 		return NULL;
-	struct mime_content *m = mime_new(s, len-1, "gnss/sourcetable", 1);
+	struct mime_content *m = mime_new_from_packet("gnss/sourcetable", p);
+	packet_decref(p);
 	return m;
 }
 
 /*
- * Return sourcetable as a Json object.
+ * Return the Json description of a sourcetable line.
  */
-json_object *sourcetable_json(struct sourcetable *this) {
-	struct sourceline *n;
-	json_object *jmain = json_object_new_object();
+static json_object *_sourceline_json(struct sourceline *n) {
+	json_object *j = json_object_new_object();
+	json_object_object_add_ex(j, "str", json_object_new_string(n->value), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "lat", json_object_new_double(n->pos.lat), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "lon", json_object_new_double(n->pos.lon), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "virtual", json_object_new_boolean(n->virtual), JSON_C_CONSTANT_NEW);
+	return j;
+}
 
+/*
+ * Return the Json object for a sourcetable, without its mountpoints.
+ */
+static json_object *_sourcetable_json_header(struct sourcetable *this) {
+	json_object *jmain = json_object_new_object();
 
 	json_object_object_add_ex(jmain, "host", json_object_new_string(this->caster), JSON_C_CONSTANT_NEW);
 	json_object_object_add_ex(jmain, "port", json_object_new_int(this->port), JSON_C_CONSTANT_NEW);
 	json_object_object_add_ex(jmain, "tls", json_object_new_boolean(this->tls), JSON_C_CONSTANT_NEW);
 	json_object_object_add_ex(jmain, "pullable", json_object_new_boolean(this->pullable), JSON_C_CONSTANT_NEW);
 	json_object_object_add_ex(jmain, "priority", json_object_new_int(this->priority), JSON_C_CONSTANT_NEW);
+	if (this->version)
+		json_object_object_add_ex(jmain, "version", json_object_new_int64(this->version), JSON_C_CONSTANT_NEW);
 
 	if (strcmp(this->caster, "LOCAL"))
 		timeval_to_json(&this->fetch_time, jmain, "fetch_time");
+	return jmain;
+}
+
+/*
+ * Return sourcetable as a Json object.
+ */
+json_object *sourcetable_json(struct sourcetable *this) {
+	struct sourceline *n;
 
+	P_RWLOCK_RDLOCK(&this->lock);
+	json_object *jmain = _sourcetable_json_header(this);
 	json_object *jmnt = json_object_new_object();
 
 	struct element *e;
 	struct hash_iterator hi;
 
-	P_RWLOCK_RDLOCK(&this->lock);
 	HASH_FOREACH(e, this->key_val, hi) {
 		n = (struct sourceline *)e->value;
-		json_object *j = json_object_new_object();
-		json_object_object_add_ex(j, "str", json_object_new_string(n->value), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(j, "lat", json_object_new_double(n->pos.lat), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(j, "lon", json_object_new_double(n->pos.lon), JSON_C_CONSTANT_NEW);
-		json_object_object_add_ex(j, "virtual", json_object_new_boolean(n->virtual), JSON_C_CONSTANT_NEW);
-		json_object_object_add(jmnt, n->key, j);
-
+		json_object_object_add(jmnt, n->key, _sourceline_json(n));
 	}
 	P_RWLOCK_UNLOCK(&this->lock);
 
@@ -262,14 +331,41 @@ json_object *sourcetable_json(struct sourcetable *this) {
 	return jmain;
 }
 
+/*
+ * Make room for one more entry in the key index.
+ */
+static int _sourcetable_index_grow(struct sourcetable *this) {
+	int n = hash_len(this->key_val);
+	if (n < this->index_size)
+		return 0;
+	int newsize = this->index_size ? this->index_size*2 : 64;
+	struct sourceline **new_index = (struct sourceline **)realloc(this->index, newsize*sizeof(struct sourceline *));
+	if (new_index == NULL)
+		return -1;
+	this->index = new_index;
+	this->index_size = newsize;
+	return 0;
+}
+
 static int _sourcetable_add_direct(struct sourcetable *this, struct sourceline *s) {
 	int r;
+	if (_sourcetable_index_grow(this) < 0)
+		return -2;
+	if (!s->virtual && geoindex_add(this->geoindex, s) < 0)
+		return -2;
 	r = hash_table_add(this->key_val, s->key, s);
 	if (r >= 0) {
 		sourceline_incref(s);
 		if (s->virtual)
 			this->nvirtual++;
-	}
+		/* Append to the key index, it will be sorted on next ordered traversal if needed */
+		int n = hash_len(this->key_val) - 1;
+		if (n && strcmp(this->index[n-1]->key, s->key) > 0)
+			this->index_sorted = 0;
+		this->index[n] = s;
+	} else if (!s->virtual)
+		/* Drop the entry we just appended to the index */
+		this->geoindex->n--;
 	return r;
 }
 
@@ -326,23 +422,20 @@ int sourcetable_nentries(struct sourcetable *this, int omit_virtual) {
 	return r;
 }
 
+/*
+ * Log the differences between two sourcetables, as a merge of their key indexes.
+ */
 void sourcetable_diff(struct caster_state *caster, struct sourcetable *t1, struct sourcetable *t2) {
-	struct element **keys1, **keys2;
+	struct sourceline **keys1, **keys2;
 	int n1, n2;
 	int i1, i2;
 
-	P_RWLOCK_RDLOCK(&t1->lock);
-	keys1 = hash_array(t1->key_val, &n1);
-	P_RWLOCK_UNLOCK(&t1->lock);
-	if (!keys1)
-		return;
-	P_RWLOCK_RDLOCK(&t2->lock);
-	keys2 = hash_array(t2->key_val, &n2);
-	P_RWLOCK_UNLOCK(&t2->lock);
-	if (!keys2) {
-		hash_array_free(keys1);
-		return;
-	}
+	sourcetable_rdlock_sorted(t1);
+	sourcetable_rdlock_sorted(t2);
+	keys1 = t1->index;
+	n1 = hash_len(t1->key_val);
+	keys2 = t2->index;
+	n2 = hash_len(t2->key_val);
 
 	i1 = 0;
 	i2 = 0;
@@ -370,8 +463,244 @@ void sourcetable_diff(struct caster_state *caster, struct sourcetable *t1, struc
 		logfmt(&caster->flog, LOG_INFO, "%s:%d Added source %s", t2->caster, t2->port, keys2[i2]->key);
 		i2++;
 	}
-	hash_array_free(keys1);
-	hash_array_free(keys2);
+	P_RWLOCK_UNLOCK(&t2->lock);
+	P_RWLOCK_UNLOCK(&t1->lock);
+}
+
+/*
+ * Find the position of a key, keylen characters long, in the sorted key index.
+ * Return -1 if not found.
+ *
+ * Required lock (read): sourcetable
+ */
+static int _sourcetable_index_find(struct sourcetable *this, const char *key, size_t keylen) {
+	int lo = 0, hi = hash_len(this->key_val);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const char *k = this->index[mid]->key;
+		int c = strncmp(k, key, keylen);
+		if (c == 0 && k[keylen] != '\0')
+			c = 1;
+		if (c < 0)
+			lo = mid + 1;
+		else if (c > 0)
+			hi = mid;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+/*
+ * Start an incremental update of a sourcetable.
+ *
+ * If base is NULL, the update just builds a new table in this->added.
+ */
+struct sourcetable_update *sourcetable_update_new(struct sourcetable *base, const char *host, unsigned short port, int tls, json_object *json_config) {
+	struct sourcetable_update *this = (struct sourcetable_update *)malloc(sizeof(struct sourcetable_update));
+	if (this == NULL)
+		return NULL;
+	this->added = sourcetable_new(host, port, tls, json_config);
+	if (this->added == NULL) {
+		free(this);
+		return NULL;
+	}
+	this->base = base;
+	this->base_version = 0;
+	this->nbase = 0;
+	this->seen = NULL;
+	this->nseen = 0;
+	if (base == NULL)
+		return this;
+
+	sourcetable_rdlock_sorted(base);
+	this->nbase = hash_len(base->key_val);
+	this->base_version = base->version;
+	P_RWLOCK_UNLOCK(&base->lock);
+
+	this->seen = (unsigned char *)calloc(this->nbase ? this->nbase : 1, sizeof(unsigned char));
+	if (this->seen == NULL) {
+		sourcetable_decref(this->added);
+		free(this);
+		return NULL;
+	}
+	sourcetable_incref(base);
+	return this;
+}
+
+void sourcetable_update_free(struct sourcetable_update *this) {
+	if (this->base)
+		sourcetable_decref(this->base);
+	sourcetable_decref(this->added);
+	free(this->seen);
+	free(this);
+}
+
+/*
+ * Return the position of a "STR" line key in the base table, or -1.
+ *
+ * If value is not NULL, also return -1 if the line differs from value.
+ * The comparison is done here as the line may be freed once the lock is released.
+ */
+static int _sourcetable_update_find(struct sourcetable_update *this, const char *key, size_t keylen, const char *value) {
+	struct sourcetable *base = this->base;
+	P_RWLOCK_RDLOCK(&base->lock);
+	int i = (base->version == this->base_version) ? _sourcetable_index_find(base, key, keylen) : -1;
+	if (i >= 0 && value != NULL && strcmp(base->index[i]->value, value))
+		i = -1;
+	P_RWLOCK_UNLOCK(&base->lock);
+	return i < this->nbase ? i : -1;
+}
+
+/*
+ * Add a line to the update.
+ */
+int sourcetable_update_add(struct sourcetable_update *this, const char *sourcetable_entry, int on_demand, struct caster_state *caster) {
+	const char *key = sourcetable_entry + 4;
+	const char *end;
+
+	if (this->base != NULL && !strncmp(sourcetable_entry, "STR;", 4) && (end = strchr(key, ';')) != NULL) {
+		int i = _sourcetable_update_find(this, key, end - key, sourcetable_entry);
+		if (i >= 0) {
+			/* Unchanged line, just keep it */
+			if (this->seen[i]) {
+				logfmt(&caster->flog, LOG_ERR, "Can't add sourcetable line (duplicate key): %s", sourcetable_entry);
+				return -1;
+			}
+			this->seen[i] = 1;
+			this->nseen++;
+			return 0;
+		}
+	}
+	return sourcetable_add(this->added, sourcetable_entry, on_demand, caster);
+}
+
+/*
+ * Apply an update to its base table, in place.
+ *
+ * Return 1 if the table was updated, 0 if it was unchanged (only fetch_time is updated),
+ * -1 if the base table was modified or removed from the stack meanwhile,
+ * or if a key was found twice.
+ *
+ * If delta is not NULL and the table changed, *delta is set to a Json
+ * description of the changes, for other nodes.
+ */
+int sourcetable_update_apply(struct caster_state *caster, sourcetable_stack_t *stack, struct sourcetable_update *this, struct timeval *fetch_time, json_object **delta) {
+	struct sourcetable *base = this->base;
+	struct sourcetable *added = this->added;
+	struct sourcetable *s;
+	unsigned char *replaced = NULL;
+	int r = -1;
+
+	if (delta)
+		*delta = NULL;
+
+	P_RWLOCK_RDLOCK(&stack->lock);
+	TAILQ_FOREACH(s, &stack->list, next)
+		if (s == base)
+			break;
+	if (s == NULL) {
+		P_RWLOCK_UNLOCK(&stack->lock);
+		return -1;
+	}
+
+	P_RWLOCK_WRLOCK(&base->lock);
+	if (base->version != this->base_version || hash_len(base->key_val) != this->nbase)
+		goto end;
+
+	int nadded = hash_len(added->key_val);
+	if (nadded == 0 && this->nseen == this->nbase && !strcmp(base->header, added->header)) {
+		base->fetch_time = *fetch_time;
+		r = 0;
+		goto end;
+	}
+
+	/*
+	 * Check which base lines are replaced, and that no key is both kept and added.
+	 */
+	replaced = (unsigned char *)calloc(nadded ? nadded : 1, sizeof(unsigned char));
+	if (replaced == NULL)
+		goto end;
+	for (int i = 0; i < nadded; i++) {
+		const char *key = added->index[i]->key;
+		int j = _sourcetable_index_find(base, key, strlen(key));
+		if (j < 0)
+			continue;
+		if (this->seen[j]) {
+			logfmt(&caster->flog, LOG_ERR, "%s:%d Duplicate source %s in update", base->caster, base->port, key);
+			goto end;
+		}
+		replaced[i] = 1;
+	}
+
+	json_object *jmnt = NULL, *jremoved = NULL;
+	if (delta) {
+		jmnt = json_object_new_object();
+		jremoved = json_object_new_array();
+	}
+
+	/*
+	 * Drop the base lines not kept, compacting the key index in place.
+	 */
+	int nkept = 0;
+	for (int i = 0; i < this->nbase; i++) {
+		struct sourceline *n = base->index[i];
+		if (this->seen[i]) {
+			base->index[nkept++] = n;
+			continue;
+		}
+		if (hash_table_get_element(added->key_val, n->key) == NULL) {
+			logfmt(&caster->flog, LOG_INFO, "%s:%d Removed source %s", base->caster, base->port, n->key);
+			if (jremoved)
+				json_object_array_add(jremoved, json_object_new_string(n->key));
+		} else
+			logfmt(&caster->flog, LOG_INFO, "%s:%d Updated source %s", base->caster, base->port, n->key);
+		if (n->virtual)
+			base->nvirtual--;
+		else
+			geoindex_del(base->geoindex, n);
+		hash_table_del(base->key_val, n->key);
+	}
+
+	/*
+	 * Append new and modified lines, they are shared with the update table.
+	 */
+	for (int i = 0; i < nadded; i++) {
+		struct sourceline *n = added->index[i];
+		if (_sourcetable_add_direct(base, n) < 0) {
+			logfmt(&caster->flog, LOG_CRIT, "%s:%d Can't add source %s: out of memory", base->caster, base->port, n->key);
+			continue;
+		}
+		if (!replaced[i])
+			logfmt(&caster->flog, LOG_INFO, "%s:%d Added source %s", base->caster, base->port, n->key);
+		if (jmnt)
+			json_object_object_add(jmnt, n->key, _sourceline_json(n));
+	}
+
+	if (strcmp(base->header, added->header)) {
+		char *header = base->header;
+		base->header = added->header;
+		added->header = header;
+	}
+	base->version = this->base_version + 1;
+	base->fetch_time = *fetch_time;
+	_sourcetable_sort_unlocked(base);
+
+	if (delta) {
+		json_object *jmain = _sourcetable_json_header(base);
+		json_object_object_add_ex(jmain, "base_version", json_object_new_int64(this->base_version), JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jmain, "mountpoints", jmnt, JSON_C_CONSTANT_NEW);
+		json_object_object_add_ex(jmain, "removed", jremoved, JSON_C_CONSTANT_NEW);
+		*delta = jmain;
+	}
+	stack_invalidate(stack);
+	r = 1;
+
+end:
+	P_RWLOCK_UNLOCK(&base->lock);
+	P_RWLOCK_UNLOCK(&stack->lock);
+	free(replaced);
+	return r;
 }
 
 static struct dist_table *dist_table_new(int n, const char *host, unsigned short port) {
@@ -398,6 +727,7 @@ static void dist_table_add(struct dist_table *this, double dist, pos_t *pos, cha
 	this->dist_array[i].pos = *pos;
 	this->dist_array[i].mountpoint = mountpoint;
 	this->dist_array[i].on_demand = on_demand;
+	this->dist_array[i].sourceline = NULL;
 }
 
 static int _cmp_dist(const void *pos1, const void *pos2) {
@@ -625,6 +955,9 @@ static void _stack_replace(struct caster_state *caster, sourcetable_stack_t *sta
 		if (local)
 			logfmt(&caster->flog, LOG_INFO, "Reloading %s", new_sourcetable->filename);
 		sourcetable_incref(new_sourcetable);
+		P_RWLOCK_WRLOCK(&new_sourcetable->lock);
+		_sourcetable_sort_unlocked(new_sourcetable);
+		P_RWLOCK_UNLOCK(&new_sourcetable->lock);
 		TAILQ_FOREACH(s, &stack->list, next) {
 			if (new_sourcetable->priority >= s->priority) {
 				TAILQ_INSERT_BEFORE(s, new_sourcetable, next);
@@ -636,6 +969,7 @@ static void _stack_replace(struct caster_state *caster, sourcetable_stack_t *sta
 			TAILQ_INSERT_TAIL(&stack->list, new_sourcetable, next);
 	}
 
+	stack_invalidate(stack);
 	P_RWLOCK_UNLOCK(&stack->lock);
 }
 
@@ -734,35 +1068,480 @@ struct sourcetable *stack_flatten(struct caster_state *caster, sourcetable_stack
 }
 
 /*
- * Return all the sourcetables as a JSON array
+ * Initialize a sourcetable stack.
+ */
+void stack_init(sourcetable_stack_t *this) {
+	TAILQ_INIT(&this->list);
+	P_RWLOCK_INIT(&this->lock, NULL);
+	P_RWLOCK_INIT(&this->flat_lock, NULL);
+	P_MUTEX_INIT(&this->flat_rebuild, NULL);
+	atomic_init(&this->gen, 1);
+	this->flat = NULL;
+	this->flat_gen = 0;
+}
+
+/*
+ * Release all sourcetables and the cached snapshot.
  */
-struct mime_content *sourcetable_list_json(struct caster_state *caster, struct request *req) {
+void stack_free(sourcetable_stack_t *this) {
+	struct sourcetable *s;
+
+	P_RWLOCK_WRLOCK(&this->lock);
+	while ((s = TAILQ_FIRST(&this->list))) {
+		TAILQ_REMOVE_HEAD(&this->list, next);
+		sourcetable_decref(s);
+	}
+	P_RWLOCK_UNLOCK(&this->lock);
+
+	if (this->flat)
+		sourcetable_decref(this->flat);
+	this->flat = NULL;
+
+	P_MUTEX_DESTROY(&this->flat_rebuild);
+	P_RWLOCK_DESTROY(&this->flat_lock);
+	P_RWLOCK_DESTROY(&this->lock);
+}
+
+/*
+ * Mark the flattened snapshot as stale.
+ *
+ * To be called whenever the stack content or the state of a local livesource changes.
+ */
+void stack_invalidate(sourcetable_stack_t *this) {
+	atomic_fetch_add(&this->gen, 1);
+}
+
+static struct sourcetable *_stack_flat_getref(sourcetable_stack_t *this, unsigned long long gen) {
+	struct sourcetable *r;
+	P_RWLOCK_RDLOCK(&this->flat_lock);
+	r = this->flat;
+	if (r && this->flat_gen == gen)
+		sourcetable_incref(r);
+	else
+		r = NULL;
+	P_RWLOCK_UNLOCK(&this->flat_lock);
+	return r;
+}
+
+/*
+ * Return a reference to the aggregated sourcetable for the stack.
+ *
+ * The result is a shared snapshot, only rebuilt when the stack or livesources
+ * changed since the last call. It is never modified once published, so
+ * callers can read it without locking it.
+ */
+struct sourcetable *stack_flatten_getref(struct caster_state *caster, sourcetable_stack_t *this) {
+	struct sourcetable *r = _stack_flat_getref(this, atomic_load(&this->gen));
+	if (r)
+		return r;
+
+	/*
+	 * Snapshot is stale: rebuild, but only from one thread at a time.
+	 */
+	P_MUTEX_LOCK(&this->flat_rebuild);
+
+	/* Check again, it may have been rebuilt while we were waiting */
+	unsigned long long gen = atomic_load(&this->gen);
+	r = _stack_flat_getref(this, gen);
+
+	if (r == NULL) {
+		r = stack_flatten(caster, this);
+		if (r != NULL) {
+			_sourcetable_sort_unlocked(r);
+			sourcetable_incref(r);
+
+			P_RWLOCK_WRLOCK(&this->flat_lock);
+			struct sourcetable *old = this->flat;
+			this->flat = r;
+			this->flat_gen = gen;
+			P_RWLOCK_UNLOCK(&this->flat_lock);
+
+			if (old)
+				sourcetable_decref(old);
+		}
+	}
+	P_MUTEX_UNLOCK(&this->flat_rebuild);
+	return r;
+}
+
+/*
+ * Return the aggregated sourcetable for the stack, as a string.
+ *
+ * The body is rendered once per snapshot and shared between all requests.
+ */
+struct mime_content *stack_sourcetable_get(struct caster_state *caster, sourcetable_stack_t *this) {
+	struct sourcetable *flat = stack_flatten_getref(caster, this);
+	if (flat == NULL)
+		return NULL;
+
+	struct packet *p = atomic_load(&flat->body);
+	if (p == NULL) {
+		struct packet *expected = NULL;
+		p = _sourcetable_render(flat);
+		if (p != NULL && !atomic_compare_exchange_strong(&flat->body, &expected, p)) {
+			/* Rendered concurrently by another thread, use its result */
+			packet_decref(p);
+			p = expected;
+		}
+	}
+
+	struct mime_content *m = p ? mime_new_from_packet("gnss/sourcetable", p) : NULL;
+	sourcetable_decref(flat);
+	return m;
+}
+
+/*
+ * State for stack_find_nearest()
+ */
+struct nearest_lookup {
+	struct caster_state *caster;
+	sourcetable_stack_t *stack;
+	struct sourcetable *table;	// table being scanned
+	int local_table;
+	struct spos *result;		// sorted by increasing distance
+	int k, n;
+	int ntotal;
+};
+
+/*
+ * Check whether a mountpoint is hidden by a table with a higher priority
+ * than the table being scanned, using the same rules as stack_flatten_dist().
+ */
+static int _nearest_shadowed(struct nearest_lookup *this, const char *mountpoint) {
+	struct sourcetable *s;
+	int r = 0;
+	TAILQ_FOREACH(s, &this->stack->list, next) {
+		if (s == this->table)
+			break;
+		P_RWLOCK_RDLOCK(&s->lock);
+		struct sourceline *sp = (struct sourceline *)hash_table_get(s->key_val, mountpoint);
+		if (sp && (strcmp(s->caster, "LOCAL") || sp->virtual || livesource_exists(this->caster, sp->key, &sp->pos)))
+			r = 1;
+		P_RWLOCK_UNLOCK(&s->lock);
+		if (r)
+			break;
+	}
+	return r;
+}
+
+static void _nearest_cb(struct sourceline *sp, float dist, void *arg) {
+	struct nearest_lookup *this = (struct nearest_lookup *)arg;
+
+	/* Skip quickly if we already have k closer bases */
+	if (this->n == this->k && dist >= this->result[this->k-1].dist) {
+		this->ntotal++;
+		return;
+	}
+	if (this->local_table && !livesource_exists(this->caster, sp->key, &sp->pos))
+		return;
+	if (_nearest_shadowed(this, sp->key))
+		return;
+
+	this->ntotal++;
+
+	/* Insertion in the sorted result array, dropping the farthest entry if full */
+	int i = this->n;
+	if (i == this->k)
+		sourceline_decref(this->result[--i].sourceline);
+	else
+		this->n++;
+	for (; i > 0 && this->result[i-1].dist > dist; i--)
+		this->result[i] = this->result[i-1];
+
+	sourceline_incref(sp);
+	this->result[i].dist = dist;
+	this->result[i].mountpoint = sp->key;
+	this->result[i].pos = sp->pos;
+	this->result[i].on_demand = sp->on_demand;
+	this->result[i].sourceline = sp;
+}
+
+/*
+ * Find the k nearest non-virtual live bases within max_dist of pos,
+ * using the spatial index of each table in the stack.
+ *
+ * The per-table indexes are maintained incrementally, so unlike the
+ * flattened snapshot they don't need a rebuild when a livesource changes.
+ *
+ * Fill the caller-provided result array, sorted by increasing distance,
+ * and return the number of entries filled.
+ * *ntotal is set to the number of bases within max_dist, for lookup distance adaptation
+ * (only exact up to k, may be higher than the real count beyond that).
+ *
+ * References are held on the returned sourcelines, release them with spos_release().
+ */
+int stack_find_nearest(struct caster_state *caster, sourcetable_stack_t *this, pos_t *pos, float max_dist, struct spos *result, int k, int *ntotal) {
+	struct nearest_lookup lookup;
+	struct sourcetable *s;
+
+	lookup.caster = caster;
+	lookup.stack = this;
+	lookup.result = result;
+	lookup.k = k;
+	lookup.n = 0;
+	lookup.ntotal = 0;
+
+	if (k <= 0) {
+		*ntotal = 0;
+		return 0;
+	}
+
+	P_RWLOCK_RDLOCK(&this->lock);
+	TAILQ_FOREACH(s, &this->list, next) {
+		lookup.table = s;
+		lookup.local_table = !strcmp(s->caster, "LOCAL");
+		P_RWLOCK_RDLOCK(&s->lock);
+		geoindex_foreach(s->geoindex, pos, max_dist, _nearest_cb, &lookup);
+		P_RWLOCK_UNLOCK(&s->lock);
+	}
+	P_RWLOCK_UNLOCK(&this->lock);
+
+	*ntotal = lookup.ntotal;
+	return lookup.n;
+}
+
+/*
+ * Release the sourceline references from a stack_find_nearest() result.
+ */
+void spos_release(struct spos *array, int n) {
+	for (int i = 0; i < n; i++)
+		if (array[i].sourceline)
+			sourceline_decref(array[i].sourceline);
+}
+
+/* Number of sourcetable lines listed at once under the sourcetable lock */
+#define	SOURCETABLE_STREAM_BATCH	256
+
+/*
+ * Return the position of the first key greater than key in the sorted index.
+ *
+ * Required lock (read): sourcetable
+ */
+static int _sourcetable_index_upper_bound(struct sourcetable *this, const char *key) {
+	int lo = 0, hi = hash_len(this->key_val);
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (strcmp(this->index[mid]->key, key) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Stream a sourcetable as a Json object, same as sourcetable_json().
+ *
+ * Lines are listed in key order, by batches. The table lock is released
+ * between batches, and we resume after the last key listed.
+ */
+static void sourcetable_stream(struct sourcetable *this, struct json_stream *js) {
+	char *last_key = NULL;
+	int more;
+	int i = 0;
+
+	sourcetable_rdlock_sorted(this);
+
+	json_stream_object_begin(js);
+	json_stream_key(js, "host");
+	json_stream_string(js, this->caster);
+	json_stream_key(js, "port");
+	json_stream_int64(js, this->port);
+	json_stream_key(js, "tls");
+	json_stream_bool(js, this->tls);
+	json_stream_key(js, "pullable");
+	json_stream_bool(js, this->pullable);
+	json_stream_key(js, "priority");
+	json_stream_int64(js, this->priority);
+	if (this->version) {
+		json_stream_key(js, "version");
+		json_stream_int64(js, this->version);
+	}
+	if (strcmp(this->caster, "LOCAL")) {
+		char iso_date[30];
+		iso_date_from_timeval(iso_date, sizeof iso_date, &this->fetch_time);
+		json_stream_key(js, "fetch_time");
+		json_stream_string(js, iso_date);
+	}
+
+	json_stream_key(js, "mountpoints");
+	json_stream_object_begin(js);
+	do {
+		int n = hash_len(this->key_val);
+		int end = (n - i > SOURCETABLE_STREAM_BATCH) ? i + SOURCETABLE_STREAM_BATCH : n;
+		for (; i < end; i++) {
+			struct sourceline *s = this->index[i];
+			json_stream_key(js, s->key);
+			json_stream_object_begin(js);
+			json_stream_key(js, "str");
+			json_stream_string(js, s->value);
+			json_stream_key(js, "lat");
+			json_stream_double(js, s->pos.lat);
+			json_stream_key(js, "lon");
+			json_stream_double(js, s->pos.lon);
+			json_stream_key(js, "virtual");
+			json_stream_bool(js, s->virtual);
+			json_stream_object_end(js);
+		}
+		more = (i < n);
+		if (more) {
+			strfree(last_key);
+			last_key = mystrdup(this->index[i-1]->key);
+			P_RWLOCK_UNLOCK(&this->lock);
+			if (last_key == NULL || json_stream_flush(js, 0) < 0) {
+				/* Out of memory or client gone */
+				json_stream_object_end(js);
+				json_stream_object_end(js);
+				strfree(last_key);
+				return;
+			}
+			sourcetable_rdlock_sorted(this);
+			i = _sourcetable_index_upper_bound(this, last_key);
+		}
+	} while (more);
+	P_RWLOCK_UNLOCK(&this->lock);
+	json_stream_object_end(js);
+	json_stream_object_end(js);
+	strfree(last_key);
+}
+
+/*
+ * Stream all the sourcetables as a JSON array
+ */
+void sourcetable_list_stream(struct caster_state *caster, struct request *req, struct json_stream *js) {
 	sourcetable_stack_t *this = &caster->sourcetablestack;
 	struct sourcetable *s;
+	struct sourcetable **tables;
 
+	/*
+	 * Get references on the tables, to avoid holding the stack lock.
+	 */
 	int n = 0;
 	P_RWLOCK_RDLOCK(&this->lock);
 	TAILQ_FOREACH(s, &this->list, next)
 		n++;
+	tables = (struct sourcetable **)malloc(sizeof(struct sourcetable *)*(n ? n : 1));
+	n = 0;
+	if (tables != NULL)
+		TAILQ_FOREACH(s, &this->list, next) {
+			sourcetable_incref(s);
+			tables[n++] = s;
+		}
+	P_RWLOCK_UNLOCK(&this->lock);
 
-	json_object *jmain = json_object_new_array_ext(n);
+	json_stream_array_begin(js);
+	for (int i = 0; i < n; i++) {
+		if (!js->error)
+			sourcetable_stream(tables[i], js);
+		sourcetable_decref(tables[i]);
+	}
+	json_stream_array_end(js);
+	free(tables);
+}
 
-	TAILQ_FOREACH(s, &this->list, next) {
-		json_object *stj = sourcetable_json(s);
-		json_object_array_add(jmain, stj);
+/*
+ * Handle a received incremental sourcetable update.
+ *
+ * The update is ignored if we don't have the version it applies to,
+ * the next full table will fix it.
+ */
+static int sourcetable_delta_execute(struct caster_state *caster, json_object *j) {
+	sourcetable_stack_t *stack = &caster->sourcetablestack;
+	struct sourcetable *s;
+	struct timeval fetch_time;
+
+	json_object *jhost = json_object_object_get(j, "host");
+	json_object *jport = json_object_object_get(j, "port");
+	json_object *jdate = json_object_object_get(j, "fetch_time");
+	json_object *jbase_version = json_object_object_get(j, "base_version");
+	json_object *tlist = json_object_object_get(j, "mountpoints");
+	json_object *jremoved = json_object_object_get(j, "removed");
+
+	if (!jhost || !jport || !jdate || !tlist || !jremoved
+	    || !timeval_from_iso_date(&fetch_time, json_object_get_string(jdate)))
+		return 400;
+
+	const char *host = json_object_get_string(jhost);
+	unsigned short port = json_object_get_int(jport);
+	unsigned long long base_version = json_object_get_int64(jbase_version);
+
+	P_RWLOCK_RDLOCK(&stack->lock);
+	TAILQ_FOREACH(s, &stack->list, next)
+		if (!s->local && !strcmp(s->caster, host) && s->port == port)
+			break;
+	struct sourcetable_update *u = NULL;
+	if (s != NULL && s->version == base_version)
+		u = sourcetable_update_new(s, host, port, s->tls, NULL);
+	P_RWLOCK_UNLOCK(&stack->lock);
+
+	if (u == NULL || u->base_version != base_version) {
+		logfmt(&caster->flog, LOG_DEBUG, "ignoring sourcetable update for %s:%d, version %llu not found", host, port, base_version);
+		if (u)
+			sourcetable_update_free(u);
+		return 200;
 	}
-	P_RWLOCK_UNLOCK(&this->lock);
 
-	char *rs = mystrdup(json_object_to_json_string(jmain));
-	struct mime_content *m = mime_new(rs, -1, "application/json", 1);
-	json_object_put(jmain);
-	return m;
+	/*
+	 * Keep everything, except removed and modified lines.
+	 */
+	struct sourcetable *base = u->base;
+	memset(u->seen, 1, u->nbase);
+	u->nseen = u->nbase;
+	P_RWLOCK_RDLOCK(&base->lock);
+	char *header = mystrdup(base->header);
+	P_RWLOCK_UNLOCK(&base->lock);
+	if (header == NULL) {
+		sourcetable_update_free(u);
+		return 503;
+	}
+	strfree(u->added->header);
+	u->added->header = header;
+
+	int nremoved = json_object_array_length(jremoved);
+	for (int i = 0; i < nremoved; i++) {
+		const char *key = json_object_get_string(json_object_array_get_idx(jremoved, i));
+		int pos = key ? _sourcetable_update_find(u, key, strlen(key), NULL) : -1;
+		if (pos >= 0 && u->seen[pos]) {
+			u->seen[pos] = 0;
+			u->nseen--;
+		}
+	}
+
+	struct json_object_iterator it = json_object_iter_begin(tlist);
+	struct json_object_iterator itEnd = json_object_iter_end(tlist);
+	int r = 200;
+	while (!json_object_iter_equal(&it, &itEnd)) {
+		const char *key = json_object_iter_peek_name(&it);
+		struct json_object *source = json_object_iter_peek_value(&it);
+		const char *str = json_object_get_string(json_object_object_get(source, "str"));
+		int pos = _sourcetable_update_find(u, key, strlen(key), NULL);
+		if (pos >= 0 && u->seen[pos]) {
+			u->seen[pos] = 0;
+			u->nseen--;
+		}
+		if (str == NULL || sourcetable_add(u->added, str, base->pullable, caster) < 0) {
+			r = 400;
+			break;
+		}
+		json_object_iter_next(&it);
+	}
+
+	if (r == 200) {
+		logfmt(&caster->flog, LOG_DEBUG, "received sourcetable update for %s:%d, version %llu", host, port, base_version+1);
+		if (sourcetable_update_apply(caster, stack, u, &fetch_time, NULL) < 0)
+			logfmt(&caster->flog, LOG_DEBUG, "sourcetable update for %s:%d not applied", host, port);
+	}
+	sourcetable_update_free(u);
+	return r;
 }
 
 /*
- * Handle and insert a received sourcetable.
+ * Handle and insert a received sourcetable, or sourcetable update.
  */
 int sourcetable_update_execute(struct caster_state *caster, json_object *j) {
+	if (json_object_object_get(j, "base_version") != NULL)
+		return sourcetable_delta_execute(caster, j);
+
 	struct sourcetable *s = sourcetable_from_json(j, caster);
 
 	if (s != NULL) {
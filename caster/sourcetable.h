@@ -4,7 +4,9 @@
 #include "conf.h"
 
 #include "caster.h"
+#include "geoindex.h"
 #include "hash.h"
+#include "packet.h"
 #include "queue.h"
 #include "sourceline.h"
 #include "util.h"
@@ -23,23 +25,54 @@ struct sourcetable {
 	int tls;			// use TLS?
 	char *header;                   // All "CAS" & "NET" lines
 	struct hash_table *key_val;	// "STR" lines in a hash table
+	struct sourceline **index;	// "STR" lines ordered by key, for ordered traversal
+	int index_size;
+	int index_sorted;		// index is sorted, otherwise it is on the next ordered traversal
+	struct geoindex *geoindex;	// spatial index of non-virtual "STR" lines
 	int pullable;                   // 1: pull mounpoints streams from the caster on demand
 	int local;                      // 1: table read from local file
 	const char *filename;           // if local
 	int priority;
 	int nvirtual;			// number of "virtual" entries
 	struct timeval fetch_time;              // time of fetch, if remote table
+	unsigned long long version;	// content version, bumped on every in-place update, 0 if unknown
 	json_object *json_config;	// optional additional Json config
+	_Atomic (struct packet *) body;	// cached sourcetable body, for stack snapshots
 	_Atomic int refcnt;
 };
 TAILQ_HEAD (sourcetableq, sourcetable);
 
+/*
+ * Incremental update of a sourcetable in the stack.
+ *
+ * Lines identical to those of the base table are only marked as seen,
+ * only new or modified lines are parsed and stored. Base lines not seen
+ * are removed when the update is applied.
+ */
+struct sourcetable_update {
+	struct sourcetable *base;	// table to update in place, reference held; NULL to build a new table
+	unsigned long long base_version;
+	int nbase;			// number of lines in base when the update was started
+	unsigned char *seen;		// base lines to keep, by position in the base key index
+	int nseen;
+	struct sourcetable *added;	// header, new and modified lines; the full table if base is NULL
+};
+
 /*
  * Sourcetable stack
  */
 typedef struct sourcetable_stack {
 	struct sourcetableq list;
 	P_RWLOCK_T lock;
+
+	/*
+	 * Cached flattened stack, rebuilt on demand when gen is bumped.
+	 */
+	_Atomic unsigned long long gen;	// bumped on every stack or livesource change
+	struct sourcetable *flat;	// last snapshot
+	unsigned long long flat_gen;	// gen at the time of the last snapshot
+	P_RWLOCK_T flat_lock;		// protects flat and flat_gen
+	P_MUTEX_T flat_rebuild;		// serializes snapshot rebuilds
 } sourcetable_stack_t;
 
 /*
@@ -50,6 +83,7 @@ struct spos {
 	char *mountpoint;
 	pos_t pos;
 	int on_demand;
+	struct sourceline *sourceline;	// reference held, if filled by stack_find_nearest()
 };
 
 /*
@@ -63,6 +97,11 @@ struct dist_table {
 	unsigned short port;
 };
 
+/*
+ * Maximum number of nearest bases returned to a NEAR-base client lookup
+ */
+#define	NEAREST_MAX_RESULTS	64
+
 struct sourcetable *sourcetable_read(struct caster_state *caster, const char *filename, int priority);
 struct sourcetable *sourcetable_new(const char *host, unsigned short port, int tls,
 	json_object *json_config);
@@ -85,7 +124,19 @@ void stack_replace_host(struct caster_state *caster, sourcetable_stack_t *stack,
 void stack_replace_local(struct caster_state *caster, sourcetable_stack_t *stack, struct sourcetable *new_sourcetable);
 struct sourcetable *stack_flatten_dist(struct caster_state *caster, sourcetable_stack_t *this, pos_t *pos, float max_dist);
 struct sourcetable *stack_flatten(struct caster_state *caster, sourcetable_stack_t *this);
-struct mime_content *sourcetable_list_json(struct caster_state *caster, struct request *req);
+void stack_init(sourcetable_stack_t *this);
+void stack_free(sourcetable_stack_t *this);
+void stack_invalidate(sourcetable_stack_t *this);
+struct sourcetable *stack_flatten_getref(struct caster_state *caster, sourcetable_stack_t *this);
+struct mime_content *stack_sourcetable_get(struct caster_state *caster, sourcetable_stack_t *this);
+int stack_find_nearest(struct caster_state *caster, sourcetable_stack_t *this, pos_t *pos, float max_dist, struct spos *result, int k, int *ntotal);
+void spos_release(struct spos *array, int n);
+struct json_stream;
+void sourcetable_list_stream(struct caster_state *caster, struct request *req, struct json_stream *js);
 int sourcetable_update_execute(struct caster_state *caster, json_object *j);
+struct sourcetable_update *sourcetable_update_new(struct sourcetable *base, const char *host, unsigned short port, int tls, json_object *json_config);
+void sourcetable_update_free(struct sourcetable_update *this);
+int sourcetable_update_add(struct sourcetable_update *this, const char *sourcetable_entry, int on_demand, struct caster_state *caster);
+int sourcetable_update_apply(struct caster_state *caster, sourcetable_stack_t *stack, struct sourcetable_update *this, struct timeval *fetch_time, json_object **delta);
 
 #endif
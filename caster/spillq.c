@@ -0,0 +1,586 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "conf.h"
+#include "log.h"
+#include "packet.h"
+#include "spillq.h"
+#include "util.h"
+
+/*
+ * Memory-mapped spill queue for ntrip_task backlogs.
+ */
+
+/* Open queues, to share them between tasks using the same directory */
+static struct spillq *spillq_list = NULL;
+static pthread_mutex_t spillq_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define	SPILLQ_HEADER_SIZE	sizeof(struct spillq_header)
+#define	SPILLQ_RETRY_DELAY	1	// seconds before retrying to create a segment
+
+static inline size_t spillq_record_size(size_t len) {
+	return 8 + ((len + 7) & ~7);
+}
+
+static inline int spillq_pos_equal(struct spillq_pos *a, struct spillq_pos *b) {
+	return a->seg == b->seg && a->off == b->off;
+}
+
+static char *spillq_path(struct spillq *this, unsigned long long seq) {
+	char name[32];
+	snprintf(name, sizeof name, "%016llx.spill", seq);
+	return joinpath(this->dir, name);
+}
+
+/*
+ * Allocate the blocks of a segment file.
+ *
+ * Writing through a mapping to a sparse file raises SIGBUS when the disk
+ * is full, so only fall back to a sparse file if the file system
+ * can't preallocate.
+ */
+static int spillq_allocate(int fd) {
+	int r = posix_fallocate(fd, 0, SPILLQ_SEGMENT_SIZE);
+	if (r == 0)
+		return 0;
+	if (r != EOPNOTSUPP && r != EINVAL)
+		return -1;
+	return ftruncate(fd, SPILLQ_SEGMENT_SIZE);
+}
+
+/*
+ * Map a segment, creating it if create is set.
+ * Return NULL on error, or if the segment does not exist.
+ */
+static struct spillq_segment *spillq_segment_map(struct spillq *this, unsigned long long seq, int create) {
+	struct spillq_segment *seg = (struct spillq_segment *)malloc(sizeof(struct spillq_segment));
+	char *path = spillq_path(this, seq);
+	if (seg == NULL || path == NULL) {
+		free(seg);
+		strfree(path);
+		return NULL;
+	}
+	int fd = open(path, create ? O_RDWR|O_CREAT : O_RDWR, 0600);
+	strfree(path);
+	if (fd < 0) {
+		free(seg);
+		return NULL;
+	}
+	struct stat sb;
+	if (fstat(fd, &sb) < 0 || (sb.st_size < SPILLQ_SEGMENT_SIZE && spillq_allocate(fd) < 0)) {
+		close(fd);
+		free(seg);
+		return NULL;
+	}
+	unsigned char *base = mmap(NULL, SPILLQ_SEGMENT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		free(seg);
+		return NULL;
+	}
+
+	struct spillq_header *h = (struct spillq_header *)base;
+	if (memcmp(h->magic, SPILLQ_MAGIC, sizeof h->magic)) {
+		/* New or unrecognized segment: start empty */
+		memset(base, 0, sb.st_size < SPILLQ_SEGMENT_SIZE ? sb.st_size : SPILLQ_SEGMENT_SIZE);
+		memcpy(h->magic, SPILLQ_MAGIC, sizeof h->magic);
+		h->acked = SPILLQ_HEADER_SIZE;
+	}
+	seg->seq = seq;
+	seg->base = base;
+	seg->full = 0;
+	seg->synced = 0;
+	seg->next = NULL;
+	return seg;
+}
+
+/*
+ * Unmap a segment, deleting its file if requested.
+ */
+static void spillq_segment_free(struct spillq *this, struct spillq_segment *seg, int delete) {
+	if (!delete && !seg->synced)
+		msync(seg->base, SPILLQ_SEGMENT_SIZE, MS_SYNC);
+	munmap(seg->base, SPILLQ_SEGMENT_SIZE);
+	if (delete) {
+		char *path = spillq_path(this, seg->seq);
+		if (path != NULL) {
+			unlink(path);
+			strfree(path);
+		}
+	}
+	free(seg);
+}
+
+static void spillq_segment_free_list(struct spillq *this, struct spillq_segment *seg, int delete) {
+	while (seg != NULL) {
+		struct spillq_segment *next = seg->next;
+		spillq_segment_free(this, seg, delete);
+		seg = next;
+	}
+}
+
+/*
+ * Check for a complete record at off.
+ * Return its length, 0 at the end of the segment, or -1 if corrupted.
+ */
+static ssize_t spillq_record(unsigned char *base, size_t off) {
+	if (off + 8 > SPILLQ_SEGMENT_SIZE)
+		return 0;
+	uint32_t len = *(uint32_t *)(base + off);
+	uint32_t crc = *(uint32_t *)(base + off + 4);
+	if (len == 0 || len > SPILLQ_SEGMENT_SIZE - off - 8)
+		return 0;
+	if (crc32(0, base + off + 8, len) != crc)
+		return -1;
+	return len;
+}
+
+/*
+ * Move pos to the next record, skipping the end of segments and corrupted records.
+ * Return the record length, or 0 at the write position.
+ *
+ * Required lock: spillq
+ */
+static ssize_t spillq_seek(struct spillq *this, struct spillq_pos *pos) {
+	while (!spillq_pos_equal(pos, &this->write)) {
+		ssize_t len = spillq_record(pos->seg->base, pos->off);
+		if (len > 0)
+			return len;
+		if (len < 0 && pos == &this->read)
+			this->corrupt++;
+		if (pos->seg == this->write.seg)
+			/* Can't happen unless the segment was altered behind our back */
+			return 0;
+		pos->seg = pos->seg->next;
+		pos->off = SPILLQ_HEADER_SIZE;
+	}
+	return 0;
+}
+
+/*
+ * Hand the segments before the ack position to the helper thread for deletion.
+ *
+ * Required lock: spillq
+ */
+static void spillq_retire(struct spillq *this) {
+	int n = 0;
+	while (this->first != this->ack.seg) {
+		struct spillq_segment *seg = this->first;
+		this->first = seg->next;
+		seg->next = this->retired;
+		this->retired = seg;
+		this->nsegments--;
+		n++;
+	}
+	if (n)
+		pthread_cond_signal(&this->cond);
+}
+
+/*
+ * Count the records between two offsets in a segment, without checking them.
+ */
+static unsigned long long spillq_count(unsigned char *base, size_t off, size_t end) {
+	unsigned long long n = 0;
+	while (off + 8 <= end) {
+		uint32_t len = *(uint32_t *)(base + off);
+		if (len == 0 || len > SPILLQ_SEGMENT_SIZE - off - 8)
+			break;
+		off += spillq_record_size(len);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Drop the oldest segment to make room.
+ *
+ * Records already read from it will still be acknowledged by the reader,
+ * in order: skip these acknowledgements rather than move ack.
+ *
+ * Required lock: spillq
+ */
+static void spillq_drop_oldest(struct spillq *this) {
+	struct spillq_segment *seg = this->first;
+	assert(seg == this->ack.seg && seg != this->write.seg);
+	unsigned long long n = spillq_count(seg->base, this->ack.off, SPILLQ_SEGMENT_SIZE);
+	unsigned long long inflight = n;
+	if (this->read.seg == seg) {
+		inflight = spillq_count(seg->base, this->ack.off, this->read.off);
+		this->read.seg = seg->next;
+		this->read.off = SPILLQ_HEADER_SIZE;
+	}
+	this->ack_skip += inflight;
+	this->dropped += n - inflight;
+	this->ack.seg = seg->next;
+	this->ack.off = SPILLQ_HEADER_SIZE;
+	spillq_retire(this);
+}
+
+/*
+ * Helper thread: delete retired segments, prepare the next write segment,
+ * and write back full segments, without holding the lock.
+ *
+ * Only this thread frees segments while the queue is open.
+ */
+static void *spillq_helper(void *arg) {
+	struct spillq *this = (struct spillq *)arg;
+	struct spillq_segment *seg;
+
+	pthread_mutex_lock(&this->mutex);
+	while (!this->stop) {
+		if (this->retired != NULL) {
+			seg = this->retired;
+			this->retired = NULL;
+			pthread_mutex_unlock(&this->mutex);
+			spillq_segment_free_list(this, seg, 1);
+			pthread_mutex_lock(&this->mutex);
+			continue;
+		}
+		if (this->prepared == NULL) {
+			/* The last segment can't change until a new one is prepared */
+			unsigned long long seq = this->last->seq + 1;
+			pthread_mutex_unlock(&this->mutex);
+			seg = spillq_segment_map(this, seq, 1);
+			pthread_mutex_lock(&this->mutex);
+			if (seg != NULL) {
+				this->prepared = seg;
+				continue;
+			}
+			this->errors++;
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += SPILLQ_RETRY_DELAY;
+			pthread_cond_timedwait(&this->cond, &this->mutex, &ts);
+			continue;
+		}
+		for (seg = this->first; seg != NULL; seg = seg->next)
+			if (seg->full && !seg->synced)
+				break;
+		if (seg != NULL) {
+			/* Safe unlocked: if retired meanwhile, we are the one to free it */
+			seg->synced = 1;
+			pthread_mutex_unlock(&this->mutex);
+			msync(seg->base, SPILLQ_SEGMENT_SIZE, MS_SYNC);
+			pthread_mutex_lock(&this->mutex);
+			continue;
+		}
+		pthread_cond_wait(&this->cond, &this->mutex);
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return NULL;
+}
+
+static int spillq_seq_cmp(const void *a, const void *b) {
+	unsigned long long sa = *(const unsigned long long *)a, sb = *(const unsigned long long *)b;
+	return sa < sb ? -1 : sa > sb;
+}
+
+/*
+ * Open or share the spill queue in a directory, recovering existing segments.
+ */
+struct spillq *spillq_open(const char *dir, struct log *log) {
+	struct spillq *this;
+
+	pthread_mutex_lock(&spillq_list_mutex);
+	for (this = spillq_list; this != NULL; this = this->next)
+		if (!strcmp(this->dir, dir)) {
+			this->refcnt++;
+			pthread_mutex_unlock(&spillq_list_mutex);
+			return this;
+		}
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		pthread_mutex_unlock(&spillq_list_mutex);
+		logfmt(log, LOG_ERR, "Can't create spill directory %s: %s", dir, strerror(errno));
+		return NULL;
+	}
+	DIR *d = opendir(dir);
+	this = (struct spillq *)calloc(1, sizeof(struct spillq));
+	if (d == NULL || this == NULL || (this->dir = mystrdup(dir)) == NULL) {
+		if (d)
+			closedir(d);
+		free(this);
+		pthread_mutex_unlock(&spillq_list_mutex);
+		logfmt(log, LOG_ERR, "Can't open spill directory %s", dir);
+		return NULL;
+	}
+
+	/* Find the existing segments */
+	unsigned long long *seqs = NULL;
+	int nsegments = 0, err = 0;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL) {
+		unsigned long long seq;
+		char suffix[8];
+		if (strlen(de->d_name) != 22 || sscanf(de->d_name, "%16llx.%6s", &seq, suffix) != 2
+		 || strcmp(suffix, "spill"))
+			continue;
+		unsigned long long *new_seqs = (unsigned long long *)realloc(seqs, sizeof(unsigned long long)*(nsegments+1));
+		if (new_seqs == NULL) {
+			err = 1;
+			break;
+		}
+		seqs = new_seqs;
+		seqs[nsegments++] = seq;
+	}
+	closedir(d);
+	if (nsegments)
+		qsort(seqs, nsegments, sizeof(unsigned long long), spillq_seq_cmp);
+
+	pthread_mutex_init(&this->mutex, NULL);
+	pthread_cond_init(&this->cond, NULL);
+
+	/* Map them all, leaving them as they are */
+	struct spillq_segment **tail = &this->first;
+	for (int i = 0; i < nsegments && !err; i++) {
+		struct spillq_segment *seg = spillq_segment_map(this, seqs[i], 0);
+		if (seg == NULL) {
+			err = 1;
+			break;
+		}
+		seg->full = 1;
+		seg->synced = 1;
+		*tail = seg;
+		tail = &seg->next;
+		this->nsegments++;
+	}
+
+	/* Always write to a new segment, and prepare the next one */
+	unsigned long long wseq = nsegments ? seqs[nsegments-1] + 1 : 0;
+	free(seqs);
+	struct spillq_segment *wseg = err ? NULL : spillq_segment_map(this, wseq, 1);
+	this->prepared = wseg ? spillq_segment_map(this, wseq + 1, 1) : NULL;
+	int started = 0;
+	if (this->prepared != NULL) {
+		*tail = wseg;
+		this->last = wseg;
+		this->nsegments++;
+
+		this->write.seg = wseg;
+		this->write.off = SPILLQ_HEADER_SIZE;
+		this->ack.seg = this->first;
+		this->ack.off = SPILLQ_HEADER_SIZE;
+		if (nsegments) {
+			size_t acked = ((struct spillq_header *)this->first->base)->acked;
+			if (acked >= SPILLQ_HEADER_SIZE && acked < SPILLQ_SEGMENT_SIZE && (acked & 7) == 0)
+				this->ack.off = acked;
+		}
+		this->read = this->ack;
+
+		/* Last, as the helper thread uses the above */
+		started = pthread_create(&this->thread, NULL, spillq_helper, this) == 0;
+		if (!started)
+			*tail = NULL;
+	}
+	if (!started) {
+		spillq_segment_free_list(this, this->first, 0);
+		if (wseg)
+			spillq_segment_free(this, wseg, 1);
+		if (this->prepared)
+			spillq_segment_free(this, this->prepared, 1);
+		pthread_mutex_destroy(&this->mutex);
+		pthread_cond_destroy(&this->cond);
+		strfree(this->dir);
+		free(this);
+		pthread_mutex_unlock(&spillq_list_mutex);
+		logfmt(log, LOG_ERR, "Can't open spill segments in %s", dir);
+		return NULL;
+	}
+	this->refcnt = 1;
+	this->next = spillq_list;
+	spillq_list = this;
+	pthread_mutex_unlock(&spillq_list_mutex);
+
+	if (nsegments)
+		logfmt(log, LOG_NOTICE, "Spill queue %s: %d segment(s) to replay", dir, nsegments);
+	return this;
+}
+
+/*
+ * Drop a reference to the queue.
+ * If reader is the current reader, unacknowledged records will be read again.
+ */
+void spillq_close(struct spillq *this, const void *reader) {
+	pthread_mutex_lock(&spillq_list_mutex);
+	pthread_mutex_lock(&this->mutex);
+	if (reader != NULL && this->reader == reader) {
+		this->reader = NULL;
+		this->read = this->ack;
+		this->ack_skip = 0;
+	}
+	pthread_mutex_unlock(&this->mutex);
+	if (--this->refcnt) {
+		pthread_mutex_unlock(&spillq_list_mutex);
+		return;
+	}
+	for (struct spillq **p = &spillq_list; *p; p = &(*p)->next)
+		if (*p == this) {
+			*p = this->next;
+			break;
+		}
+	pthread_mutex_unlock(&spillq_list_mutex);
+
+	pthread_mutex_lock(&this->mutex);
+	this->stop = 1;
+	pthread_cond_signal(&this->cond);
+	pthread_mutex_unlock(&this->mutex);
+	pthread_join(this->thread, NULL);
+
+	/* Delete segments if everything was acknowledged */
+	int empty = (spillq_seek(this, &this->ack) == 0);
+	spillq_retire(this);
+	spillq_segment_free_list(this, this->retired, 1);
+	spillq_segment_free_list(this, this->first, empty);
+	if (this->prepared)
+		spillq_segment_free(this, this->prepared, 1);
+	pthread_mutex_destroy(&this->mutex);
+	pthread_cond_destroy(&this->cond);
+	strfree(this->dir);
+	free(this);
+}
+
+/*
+ * Limit the size of the queue, rounded to segments, 0 for no limit.
+ * Applies when the write segment is full.
+ */
+void spillq_set_limit(struct spillq *this, size_t max_size, enum spillq_policy policy) {
+	size_t n = max_size / SPILLQ_SEGMENT_SIZE;
+	pthread_mutex_lock(&this->mutex);
+	/* At least 2 mapped segments, and the prepared one */
+	this->max_segments = max_size == 0 ? 0 : n < 3 ? 3 : n > INT_MAX ? INT_MAX : n;
+	this->policy = policy;
+	pthread_mutex_unlock(&this->mutex);
+}
+
+/*
+ * Append a record.
+ *
+ * Only copies to the mapped write segment: if it is full and the helper thread
+ * hasn't prepared the next one yet, fail rather than wait.
+ * If the queue is full, apply its policy.
+ * Return -1 if the record was dropped: too big, no segment ready, or queue full.
+ */
+int spillq_append(struct spillq *this, const void *data, size_t len) {
+	size_t rsize = spillq_record_size(len);
+	if (len == 0 || rsize > SPILLQ_SEGMENT_SIZE - SPILLQ_HEADER_SIZE) {
+		pthread_mutex_lock(&this->mutex);
+		this->dropped++;
+		pthread_mutex_unlock(&this->mutex);
+		return -1;
+	}
+	uint32_t crc = crc32(0, data, len);
+
+	pthread_mutex_lock(&this->mutex);
+	if (this->write.off + rsize > SPILLQ_SEGMENT_SIZE) {
+		if (this->prepared == NULL) {
+			this->dropped++;
+			pthread_mutex_unlock(&this->mutex);
+			return -1;
+		}
+		if (this->max_segments && this->nsegments + 2 > this->max_segments) {
+			if (this->policy == SPILLQ_DROP_NEW) {
+				this->dropped++;
+				pthread_mutex_unlock(&this->mutex);
+				return -1;
+			}
+			spillq_drop_oldest(this);
+		}
+		/* Segment full: the zeroed remainder marks its end */
+		this->write.seg->full = 1;
+		this->last->next = this->prepared;
+		this->last = this->prepared;
+		this->prepared = NULL;
+		this->nsegments++;
+		this->write.seg = this->last;
+		this->write.off = SPILLQ_HEADER_SIZE;
+		pthread_cond_signal(&this->cond);
+	}
+	unsigned char *p = this->write.seg->base + this->write.off;
+	memcpy(p + 8, data, len);
+	*(uint32_t *)(p + 4) = crc;
+	/* Length last, so a torn record is not seen as complete */
+	*(uint32_t *)p = len;
+	this->write.off += rsize;
+	this->spilled++;
+	pthread_mutex_unlock(&this->mutex);
+	return 0;
+}
+
+/*
+ * Return 1 if there is nothing left to read.
+ */
+int spillq_empty(struct spillq *this) {
+	pthread_mutex_lock(&this->mutex);
+	int r = (spillq_seek(this, &this->read) == 0);
+	pthread_mutex_unlock(&this->mutex);
+	return r;
+}
+
+/*
+ * Read the next record as a packet, if not longer than max_len.
+ * Return NULL if there is none, or if another reader is active.
+ */
+struct packet *spillq_read(struct spillq *this, const void *reader, size_t max_len) {
+	struct packet *p = NULL;
+
+	pthread_mutex_lock(&this->mutex);
+	if (this->reader != NULL && this->reader != reader) {
+		pthread_mutex_unlock(&this->mutex);
+		return NULL;
+	}
+	ssize_t len = spillq_seek(this, &this->read);
+	if (len > 0 && (size_t)len <= max_len && (p = packet_new(len)) != NULL) {
+		memcpy(p->data, this->read.seg->base + this->read.off + 8, len);
+		this->read.off += spillq_record_size(len);
+		this->reader = reader;
+		this->replayed++;
+	}
+	pthread_mutex_unlock(&this->mutex);
+	return p;
+}
+
+/*
+ * Acknowledge the oldest record read, deleting segments no longer needed.
+ */
+void spillq_ack(struct spillq *this, const void *reader) {
+	pthread_mutex_lock(&this->mutex);
+	if (this->reader == reader && this->ack_skip) {
+		this->ack_skip--;
+	} else if (this->reader == reader && !spillq_pos_equal(&this->ack, &this->read)) {
+		ssize_t len = spillq_seek(this, &this->ack);
+		if (len > 0) {
+			this->ack.off += spillq_record_size(len);
+			((struct spillq_header *)this->ack.seg->base)->acked = this->ack.off;
+			this->acked++;
+		}
+		spillq_retire(this);
+	}
+	pthread_mutex_unlock(&this->mutex);
+}
+
+json_object *spillq_json(struct spillq *this) {
+	json_object *j = json_object_new_object();
+	pthread_mutex_lock(&this->mutex);
+	json_object_object_add_ex(j, "segments", json_object_new_int(this->nsegments), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "spilled", json_object_new_uint64(this->spilled), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "replayed", json_object_new_uint64(this->replayed), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "acked", json_object_new_uint64(this->acked), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "dropped", json_object_new_uint64(this->dropped), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "corrupt", json_object_new_uint64(this->corrupt), JSON_C_CONSTANT_NEW);
+	json_object_object_add_ex(j, "errors", json_object_new_uint64(this->errors), JSON_C_CONSTANT_NEW);
+	pthread_mutex_unlock(&this->mutex);
+	return j;
+}
@@ -0,0 +1,117 @@
+#ifndef __SPILLQ_H__
+#define __SPILLQ_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <json-c/json_object.h>
+
+#include "conf.h"
+
+/*
+ * Append-only, memory-mapped spill queue stored as a sequence of
+ * fixed-size segment files in a directory.
+ *
+ * A segment file is named after its sequence number ("%016llx.spill").
+ * It starts with a header, followed by records:
+ * a length (4 bytes), a CRC32 of the data (4 bytes), then the data,
+ * padded to a multiple of 8 bytes. A zero length marks the end of
+ * the records in a segment.
+ *
+ * The header stores the offset of the first record not yet acknowledged,
+ * so a restart replays everything that was not acknowledged.
+ * Fully acknowledged segments are deleted.
+ *
+ * All segments from the oldest unacknowledged one to the write segment
+ * stay mapped, so appending, reading and acknowledging records are
+ * memory operations only. File creation, syncing and deletion are left
+ * to a helper thread, which also prepares the next write segment in advance.
+ *
+ * The number of segments can be limited, dropping either new records
+ * or the oldest segment when the limit is reached.
+ *
+ * Several tasks may share a spill queue while a configuration is reloaded,
+ * but only one of them reads it at a time.
+ */
+
+#define	SPILLQ_MAGIC		"MSQ1"
+#define	SPILLQ_SEGMENT_SIZE	(4*1024*1024)
+
+/* What to do when the queue is full */
+enum spillq_policy {
+	SPILLQ_DROP_OLDEST,		// delete the oldest segment
+	SPILLQ_DROP_NEW			// drop new records
+};
+
+struct spillq_header {
+	char magic[4];
+	uint32_t acked;			// offset of the first unacknowledged record
+	uint32_t reserved[2];
+};
+
+struct spillq_segment {
+	unsigned long long seq;
+	unsigned char *base;
+	char full;			// no more records will be appended
+	char synced;			// written back by the helper thread
+	struct spillq_segment *next;
+};
+
+/* Position in the queue */
+struct spillq_pos {
+	struct spillq_segment *seg;
+	size_t off;
+};
+
+struct spillq {
+	char *dir;
+	int refcnt;
+	pthread_mutex_t mutex;
+
+	/* Mapped segments, from the oldest unacknowledged one to the write segment */
+	struct spillq_segment *first, *last;
+	int nsegments;
+
+	/* Maximum number of segment files, including the prepared one, 0 = unlimited */
+	int max_segments;
+	enum spillq_policy policy;
+
+	/* Next write segment prepared by the helper thread, NULL if not ready yet */
+	struct spillq_segment *prepared;
+
+	/* Acknowledged segments, to be deleted by the helper thread */
+	struct spillq_segment *retired;
+
+	/* Next record to acknowledge, next record to read, end of written data */
+	struct spillq_pos ack, read, write;
+
+	/* Current reader, NULL if none */
+	const void *reader;
+
+	/* Records read from dropped segments, acknowledged without moving ack */
+	unsigned long long ack_skip;
+
+	/* Helper thread for file system operations */
+	pthread_t thread;
+	pthread_cond_t cond;
+	int stop;
+
+	/* Statistics */
+	unsigned long long spilled, replayed, acked, dropped, corrupt, errors;
+
+	/* Next in the list of open queues */
+	struct spillq *next;
+};
+
+struct log;
+struct spillq *spillq_open(const char *dir, struct log *log);
+void spillq_close(struct spillq *this, const void *reader);
+void spillq_set_limit(struct spillq *this, size_t max_size, enum spillq_policy policy);
+int spillq_append(struct spillq *this, const void *data, size_t len);
+int spillq_empty(struct spillq *this);
+struct packet *spillq_read(struct spillq *this, const void *reader, size_t max_len);
+void spillq_ack(struct spillq *this, const void *reader);
+json_object *spillq_json(struct spillq *this);
+
+#endif
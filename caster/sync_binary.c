@@ -0,0 +1,205 @@
+#include <string.h>
+
+#include <event2/buffer.h>
+
+#include "conf.h"
+#include "packet.h"
+#include "sync_binary.h"
+
+/*
+ * Writer and reader for the compact binary syncer encoding.
+ */
+
+int sync_binary_writer_init(struct sync_binary_writer *this) {
+	this->msg = evbuffer_new();
+	this->rec = evbuffer_new();
+	this->type = 0;
+	this->error = 0;
+	if (this->msg == NULL || this->rec == NULL
+	    || evbuffer_add(this->msg, SYNC_BINARY_MAGIC, SYNC_BINARY_MAGIC_LEN) < 0) {
+		sync_binary_writer_free(this);
+		return -1;
+	}
+	return 0;
+}
+
+void sync_binary_writer_free(struct sync_binary_writer *this) {
+	if (this->msg)
+		evbuffer_free(this->msg);
+	if (this->rec)
+		evbuffer_free(this->rec);
+	this->msg = NULL;
+	this->rec = NULL;
+}
+
+void sync_binary_record_begin(struct sync_binary_writer *this, enum sync_binary_record type) {
+	this->type = type;
+}
+
+/*
+ * Append the current record to the message, prefixed with its type and length.
+ */
+void sync_binary_record_end(struct sync_binary_writer *this) {
+	unsigned char header[5];
+	size_t len = evbuffer_get_length(this->rec);
+	header[0] = this->type;
+	header[1] = len >> 24;
+	header[2] = len >> 16;
+	header[3] = len >> 8;
+	header[4] = len;
+	if (evbuffer_add(this->msg, header, sizeof header) < 0
+	    || evbuffer_add_buffer(this->msg, this->rec) < 0)
+		this->error = 1;
+}
+
+void sync_binary_put_u8(struct sync_binary_writer *this, unsigned char v) {
+	if (evbuffer_add(this->rec, &v, 1) < 0)
+		this->error = 1;
+}
+
+void sync_binary_put_u16(struct sync_binary_writer *this, unsigned short v) {
+	unsigned char b[2] = {v >> 8, v};
+	if (evbuffer_add(this->rec, b, sizeof b) < 0)
+		this->error = 1;
+}
+
+void sync_binary_put_u32(struct sync_binary_writer *this, unsigned long v) {
+	unsigned char b[4] = {v >> 24, v >> 16, v >> 8, v};
+	if (evbuffer_add(this->rec, b, sizeof b) < 0)
+		this->error = 1;
+}
+
+void sync_binary_put_u64(struct sync_binary_writer *this, unsigned long long v) {
+	sync_binary_put_u32(this, v >> 32);
+	sync_binary_put_u32(this, v & 0xffffffff);
+}
+
+void sync_binary_put_string(struct sync_binary_writer *this, const char *s) {
+	size_t len = s ? strlen(s) : 0;
+	if (len > 0xffff) {
+		this->error = 1;
+		return;
+	}
+	sync_binary_put_u16(this, len);
+	if (len && evbuffer_add(this->rec, s, len) < 0)
+		this->error = 1;
+}
+
+/*
+ * Return the complete message as a packet, or NULL if out of memory.
+ */
+struct packet *sync_binary_packet(struct sync_binary_writer *this) {
+	if (this->error)
+		return NULL;
+	size_t len = evbuffer_get_length(this->msg);
+	struct packet *p = packet_new(len);
+	if (p == NULL)
+		return NULL;
+	evbuffer_copyout(this->msg, p->data, len);
+	return p;
+}
+
+/*
+ * Start reading a message.
+ * Return -1 if it does not start with the expected magic string.
+ */
+int sync_binary_reader_init(struct sync_binary_reader *this, const unsigned char *data, size_t len) {
+	this->type = 0;
+	this->msg_end = data + len;
+	if (len < SYNC_BINARY_MAGIC_LEN || memcmp(data, SYNC_BINARY_MAGIC, SYNC_BINARY_MAGIC_LEN)) {
+		this->error = 1;
+		this->p = this->end = this->next = this->msg_end;
+		return -1;
+	}
+	this->error = 0;
+	this->p = this->end = this->next = data + SYNC_BINARY_MAGIC_LEN;
+	return 0;
+}
+
+/*
+ * Move to the next record.
+ * Return 1 if found, 0 at the end of the message, -1 if truncated.
+ */
+int sync_binary_next_record(struct sync_binary_reader *this) {
+	if (this->error)
+		return -1;
+	if (this->next == this->msg_end)
+		return 0;
+	if (this->msg_end - this->next < 5) {
+		this->error = 1;
+		return -1;
+	}
+	const unsigned char *h = this->next;
+	size_t len = ((size_t)h[1] << 24) | ((size_t)h[2] << 16) | ((size_t)h[3] << 8) | h[4];
+	if (len > this->msg_end - h - 5) {
+		this->error = 1;
+		return -1;
+	}
+	this->type = h[0];
+	this->p = h + 5;
+	this->end = this->p + len;
+	this->next = this->end;
+	return 1;
+}
+
+/*
+ * Return the number of unread bytes in the current record.
+ */
+int sync_binary_remaining(struct sync_binary_reader *this) {
+	return this->end - this->p;
+}
+
+/*
+ * Check there are at least n unread bytes in the current record.
+ */
+static int sync_binary_check(struct sync_binary_reader *this, size_t n) {
+	if (this->error || this->end - this->p < n) {
+		this->error = 1;
+		return 0;
+	}
+	return 1;
+}
+
+unsigned char sync_binary_get_u8(struct sync_binary_reader *this) {
+	if (!sync_binary_check(this, 1))
+		return 0;
+	return *this->p++;
+}
+
+unsigned short sync_binary_get_u16(struct sync_binary_reader *this) {
+	if (!sync_binary_check(this, 2))
+		return 0;
+	unsigned short v = (this->p[0] << 8) | this->p[1];
+	this->p += 2;
+	return v;
+}
+
+unsigned long sync_binary_get_u32(struct sync_binary_reader *this) {
+	if (!sync_binary_check(this, 4))
+		return 0;
+	unsigned long v = ((unsigned long)this->p[0] << 24) | ((unsigned long)this->p[1] << 16)
+		| ((unsigned long)this->p[2] << 8) | this->p[3];
+	this->p += 4;
+	return v;
+}
+
+unsigned long long sync_binary_get_u64(struct sync_binary_reader *this) {
+	unsigned long long v = sync_binary_get_u32(this);
+	return (v << 32) | sync_binary_get_u32(this);
+}
+
+/*
+ * Copy a string to s as a null-terminated string.
+ * Return its length, or -1 if truncated or longer than size-1.
+ */
+int sync_binary_get_string(struct sync_binary_reader *this, char *s, size_t size) {
+	size_t len = sync_binary_get_u16(this);
+	if (!sync_binary_check(this, len) || len >= size) {
+		this->error = 1;
+		return -1;
+	}
+	memcpy(s, this->p, len);
+	s[len] = '\0';
+	this->p += len;
+	return len;
+}
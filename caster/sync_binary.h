@@ -0,0 +1,81 @@
+#ifndef __SYNC_BINARY_H__
+#define __SYNC_BINARY_H__
+
+#include <stddef.h>
+
+#include <event2/buffer.h>
+
+/*
+ * Compact binary encoding for syncer updates, as an alternative to Json.
+ *
+ * A message is the SYNC_BINARY_MAGIC string followed by records.
+ * A record is a type (1 byte), a payload length (4 bytes), then the payload.
+ * Integers are in network byte order. Strings are a 2-byte length
+ * followed by the characters, without a terminating '\0'.
+ *
+ * Unknown record types are skipped by the receiver.
+ */
+
+#define	SYNC_BINARY_MIME_TYPE	"application/vnd.millipede.sync"
+#define	SYNC_BINARY_MAGIC	"MSB1"
+#define	SYNC_BINARY_MAGIC_LEN	4
+
+/* Max length of a string we accept when decoding */
+#define	SYNC_BINARY_STRING_MAX	256
+
+enum sync_binary_record {
+	/* hostname, start_date, serial (8 bytes), update type (1 byte) */
+	SYNC_BINARY_REC_TABLE = 1,
+	/* host, port (2 bytes), tls (1 byte) */
+	SYNC_BINARY_REC_ENDPOINT = 2,
+	/* id (4 bytes), state (1 byte), type (1 byte), mountpoint (only on full tables and additions) */
+	SYNC_BINARY_REC_LIVESOURCE = 3,
+	/* update type (1 byte), then same as SYNC_BINARY_REC_LIVESOURCE */
+	SYNC_BINARY_REC_CHANGE = 4
+};
+
+enum sync_binary_update {
+	SYNC_BINARY_CHECKSERIAL = 0,
+	SYNC_BINARY_FULLTABLE = 1,
+	SYNC_BINARY_ADD = 2,
+	SYNC_BINARY_DEL = 3,
+	SYNC_BINARY_UPDATE = 4,
+	SYNC_BINARY_REPLAY = 5		// followed by SYNC_BINARY_REC_CHANGE records
+};
+
+struct sync_binary_writer {
+	struct evbuffer *msg;		// complete records
+	struct evbuffer *rec;		// current record payload
+	int type;			// current record type
+	int error;
+};
+
+struct sync_binary_reader {
+	const unsigned char *p, *end;	// current record payload
+	const unsigned char *next;	// next record
+	const unsigned char *msg_end;
+	int type;			// current record type
+	int error;
+};
+
+int sync_binary_writer_init(struct sync_binary_writer *this);
+void sync_binary_writer_free(struct sync_binary_writer *this);
+void sync_binary_record_begin(struct sync_binary_writer *this, enum sync_binary_record type);
+void sync_binary_record_end(struct sync_binary_writer *this);
+void sync_binary_put_u8(struct sync_binary_writer *this, unsigned char v);
+void sync_binary_put_u16(struct sync_binary_writer *this, unsigned short v);
+void sync_binary_put_u32(struct sync_binary_writer *this, unsigned long v);
+void sync_binary_put_u64(struct sync_binary_writer *this, unsigned long long v);
+void sync_binary_put_string(struct sync_binary_writer *this, const char *s);
+struct packet *sync_binary_packet(struct sync_binary_writer *this);
+
+int sync_binary_reader_init(struct sync_binary_reader *this, const unsigned char *data, size_t len);
+int sync_binary_next_record(struct sync_binary_reader *this);
+int sync_binary_remaining(struct sync_binary_reader *this);
+unsigned char sync_binary_get_u8(struct sync_binary_reader *this);
+unsigned short sync_binary_get_u16(struct sync_binary_reader *this);
+unsigned long sync_binary_get_u32(struct sync_binary_reader *this);
+unsigned long long sync_binary_get_u64(struct sync_binary_reader *this);
+int sync_binary_get_string(struct sync_binary_reader *this, char *s, size_t size);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdatomic.h>
 #include <string.h>
 
 #include <event2/http.h>
@@ -6,6 +7,8 @@
 #include "config.h"
 #include "ntrip_task.h"
 #include "ntripcli.h"
+#include "packet.h"
+#include "sync_binary.h"
 #include "syncer.h"
 #include "util.h"
 
@@ -29,13 +32,55 @@ static void queue_json(struct syncer *this, struct ntrip_task *task, json_object
 	packet_decref(packet);
 }
 
+/*
+ * Queue a binary API request to 1 node.
+ */
+static void queue_binary(struct syncer *this, struct ntrip_task *task, struct packet *packet) {
+	if (packet == NULL) {
+		logfmt(&task->caster->flog, LOG_CRIT, "out of memory in queue_binary");
+		return;
+	}
+	ntrip_task_queue_mime(task, packet, SYNC_BINARY_MIME_TYPE);
+	packet_decref(packet);
+}
+
+static int use_binary(struct syncer *this, int n) {
+	return atomic_load_explicit(&this->nodes[n].encoding, memory_order_relaxed) != SYNCER_ENCODING_JSON;
+}
+
 /*
  * Queue a full livesources table to 1 node.
  */
-static void queue_full(struct syncer *this, struct ntrip_task *task) {
-	json_object *j = livesource_full_update_json(task->caster, task->caster->livesources);
+static void queue_full(struct syncer *this, int n) {
+	struct ntrip_task *task = this->task[n];
 	logfmt(&task->caster->flog, LOG_DEBUG, "syncer queue full table, serial %lld", task->caster->livesources->serial);
-	queue_json(this, task, j);
+	if (use_binary(this, n))
+		queue_binary(this, task, livesource_full_update_binary(task->caster, task->caster->livesources));
+	else
+		queue_json(this, task, livesource_full_update_json(task->caster, task->caster->livesources));
+}
+
+/*
+ * Queue the changes a node missed since its serial.
+ * Return 1 if queued, 0 if nothing to queue, -1 if a full table is needed.
+ */
+static int queue_replay(struct syncer *this, int n, unsigned long long serial) {
+	struct ntrip_task *task = this->task[n];
+	int r;
+	logfmt(&task->caster->flog, LOG_DEBUG, "syncer queue %d replay from serial %llu, serial %lld",
+		n, serial, task->caster->livesources->serial);
+	if (use_binary(this, n)) {
+		struct packet *packet;
+		r = livesource_replay_binary(task->caster->livesources, serial, &packet);
+		if (r == 1)
+			queue_binary(this, task, packet);
+	} else {
+		json_object *j;
+		r = livesource_replay_json(task->caster->livesources, serial, &j);
+		if (r == 1)
+			queue_json(this, task, j);
+	}
+	return r;
 }
 
 /*
@@ -43,50 +88,68 @@ static void queue_full(struct syncer *this, struct ntrip_task *task) {
  */
 static void queue_checkserial(struct syncer *this, int n) {
 	struct ntrip_task *task = this->task[n];
-	json_object *j = livesource_checkserial_json(task->caster->livesources);
 	logfmt(&task->caster->flog, LOG_DEBUG, "syncer queue %d checkserial, serial %lld", n, task->caster->livesources->serial);
-	queue_json(this, task, j);
+	if (use_binary(this, n))
+		queue_binary(this, task, livesource_checkserial_binary(task->caster->livesources));
+	else
+		queue_json(this, task, livesource_checkserial_json(task->caster->livesources));
 }
 
 /*
- * Queue a JSON update provided as a char *, to all nodes.
+ * Queue an update to all nodes, in the encoding they accept.
+ *
+ * The binary version is optional. The Json version is only converted
+ * to a string if needed.
  */
-void syncer_queue(struct syncer *this, char *json) {
-	struct packet *packet = packet_new_from_string(json);
-	if (packet == NULL) {
-		logfmt(&this->caster->flog, LOG_CRIT, "Out of memory when allocating syncer output, dropping");
-		return;
-	}
+void syncer_queue(struct syncer *this, json_object *j, struct packet *binary) {
+	struct packet *packet = NULL;
+	const char *json = NULL;
 
 	for (int i = 0; i < this->ntask; i++) {
+		if (binary != NULL && use_binary(this, i)) {
+			if (this->task[i]->st)
+				ntrip_log(this->task[i]->st, LOG_DEBUG, "syncer %d queueing %zu bytes binary", i, binary->datalen);
+			ntrip_task_queue_mime(this->task[i], binary, SYNC_BINARY_MIME_TYPE);
+			continue;
+		}
+		if (packet == NULL) {
+			json = json_object_to_json_string(j);
+			packet = packet_new_from_string(json);
+			if (packet == NULL) {
+				logfmt(&this->caster->flog, LOG_CRIT, "Out of memory when allocating syncer output, dropping");
+				return;
+			}
+		}
 		if (this->task[i]->st)
 			ntrip_log(this->task[i]->st, LOG_DEBUG, "syncer %d queueing %.80s", i, json);
 		else
 			logfmt(&this->caster->flog, LOG_DEBUG, "syncer %d queueing %.80s (not running)", i, json);
 		ntrip_task_queue(this->task[i], packet);
 	}
-	packet_decref(packet);
+	if (packet != NULL)
+		packet_decref(packet);
 }
 
 /*
- * Convert and send a Json object
+ * Send an update, provided as Json and optionally in binary encoding.
  */
-void syncer_queue_json(struct caster_state *caster, json_object *j) {
-	if (j == NULL)
-		return;
-
-	struct config *config = caster_config_getref(caster);
-	if (config->dyn->syncers_count >= 1) {
-		char *s = mystrdup(json_object_to_json_string(j));
-		if (s != NULL) {
-			logfmt(&caster->flog, LOG_DEBUG, "syncer_queue_json %.80s", s);
-			syncer_queue(config->dyn->syncers[0], s);
-			strfree(s);
-		}
+void syncer_queue_update(struct caster_state *caster, json_object *j, struct packet *binary) {
+	if (j != NULL) {
+		struct config *config = caster_config_getref(caster);
+		if (config->dyn->syncers_count >= 1)
+			syncer_queue(config->dyn->syncers[0], j, binary);
+		config_decref(config);
+		json_object_put(j);
 	}
-	config_decref(config);
+	if (binary != NULL)
+		packet_decref(binary);
+}
 
-	json_object_put(j);
+/*
+ * Convert and send a Json object
+ */
+void syncer_queue_json(struct caster_state *caster, json_object *j) {
+	syncer_queue_update(caster, j, NULL);
 }
 
 /*
@@ -97,8 +160,20 @@ void syncer_queue_json(struct caster_state *caster, json_object *j) {
 static void
 end_cb(int ok, void *arg, int n) {
 	struct syncer *a = (struct syncer *)arg;
+	struct syncer_node *node = &a->nodes[n];
 	ntrip_task_clear_st(a->task[n]);
 
+	if (node->resync != SYNCER_RESYNC_NONE) {
+		/*
+		 * The node missed some updates: queued ones would be refused.
+		 * Replay the missing changes if we still have them, else send a full table.
+		 */
+		ntrip_task_drain_queue(a->task[n]);
+		if (node->resync != SYNCER_RESYNC_REPLAY || queue_replay(a, n, node->resync_serial) < 0)
+			queue_full(a, n);
+		node->resync = SYNCER_RESYNC_NONE;
+	}
+
 	/*
 	 * Queue a serial check for the next connection, to handle
 	 * cases where the node has been rebooted/restarted.
@@ -114,14 +189,56 @@ end_cb(int ok, void *arg, int n) {
 static void
 status_cb(void *arg, int status, int n) {
 	struct syncer *a = (struct syncer *)arg;
-	ntrip_log(a->task[n]->st, LOG_EDEBUG, "syncer status %d", a->task[n]->st->status_code);
+	struct ntrip_task *task = a->task[n];
+	int status_code = task->st->status_code;
+	ntrip_log(task->st, LOG_EDEBUG, "syncer status %d", status_code);
+
+	/* Check the encoding of the request this status applies to */
+	P_RWLOCK_RDLOCK(&task->mimeq_lock);
+	struct mime_content *m = task->pending ? STAILQ_FIRST(&task->mimeq) : NULL;
+	int binary_sent = m != NULL && !strcmp(m->mime_type, SYNC_BINARY_MIME_TYPE);
+	P_RWLOCK_UNLOCK(&task->mimeq_lock);
 
 	/* acknowledge/purge pending data anyway */
-	ntrip_task_ack_pending(a->task[n]);
+	ntrip_task_ack_pending(task);
+
+	if (binary_sent) {
+		int encoding = atomic_load(&a->nodes[n].encoding);
+		if (status_code == 200 || status_code == 409)
+			atomic_store(&a->nodes[n].encoding, SYNCER_ENCODING_BINARY);
+		else if (status_code == 415 || (status_code == 503 && encoding == SYNCER_ENCODING_BINARY_TRY)) {
+			/*
+			 * The node does not know the binary encoding (older versions reply 503).
+			 * Queued binary updates are superseded by the full table below.
+			 */
+			ntrip_log(task->st, LOG_NOTICE, "syncer: binary encoding refused by %s:%d, falling back to Json", task->host, task->port);
+			atomic_store(&a->nodes[n].encoding, SYNCER_ENCODING_JSON);
+			ntrip_task_drain_queue(task);
+		}
+	}
 
-	/* If the call failed, requeue a full table */
-	if (a->task[n]->st->status_code != 200)
-		queue_full(a, a->task[n]);
+	if (status_code == 409)
+		/* Serial mismatch, handled in end_cb() depending on the node serial */
+		a->nodes[n].resync = SYNCER_RESYNC_FULL;
+	else if (status_code != 200)
+		/* If the call failed, requeue a full table */
+		queue_full(a, n);
+}
+
+/*
+ * Handle headers in server reply, to get the node serial on a 409 status.
+ */
+static void
+header_cb(void *arg, const char *key, const char *value, int n) {
+	struct syncer *a = (struct syncer *)arg;
+	struct syncer_node *node = &a->nodes[n];
+	unsigned long long serial;
+
+	if (node->resync != SYNCER_RESYNC_NONE && !strcasecmp(key, "x-sync-serial")
+	    && sscanf(value, "%llu", &serial) == 1) {
+		node->resync_serial = serial;
+		node->resync = SYNCER_RESYNC_REPLAY;
+	}
 }
 
 /*
@@ -165,6 +282,8 @@ static struct ntrip_task *syncer_task_new(struct caster_state *caster, struct sy
 	task->method = "POST";
 	task->status_cb = status_cb;
 	task->status_cb_arg = syncer;
+	task->header_cb = header_cb;
+	task->header_cb_arg = syncer;
 	task->end_cb = end_cb;
 	task->end_cb_arg = syncer;
 	task->restart_cb = syncer_start;
@@ -184,18 +303,28 @@ int syncer_reload(struct syncer *this,
 	struct config_node *node, int node_count, const char *uri,
 	int bulk_max_size) {
 	struct ntrip_task **tasks = (struct ntrip_task **)calloc(sizeof(struct ntrip_task *)*node_count, 1);
+	struct syncer_node *nodes = (struct syncer_node *)malloc(sizeof(struct syncer_node)*(node_count ? node_count : 1));
 	int ntask = node_count;
 	int err = 0;
-	if (tasks == NULL)
+	if (tasks == NULL || nodes == NULL) {
+		free(tasks);
+		free(nodes);
 		return -1;
+	}
 
 	for (int i = 0; i < node_count; i++) {
 		struct ntrip_task *nt = NULL;
+		atomic_init(&nodes[i].encoding, node[i].sync_binary ? SYNCER_ENCODING_BINARY_TRY : SYNCER_ENCODING_JSON);
+		nodes[i].resync = SYNCER_RESYNC_NONE;
+		nodes[i].resync_serial = 0;
 		if (this->task != NULL) {
 			for (int j = 0; j < this->ntask; j++) {
 				if (!compare_node_task(&node[i], this->task[j])) {
 					nt = this->task[j];
 					ntrip_task_incref(nt);
+					/* Keep what we learnt about the node */
+					if (node[i].sync_binary)
+						atomic_init(&nodes[i].encoding, atomic_load(&this->nodes[j].encoding));
 					break;
 				}
 			}
@@ -215,6 +344,7 @@ int syncer_reload(struct syncer *this,
 			if (tasks[i] != NULL)
 				ntrip_task_decref(tasks[i]);
 		free(tasks);
+		free(nodes);
 		return -1;
 	}
 
@@ -222,7 +352,9 @@ int syncer_reload(struct syncer *this,
 	for (int i = 0; i < this->ntask; i++)
 		ntrip_task_decref(this->task[i]);
 	free(this->task);
+	free(this->nodes);
 	this->task = tasks;
+	this->nodes = nodes;
 	this->ntask = ntask;
 	return 0;
 }
@@ -247,6 +379,7 @@ struct syncer *syncer_new(struct caster_state *caster,
 
 	this->caster = caster;
 	this->task = NULL;
+	this->nodes = NULL;
 	this->ntask = 0;
 
 	if (syncer_reload(this, node, node_count, uri, bulk_max_size) < 0) {
@@ -263,6 +396,7 @@ void syncer_free(struct syncer *this) {
 		this->task[i] = NULL;
 	}
 	free(this->task);
+	free(this->nodes);
 	free(this);
 }
 
@@ -273,7 +407,7 @@ static void
 syncer_start_config(void *arg_cb, int n, struct config *new_config) {
 	struct syncer *a = (struct syncer *)arg_cb;
 	struct ntrip_task *task = a->task[n];
-	queue_full(a, task);
+	queue_full(a, n);
 	ntrip_task_start(task, a, NULL, 0, new_config);
 }
 
@@ -5,14 +5,40 @@
 #include "ntrip_task.h"
 #include "util.h"
 
+enum syncer_encoding {
+	SYNCER_ENCODING_JSON,
+	SYNCER_ENCODING_BINARY_TRY,	// binary, not yet accepted by the node
+	SYNCER_ENCODING_BINARY		// binary, accepted by the node
+};
+
+enum syncer_resync {
+	SYNCER_RESYNC_NONE,
+	SYNCER_RESYNC_FULL,		// serial mismatch, replay not possible
+	SYNCER_RESYNC_REPLAY		// serial mismatch, node serial received
+};
+
+/*
+ * Per node state
+ */
+struct syncer_node {
+	_Atomic int encoding;		// enum syncer_encoding
+	/* Only accessed with the ntrip_state lock */
+	enum syncer_resync resync;
+	unsigned long long resync_serial;	// serial of the node
+};
+
 struct syncer {
 	struct ntrip_task **task;
+	struct syncer_node *nodes;	// by task
 	int ntask;
 	struct caster_state *caster;
 };
 
-void syncer_queue(struct syncer *this, char *json);
+struct packet;
+
+void syncer_queue(struct syncer *this, json_object *j, struct packet *binary);
 void syncer_queue_json(struct caster_state *caster, json_object *j);
+void syncer_queue_update(struct caster_state *caster, json_object *j, struct packet *binary);
 int syncer_reload(struct syncer *this,
 	struct config_node *node, int node_count, const char *uri,
 	int bulk_max_size);
@@ -3,12 +3,34 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/thread.h>
+#include <zlib.h>
 
 #include "bitfield.h"
+#include "caster.h"
 #include "conf.h"
+#include "geoindex.h"
 #include "ip.h"
+#include "jobs.h"
+#include "json_stream.h"
+#include "livesource.h"
 #include "log.h"
+#include "nodes.h"
+#include "ntrip_common.h"
+#include "ntrip_task.h"
+#include "request.h"
 #include "rtcm.h"
+#include "sourceline.h"
+#include "sourcetable.h"
+#include "spillq.h"
+#include "sync_binary.h"
 #include "util.h"
 
 static int urldecode_test() {
@@ -517,6 +539,8 @@ static int test_msm7_msm4() {
 	    {0, 0, NULL, 0, 0, NULL}
 	};
 
+	struct rtcm_filter *filter = rtcm_filter_new("msm4", "1005,1006", "1077,1087,1097", RTCM_CONV_MSM7_4);
+
 	for (struct test *tl = testlist; tl->data7; tl++) {
 		struct packet *p7 = packet_new(tl->len7);
 		memcpy(p7->data, tl->data7, tl->len7);
@@ -537,13 +561,222 @@ static int test_msm7_msm4() {
 			printf("FAIL on %d: bad conversion\n", tl->type7);
 		} else
 			putchar('.');
+
+		/* Same conversion through a filter, computed once and cached on the packet */
+		struct packet *pf = rtcm_filter_packet(filter, NULL, p7);
+		if (pf == NULL || pf->datalen != tl->len4 || memcmp(pf->data, tl->data4, tl->len4)) {
+			fail++;
+			printf("FAIL on %d: bad filter conversion\n", tl->type7);
+		} else if (rtcm_filter_packet(filter, NULL, p7) != pf) {
+			fail++;
+			printf("FAIL on %d: filter conversion not cached\n", tl->type7);
+		} else
+			putchar('.');
+
 		packet_decref(p7);
 		if (p)
 			packet_decref(p);
 	}
+	rtcm_filter_decref(filter);
+
+	putchar('\n');
+
+	return fail;
+}
+
+/*
+ * Check hash table operations against a plain array, through growth
+ * and many deletions.
+ */
+static int hash_table_test() {
+	int fail = 0;
+	puts("hash_table");
+
+	int n = 5000;
+	char (*keys)[16] = malloc(n*sizeof(*keys));
+	char *present = calloc(n, 1);
+	struct hash_table *h = hash_table_new(5, hash_table_free_null);
+	int npresent = 0;
+
+	for (int i = 0; i < n; i++)
+		snprintf(keys[i], sizeof keys[i], "K%d", i);
+
+	for (int round = 0; round < 50000; round++) {
+		int i = random() % n;
+		if (random() % 3) {
+			int r = hash_table_add(h, keys[i], keys[i]);
+			if (r != (present[i] ? -1 : 0)) {
+				fail++;
+				printf("FAIL: add %s returned %d\n", keys[i], r);
+			}
+			if (!present[i])
+				npresent++;
+			present[i] = 1;
+		} else {
+			int r = hash_table_del(h, keys[i]);
+			if (r != (present[i] ? 0 : -1)) {
+				fail++;
+				printf("FAIL: del %s returned %d\n", keys[i], r);
+			}
+			if (present[i])
+				npresent--;
+			present[i] = 0;
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct element *e = hash_table_get_element(h, keys[i]);
+		if ((e != NULL) != present[i] || (e && (e->value != keys[i] || strcmp(e->key, keys[i])))) {
+			fail++;
+			printf("FAIL: bad lookup for %s\n", keys[i]);
+		}
+	}
 
+	struct hash_iterator hi;
+	struct element *e;
+	int count = 0;
+	HASH_FOREACH(e, h, hi)
+		count++;
+	if (count != npresent || hash_len(h) != npresent) {
+		fail++;
+		printf("FAIL: %d entries iterated, %d counted, expected %d\n", count, hash_len(h), npresent);
+	}
+	if (!fail)
+		putchar('.');
 	putchar('\n');
 
+	hash_table_free(h);
+	free(present);
+	free(keys);
+	return fail;
+}
+
+/*
+ * Reference bitwise CRC24Q implementation.
+ */
+static unsigned long test_crc24q(const unsigned char *data, size_t len) {
+	unsigned long crc = 0;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= (unsigned long)data[i] << 16;
+		for (int b = 0; b < 8; b++) {
+			crc <<= 1;
+			if (crc & 0x1000000)
+				crc ^= 0x1864cfb;
+		}
+	}
+	return crc & 0xffffff;
+}
+
+/*
+ * Cross-check the CRC24Q implementations, on whole and split buffers.
+ */
+static int crc24q_test() {
+	int fail = 0;
+	puts("crc24q");
+
+	unsigned char data[1100];
+	for (int i = 0; i < sizeof data; i++)
+		data[i] = random();
+
+	for (size_t len = 0; len <= 1040; len++) {
+		int offset = len % 8;
+		unsigned long ref = test_crc24q(data+offset, len);
+		unsigned long bytewise = rtcm_crc24q_update_bytewise(0, data+offset, len);
+		unsigned long sliced = rtcm_crc24q_hash(data+offset, len);
+		size_t split = len / 3;
+		unsigned long incremental = rtcm_crc24q_update(rtcm_crc24q_update(0, data+offset, split), data+offset+split, len-split);
+		if (bytewise != ref || sliced != ref || incremental != ref) {
+			printf("FAIL: len %zd: ref %06lx bytewise %06lx sliced %06lx incremental %06lx\n",
+				len, ref, bytewise, sliced, incremental);
+			fail++;
+		}
+	}
+	if (!fail)
+		putchar('.');
+	putchar('\n');
+	return fail;
+}
+
+/*
+ * Build a RTCM frame with a given payload length, return its total length.
+ */
+static size_t test_rtcm_frame(unsigned char *frame, size_t payload_len, int seed) {
+	frame[0] = 0xd3;
+	frame[1] = payload_len >> 8;
+	frame[2] = payload_len & 0xff;
+	for (size_t i = 0; i < payload_len; i++)
+		frame[3+i] = (i*7 + seed) % 251;
+	unsigned long crc = test_crc24q(frame, payload_len+3);
+	frame[payload_len+3] = crc >> 16;
+	frame[payload_len+4] = crc >> 8;
+	frame[payload_len+5] = crc;
+	return payload_len + 6;
+}
+
+/*
+ * Check RTCM framing on input buffers split in many extents.
+ */
+static int rtcm_packet_extract_test() {
+	int fail = 0;
+	puts("rtcm_packet_extract");
+
+	unsigned char stream[3000];
+	size_t len = 0;
+	memcpy(stream, "junk", 4);
+	len += 4;
+	size_t frame1 = len;
+	len += test_rtcm_frame(stream+len, 1023, 1);
+	size_t frame2 = len;
+	len += test_rtcm_frame(stream+len, 200, 2);
+	stream[len-1] ^= 1;			// corrupt the CRC
+	size_t frame3 = len;
+	len += test_rtcm_frame(stream+len, 10, 3);
+	size_t partial = len;
+	len += test_rtcm_frame(stream+len, 500, 4) - 100;
+
+	struct {
+		enum rtcm_frame type;
+		size_t start, end;
+	} expect[] = {
+		{RTCM_FRAME_RAW, 0, frame1},
+		{RTCM_FRAME_RTCM, frame1, frame2},
+		{RTCM_FRAME_BAD_CRC, frame2, frame3},
+		{RTCM_FRAME_RTCM, frame3, partial},
+		{RTCM_FRAME_NEED_MORE, 0, 0}
+	};
+
+	/* Chunk sizes, from very fragmented (pullup fallback) to contiguous */
+	int chunks[] = {1, 2, 3, 7, 100, 1000, 3000};
+	for (int c = 0; c < sizeof chunks/sizeof chunks[0]; c++) {
+		struct evbuffer *input = evbuffer_new();
+		for (size_t i = 0; i < len; i += chunks[c])
+			evbuffer_add_reference(input, stream+i, (len-i) < chunks[c] ? len-i : chunks[c], NULL, NULL);
+		int ok = 1;
+		for (int i = 0; i < sizeof expect/sizeof expect[0]; i++) {
+			struct packet *p;
+			enum rtcm_frame r = rtcm_packet_extract(input, &p);
+			if (r != expect[i].type
+			    || (p == NULL) != (r == RTCM_FRAME_NEED_MORE)
+			    || (p && (p->datalen != expect[i].end - expect[i].start
+					|| memcmp(p->data, stream + expect[i].start, p->datalen)
+					|| p->is_rtcm != (r == RTCM_FRAME_RTCM)))) {
+				printf("FAIL: chunk size %d, frame %d: got type %d\n", chunks[c], i, r);
+				ok = 0;
+			}
+			if (p)
+				packet_decref(p);
+		}
+		if (evbuffer_get_length(input) != len - partial) {
+			printf("FAIL: chunk size %d, partial frame not kept\n", chunks[c]);
+			ok = 0;
+		}
+		if (ok)
+			putchar('.');
+		else
+			fail++;
+		evbuffer_free(input);
+	}
+	putchar('\n');
 	return fail;
 }
 
@@ -679,6 +912,1116 @@ static int file_parse_test(const char *test_dir) {
 			putchar('.');
 		file_free(f);
 	}
+	log_free(&flog);
+	return fail;
+}
+
+static void geoindex_count_cb(struct sourceline *sourceline, float dist, void *arg) {
+	(*(int *)arg)++;
+}
+
+/*
+ * Check grid lookups in a sorted geoindex against a linear scan.
+ */
+static int geoindex_test() {
+	int fail = 0;
+	puts("geoindex");
+	struct {
+		pos_t pos;
+		float max_dist;
+	} testlist[] = {
+		{{48.8, 2.3}, 50000},
+		{{48.8, 2.3}, 1000000},
+		{{-33.9, 151.2}, 300000},
+		{{0, 179.9}, 500000},
+		{{0, -179.9}, 500000},
+		{{89.5, 10}, 200000},
+		{{-89.5, -10}, 2000000},
+		{{45, 0}, 8000000},
+		{{0, 0}, 0}
+	};
+	struct geoindex *sorted = geoindex_new();
+	struct geoindex *unsorted = geoindex_new();
+	int nlines = 2000;
+	struct sourceline **lines = (struct sourceline **)malloc(nlines*sizeof(struct sourceline *));
+
+	srandom(1);
+	for (int i = 0; i < nlines; i++) {
+		char key[16];
+		snprintf(key, sizeof key, "MP%d", i);
+		lines[i] = sourceline_new("LOCAL", 0, 0, key, "STR;");
+		lines[i]->pos.lat = (random() % 180000) / 1000. - 90;
+		lines[i]->pos.lon = (random() % 360000) / 1000. - 180;
+		geoindex_add(sorted, lines[i]);
+		geoindex_add(unsorted, lines[i]);
+	}
+	geoindex_sort(sorted);
+	unsorted->sorted = 0;
+
+	for (int i = 0; testlist[i].max_dist; i++) {
+		int n1 = 0, n2 = 0;
+		geoindex_foreach(sorted, &testlist[i].pos, testlist[i].max_dist, geoindex_count_cb, &n1);
+		geoindex_foreach(unsorted, &testlist[i].pos, testlist[i].max_dist, geoindex_count_cb, &n2);
+		if (n1 == n2)
+			putchar('.');
+		else {
+			printf("\nFAIL: (%f, %f) %.0f m: %d entries vs %d\n", testlist[i].pos.lat, testlist[i].pos.lon, testlist[i].max_dist, n1, n2);
+			fail++;
+		}
+	}
+
+	/* Removals are only compacted by the next sort, lookups skip them */
+	for (int i = 0; i < nlines; i += 2) {
+		fail += geoindex_del(sorted, lines[i]) != 0;
+		fail += geoindex_del(unsorted, lines[i]) != 0;
+	}
+	fail += geoindex_del(sorted, lines[0]) != -1;
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; testlist[i].max_dist; i++) {
+			int n1 = 0, n2 = 0;
+			geoindex_foreach(sorted, &testlist[i].pos, testlist[i].max_dist, geoindex_count_cb, &n1);
+			geoindex_foreach(unsorted, &testlist[i].pos, testlist[i].max_dist, geoindex_count_cb, &n2);
+			if (n1 == n2)
+				putchar('.');
+			else {
+				printf("\nFAIL: after removals, (%f, %f) %.0f m: %d entries vs %d\n", testlist[i].pos.lat, testlist[i].pos.lon, testlist[i].max_dist, n1, n2);
+				fail++;
+			}
+		}
+		geoindex_sort(sorted);
+	}
+	if (sorted->n != nlines/2 || !sorted->sorted) {
+		printf("\nFAIL: %d entries after compaction\n", sorted->n);
+		fail++;
+	}
+	putchar('\n');
+
+	geoindex_free(sorted);
+	geoindex_free(unsorted);
+	for (int i = 0; i < nlines; i++)
+		sourceline_decref(lines[i]);
+	free(lines);
+	return fail;
+}
+
+static struct caster_state *sourcetable_update_test_caster();
+static void sourcetable_update_test_caster_free(struct caster_state *caster);
+
+/*
+ * Check the rendering of a sourcetable body,
+ * and its caching for the sourcetable stack.
+ */
+static int sourcetable_get_test() {
+	int fail = 0;
+	puts("sourcetable_get");
+	const char *lines[] = {
+		"CAS;caster.example.com;2101;TEST;Test;0;FRA;48.8;2.3;0.0.0.0;0;http://example.com",
+		"STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;",
+		"STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;",
+		NULL
+	};
+	const char *expect =
+		"CAS;caster.example.com;2101;TEST;Test;0;FRA;48.8;2.3;0.0.0.0;0;http://example.com\r\n"
+		"STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;\r\n"
+		"STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;\r\n"
+		"ENDSOURCETABLE\r\n";
+
+	struct sourcetable *sourcetable = sourcetable_new("LOCAL", 0, 0, NULL);
+	for (const char **line = lines; *line; line++)
+		if (sourcetable_add(sourcetable, *line, 0, NULL) < 0) {
+			printf("FAIL: can't add %s\n", *line);
+			fail++;
+		}
+
+	struct mime_content *m = sourcetable_get(sourcetable);
+	if (m == NULL || m->len != strlen(expect) || memcmp(m->s, expect, m->len)) {
+		printf("FAIL: bad sourcetable body\n");
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+	if (m)
+		mime_free(m);
+
+	/* A later out-of-order addition must be sorted again */
+	const char *expect2 =
+		"CAS;caster.example.com;2101;TEST;Test;0;FRA;48.8;2.3;0.0.0.0;0;http://example.com\r\n"
+		"STR;MP0;Nice;RTCM 3.3;;2;GPS+GLO;NONE;FRA;43.70;7.27;0;0;none;none;B;N;0;\r\n"
+		"STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;\r\n"
+		"STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;\r\n"
+		"ENDSOURCETABLE\r\n";
+	if (sourcetable_add(sourcetable, "STR;MP0;Nice;RTCM 3.3;;2;GPS+GLO;NONE;FRA;43.70;7.27;0;0;none;none;B;N;0;", 0, NULL) < 0) {
+		printf("FAIL: can't add MP0\n");
+		fail++;
+	}
+	m = sourcetable_get(sourcetable);
+	if (m == NULL || m->len != strlen(expect2) || memcmp(m->s, expect2, m->len)) {
+		printf("FAIL: bad sourcetable body after update\n");
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+	if (m)
+		mime_free(m);
+
+	/*
+	 * Stack body: rendered once and reused while nothing changes,
+	 * rendered again after a live state, table or stack update.
+	 */
+	struct caster_state *caster = sourcetable_update_test_caster();
+	sourcetable_stack_t *stack = &caster->sourcetablestack;
+	struct sourcetable *remote = sourcetable_new("caster.example.com", 2101, 0, NULL);
+	sourcetable_add(remote, lines[1], 0, NULL);
+	stack_replace_host(caster, stack, remote->caster, remote->port, remote);
+
+	struct mime_content *m1 = stack_sourcetable_get(caster, stack);
+	struct mime_content *m2 = stack_sourcetable_get(caster, stack);
+	if (m1 == NULL || m2 == NULL || m1->packet == NULL || m1->packet != m2->packet) {
+		printf("FAIL: stack sourcetable body not reused\n");
+		fail++;
+	} else
+		putchar('.');
+	if (m2) mime_free(m2);
+
+	stack_invalidate(stack);
+	m2 = stack_sourcetable_get(caster, stack);
+	if (m1 == NULL || m2 == NULL || m2->packet == m1->packet
+	    || m2->len != m1->len || memcmp(m2->s, m1->s, m1->len)) {
+		printf("FAIL: stack sourcetable body not rebuilt after invalidation\n");
+		fail++;
+	} else
+		putchar('.');
+	if (m1) mime_free(m1);
+	m1 = m2;
+
+	/* In-place table update */
+	struct timeval fetch_time;
+	gettimeofday(&fetch_time, NULL);
+	struct sourcetable_update *u = sourcetable_update_new(remote, remote->caster, remote->port, 0, NULL);
+	sourcetable_update_add(u, lines[1], 0, caster);
+	sourcetable_update_add(u, lines[2], 0, caster);
+	int r = sourcetable_update_apply(caster, stack, u, &fetch_time, NULL);
+	sourcetable_update_free(u);
+	m2 = stack_sourcetable_get(caster, stack);
+	if (r != 1 || m1 == NULL || m2 == NULL || m2->packet == m1->packet
+	    || memmem(m2->s, m2->len, "STR;MP1;", 8) == NULL) {
+		printf("FAIL: stack sourcetable body not rebuilt after table update\n");
+		fail++;
+	} else
+		putchar('.');
+	if (m1) mime_free(m1);
+	m1 = m2;
+
+	/* Table removed from the stack */
+	stack_replace_host(caster, stack, remote->caster, remote->port, NULL);
+	m2 = stack_sourcetable_get(caster, stack);
+	if (m1 == NULL || m2 == NULL || m2->packet == m1->packet
+	    || memmem(m2->s, m2->len, "STR;", 4) != NULL) {
+		printf("FAIL: stack sourcetable body not rebuilt after stack update\n");
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+	if (m1) mime_free(m1);
+	if (m2) mime_free(m2);
+
+	sourcetable_decref(remote);
+	sourcetable_update_test_caster_free(caster);
+	sourcetable_decref(sourcetable);
+	return fail;
+}
+
+static void *packet_pool_test_free(void *arg) {
+	struct packet **packets = (struct packet **)arg;
+	for (int i = 0; i < 256; i++)
+		packet_decref(packets[i]);
+	return NULL;
+}
+
+/*
+ * Check packet reuse by the packet pools, including packets freed by another thread.
+ */
+static int packet_pool_test() {
+	int fail = 0;
+	puts("packet_pool");
+
+	struct packet *p = packet_new(1029);
+	struct packet *big = packet_new(1030);
+	if (p->pool < 0 || big->pool != -1) {
+		printf("FAIL: bad size classes %d %d\n", p->pool, big->pool);
+		fail++;
+	} else
+		putchar('.');
+	packet_decref(big);
+	struct packet *prev = p;
+	packet_decref(p);
+	p = packet_new(1000);
+	if (p != prev) {
+		printf("FAIL: packet not reused from the thread cache\n");
+		fail++;
+	} else
+		putchar('.');
+	packet_decref(p);
+
+	struct packet *packets[256], *freed[256];
+	for (int i = 0; i < 256; i++)
+		freed[i] = packets[i] = packet_new(100);
+	pthread_t thread;
+	pthread_create(&thread, NULL, packet_pool_test_free, packets);
+	pthread_join(thread, NULL);
+
+	/* The other thread flushed its cache on exit, all packets should be reusable here */
+	int reused = 0;
+	for (int i = 0; i < 256; i++) {
+		packets[i] = packet_new(100);
+		for (int j = 0; j < 256; j++)
+			if (packets[i] == freed[j]) {
+				reused++;
+				break;
+			}
+	}
+	if (reused < 256) {
+		printf("FAIL: only %d packets reused across threads\n", reused);
+		fail++;
+	} else
+		putchar('.');
+	for (int i = 0; i < 256; i++)
+		packet_decref(packets[i]);
+	putchar('\n');
+	return fail;
+}
+
+static void bench_log_cb(void *arg, struct gelf_entry *g, int level, const char *fmt, va_list ap) {
+}
+
+static double bench_elapsed_us(struct timespec *t0, struct timespec *t1) {
+	return (t1->tv_sec - t0->tv_sec)*1e6 + (t1->tv_nsec - t0->tv_nsec)/1e3;
+}
+
+/*
+ * Benchmark packet fan-out from a livesource to its subscribers.
+ * Not a pass/fail test: only displays timings.
+ */
+static int bench_livesource_send_subscribers() {
+	int sizes[] = {1000, 10000, 50000, 0};
+	int batches[] = {1, 8, 0};
+	int npackets = 24;
+	puts("bench_livesource_send_subscribers");
+
+	struct event_base *base = event_base_new();
+	struct caster_state *caster = (struct caster_state *)calloc(1, sizeof(struct caster_state));
+	log_init(&caster->flog, NULL, bench_log_cb, -1, -1, -1, -1, caster);
+	atomic_store(&caster->backlog_evbuffer, 1000000000);
+
+	struct packet *packet = packet_new(100);
+	memset(packet->data, 0, packet->datalen);
+	struct packet *packets[8];
+	for (int i = 0; i < 8; i++)
+		packets[i] = packet;
+
+	for (int *size = sizes; *size; size++) {
+		int nsubs = *size;
+		struct livesource *livesource = livesource_new("BENCH", LIVESOURCE_TYPE_DIRECT, LIVESOURCE_RUNNING);
+		struct ntrip_state **sts = (struct ntrip_state **)malloc(nsubs*sizeof(struct ntrip_state *));
+
+		for (int i = 0; i < nsubs; i++) {
+			struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+			st->caster = caster;
+			st->bev = bufferevent_socket_new(base, -1, 0);
+			/* Allow draining the output buffer from here */
+			evbuffer_unfreeze(bufferevent_get_output(st->bev), 1);
+			ntrip_set_state(st, NTRIP_WAIT_CLIENT_INPUT);
+			atomic_store(&st->rtcm_client_state, NTRIP_RTCM_POS_OK);
+			livesource_add_subscriber(st, livesource, NULL);
+			sts[i] = st;
+		}
+
+		/* One packet per call, then batches of a typical epoch size */
+		for (int *batch = batches; *batch; batch++) {
+			double total_us = 0;
+			for (int j = 0; j < npackets; j += *batch) {
+				struct timespec t0, t1;
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+				livesource_send_subscribers(livesource, packets, *batch, caster);
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+				total_us += bench_elapsed_us(&t0, &t1);
+				for (int i = 0; i < nsubs; i++) {
+					struct evbuffer *output = bufferevent_get_output(sts[i]->bev);
+					evbuffer_drain(output, evbuffer_get_length(output));
+				}
+			}
+			printf("%6d subscribers, batch %d: %10.1f us per packet, %.3f us per subscriber\n",
+				nsubs, *batch, total_us/npackets, total_us/npackets/nsubs);
+		}
+
+		for (int i = 0; i < nsubs; i++) {
+			livesource_del_subscriber(sts[i]);
+			bufferevent_free(sts[i]->bev);
+			free(sts[i]);
+		}
+		free(sts);
+		livesource_decref(livesource);
+	}
+	packet_decref(packet);
+	log_free(&caster->flog);
+	free(caster);
+	event_base_free(base);
+	return 0;
+}
+
+/*
+ * Check sharded fan-out: packets are sent from the event loop of each shard,
+ * and a stalled shard loop drops its subscribers instead of queueing forever.
+ */
+static int livesource_shard_test() {
+	int fail = 0, nsubs = 4;
+	struct ntrip_state *sts[4];
+	puts("livesource_shard_test");
+
+	int old_threads = threads;
+	threads = 1;
+	evthread_use_pthreads();
+	struct event_base *bases[2] = {event_base_new(), event_base_new()};
+	struct caster_state *caster = (struct caster_state *)calloc(1, sizeof(struct caster_state));
+	log_init(&caster->flog, NULL, bench_log_cb, -1, -1, -1, -1, caster);
+	atomic_store(&caster->backlog_evbuffer, 1000);
+	caster->base = bases;
+	atomic_store(&caster->nbase, 2);
+
+	struct packet *packet = packet_new(100);
+	memset(packet->data, 0, packet->datalen);
+	struct packet *packets[4] = {packet, packet, packet, packet};
+
+	struct livesource *livesource = livesource_new("SHARD", LIVESOURCE_TYPE_DIRECT, LIVESOURCE_RUNNING);
+	for (int i = 0; i < nsubs; i++) {
+		struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+		st->caster = caster;
+		st->bev = bufferevent_socket_new(bases[i % 2], -1, BEV_OPT_THREADSAFE);
+		evbuffer_unfreeze(bufferevent_get_output(st->bev), 1);
+		ntrip_set_state(st, NTRIP_WAIT_CLIENT_INPUT);
+		atomic_store(&st->rtcm_client_state, NTRIP_RTCM_POS_OK);
+		livesource_add_subscriber(st, livesource, NULL);
+		sts[i] = st;
+	}
+
+	/* Nothing sent until the shard loops run */
+	livesource_send_subscribers(livesource, packets, 4, caster);
+	fail += evbuffer_get_length(bufferevent_get_output(sts[0]->bev)) != 0;
+	event_base_loop(bases[0], EVLOOP_NONBLOCK);
+	event_base_loop(bases[1], EVLOOP_NONBLOCK);
+	for (int i = 0; i < nsubs; i++) {
+		struct evbuffer *output = bufferevent_get_output(sts[i]->bev);
+		if (evbuffer_get_length(output) != 400) {
+			printf("FAIL: shard fan-out sent %zu bytes to subscriber %d\n", evbuffer_get_length(output), i);
+			fail++;
+		}
+		evbuffer_drain(output, evbuffer_get_length(output));
+	}
+
+	/* Shard 1 stalled: its queue is capped, and its subscribers dropped */
+	for (int j = 0; j < 10; j++) {
+		for (int i = 0; i < nsubs; i += 2) {
+			struct evbuffer *output = bufferevent_get_output(sts[i]->bev);
+			evbuffer_drain(output, evbuffer_get_length(output));
+		}
+		livesource_send_subscribers(livesource, packets, 4, caster);
+		event_base_loop(bases[0], EVLOOP_NONBLOCK);
+	}
+	if (livesource->shards[1]->queue_bytes > 1000 || livesource->shards[1]->queue_size > 16) {
+		printf("FAIL: shard queue %zu bytes, size %d\n", livesource->shards[1]->queue_bytes, livesource->shards[1]->queue_size);
+		fail++;
+	}
+	event_base_loop(bases[1], EVLOOP_NONBLOCK);
+	for (int i = 0; i < nsubs; i++) {
+		int subscribed = sts[i]->subscription != NULL;
+		size_t len = evbuffer_get_length(bufferevent_get_output(sts[i]->bev));
+		if (subscribed != (i % 2 == 0) || len != (i % 2 == 0 ? 400 : 800)) {
+			printf("FAIL: shard subscriber %d, subscribed %d, %zu bytes\n", i, subscribed, len);
+			fail++;
+		}
+	}
+	if (fail == 0)
+		putchar('.');
+	putchar('\n');
+
+	for (int i = 0; i < nsubs; i++) {
+		livesource_del_subscriber(sts[i]);
+		bufferevent_free(sts[i]->bev);
+		free(sts[i]);
+	}
+	livesource_decref(livesource);
+	packet_decref(packet);
+	log_free(&caster->flog);
+	free(caster);
+	event_base_free(bases[0]);
+	event_base_free(bases[1]);
+	threads = old_threads;
+	return fail;
+}
+
+/*
+ * Get the sourcetable body, as a NUL-terminated string.
+ */
+static char *sourcetable_body(struct sourcetable *sourcetable) {
+	struct mime_content *m = sourcetable_get(sourcetable);
+	if (m == NULL)
+		return NULL;
+	char *s = (char *)strmalloc(m->len + 1);
+	memcpy(s, m->s, m->len);
+	s[m->len] = '\0';
+	mime_free(m);
+	return s;
+}
+
+static struct caster_state *sourcetable_update_test_caster() {
+	struct caster_state *caster = (struct caster_state *)calloc(1, sizeof(struct caster_state));
+	log_init(&caster->flog, NULL, bench_log_cb, -1, -1, -1, -1, caster);
+	stack_init(&caster->sourcetablestack);
+	return caster;
+}
+
+static void sourcetable_update_test_caster_free(struct caster_state *caster) {
+	stack_free(&caster->sourcetablestack);
+	log_free(&caster->flog);
+	free(caster);
+}
+
+static int sourcetable_update_test() {
+	int fail = 0;
+	puts("sourcetable_update");
+	const char *lines1[] = {
+		"STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;",
+		"STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;",
+		"STR;MP3;Nice;RTCM 3.3;;2;GPS+GLO;NONE;FRA;43.70;7.27;0;0;none;none;B;N;0;",
+		NULL
+	};
+	const char *lines2[] = {
+		"STR;MP4;Brest;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.39;-4.49;0;0;none;none;B;N;0;",
+		"STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;",
+		"STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO+GAL;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;",
+		NULL
+	};
+	const char *expect2 =
+		"STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;\r\n"
+		"STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO+GAL;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;\r\n"
+		"STR;MP4;Brest;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.39;-4.49;0;0;none;none;B;N;0;\r\n"
+		"ENDSOURCETABLE\r\n";
+
+	struct caster_state *caster = sourcetable_update_test_caster();
+	struct caster_state *peer = sourcetable_update_test_caster();
+	sourcetable_stack_t *stack = &caster->sourcetablestack;
+	struct timeval fetch_time;
+	gettimeofday(&fetch_time, NULL);
+
+	/* Initial fetch: a new table */
+	struct sourcetable_update *u = sourcetable_update_new(NULL, "caster.example.com", 2101, 0, NULL);
+	for (const char **line = lines1; *line; line++)
+		sourcetable_update_add(u, *line, 1, caster);
+	struct sourcetable *current = u->added;
+	sourcetable_incref(current);
+	current->fetch_time = fetch_time;
+	current->version = 1;
+	stack_replace_host(caster, stack, current->caster, current->port, current);
+	sourcetable_update_free(u);
+
+	/* Same table on the peer */
+	json_object *j = sourcetable_json(current);
+	sourcetable_update_execute(peer, j);
+	json_object_put(j);
+
+	/* Refresh with 1 unchanged, 1 modified, 1 new and 1 removed line */
+	fetch_time.tv_sec++;
+	u = sourcetable_update_new(current, "caster.example.com", 2101, 0, NULL);
+	for (const char **line = lines2; *line; line++)
+		sourcetable_update_add(u, *line, 1, caster);
+	if (sourcetable_nentries(u->added, 0) != 2) {
+		printf("FAIL: expected 2 new or modified lines, got %d\n", sourcetable_nentries(u->added, 0));
+		fail++;
+	}
+	int r = sourcetable_update_apply(caster, stack, u, &fetch_time, &j);
+	sourcetable_update_free(u);
+	char *body = sourcetable_body(current);
+	if (r != 1 || current->version != 2 || current->geoindex->n != 3 || j == NULL
+	    || body == NULL || strcmp(body, expect2)) {
+		printf("FAIL: in-place update, r=%d version %llu\n", r, current->version);
+		fail++;
+	} else
+		putchar('.');
+	strfree(body);
+
+	/* Apply the same changes on the peer */
+	if (j != NULL) {
+		sourcetable_update_execute(peer, j);
+		json_object_put(j);
+	}
+	struct sourcetable *peer_table = TAILQ_FIRST(&peer->sourcetablestack.list);
+	body = peer_table ? sourcetable_body(peer_table) : NULL;
+	if (body == NULL || strcmp(body, expect2) || peer_table->version != 2) {
+		printf("FAIL: update not applied on peer\n");
+		fail++;
+	} else
+		putchar('.');
+	strfree(body);
+
+	/* Refresh with no changes */
+	fetch_time.tv_sec++;
+	u = sourcetable_update_new(current, "caster.example.com", 2101, 0, NULL);
+	for (const char **line = lines2; *line; line++)
+		sourcetable_update_add(u, *line, 1, caster);
+	r = sourcetable_update_apply(caster, stack, u, &fetch_time, &j);
+	sourcetable_update_free(u);
+	if (r != 0 || j != NULL || current->version != 2 || current->fetch_time.tv_sec != fetch_time.tv_sec) {
+		printf("FAIL: unchanged table, r=%d\n", r);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Not applicable once the table was replaced in the stack */
+	u = sourcetable_update_new(current, "caster.example.com", 2101, 0, NULL);
+	stack_replace_host(caster, stack, current->caster, current->port, NULL);
+	r = sourcetable_update_apply(caster, stack, u, &fetch_time, NULL);
+	sourcetable_update_free(u);
+	if (r != -1) {
+		printf("FAIL: update applied to a table not in the stack\n");
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	sourcetable_decref(current);
+	sourcetable_update_test_caster_free(caster);
+	sourcetable_update_test_caster_free(peer);
+	return fail;
+}
+
+/*
+ * Check the flattened stack snapshot is reused until the stack changes.
+ */
+static int stack_snapshot_test() {
+	int fail = 0;
+	puts("stack_snapshot");
+	struct caster_state *caster = sourcetable_update_test_caster();
+	sourcetable_stack_t *stack = &caster->sourcetablestack;
+
+	struct sourcetable *table = sourcetable_new("caster.example.com", 2101, 0, NULL);
+	sourcetable_add(table, "STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;", 0, caster);
+	stack_replace_host(caster, stack, table->caster, table->port, table);
+	sourcetable_decref(table);
+
+	struct sourcetable *flat1 = stack_flatten_getref(caster, stack);
+	struct sourcetable *flat2 = stack_flatten_getref(caster, stack);
+	if (flat1 == NULL || flat1 != flat2 || sourcetable_nentries(flat1, 0) != 1) {
+		printf("FAIL: snapshot not reused\n");
+		fail++;
+	} else
+		putchar('.');
+
+	/* A new table for the same host: rebuilt */
+	table = sourcetable_new("caster.example.com", 2101, 0, NULL);
+	sourcetable_add(table, "STR;MP1;Lyon;RTCM 3.3;;2;GPS+GLO;NONE;FRA;45.76;4.83;0;0;none;none;B;N;0;", 0, caster);
+	sourcetable_add(table, "STR;MP2;Paris;RTCM 3.3;;2;GPS+GLO;NONE;FRA;48.80;2.30;0;0;none;none;B;N;0;", 0, caster);
+	stack_replace_host(caster, stack, table->caster, table->port, table);
+	sourcetable_decref(table);
+
+	struct sourcetable *flat3 = stack_flatten_getref(caster, stack);
+	if (flat3 == NULL || flat3 == flat1 || sourcetable_nentries(flat3, 0) != 2) {
+		printf("FAIL: snapshot not rebuilt after stack_replace_host\n");
+		fail++;
+	} else
+		putchar('.');
+
+	/* Then reused again */
+	struct sourcetable *flat4 = stack_flatten_getref(caster, stack);
+	if (flat4 != flat3) {
+		printf("FAIL: rebuilt snapshot not reused\n");
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	if (flat1) sourcetable_decref(flat1);
+	if (flat2) sourcetable_decref(flat2);
+	if (flat3) sourcetable_decref(flat3);
+	if (flat4) sourcetable_decref(flat4);
+	sourcetable_update_test_caster_free(caster);
+	return fail;
+}
+
+static char *json_stream_text(struct json_stream *js) {
+	size_t len = evbuffer_get_length(js->buf);
+	char *s = (char *)strmalloc(len + 1);
+	evbuffer_remove(js->buf, s, len);
+	s[len] = '\0';
+	return s;
+}
+
+static int json_stream_test() {
+	int fail = 0;
+	struct json_stream js;
+	puts("json_stream");
+
+	/* Separators, nesting and escaping */
+	json_stream_init(&js, NULL, 0);
+	json_stream_object_begin(&js);
+	json_stream_key(&js, "a\"b");
+	json_stream_array_begin(&js);
+	json_stream_int64(&js, -12);
+	json_stream_string(&js, "x\\y\n\001");
+	json_stream_null(&js);
+	json_stream_object_begin(&js);
+	json_stream_object_end(&js);
+	json_stream_array_end(&js);
+	json_stream_key(&js, "d");
+	json_stream_double(&js, 2.0);
+	json_stream_key(&js, "e");
+	json_stream_bool(&js, 0);
+	json_stream_object_end(&js);
+	json_stream_end(&js);
+	char *s = json_stream_text(&js);
+	const char *expect = "{\"a\\\"b\":[-12,\"x\\\\y\\n\\u0001\",null,{}],\"d\":2.0,\"e\":false}";
+	if (strcmp(s, expect) || js.error) {
+		printf("FAIL: json_stream got %s expected %s\n", s, expect);
+		fail++;
+	} else
+		putchar('.');
+	strfree(s);
+	json_stream_free(&js);
+
+	/* A sourcetable spanning several batches, same as the non-streamed version */
+	struct caster_state *caster = sourcetable_update_test_caster();
+	struct sourcetable_update *u = sourcetable_update_new(NULL, "caster.example.com", 2101, 0, NULL);
+	for (int i = 0; i < 700; i++) {
+		char line[100];
+		snprintf(line, sizeof line, "STR;MP%d;Town;RTCM 3.3;;2;GPS;NONE;FRA;%d.25;%d.5;0;0;none;none;B;N;0;", (i*7)%700, i%90, i%180);
+		sourcetable_update_add(u, line, 1, caster);
+	}
+	struct sourcetable *table = u->added;
+	sourcetable_incref(table);
+	stack_replace_host(caster, &caster->sourcetablestack, table->caster, table->port, table);
+	sourcetable_update_free(u);
+
+	json_stream_init(&js, NULL, 0);
+	sourcetable_list_stream(caster, NULL, &js);
+	s = json_stream_text(&js);
+	json_object *j = json_tokener_parse(s);
+	json_object *expect_j = sourcetable_json(table);
+	if (j == NULL || json_object_array_length(j) != 1
+	    || !json_object_equal(json_object_array_get_idx(j, 0), expect_j)) {
+		printf("FAIL: streamed sourcetable differs\n");
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+	json_object_put(j);
+	json_object_put(expect_j);
+	strfree(s);
+	json_stream_free(&js);
+
+	sourcetable_decref(table);
+	sourcetable_update_test_caster_free(caster);
+	return fail;
+}
+
+struct json_stream_test_client {
+	struct ntrip_state *st;
+	_Atomic int stop;
+	size_t max_len, total;
+};
+
+/*
+ * A slow client, reading 4 KB per ms.
+ */
+static void *json_stream_test_reader(void *arg) {
+	struct json_stream_test_client *client = (struct json_stream_test_client *)arg;
+	struct evbuffer *output = bufferevent_get_output(client->st->bev);
+	int stop;
+	do {
+		stop = atomic_load(&client->stop);
+		bufferevent_lock(client->st->bev);
+		size_t len = evbuffer_get_length(output);
+		if (len > client->max_len)
+			client->max_len = len;
+		size_t n = (len > 4096 && !stop) ? 4096 : len;
+		evbuffer_drain(output, n);
+		client->total += n;
+		bufferevent_unlock(client->st->bev);
+		usleep(1000);
+	} while (!stop);
+	return NULL;
+}
+
+/*
+ * Check a streamed reply waits for a slow client instead of buffering everything.
+ */
+static int json_stream_backpressure_test() {
+	int fail = 0;
+	puts("json_stream_backpressure");
+
+	int old_threads = threads;
+	threads = 1;
+	evthread_use_pthreads();
+	struct event_base *base = event_base_new();
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+	st->bev = bufferevent_socket_new(base, -1, BEV_OPT_THREADSAFE);
+	/* Allow draining the output buffer from here */
+	evbuffer_unfreeze(bufferevent_get_output(st->bev), 1);
+	ntrip_set_state(st, NTRIP_WAIT_CLIENT_INPUT);
+
+	struct json_stream_test_client client = {.st = st, .max_len = 0, .total = 0};
+	atomic_init(&client.stop, 0);
+	pthread_t thread;
+	pthread_create(&thread, NULL, json_stream_test_reader, &client);
+
+	char value[1000];
+	memset(value, 'x', sizeof value - 1);
+	value[sizeof value - 1] = '\0';
+	struct json_stream js;
+	json_stream_init(&js, st, 0);
+	json_stream_array_begin(&js);
+	for (int i = 0; i < 300; i++) {
+		json_stream_string(&js, value);
+		json_stream_flush(&js, 0);
+	}
+	json_stream_array_end(&js);
+	json_stream_end(&js);
+	int error = js.error;
+	json_stream_free(&js);
+
+	atomic_store(&client.stop, 1);
+	pthread_join(thread, NULL);
+	size_t expected = 2 + 300*(sizeof value + 2) - 1;
+	if (error || client.total != expected) {
+		printf("FAIL: json_stream sent %zu bytes, expected %zu, error %d\n", client.total, expected, error);
+		fail++;
+	} else
+		putchar('.');
+	if (client.max_len > JSON_STREAM_HIGH_WATER + 2*JSON_STREAM_CHUNK_SIZE) {
+		printf("FAIL: json_stream buffered %zu bytes\n", client.max_len);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Stalled client: give up after max_wait */
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	evbuffer_drain(output, evbuffer_get_length(output));
+	json_stream_init(&js, st, 0);
+	js.max_wait = 300;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	json_stream_array_begin(&js);
+	for (int i = 0; i < 300; i++) {
+		json_stream_string(&js, value);
+		json_stream_flush(&js, 0);
+	}
+	json_stream_array_end(&js);
+	int r = json_stream_end(&js);
+	json_stream_free(&js);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long ms = (end.tv_sec - start.tv_sec)*1000L + (end.tv_nsec - start.tv_nsec)/1000000L;
+	if (r != -1 || ms < 300 || ms > 2000 || evbuffer_get_length(output) > JSON_STREAM_HIGH_WATER + 2*JSON_STREAM_CHUNK_SIZE) {
+		printf("FAIL: json_stream stalled client, r %d after %ld ms, %zu bytes buffered\n", r, ms, evbuffer_get_length(output));
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	bufferevent_free(st->bev);
+	free(st);
+	event_base_free(base);
+	threads = old_threads;
+	return fail;
+}
+
+/*
+ * Execute a binary livesource update, as received on the syncer API.
+ */
+static int sync_binary_execute(struct caster_state *caster, struct ntrip_state *st, struct packet *p) {
+	struct request *req = request_new();
+	req->st = st;
+	st->content = (char *)p->data;
+	st->content_length = p->datalen;
+	int r = livesource_update_execute_binary(caster, caster->livesources, req);
+	st->content = NULL;
+	request_free(req);
+	packet_decref(p);
+	return r;
+}
+
+static struct packet *sync_binary_diff(const char *hostname, const char *start_date, unsigned long long serial,
+	enum sync_binary_update utype, unsigned long id, enum livesource_state state, const char *mountpoint) {
+	struct sync_binary_writer w;
+	sync_binary_writer_init(&w);
+	sync_binary_record_begin(&w, SYNC_BINARY_REC_TABLE);
+	sync_binary_put_string(&w, hostname);
+	sync_binary_put_string(&w, start_date);
+	sync_binary_put_u64(&w, serial);
+	sync_binary_put_u8(&w, utype);
+	sync_binary_record_end(&w);
+	sync_binary_record_begin(&w, SYNC_BINARY_REC_LIVESOURCE);
+	sync_binary_put_u32(&w, id);
+	sync_binary_put_u8(&w, state);
+	sync_binary_put_u8(&w, LIVESOURCE_TYPE_DIRECT);
+	if (mountpoint)
+		sync_binary_put_string(&w, mountpoint);
+	sync_binary_record_end(&w);
+	struct packet *p = sync_binary_packet(&w);
+	sync_binary_writer_free(&w);
+	return p;
+}
+
+static int sync_binary_test() {
+	int fail = 0;
+	struct timeval start_date;
+	puts("sync_binary");
+
+	/* Primitives, and detection of truncated messages */
+	struct sync_binary_writer w;
+	sync_binary_writer_init(&w);
+	sync_binary_record_begin(&w, SYNC_BINARY_REC_TABLE);
+	sync_binary_put_u64(&w, 0x123456789abcdef0ULL);
+	sync_binary_put_string(&w, "MP1");
+	sync_binary_record_end(&w);
+	struct packet *p = sync_binary_packet(&w);
+	sync_binary_writer_free(&w);
+
+	struct sync_binary_reader r;
+	char s[20];
+	sync_binary_reader_init(&r, p->data, p->datalen);
+	int n = sync_binary_next_record(&r);
+	unsigned long long v = sync_binary_get_u64(&r);
+	int len = sync_binary_get_string(&r, s, sizeof s);
+	if (n != 1 || r.type != SYNC_BINARY_REC_TABLE || v != 0x123456789abcdef0ULL || len != 3 || strcmp(s, "MP1")
+	    || sync_binary_remaining(&r) != 0 || sync_binary_next_record(&r) != 0) {
+		printf("FAIL: sync_binary round trip\n");
+		fail++;
+	} else
+		putchar('.');
+	sync_binary_reader_init(&r, p->data, p->datalen - 1);
+	if (sync_binary_next_record(&r) != -1) {
+		printf("FAIL: sync_binary truncated record not detected\n");
+		fail++;
+	} else
+		putchar('.');
+	packet_decref(p);
+
+	/* Full table from a sender node */
+	struct config_endpoint endpoint = {.host = "node1.example.com", .port = 2443, .tls = 1};
+	struct config *config = (struct config *)calloc(1, sizeof(struct config));
+	config->endpoint = &endpoint;
+	config->endpoint_count = 1;
+	atomic_init(&config->refcnt, 1);
+
+	gettimeofday(&start_date, NULL);
+	struct caster_state *sender = sourcetable_update_test_caster();
+	P_RWLOCK_INIT(&sender->configlock, NULL);
+	sender->config = config;
+	sender->livesources = livesource_table_new("node1", &start_date);
+	const char *mountpoints[] = {"MP1", "MP2", "MP3", NULL};
+	for (const char **mp = mountpoints; *mp; mp++) {
+		struct livesource *l = livesource_new((char *)*mp, LIVESOURCE_TYPE_DIRECT, LIVESOURCE_RUNNING);
+		l->id = ++sender->livesources->next_id;
+		hash_table_add(sender->livesources->hash, *mp, l);
+		sender->livesources->serial++;
+	}
+
+	struct caster_state *receiver = sourcetable_update_test_caster();
+	receiver->livesources = livesource_table_new("node2", &start_date);
+	receiver->nodes = nodes_new();
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+
+	int status = sync_binary_execute(receiver, st, livesource_full_update_binary(sender, sender->livesources));
+	struct livesources_remote *remote = (struct livesources_remote *)hash_table_get(receiver->livesources->remote, "node1");
+	if (status != 200 || remote == NULL || hash_len(remote->hash) != 3 || remote->serial != 3
+	    || remote->endpoint_count != 1 || strcmp(remote->endpoints[0].host, "node1.example.com")
+	    || remote->endpoints[0].port != 2443 || !remote->endpoints[0].tls) {
+		printf("FAIL: binary full table, status %d\n", status);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Incremental updates, by interned id */
+	const char *sd = sender->livesources->start_date;
+	status = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 3, SYNC_BINARY_UPDATE, 2, LIVESOURCE_FETCH_PENDING, NULL));
+	struct livesource_remote *lr = remote ? (struct livesource_remote *)hash_table_get(remote->hash, "MP2") : NULL;
+	if (status != 200 || lr == NULL || lr->state != LIVESOURCE_FETCH_PENDING) {
+		printf("FAIL: binary update, status %d\n", status);
+		fail++;
+	} else
+		putchar('.');
+
+	status = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 4, SYNC_BINARY_DEL, 1, 0, NULL));
+	int status2 = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 5, SYNC_BINARY_ADD, 4, LIVESOURCE_RUNNING, "MP4"));
+	int status3 = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 6, SYNC_BINARY_DEL, 4, 0, NULL));
+	if (status != 200 || status2 != 200 || status3 != 200 || !remote || hash_len(remote->hash) != 2
+	    || hash_table_get(remote->hash, "MP1") != NULL || remote->serial != 7) {
+		printf("FAIL: binary add/del, status %d %d %d\n", status, status2, status3);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Unknown id, bad serial */
+	status = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 7, SYNC_BINARY_UPDATE, 1, LIVESOURCE_RUNNING, NULL));
+	status2 = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 3, SYNC_BINARY_UPDATE, 2, LIVESOURCE_RUNNING, NULL));
+	if (status != 404 || status2 != 409) {
+		printf("FAIL: binary bad update accepted, status %d %d\n", status, status2);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Out of range state or type, from an update or a full table */
+	status = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 7, SYNC_BINARY_UPDATE, 2, LIVESOURCE_RUNNING+1, NULL));
+	struct livesource *l = (struct livesource *)hash_table_get(sender->livesources->hash, "MP3");
+	l->type = LIVESOURCE_TYPE_FETCHED+1;
+	status2 = sync_binary_execute(receiver, st, livesource_full_update_binary(sender, sender->livesources));
+	l->type = LIVESOURCE_TYPE_DIRECT;
+	if (status != 400 || status2 != 400 || lr == NULL || lr->state != LIVESOURCE_FETCH_PENDING
+	    || hash_table_get(receiver->livesources->remote, "node1") != remote) {
+		printf("FAIL: binary out of range state or type accepted, status %d %d\n", status, status2);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Duplicate id, from an addition or a full table */
+	status = sync_binary_execute(receiver, st, sync_binary_diff("node1", sd, 7, SYNC_BINARY_ADD, 2, LIVESOURCE_RUNNING, "MP5"));
+	l->id = 2;
+	status2 = sync_binary_execute(receiver, st, livesource_full_update_binary(sender, sender->livesources));
+	l->id = 3;
+	if (status != 409 || status2 != 400 || hash_table_get(remote->hash, "MP5") != NULL || remote->serial != 7
+	    || hash_table_get(receiver->livesources->remote, "node1") != remote) {
+		printf("FAIL: binary duplicate id accepted, status %d %d\n", status, status2);
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	if (st->node)
+		json_object_put(st->node);
+	strfree(st->syncer_id);
+	free(st);
+	nodes_free(receiver->nodes);
+	livesource_table_free(receiver->livesources);
+	sourcetable_update_test_caster_free(receiver);
+	livesource_table_free(sender->livesources);
+	P_RWLOCK_DESTROY(&sender->configlock);
+	sourcetable_update_test_caster_free(sender);
+	free(config);
+	return fail;
+}
+
+/*
+ * Replay of recent changes to a node which missed some updates.
+ */
+static int livesource_replay_test() {
+	int fail = 0;
+	struct timeval start_date;
+	puts("livesource_replay");
+
+	struct caster_dynconfig *dyn = (struct caster_dynconfig *)calloc(1, sizeof(struct caster_dynconfig));
+	struct config *config = (struct config *)calloc(1, sizeof(struct config));
+	config->dyn = dyn;
+	atomic_init(&config->refcnt, 1);
+
+	gettimeofday(&start_date, NULL);
+	struct caster_state *sender = sourcetable_update_test_caster();
+	P_RWLOCK_INIT(&sender->configlock, NULL);
+	sender->config = config;
+	sender->livesources = livesource_table_new("node1", &start_date);
+	const char *mountpoints[] = {"MP1", "MP2", "MP3", NULL};
+	struct livesource *ls[3];
+	for (int i = 0; mountpoints[i]; i++) {
+		ls[i] = livesource_new((char *)mountpoints[i], LIVESOURCE_TYPE_DIRECT, LIVESOURCE_RUNNING);
+		ls[i]->id = ++sender->livesources->next_id;
+		hash_table_add(sender->livesources->hash, mountpoints[i], ls[i]);
+		sender->livesources->serial++;
+	}
+
+	struct caster_state *receiver = sourcetable_update_test_caster();
+	receiver->livesources = livesource_table_new("node2", &start_date);
+	receiver->nodes = nodes_new();
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+	sync_binary_execute(receiver, st, livesource_full_update_binary(sender, sender->livesources));
+	struct livesources_remote *remote = (struct livesources_remote *)hash_table_get(receiver->livesources->remote, "node1");
+
+	/* The receiver misses these, and reports its serial */
+	livesource_set_state(ls[0], sender, LIVESOURCE_FETCH_PENDING);
+	livesource_set_state(ls[1], sender, LIVESOURCE_FETCH_PENDING);
+	livesource_set_state(ls[0], sender, LIVESOURCE_RUNNING);
+
+	struct request *req = request_new();
+	req->st = st;
+	struct packet *p = livesource_checkserial_binary(sender->livesources);
+	st->content = (char *)p->data;
+	st->content_length = p->datalen;
+	int status = livesource_update_execute_binary(receiver, receiver->livesources, req);
+	const char *serial = req->headers ? evhttp_find_header(req->headers, "X-Sync-Serial") : NULL;
+	if (status != 409 || serial == NULL || strcmp(serial, "3")) {
+		printf("FAIL: serial mismatch, status %d serial %s\n", status, serial ? serial : "(null)");
+		fail++;
+	} else
+		putchar('.');
+	st->content = NULL;
+	packet_decref(p);
+	request_free(req);
+
+	/* Json replay */
+	json_object *j;
+	int r = livesource_replay_json(sender->livesources, 3, &j);
+	req = request_new();
+	req->st = st;
+	req->json = j;
+	status = r == 1 ? livesource_update_execute(receiver, receiver->livesources, req) : 0;
+	request_free(req);
+	struct livesource_remote *lr1 = remote ? (struct livesource_remote *)hash_table_get(remote->hash, "MP1") : NULL;
+	struct livesource_remote *lr2 = remote ? (struct livesource_remote *)hash_table_get(remote->hash, "MP2") : NULL;
+	if (r != 1 || status != 200 || remote->serial != 6 || lr1 == NULL || lr1->state != LIVESOURCE_RUNNING
+	    || lr2 == NULL || lr2->state != LIVESOURCE_FETCH_PENDING) {
+		printf("FAIL: json replay, r %d status %d\n", r, status);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Binary replay */
+	livesource_set_state(ls[2], sender, LIVESOURCE_FETCH_PENDING);
+	livesource_set_state(ls[1], sender, LIVESOURCE_RUNNING);
+	r = livesource_replay_binary(sender->livesources, 6, &p);
+	status = r == 1 ? sync_binary_execute(receiver, st, p) : 0;
+	struct livesource_remote *lr3 = remote ? (struct livesource_remote *)hash_table_get(remote->hash, "MP3") : NULL;
+	if (r != 1 || status != 200 || remote->serial != 8 || lr2->state != LIVESOURCE_RUNNING
+	    || lr3 == NULL || lr3->state != LIVESOURCE_FETCH_PENDING) {
+		printf("FAIL: binary replay, r %d status %d\n", r, status);
+		fail++;
+	} else
+		putchar('.');
+
+	/* Nothing to replay, unknown or dropped serials */
+	int r2 = livesource_replay_json(sender->livesources, 8, &j);
+	int r3 = livesource_replay_binary(sender->livesources, 2, &p);
+	int r4 = livesource_replay_binary(sender->livesources, 9, &p);
+	for (int i = 0; i < LIVESOURCE_CHANGELOG_SIZE; i++)
+		livesource_set_state(ls[0], sender, i & 1 ? LIVESOURCE_RUNNING : LIVESOURCE_FETCH_PENDING);
+	int r5 = livesource_replay_json(sender->livesources, 7, &j);
+	int r6 = livesource_replay_json(sender->livesources, 9, &j);
+	if (j != NULL)
+		json_object_put(j);
+	if (r2 != 0 || r3 != -1 || r4 != -1 || r5 != -1 || r6 != 1) {
+		printf("FAIL: replay limits, r %d %d %d %d %d\n", r2, r3, r4, r5, r6);
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	if (st->node)
+		json_object_put(st->node);
+	strfree(st->syncer_id);
+	free(st);
+	nodes_free(receiver->nodes);
+	livesource_table_free(receiver->livesources);
+	sourcetable_update_test_caster_free(receiver);
+	livesource_table_free(sender->livesources);
+	P_RWLOCK_DESTROY(&sender->configlock);
+	sourcetable_update_test_caster_free(sender);
+	free(config);
+	free(dyn);
 	return fail;
 }
 
@@ -708,13 +2051,940 @@ static void sourcetable_test(struct sourcetable *sourcetable) {
 }
 #endif
 
-int main(int argc, const char **argv) {
+/*
+ * Benchmark the CRC24Q implementations on typical RTCM frame sizes.
+ * Not a pass/fail test: only displays throughputs.
+ */
+static int bench_crc24q() {
+	puts("bench_crc24q");
+	unsigned char data[1029];
+	size_t sizes[] = {50, 200, 500, 1029};
+	for (int i = 0; i < sizeof data; i++)
+		data[i] = random();
+
+	for (int i = 0; i < sizeof sizes/sizeof sizes[0]; i++) {
+		size_t len = sizes[i];
+		int n = 100000000 / len;
+		struct timespec t0, t1, t2;
+		volatile unsigned long sink = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int j = 0; j < n; j++)
+			sink += rtcm_crc24q_update_bytewise(0, data, len);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (int j = 0; j < n; j++)
+			sink += rtcm_crc24q_hash(data, len);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+
+		double bytes = (double)n*len;
+		printf("%5zd bytes: bytewise %6.2f GB/s, slicing-by-8 %6.2f GB/s\n", len,
+			bytes/bench_elapsed_us(&t0, &t1)/1e3, bytes/bench_elapsed_us(&t1, &t2)/1e3);
+	}
+	return 0;
+}
+
+static void joblist_coalesce_test_cb1(struct ntrip_state *st) {
+}
+
+static void joblist_coalesce_test_cb2(struct ntrip_state *st) {
+}
+
+static void joblist_coalesce_test_readcb(struct bufferevent *bev, void *arg) {
+}
+
+/*
+ * Check redundant jobs for a ntrip_state are coalesced, without running them.
+ */
+static int joblist_coalesce_test() {
+	int fail = 0;
+	puts("joblist_coalesce");
+
+	int old_threads = threads;
+	threads = 1;
+	struct config *config = (struct config *)calloc(1, sizeof(struct config));
+	atomic_init(&config->refcnt, 1);
+	struct caster_state *caster = sourcetable_update_test_caster();
+	P_RWLOCK_INIT(&caster->configlock, NULL);
+	caster->config = config;
+	struct joblist *joblist = joblist_new(caster);
+
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+	st->caster = caster;
+	st->config = config;
+	STAILQ_INIT(&st->jobq);
+
+	for (int i = 0; i < 100; i++) {
+		joblist_append_ntrip_locked(joblist, st, joblist_coalesce_test_cb1);
+		joblist_append(joblist, joblist_coalesce_test_readcb, NULL, NULL, st, 0);
+		joblist_append_ntrip_locked(joblist, st, joblist_coalesce_test_cb2);
+	}
+	if (st->njobs != 3 || st->newjobs != -1) {
+		printf("FAIL: %d jobs queued, newjobs %d\n", st->njobs, st->newjobs);
+		fail++;
+	} else
+		putchar('.');
+
+	/* The ntrip_state was queued once, and its jobs are drained with the list */
+	joblist_free(joblist);
+	if (st->njobs != 0 || !STAILQ_EMPTY(&st->jobq)) {
+		printf("FAIL: %d jobs left after drain\n", st->njobs);
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	free(st);
+	P_RWLOCK_DESTROY(&caster->configlock);
+	sourcetable_update_test_caster_free(caster);
+	free(config);
+	threads = old_threads;
+	return fail;
+}
+
+/*
+ * Check log lines are all written by the async writer, or counted as dropped.
+ */
+#define	ASYNC_LOG_THREADS	4
+#define	ASYNC_LOG_LINES		2000
+
+static void async_log_test_cb(void *arg, struct gelf_entry *g, int level, const char *fmt, va_list ap) {
+	struct caster_state *caster = (struct caster_state *)arg;
+	vlogall(caster, g, &caster->flog, level, fmt, ap);
+}
+
+static void *async_log_test_thread(void *arg) {
+	struct caster_state *caster = (struct caster_state *)arg;
+	for (int i = 0; i < ASYNC_LOG_LINES; i++)
+		logfmt(&caster->flog, LOG_INFO, "async log test line %d", i);
+	return NULL;
+}
+
+/*
+ * Count the lines in a file, and those matching a string.
+ */
+static int async_log_count(const char *filename, const char *match, int *nmatch) {
+	char line[200];
+	int n = 0;
+	*nmatch = 0;
+	FILE *f = fopen(filename, "r");
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof line, f)) {
+		n++;
+		if (strstr(line, match))
+			(*nmatch)++;
+	}
+	fclose(f);
+	return n;
+}
+
+static int async_log_test() {
+	int fail = 0;
+	puts("async_log");
+
+	char filename1[] = "/tmp/millipede-test-log-XXXXXX", filename2[] = "/tmp/millipede-test-log-XXXXXX";
+	close(mkstemp(filename1));
+	close(mkstemp(filename2));
+
+	struct caster_state *caster = (struct caster_state *)calloc(1, sizeof(struct caster_state));
+	atomic_store(&caster->graylog_log_level, -1);
+	log_init(&caster->flog, filename1, async_log_test_cb, LOG_INFO, -1, -1, -1, caster);
+
+	/* Concurrent writers, then a reopen while lines may still be queued */
+	pthread_t t[ASYNC_LOG_THREADS];
+	for (int i = 0; i < ASYNC_LOG_THREADS; i++)
+		pthread_create(&t[i], NULL, async_log_test_thread, caster);
+	for (int i = 0; i < ASYNC_LOG_THREADS; i++)
+		pthread_join(t[i], NULL);
+	log_reopen(&caster->flog, filename2, LOG_INFO, -1, -1, -1);
+	logfmt(&caster->flog, LOG_DEBUG, "not logged");
+
+	/* Block the writer to fill our ring */
+	pthread_rwlock_wrlock(&caster->flog.lock);
+	for (int i = 0; i < ASYNC_LOG_LINES; i++)
+		logfmt(&caster->flog, LOG_INFO, "async log test line %d", i);
+	pthread_rwlock_unlock(&caster->flog.lock);
+
+	unsigned long long dropped = log_dropped(&caster->flog);
+	log_free(&caster->flog);
+
+	int n1, n2, dropped_lines;
+	async_log_count(filename1, " async log test line ", &n1);
+	async_log_count(filename2, " async log test line ", &n2);
+	async_log_count(filename2, " log lines dropped", &dropped_lines);
+	if (n1 + n2 + dropped != (ASYNC_LOG_THREADS+1)*ASYNC_LOG_LINES) {
+		printf("FAIL: %d+%d lines written, %llu dropped, expected %d in total\n", n1, n2, dropped, (ASYNC_LOG_THREADS+1)*ASYNC_LOG_LINES);
+		fail++;
+	} else
+		putchar('.');
+	if (dropped == 0 || dropped_lines == 0) {
+		printf("FAIL: %llu lines dropped, %d reported\n", dropped, dropped_lines);
+		fail++;
+	} else
+		putchar('.');
+	putchar('\n');
+
+	unlink(filename1);
+	unlink(filename2);
+	free(caster);
+	return fail;
+}
+
+/*
+ * Check CPU list parsing, and the worker layout over thread groups.
+ */
+static _Atomic int joblist_groups_done;
+
+static void joblist_groups_test_cb(struct ntrip_state *arg) {
+	atomic_fetch_add(&joblist_groups_done, 1);
+}
+
+static int joblist_groups_test() {
 	int fail = 0;
+	puts("joblist_groups");
+
+	struct {
+		const char *cpus;
+		int count;
+	} cpus_tests[] = {
+		{"0", 1},
+		{"0-3", 4},
+		{"0-3,8,10-11", 7},
+		{" 1 , 3 ", 2},
+		{"3-1", -1},
+		{"1,", -1},
+		{"a", -1},
+		{"", -1},
+		{"0-100000", -1},
+	};
+	for (int i = 0; i < sizeof cpus_tests/sizeof cpus_tests[0]; i++) {
+		jobs_cpuset_t cpuset;
+		int r = jobs_parse_cpus(cpus_tests[i].cpus, &cpuset);
+		if (r != cpus_tests[i].count) {
+			printf("FAIL: jobs_parse_cpus(\"%s\") returned %d, expected %d\n", cpus_tests[i].cpus, r, cpus_tests[i].count);
+			fail++;
+		} else
+			putchar('.');
+	}
+
+	/* Pin the second group to the first CPU we are allowed to run on */
+	jobs_cpuset_t allowed;
+	char cpu[16] = "0";
+	if (pthread_getaffinity_np(pthread_self(), sizeof allowed, &allowed) == 0)
+		for (int i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &allowed)) {
+				snprintf(cpu, sizeof cpu, "%d", i);
+				break;
+			}
+
+	int old_threads = threads;
+	threads = 1;
+	struct config_threads config_threads[2] = {{.stacksize = 500*1024}, {.stacksize = 500*1024, .cpus = cpu}};
+	struct config config = {.threads = config_threads, .threads_count = 2};
+	struct caster_state *caster = sourcetable_update_test_caster();
+	caster->config = &config;
+	struct joblist *joblist = joblist_new(caster);
+	caster->joblist = joblist;
+	atomic_store(&joblist_groups_done, 0);
+
+	if (jobs_start_threads(joblist, 4, 0) < 0) {
+		printf("FAIL: jobs_start_threads\n");
+		fail++;
+	} else {
+		for (int i = 0; i < 1000; i++)
+			joblist_append_ntrip_unlocked(joblist, joblist_groups_test_cb, NULL);
+		while (atomic_load(&joblist_groups_done) < 1000)
+			usleep(100);
+
+		json_object *j = jobs_threads_json(joblist);
+		int expected_group[] = {0, 0, 0, 1, 1};
+		unsigned long long njobs = 0;
+		for (int i = 0; i < 5; i++) {
+			json_object *t = json_object_array_get_idx(j, i);
+			int group = json_object_get_int(json_object_object_get(t, "group"));
+			if (group != expected_group[i]) {
+				printf("FAIL: thread %d in group %d, expected %d\n", i, group, expected_group[i]);
+				fail++;
+			} else
+				putchar('.');
+			njobs += json_object_get_int64(json_object_object_get(t, "jobs"));
+		}
+		json_object_put(j);
+		if (njobs < 1000) {
+			printf("FAIL: %llu jobs counted, expected at least 1000\n", njobs);
+			fail++;
+		} else
+			putchar('.');
+
+		jobs_cpuset_t pinned;
+		pthread_getaffinity_np(joblist->threads[3].thread, sizeof pinned, &pinned);
+		if (CPU_COUNT(&pinned) != 1 || !CPU_ISSET(atoi(cpu), &pinned)) {
+			printf("FAIL: worker not pinned to CPU %s\n", cpu);
+			fail++;
+		} else
+			putchar('.');
+		jobs_stop_threads(joblist);
+	}
+	putchar('\n');
+
+	joblist_free(joblist);
+	caster->joblist = NULL;
+	sourcetable_update_test_caster_free(caster);
+	threads = old_threads;
+	return fail;
+}
+
+/*
+ * Benchmark the worker job queues: each job spawns the next one in its chain,
+ * so that most of them are appended by workers and balanced by stealing.
+ * Not a pass/fail test, except for lost jobs and job recycling.
+ */
+#define	BENCH_JOBLIST_JOBS	1000000
+#define	BENCH_JOBLIST_SEEDS	64
+
+static struct joblist *bench_joblist;
+static _Atomic int bench_joblist_spawned, bench_joblist_done;
+
+static void bench_joblist_cb(struct ntrip_state *arg) {
+	if (atomic_fetch_add(&bench_joblist_spawned, 1) < BENCH_JOBLIST_JOBS)
+		joblist_append_ntrip_unlocked(bench_joblist, bench_joblist_cb, NULL);
+	atomic_fetch_add(&bench_joblist_done, 1);
+}
+
+static int bench_joblist_run() {
+	int nthreads[] = {1, 2, 4, 8, 0};
+	int fail = 0;
+	puts("bench_joblist");
+
+	int old_threads = threads;
+	threads = 1;
+	struct config_threads config_threads = {.stacksize = 500*1024};
+	struct config config = {.threads = &config_threads, .threads_count = 1};
+	struct caster_state *caster = sourcetable_update_test_caster();
+	caster->config = &config;
+
+	for (int *n = nthreads; *n; n++) {
+		struct timespec t0, t1;
+		bench_joblist = joblist_new(caster);
+		caster->joblist = bench_joblist;
+		atomic_store(&bench_joblist_spawned, BENCH_JOBLIST_SEEDS);
+		atomic_store(&bench_joblist_done, 0);
+		jobs_start_threads(bench_joblist, *n, 0);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int i = 0; i < BENCH_JOBLIST_SEEDS; i++)
+			joblist_append_ntrip_unlocked(bench_joblist, bench_joblist_cb, NULL);
+		while (atomic_load(&bench_joblist_done) < BENCH_JOBLIST_JOBS)
+			usleep(100);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		jobs_stop_threads(bench_joblist);
+		joblist_free(bench_joblist);
+		int done = atomic_load(&bench_joblist_done);
+		printf("%d thread(s): %.0f jobs/s\n", *n, done/bench_elapsed_us(&t0, &t1)*1e6);
+		if (done != BENCH_JOBLIST_JOBS) {
+			printf("FAIL: %d jobs run, expected %d\n", done, BENCH_JOBLIST_JOBS);
+			fail++;
+		}
+	}
+
+	/* Nearly all jobs should have been recycled */
+	json_object *jpool = job_pool_json();
+	double hit_rate = json_object_get_double(json_object_object_get(jpool, "hit_rate"));
+	printf("job pool hit rate %.4f, %lld misses\n", hit_rate,
+		(long long)json_object_get_int64(json_object_object_get(jpool, "misses")));
+	if (hit_rate < 0.99) {
+		printf("FAIL: job pool hit rate %.4f\n", hit_rate);
+		fail++;
+	}
+	json_object_put(jpool);
+
+	caster->joblist = NULL;
+	sourcetable_update_test_caster_free(caster);
+	threads = old_threads;
+	return fail;
+}
+
+/*
+ * Check gelf_packet() output parses to the same JSON as gelf_json().
+ */
+static int gelf_packet_test() {
+	int fail = 0;
+	struct {
+		const char *msg;
+		const char *remote_ip;
+		unsigned long long connection_id;
+		int thread_id;
+	} tests[] = {
+		{"Plain message", NULL, 0, -1},
+		{"Quote \" backslash \\ slash / tab \t newline \n cr \r", "192.0.2.1", 12, 3},
+		{"Control \x01\x1f and UTF-8 \xc3\xa9t\xc3\xa9", "2001:db8::1", 1ULL<<40, 0},
+		{"", "", 1, 7},
+	};
+	puts("gelf_packet_test");
+
+	for (int i = 0; i < sizeof tests/sizeof tests[0]; i++) {
+		struct gelf_entry g;
+		gelf_init(&g, LOG_INFO, "caster\"host", tests[i].thread_id);
+		g.short_message = (char *)tests[i].msg;
+		g.remote_ip = tests[i].remote_ip;
+		g.remote_port = 2101;
+		g.connection_id = tests[i].connection_id;
+		if (i == 3)
+			g.ts.tv_usec = 0;
+
+		struct packet *p = gelf_packet(&g);
+		char *s = p ? strndup((char *)p->data, p->datalen) : NULL;
+		json_object *j = s ? json_tokener_parse(s) : NULL;
+		json_object *expect_j = gelf_json(&g);
+		if (j == NULL || !json_object_equal(j, expect_j)) {
+			printf("FAIL: gelf_packet differs for test %d: %s\n", i, s ? s : "(null)");
+			fail++;
+		} else
+			putchar('.');
+		json_object_put(j);
+		json_object_put(expect_j);
+		free(s);
+		if (p)
+			packet_decref(p);
+	}
+	putchar('\n');
+	return fail;
+}
+
+/*
+ * Benchmark GELF serialization to a packet, through json-c and directly.
+ * Not a pass/fail test: only displays timings.
+ */
+static int bench_gelf() {
+	int n = 200000;
+	puts("bench_gelf");
+
+	struct gelf_entry g;
+	gelf_init(&g, LOG_INFO, "caster.example.com", 3);
+	g.short_message = "192.0.2.1:2101 42 RTCM packet type 1077 len 412 from \"MP1\"";
+	g.remote_ip = "192.0.2.1";
+	g.remote_port = 2101;
+	g.connection_id = 42;
+
+	struct timespec t0, t1, t2;
+	size_t len = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < n; i++) {
+		json_object *j = gelf_json(&g);
+		struct packet *p = packet_new_from_string(json_object_to_json_string(j));
+		json_object_put(j);
+		len += p->datalen;
+		packet_decref(p);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (int i = 0; i < n; i++) {
+		struct packet *p = gelf_packet(&g);
+		len += p->datalen;
+		packet_decref(p);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	printf("json-c: %.1f ns per entry, direct: %.1f ns per entry (%zu bytes)\n",
+		bench_elapsed_us(&t0, &t1)*1e3/n, bench_elapsed_us(&t1, &t2)*1e3/n, len);
+	return 0;
+}
+
+/*
+ * Check gzip compression of bulk requests: the stream must inflate back
+ * to the queued items joined by '\n'. Also displays the compression ratio.
+ */
+static int bulk_compression_test() {
+	int fail = 0, n = 500;
+	struct packet *packets[500];
+	puts("bulk_compression_test");
+
+	struct caster_state *caster = sourcetable_update_test_caster();
+	struct ntrip_task *task = ntrip_task_new(caster, "localhost", 7777, "/gelf", 0, 0, 62000, 4000000, "test", NULL);
+	if (ntrip_task_set_compression(task, 10) != -1 || ntrip_task_set_compression(task, 6) != 0) {
+		printf("FAIL: compression level check\n");
+		fail++;
+	}
+
+	struct evbuffer *expect = evbuffer_new();
+	for (int i = 0; i < n; i++) {
+		struct gelf_entry g;
+		char msg[100];
+		gelf_init(&g, LOG_INFO, "caster.example.com", i % 4);
+		snprintf(msg, sizeof msg, "192.0.2.%d:2101 %d RTCM packet type 1077 len %d from \"MP%d\"", i % 250, i, i * 7 % 1000, i % 20);
+		g.short_message = msg;
+		packets[i] = gelf_packet(&g);
+		evbuffer_add(expect, packets[i]->data, packets[i]->datalen);
+		evbuffer_add(expect, "\n", 1);
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		/* Second pass checks the compressor is correctly reset */
+		struct evbuffer *zbuf = evbuffer_new();
+		ssize_t zlen = ntrip_task_compress_bulk(task, packets, n, zbuf);
+
+		size_t len = evbuffer_get_length(expect);
+		unsigned char *out = (unsigned char *)malloc(len + 1);
+		z_stream z;
+		memset(&z, 0, sizeof z);
+		inflateInit2(&z, 15 + 16);
+		z.next_in = evbuffer_pullup(zbuf, -1);
+		z.avail_in = evbuffer_get_length(zbuf);
+		z.next_out = out;
+		z.avail_out = len + 1;
+		int r = inflate(&z, Z_FINISH);
+		if (zlen <= 0 || zlen != evbuffer_get_length(zbuf) || r != Z_STREAM_END
+		    || z.total_out != len || memcmp(out, evbuffer_pullup(expect, -1), len)) {
+			printf("FAIL: bulk compression pass %d, zlen %zd inflate %d\n", pass, zlen, r);
+			fail++;
+		} else
+			putchar('.');
+		inflateEnd(&z);
+		free(out);
+		evbuffer_free(zbuf);
+	}
+	putchar('\n');
+
+	json_object *j = ntrip_task_json(task);
+	json_object *jin, *jout;
+	json_object_object_get_ex(j, "bulk_bytes_in", &jin);
+	json_object_object_get_ex(j, "bulk_bytes_out", &jout);
+	printf("%zu bytes compressed to %lld, ratio %.1f\n", evbuffer_get_length(expect),
+		(long long)json_object_get_int64(jout)/2, (double)json_object_get_int64(jin)/json_object_get_int64(jout));
+	if (json_object_get_int64(jin) != 2*evbuffer_get_length(expect)) {
+		printf("FAIL: bulk_bytes_in %lld\n", (long long)json_object_get_int64(jin));
+		fail++;
+	}
+	json_object_put(j);
+
+	/* Through a request: compressed items stay queued until acknowledged */
+	task->method = "POST";
+	task->bulk_content_type = "application/json";
+	for (int i = 0; i < n; i++)
+		ntrip_task_queue(task, packets[i]);
+	struct event_base *base = event_base_new();
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+	st->caster = caster;
+	st->task = task;
+	st->host = "localhost";
+	st->port = 7777;
+	st->uri = "/gelf";
+	st->bev = bufferevent_socket_new(base, -1, 0);
+	ntrip_set_state(st, NTRIP_IDLE_CLIENT);
+	ntrip_task_send_next_request(st);
+	struct evbuffer *output = bufferevent_get_output(st->bev);
+	int pending = task->pending, queued = 0;
+	struct mime_content *m;
+	STAILQ_FOREACH(m, &task->mimeq, next)
+		queued++;
+	if (pending <= 0 || pending >= n || queued != n
+	 || evbuffer_search(output, "Content-Encoding: gzip\r\n", 24, NULL).pos < 0
+	 || evbuffer_search(output, "\r\n\r\n\x1f\x8b", 6, NULL).pos < 0) {
+		printf("FAIL: compressed bulk request, %d pending, %d queued\n", pending, queued);
+		fail++;
+	}
+	ntrip_task_ack_pending(task);
+	queued = 0;
+	STAILQ_FOREACH(m, &task->mimeq, next)
+		queued++;
+	if (queued != n - pending) {
+		printf("FAIL: compressed bulk request, %d queued after ack\n", queued);
+		fail++;
+	}
+	bufferevent_free(st->bev);
+	free(st);
+	event_base_free(base);
+
+	for (int i = 0; i < n; i++)
+		packet_decref(packets[i]);
+	evbuffer_free(expect);
+	ntrip_task_decref(task);
+	sourcetable_update_test_caster_free(caster);
+	return fail;
+}
+
+/*
+ * Count the segment files in a spill directory.
+ */
+static int spillq_test_count(const char *dir) {
+	char cmd[PATH_MAX+40];
+	snprintf(cmd, sizeof cmd, "ls %s | grep -c spill", dir);
+	FILE *f = popen(cmd, "r");
+	int n = -1;
+	if (f) {
+		if (fscanf(f, "%d", &n) != 1)
+			n = -1;
+		pclose(f);
+	}
+	return n;
+}
+
+/*
+ * Read n records from a spill queue, checking they are numbered from first.
+ */
+static int spillq_test_read(struct spillq *q, const void *reader, int first, int n, int ack) {
+	for (int i = first; i < first + n; i++) {
+		char expect[32];
+		struct packet *p = spillq_read(q, reader, 100000);
+		snprintf(expect, sizeof expect, "record %d ", i);
+		if (p == NULL || p->datalen < strlen(expect) || memcmp(p->data, expect, strlen(expect))) {
+			printf("FAIL: spill record %d %s\n", i, p ? "differs" : "missing");
+			if (p)
+				packet_decref(p);
+			return 1;
+		}
+		packet_decref(p);
+		if (ack)
+			spillq_ack(q, reader);
+	}
+	return 0;
+}
+
+/*
+ * Check spill queue persistence: segment rollover, replay after close,
+ * replay after a simulated crash, and reclaiming of acknowledged segments.
+ */
+static int spillq_test() {
+	int fail = 0, n = 3000;
+	char dir[] = "/tmp/spillqXXXXXX", crashdir[PATH_MAX], cmd[2*PATH_MAX+20];
+	char data[2000];
+	int reader_a, reader_b;
+	puts("spillq_test");
+
+	struct caster_state *caster = sourcetable_update_test_caster();
+	if (mkdtemp(dir) == NULL) {
+		printf("FAIL: mkdtemp\n");
+		return 1;
+	}
+	snprintf(crashdir, sizeof crashdir, "%s.crash", dir);
+
+	/* About 6 MB: more than one segment */
+	struct spillq *q = spillq_open(dir, &caster->flog);
+	memset(data, 'x', sizeof data);
+	for (int i = 0; i < n; i++) {
+		int len = snprintf(data, sizeof data, "record %d ", i);
+		data[len] = 'x';
+		fail += spillq_append(q, data, sizeof data - i % 100) != 0;
+	}
+	fail += q->nsegments != 2;
+	/* Dropped and counted, as it can't fit in a segment */
+	fail += spillq_append(q, data, SPILLQ_SEGMENT_SIZE) != -1 || q->dropped != 1;
+
+	/* Only one reader at a time */
+	fail += spillq_test_read(q, &reader_a, 0, 1000, 1);
+	fail += spillq_test_read(q, &reader_a, 1000, 10, 0);
+	fail += spillq_read(q, &reader_b, 100000) != NULL;
+
+	/* Snapshot of the files as they would be after a crash */
+	snprintf(cmd, sizeof cmd, "cp -r %s %s", dir, crashdir);
+	fail += system(cmd) != 0;
+
+	/* Unacknowledged records are read again after close */
+	spillq_close(q, &reader_a);
+	q = spillq_open(dir, &caster->flog);
+	fail += spillq_test_read(q, &reader_b, 1000, n - 1000, 1);
+	fail += !spillq_empty(q);
+	spillq_close(q, &reader_b);
+	if (spillq_test_count(dir) != 0) {
+		printf("FAIL: acknowledged segments not deleted\n");
+		fail++;
+	}
+
+	/* Same from the crash snapshot */
+	q = spillq_open(crashdir, &caster->flog);
+	fail += spillq_test_read(q, &reader_b, 1000, n - 1000, 0);
+	fail += !spillq_empty(q);
+	spillq_close(q, &reader_b);
+
+	snprintf(cmd, sizeof cmd, "rm -r %s %s", dir, crashdir);
+	system(cmd);
+
+	/* Size limit, dropping new records: the oldest ones are kept */
+	strcpy(dir, "/tmp/spillqXXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		printf("FAIL: mkdtemp\n");
+		return fail + 1;
+	}
+	q = spillq_open(dir, &caster->flog);
+	spillq_set_limit(q, 3*SPILLQ_SEGMENT_SIZE, SPILLQ_DROP_NEW);
+	int kept = 0;
+	for (int i = 0; i < 10000; i++) {
+		int len = snprintf(data, sizeof data, "record %d ", kept);
+		data[len] = 'x';
+		if (spillq_append(q, data, sizeof data) == 0)
+			kept++;
+	}
+	if (q->nsegments != 2 || kept < 4000 || q->dropped != 10000 - kept) {
+		printf("FAIL: spill limit, %d segments, %d kept, %llu dropped\n", q->nsegments, kept, q->dropped);
+		fail++;
+	}
+	fail += spillq_test_read(q, &reader_a, 0, kept, 1);
+	fail += !spillq_empty(q);
+	spillq_close(q, &reader_a);
+
+	/*
+	 * Size limit, dropping the oldest records, including some being sent:
+	 * their acknowledgements don't skip newer records.
+	 */
+	q = spillq_open(dir, &caster->flog);
+	spillq_set_limit(q, 3*SPILLQ_SEGMENT_SIZE, SPILLQ_DROP_OLDEST);
+	int retries = 0;
+	for (int i = 0; i < 10000; i++) {
+		int len = snprintf(data, sizeof data, "record %d ", i);
+		data[len] = 'x';
+		/* Wait for the helper thread if the next segment isn't ready yet */
+		while (spillq_append(q, data, sizeof data) != 0) {
+			retries++;
+			usleep(1000);
+		}
+		if (i == 999)
+			fail += spillq_test_read(q, &reader_a, 0, 10, 0);
+	}
+	for (int i = 0; i < 10; i++)
+		spillq_ack(q, &reader_a);
+	struct packet *p = spillq_read(q, &reader_a, 100000);
+	int oldest = -1;
+	if (p == NULL || sscanf((char *)p->data, "record %d ", &oldest) != 1
+	 || oldest < 10 || q->nsegments != 2 || q->dropped != oldest - 10 + retries) {
+		printf("FAIL: spill drop oldest, first record %d, %d segments, %llu dropped\n", oldest, q->nsegments, q->dropped);
+		fail++;
+	}
+	if (p)
+		packet_decref(p);
+	spillq_ack(q, &reader_a);
+	if (oldest >= 0)
+		fail += spillq_test_read(q, &reader_a, oldest + 1, 10000 - oldest - 1, 1);
+	fail += !spillq_empty(q);
+	spillq_close(q, &reader_a);
+	if (spillq_test_count(dir) != 0) {
+		printf("FAIL: dropped segments not deleted\n");
+		fail++;
+	}
+	rmdir(dir);
+
+	/*
+	 * Through an ntrip_task: everything is written ahead to the spill queue,
+	 * then read back in order when sending, including an item larger than
+	 * the memory queue. Unacknowledged items are replayed in order after exit.
+	 */
+	strcpy(dir, "/tmp/spillqXXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		printf("FAIL: mkdtemp\n");
+		return fail + 1;
+	}
+	struct ntrip_task *task = ntrip_task_new(caster, "localhost", 7777, "/gelf", 0, 0, 62000, 1000, "test", NULL);
+	task->method = "POST";
+	task->bulk_content_type = "application/json";
+	fail += ntrip_task_set_spill(task, dir, 0, SPILLQ_DROP_OLDEST) != 0;
+	for (int i = 0; i < 50; i++) {
+		int len = snprintf(data, sizeof data, "record %d ", i);
+		memset(data + len, 'x', sizeof data - len);
+		data[i == 10 ? 1500 : 100] = '\0';
+		struct packet *p = packet_new_from_string(data);
+		ntrip_task_queue(task, p);
+		packet_decref(p);
+	}
+	if (task->spill->spilled != 50 || !STAILQ_EMPTY(&task->mimeq)) {
+		printf("FAIL: %llu spilled\n", task->spill->spilled);
+		fail++;
+	}
+
+	struct event_base *base = event_base_new();
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+	st->caster = caster;
+	st->task = task;
+	st->host = "localhost";
+	st->port = 7777;
+	st->uri = "/gelf";
+	st->bev = bufferevent_socket_new(base, -1, 0);
+	int acked = 0, rounds = 0;
+	while (acked < 20 && rounds++ < 50) {
+		ntrip_set_state(st, NTRIP_IDLE_CLIENT);
+		ntrip_task_send_next_request(st);
+		if (task->pending == 0)
+			break;
+		acked += task->pending;
+		ntrip_task_ack_pending(task);
+	}
+	/* One more request, left unacknowledged */
+	ntrip_set_state(st, NTRIP_IDLE_CLIENT);
+	ntrip_task_send_next_request(st);
+	if (acked < 20 || task->pending == 0 || task->spill->acked != acked) {
+		printf("FAIL: task replay stalled, %d acked\n", acked);
+		fail++;
+	}
+	ntrip_task_decref(task);
+	bufferevent_free(st->bev);
+	free(st);
+	event_base_free(base);
+
+	q = spillq_open(dir, &caster->flog);
+	int next = acked;
+	while ((p = spillq_read(q, &reader_a, 100000)) != NULL) {
+		int i;
+		if (sscanf((char *)p->data, "record %d ", &i) != 1 || i != next) {
+			printf("FAIL: task record %d replayed instead of %d\n", i, next);
+			fail++;
+		}
+		next++;
+		packet_decref(p);
+		spillq_ack(q, &reader_a);
+	}
+	if (next != 50) {
+		printf("FAIL: task records replayed up to %d\n", next);
+		fail++;
+	}
+	spillq_close(q, &reader_a);
+	rmdir(dir);
+
+	if (fail == 0)
+		putchar('.');
+	putchar('\n');
+	sourcetable_update_test_caster_free(caster);
+	return fail;
+}
+
+/*
+ * Benchmark the cost of per-packet ntrip_log() calls, for levels filtered
+ * out and for lines actually queued to the log writer.
+ * Not a pass/fail test: only displays timings.
+ */
+static void bench_ntrip_log_cb(void *arg, struct gelf_entry *g, int level, const char *fmt, va_list ap) {
+	struct caster_state *caster = (struct caster_state *)arg;
+	vlogall(caster, g, &caster->flog, level, fmt, ap);
+}
+
+static int bench_ntrip_log() {
+	int n = 1000000, nqueued = 20000;
+	struct {
+		int level;
+		const char *name;
+	} levels[] = {{LOG_EDEBUG, "EDEBUG"}, {LOG_DEBUG, "DEBUG"}};
+	puts("bench_ntrip_log");
+
+	struct caster_state *caster = (struct caster_state *)calloc(1, sizeof(struct caster_state));
+	atomic_store(&caster->graylog_log_level, -1);
+	log_init(&caster->flog, "/dev/null", bench_ntrip_log_cb, LOG_INFO, -1, -1, -1, caster);
+	struct caster_dynconfig *dyn = (struct caster_dynconfig *)calloc(1, sizeof(struct caster_dynconfig));
+	struct config *config = (struct config *)calloc(1, sizeof(struct config));
+	config->dyn = dyn;
+	struct ntrip_state *st = (struct ntrip_state *)calloc(1, sizeof(struct ntrip_state));
+	st->caster = caster;
+	st->config = config;
+	st->id = 42;
+	st->mountpoint = "MP1";
+
+	for (int l = 0; l < sizeof levels/sizeof levels[0]; l++) {
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int i = 0; i < n; i++)
+			ntrip_log(st, levels[l].level, "RTCM packet type %d len %d from %s", 1077, i & 1023, st->mountpoint);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		printf("%-7s filtered: %.1f ns per call\n", levels[l].name, bench_elapsed_us(&t0, &t1)*1e3/n);
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0; i < nqueued; i++)
+		ntrip_log(st, LOG_INFO, "RTCM packet type %d len %d from %s", 1077, i & 1023, st->mountpoint);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("INFO    queued:   %.1f ns per call, %llu of %d dropped\n", bench_elapsed_us(&t0, &t1)*1e3/nqueued,
+		log_dropped(&caster->flog), nqueued);
+
+	log_free(&caster->flog);
+	free(st);
+	free(config);
+	free(dyn);
+	free(caster);
+	return 0;
+}
+
+/*
+ * Benchmark hash table insertions, lookups and deletions.
+ * Not a pass/fail test: only displays timings.
+ */
+static int bench_hash_table() {
+	int sizes[] = {1000, 10000, 100000, 0};
+	puts("bench_hash_table");
+
+	for (int *size = sizes; *size; size++) {
+		int n = *size;
+		char (*keys)[16] = malloc(n*sizeof(*keys));
+		for (int i = 0; i < n; i++)
+			snprintf(keys[i], sizeof keys[i], "MP%08d", i*7919);
+		struct timespec t0, t1, t2, t3, t4;
+		struct hash_table *h = hash_table_new(509, hash_table_free_null);
+		int found = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for (int i = 0; i < n; i++)
+			hash_table_add(h, keys[i], keys[i]);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (int j = 0; j < 10; j++)
+			for (int i = 0; i < n; i++)
+				found += (hash_table_get(h, keys[i]) != NULL);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		for (int i = 0; i < n; i++) {
+			char miss[16];
+			snprintf(miss, sizeof miss, "XX%08d", i);
+			found += (hash_table_get(h, miss) != NULL);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t3);
+		for (int i = 0; i < n; i++)
+			hash_table_del(h, keys[i]);
+		clock_gettime(CLOCK_MONOTONIC, &t4);
+
+		printf("%6d keys: insert %.1f ns, lookup %.1f ns, miss %.1f ns, delete %.1f ns (found %d)\n", n,
+			bench_elapsed_us(&t0, &t1)*1e3/n, bench_elapsed_us(&t1, &t2)*1e3/n/10,
+			bench_elapsed_us(&t2, &t3)*1e3/n, bench_elapsed_us(&t3, &t4)*1e3/n, found);
+		hash_table_free(h);
+		free(keys);
+	}
+	return 0;
+}
+
+/*
+ * Run the benchmarks, only on request as they take a while
+ * and their results depend on the machine.
+ */
+static int run_benchmarks() {
+	int fail = 0;
+	fail += bench_livesource_send_subscribers();
+	fail += bench_crc24q();
+	fail += bench_hash_table();
+	fail += bench_ntrip_log();
+	fail += bench_gelf();
+	fail += bench_joblist_run();
+	return fail;
+}
+
+static void usage(char **argv) {
+	fprintf(stderr, "Usage: %s [-b] [test directory]\n"
+		"\t-b\t\talso run the benchmarks\n", argv[0]);
+}
+
+int main(int argc, char **argv) {
+	int fail = 0;
+	int benchmarks = 0;
 	const char *test_dir;
-	if (argc < 2)
+	int ch;
+
+	while ((ch = getopt(argc, argv, "b")) != -1) {
+		switch (ch) {
+		case 'b':
+			benchmarks = 1;
+			break;
+		default:
+			usage(argv);
+			exit(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
 		test_dir = ".";
 	else
-		test_dir = argv[1];
+		test_dir = argv[0];
 	fail += gga_test();
 	fail += b64_test();
 	fail += test_ip_analyze_prefixquota();
@@ -725,7 +2995,28 @@ int main(int argc, const char **argv) {
 	fail += test_prefix_table();
 	fail += test_ip_convert();
 	fail += test_msm7_msm4();
+	fail += crc24q_test();
+	fail += rtcm_packet_extract_test();
 	fail += timeval_from_iso_date_test();
+	fail += hash_table_test();
+	fail += geoindex_test();
+	fail += sourcetable_get_test();
+	fail += sourcetable_update_test();
+	fail += stack_snapshot_test();
+	fail += json_stream_test();
+	fail += json_stream_backpressure_test();
+	fail += sync_binary_test();
+	fail += livesource_replay_test();
+	fail += livesource_shard_test();
+	fail += packet_pool_test();
+	fail += joblist_coalesce_test();
+	fail += joblist_groups_test();
+	fail += async_log_test();
+	fail += gelf_packet_test();
+	fail += bulk_compression_test();
+	fail += spillq_test();
 	fail += file_parse_test(test_dir);
+	if (benchmarks)
+		fail += run_benchmarks();
 	return fail != 0;
 }
@@ -380,6 +380,7 @@ struct mime_content *mime_new(char *s, long long len, const char *mime_type, int
 	m->mime_type = mime_type;
 	m->use_strfree = use_strfree;
 	m->packet = NULL;
+	m->spilled = 0;
 	return m;
 }
 
@@ -396,6 +397,7 @@ struct mime_content *mime_new_from_packet(const char *mime_type, struct packet *
 	m->mime_type = mime_type;
 	m->use_strfree = 0;
 	m->packet = packet;
+	m->spilled = 0;
 	return m;
 }
 
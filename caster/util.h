@@ -38,6 +38,7 @@ struct mime_content {
 	size_t len;
 	int use_strfree, is_packet;
 	struct packet *packet;
+	char spilled;				// replayed from a spill queue
 };
 STAILQ_HEAD(mimeq, mime_content);
 